@@ -26,6 +26,66 @@
 #include "stdio.h"
 #include "console.h"
 #include "timebase.h"
+#include "trace.h"
+
+/*
+ * Binary logging: when TRACE_PRLOG is enabled in the trace mask,
+ * messages that would only go to the memory console are recorded
+ * unformatted in the per-CPU trace buffer instead, as the offset of
+ * the format string in the skiboot image and the raw arguments.
+ * external/trace/dump_trace formats them given the skiboot image.
+ *
+ * Only constant formats with integer and pointer arguments qualify,
+ * anything else is formatted as usual.
+ */
+static bool prlog_binary(int log_level, const char *fmt, va_list ap)
+{
+	union trace t;
+	const char *p;
+	unsigned int n = 0, longs;
+	va_list aq;
+
+	if (!is_rodata(fmt))
+		return false;
+
+	/* Nothing from the stack must make it to the buffer, or to repeats */
+	memset(&t, 0, sizeof(t.prlog));
+	va_copy(aq, ap);
+	for (p = fmt; *p; p++) {
+		if (*p != '%')
+			continue;
+		p++;
+		while (*p && strchr("-+ #0123456789.", *p))
+			p++;
+		for (longs = 0; *p && strchr("hlzjt", *p); p++)
+			if (*p != 'h')
+				longs++;
+		if (*p == '%')
+			continue;
+		if (!*p || !strchr("diuxXocp", *p) ||
+		    n == TRACE_PRLOG_MAX_ARGS)
+			goto fallback;
+		if (*p == 'p')
+			t.prlog.args[n++] = cpu_to_be64((unsigned long)
+						       va_arg(aq, void *));
+		else if (longs)
+			t.prlog.args[n++] = cpu_to_be64(va_arg(aq, long));
+		else
+			t.prlog.args[n++] = cpu_to_be64(va_arg(aq, int));
+	}
+	va_end(aq);
+
+	t.prlog.fmt = cpu_to_be32((unsigned long)fmt - SKIBOOT_BASE);
+	t.prlog.level = log_level;
+	t.prlog.nargs = n;
+	trace_add(&t, TRACE_PRLOG,
+		  offsetof(struct trace_prlog, args[n]));
+	return true;
+
+ fallback:
+	va_end(aq);
+	return false;
+}
 
 static int vprlog(int log_level, const char *fmt, va_list ap)
 {
@@ -43,6 +103,11 @@ static int vprlog(int log_level, const char *fmt, va_list ap)
 	if (log_level > (debug_descriptor.console_log_levels >> 4))
 		return 0;
 
+	if (log_level > (debug_descriptor.console_log_levels & 0x0f) &&
+	    (debug_descriptor.trace_mask & (1ul << TRACE_PRLOG)) &&
+	    prlog_binary(log_level, fmt, ap))
+		return 0;
+
 	count = snprintf(buffer, sizeof(buffer), "[%lu,%d] ",
 			 mftb(), log_level);
 	count+= vsnprintf(buffer+count, sizeof(buffer)-count, fmt, ap);
@@ -27,13 +27,37 @@
 #include <device.h>
 #include <processor.h>
 #include <cpu.h>
+#include <timebase.h>
 
 static char *con_buf = (char *)INMEM_CON_START;
-static size_t con_in;
-static size_t con_out;
-static bool con_wrapped;
 static struct con_ops *con_driver;
 
+/*
+ * The output buffer is filled by any number of writers without taking
+ * a lock. A writer atomically advances con_reserved by the size of its
+ * message, copies it in, then waits for the writers ahead of it before
+ * advancing con_in, which is what readers of the buffer see. These are
+ * free running positions, the buffer index is modulo INMEM_CON_OUT_LEN.
+ *
+ * A writer ahead that never finishes, because it got interrupted by
+ * something printing on the same CPU, would hold everybody up: past
+ * INMEM_PUBLISH_TIMEOUT_MS, or straight away when locks are busted,
+ * con_in gets advanced over its reservation regardless. It can then
+ * only move forward, so the late writer doesn't take it back.
+ *
+ * con_out is how far we went pushing the buffer to the console driver,
+ * it is protected by con_lock.
+ */
+static uint64_t con_reserved;
+static uint64_t con_in;
+static uint64_t con_out;
+
+/* Writers split bigger buffers so no message can lap the ring */
+#define CON_MAX_WRITE	(INMEM_CON_OUT_LEN / 4)
+
+/* Far longer than the copy a writer ahead has left to do */
+#define INMEM_PUBLISH_TIMEOUT_MS	1000
+
 struct lock con_lock = LOCK_UNLOCKED;
 
 /* This is mapped via TCEs so we keep it alone in a page */
@@ -111,18 +135,18 @@ void clear_console(void)
 
 /*
  * Flush the console buffer into the driver, returns true
- * if there is more to go.
+ * if there is more to go. Must be called with con_lock held.
  * Optionally can skip flushing to drivers, leaving messages
  * just in memory console.
  */
-bool __flush_console(bool flush_to_drivers)
+static bool __flush_console_locked(bool flush_to_drivers)
 {
 	struct cpu_thread *cpu = this_cpu();
-	size_t req, len = 0;
-	static bool in_flush, more_flush;
+	uint64_t in = con_in;
+	size_t idx, req, len;
 
 	/* Is there anything to flush ? Bail out early if not */
-	if (con_in == con_out || !con_driver)
+	if (in == con_out || !con_driver)
 		return false;
 
 	/*
@@ -136,76 +160,118 @@ bool __flush_console(bool flush_to_drivers)
 	}
 	cpu->con_need_flush = false;
 
+	/* Writers went around the ring, drop what was overwritten */
+	if (in - con_out >= INMEM_CON_OUT_LEN)
+		con_out = in - INMEM_CON_OUT_LEN + 1;
+
+	if (!flush_to_drivers) {
+		con_out = in;
+		return false;
+	}
+
 	/*
-	 * We must call the underlying driver with the console lock
-	 * dropped otherwise we get some deadlocks if anything down
-	 * that path tries to printf() something.
-	 *
-	 * So instead what we do is we keep a static in_flush flag
-	 * set/released with the lock held, which is used to prevent
-	 * concurrent attempts at flushing the same chunk of buffer
-	 * by other processors.
+	 * Drivers are called with con_lock held, writers never wait for
+	 * it so this doesn't hold up anybody but other flushers. A driver
+	 * that doesn't take everything just gets the rest next time.
 	 */
-	if (in_flush) {
-		more_flush = true;
-		return false;
+	while (con_out != in) {
+		idx = con_out % INMEM_CON_OUT_LEN;
+		req = MIN(in - con_out, INMEM_CON_OUT_LEN - idx);
+		len = con_driver->write(con_buf + idx, req);
+		con_out += len;
+		if (len < req)
+			break;
 	}
-	in_flush = true;
+	return con_out != in;
+}
+
+/*
+ * Only one CPU flushes at a time. Whoever finds con_lock taken leaves
+ * its output to the current holder, which looks for more after
+ * dropping the lock.
+ */
+bool __flush_console(bool flush_to_drivers)
+{
+	uint64_t in;
+	bool more;
 
 	do {
-		more_flush = false;
-		if (con_out > con_in) {
-			req = INMEM_CON_OUT_LEN - con_out;
-			if (!flush_to_drivers) {
-				len = req;
-			} else {
-				unlock(&con_lock);
-				len = con_driver->write(con_buf + con_out,
-							req);
-				lock(&con_lock);
-			}
-			con_out = (con_out + len) % INMEM_CON_OUT_LEN;
-			if (len < req)
-				goto bail;
-		}
-		if (con_out < con_in) {
-			if (!flush_to_drivers) {
-				len = con_in - con_out;
-			} else {
-				unlock(&con_lock);
-				len = con_driver->write(con_buf + con_out,
-							con_in - con_out);
-				lock(&con_lock);
-			}
-			con_out = (con_out + len) % INMEM_CON_OUT_LEN;
-		}
-	} while(more_flush);
-bail:
-	in_flush = false;
-	return con_out != con_in;
+		if (!bust_locks && !try_lock(&con_lock))
+			return true;
+		in = con_in;
+		more = __flush_console_locked(flush_to_drivers);
+		unlock(&con_lock);
+
+		/* Order dropping the lock vs. looking for new output */
+		sync();
+	} while (!more && con_in != in);
+
+	return more;
 }
 
 bool flush_console(void)
 {
-	bool ret;
+	return __flush_console(true);
+}
 
-	lock(&con_lock);
-	ret = __flush_console(true);
-	unlock(&con_lock);
+/* Copy into the ring at a free running position, handling the wrap */
+static void inmem_copy(uint64_t pos, const char *buf, size_t len)
+{
+	size_t idx = pos % INMEM_CON_OUT_LEN;
+	size_t chunk = MIN(len, INMEM_CON_OUT_LEN - idx);
 
-	return ret;
+	memcpy(con_buf + idx, buf, chunk);
+	memcpy(con_buf, buf + chunk, len - chunk);
 }
 
-static void inmem_write(char c)
+/*
+ * Reserve space for the message in one go and copy it in, turning
+ * "\n" into "\r\n" and dropping NULs as we go.
+ */
+static void inmem_write(const char *buf, size_t count)
 {
+	uint64_t start, pos, in, deadline;
+	size_t i, len = 0, seg;
 	uint32_t opos;
 
-	if (!c)
+	for (i = 0; i < count; i++) {
+		if (buf[i] == '\n')
+			len += 2;
+		else if (buf[i])
+			len++;
+	}
+	if (!len)
 		return;
-	con_buf[con_in++] = c;
-	if (con_in >= INMEM_CON_OUT_LEN) {
-		con_in = 0;
-		con_wrapped = true;
+
+	start = pos = __sync_fetch_and_add(&con_reserved, len);
+	while (count) {
+		for (seg = 0; seg < count && buf[seg] && buf[seg] != '\n';
+		     seg++)
+			;
+		inmem_copy(pos, buf, seg);
+		pos += seg;
+		if (seg < count) {
+			if (buf[seg] == '\n') {
+				inmem_copy(pos, "\r\n", 2);
+				pos += 2;
+			}
+			seg++;
+		}
+		buf += seg;
+		count -= seg;
+	}
+
+	/*
+	 * Publish in reservation order, the writers ahead of us only
+	 * have a copy left to do. Unless they are stuck, see above.
+	 */
+	if (!bust_locks && *(volatile uint64_t *)&con_in < start) {
+		deadline = mftb() + msecs_to_tb(INMEM_PUBLISH_TIMEOUT_MS);
+		while (*(volatile uint64_t *)&con_in < start) {
+			if (tb_compare(mftb(), deadline) == TB_AAFTERB)
+				break;
+			cpu_relax();
+		}
 	}
 
 	/*
@@ -215,15 +281,18 @@ static void inmem_write(char c)
 	 * 8 bytes containing out_pos and in_prod, thus corrupting
 	 * out_pos
 	 */
-	opos = con_in;
-	if (con_wrapped)
+	opos = pos % INMEM_CON_OUT_LEN;
+	if (pos >= INMEM_CON_OUT_LEN)
 		opos |= MEMCONS_OUT_POS_WRAP;
-	lwsync();
-	memcons.out_pos = opos;
-
-	/* If head reaches tail, push tail around & drop chars */
-	if (con_in == con_out)
-		con_out = (con_in + 1) % INMEM_CON_OUT_LEN;
+	do {
+		/* Published over while we were stuck */
+		in = *(volatile uint64_t *)&con_in;
+		if (in >= pos)
+			return;
+		lwsync();
+		memcons.out_pos = opos;
+		lwsync();
+	} while (!__sync_bool_compare_and_swap(&con_in, in, pos));
 }
 
 static size_t inmem_read(char *buf, size_t req)
@@ -241,34 +310,27 @@ static size_t inmem_read(char *buf, size_t req)
 	return read;
 }
 
-static void write_char(char c)
-{
-#ifdef MAMBO_DEBUG_CONSOLE
-	mambo_write(&c, 1);
-#endif
-	inmem_write(c);
-}
-
 ssize_t console_write(bool flush_to_drivers, const void *buf, size_t count)
 {
-	/* We use recursive locking here as we can get called
-	 * from fairly deep debug path
-	 */
-	bool need_unlock = lock_recursive(&con_lock);
 	const char *cbuf = buf;
+	size_t left = count, chunk;
 
-	while(count--) {
-		char c = *(cbuf++);
-		if (c == 10)
-			write_char(13);
-		write_char(c);
+#ifdef MAMBO_DEBUG_CONSOLE
+	for (chunk = 0; chunk < count; chunk++) {
+		if (cbuf[chunk] == 10)
+			mambo_write("\r", 1);
+		mambo_write(&cbuf[chunk], 1);
+	}
+#endif
+	while (left) {
+		chunk = MIN(left, CON_MAX_WRITE);
+		inmem_write(cbuf, chunk);
+		cbuf += chunk;
+		left -= chunk;
 	}
 
 	__flush_console(flush_to_drivers);
 
-	if (need_unlock)
-		unlock(&con_lock);
-
 	return count;
 }
 
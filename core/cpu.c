@@ -518,6 +518,44 @@ void cpu_callin(struct cpu_thread *cpu)
 	cpu->state = cpu_state_active;
 }
 
+/*
+ * cpu_barrier - Wait for a set of CPUs to get somewhere
+ *
+ * @pending says whether a CPU is still being waited for. All CPUs are
+ * polled on each pass rather than waiting for each in turn, and after
+ * @timeout_ms the ones still pending are logged and given up on.
+ * Returns how many that was, 0 when everybody made it.
+ */
+unsigned int cpu_barrier(const char *what, cpu_barrier_fn pending,
+			 void *data, unsigned long timeout_ms)
+{
+	unsigned long end = mftb() + msecs_to_tb(timeout_ms);
+	struct cpu_thread *cpu;
+	unsigned int left;
+
+	for (;;) {
+		left = 0;
+		for_each_cpu(cpu) {
+			if (pending(cpu, data))
+				left++;
+		}
+		if (!left || tb_compare(mftb(), end) == TB_AAFTERB)
+			break;
+		smt_very_low();
+		sync();
+	}
+	smt_medium();
+
+	if (!left)
+		return 0;
+	for_each_cpu(cpu) {
+		if (pending(cpu, data))
+			prerror("CPU: PIR 0x%04x timed out %s (state %d)\n",
+				cpu->pir, what, cpu->state);
+	}
+	return left;
+}
+
 static void opal_start_thread_job(void *data)
 {
 	cpu_give_self_os();
@@ -636,6 +674,7 @@ static int64_t opal_reinit_cpus(uint64_t flags)
 {
 	struct cpu_thread *cpu;
 	int64_t rc = OPAL_SUCCESS;
+	uint64_t start = mftb();
 	int i;
 
 	lock(&reinit_lock);
@@ -693,6 +732,8 @@ static int64_t opal_reinit_cpus(uint64_t flags)
 	/* And undo the above */
 	this_cpu()->state = cpu_state_os;
 
+	prlog(PR_NOTICE, "OPAL: CPU re-init done in %lu ms, rc %lld\n",
+	      tb_to_msecs(mftb() - start), rc);
 bail:
 	unlock(&reinit_lock);
 	return rc;
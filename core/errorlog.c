@@ -20,10 +20,11 @@
  * the actual errors.
  */
 #include <skiboot.h>
-#include <lock.h>
-#include <errorlog.h>
 #include <errorlog.h>
-#include <pool.h>
+#include <opal-api.h>
+#include <lock.h>
+#include <timer.h>
+#include <timebase.h>
 
 /*
  * Maximum number buffers that are pre-allocated
@@ -32,30 +33,133 @@
  */
 #define ELOG_WRITE_MAX_RECORD		64
 
+/*
+ * Records kept back for the more severe errors, so that a storm of
+ * informational or predictive logs can't starve them
+ */
+#define ELOG_RESERVED_PANIC		1
+#define ELOG_RESERVED_UNRECOVERABLE	4
+
+/*
+ * Repeats of a log (same reason code, component and user data) within
+ * ELOG_DEDUP_WINDOW_SECS of the one that was committed are only
+ * counted. When the window closes, one more log reports how many
+ * there were.
+ */
+#define ELOG_DEDUP_ENTRIES		16
+#define ELOG_DEDUP_WINDOW_SECS		60
+
+/*
+ * Each component gets a bucket of ELOG_RATE_BURST logs, refilled by
+ * one every ELOG_RATE_INTERVAL_SECS. Unrecoverable errors and panics
+ * are never rate limited.
+ */
+#define ELOG_RATE_COMPONENTS		32
+#define ELOG_RATE_BURST			10
+#define ELOG_RATE_INTERVAL_SECS		6
+
+#define ELOG_TAG_DESC			0x44455343	/* ASCII of DESC */
+
 /* Platform Log ID as per the spec */
 static uint32_t sapphire_elog_id = 0xB0000000;
 /* Reserved for future use */
 /* static uint32_t powernv_elog_id = 0xB1000000; */
 
-/* Pool to allocate elog messages from */
-static struct pool elog_pool;
-static struct lock elog_lock = LOCK_UNLOCKED;
+/*
+ * Records are claimed from a bitmap of free entries with atomic
+ * operations rather than under a lock, error storms hit this from
+ * many CPUs at once. The free count is taken before a bit is claimed
+ * and given back after the bit is released, so a CPU that got a
+ * count always finds a bit.
+ */
+static struct errorlog *elog_records;
+static uint64_t elog_free_map;
+static int elog_free_count;
 
 static bool elog_available = false;
 
+struct elog_dedup {
+	bool		used;
+	uint32_t	hash;
+	uint32_t	reason_code;
+	uint16_t	component_id;
+	uint8_t		error_event_type;
+	uint8_t		subsystem_id;
+	uint8_t		event_severity;
+	uint8_t		event_subtype;
+	uint32_t	plid;		/* The log that was committed */
+	uint32_t	repeats;
+	uint64_t	start;
+	uint64_t	last;
+};
+
+struct elog_bucket {
+	bool		used;
+	uint16_t	component_id;
+	uint32_t	tokens;
+	uint32_t	dropped;	/* Since the last log let through */
+	uint64_t	refill;
+};
+
+/* Commit time filtering, protected by elog_commit_lock */
+static struct lock elog_commit_lock = LOCK_UNLOCKED;
+static struct elog_dedup elog_dedup[ELOG_DEDUP_ENTRIES];
+static struct elog_bucket elog_buckets[ELOG_RATE_COMPONENTS];
+static struct timer elog_dedup_timer;
+static uint64_t elog_dedup_next;
+
+/* Updated atomically, read by OPAL_ELOG_STATS */
+static struct {
+	uint64_t	committed;
+	uint64_t	duplicates;
+	uint64_t	summaries;
+	uint64_t	rate_limited;
+	uint64_t	no_buffer;
+} elog_stats;
+
+static int elog_reserved(int opal_event_severity)
+{
+	if (opal_event_severity == OPAL_ERROR_PANIC)
+		return 0;
+	if (opal_event_severity >= OPAL_UNRECOVERABLE_ERR_GENERAL)
+		return ELOG_RESERVED_PANIC;
+	return ELOG_RESERVED_PANIC + ELOG_RESERVED_UNRECOVERABLE;
+}
+
 static struct errorlog *get_write_buffer(int opal_event_severity)
 {
+	int reserved = elog_reserved(opal_event_severity);
+	uint64_t map, old;
 	struct errorlog *buf;
+	int count, prev;
 
 	if (!elog_available)
 		return NULL;
 
-	lock(&elog_lock);
-	if (opal_event_severity == OPAL_ERROR_PANIC)
-		buf = pool_get(&elog_pool, POOL_HIGH);
-	else
-		buf = pool_get(&elog_pool, POOL_NORMAL);
-	unlock(&elog_lock);
+	count = elog_free_count;
+	for (;;) {
+		if (count <= reserved)
+			return NULL;
+		prev = __sync_val_compare_and_swap(&elog_free_count, count,
+						   count - 1);
+		if (prev == count)
+			break;
+		count = prev;
+	}
+
+	map = elog_free_map;
+	for (;;) {
+		assert(map);
+		old = __sync_val_compare_and_swap(&elog_free_map, map,
+						  map & (map - 1));
+		if (old == map)
+			break;
+		map = old;
+	}
+	buf = &elog_records[ilog2(map & -map)];
+
+	/* The user data was cleared by opal_elog_complete() */
+	memset(buf, 0, offsetof(struct errorlog, user_data_dump));
 	return buf;
 }
 
@@ -71,7 +175,8 @@ int opal_elog_update_user_dump(struct errorlog *buf, unsigned char *data,
 	}
 
 	buffer = (char *)buf->user_data_dump + buf->user_section_size;
-	if ((buf->user_section_size + size) > OPAL_LOG_MAX_DUMP) {
+	if ((buf->user_section_size + size +
+	     sizeof(struct elog_user_data_section) - 1) > OPAL_LOG_MAX_DUMP) {
 		prerror("ELOG: Size of dump data overruns buffer\n");
 		return -1;
 	}
@@ -100,10 +205,7 @@ struct errorlog *opal_elog_create(struct opal_err_info *e_info)
 		buf->event_subtype = e_info->event_subtype;
 		buf->reason_code = e_info->reason_code;
 		buf->elog_origin = ORG_SAPPHIRE;
-
-		lock(&elog_lock);
-		buf->plid = ++sapphire_elog_id;
-		unlock(&elog_lock);
+		buf->plid = __sync_add_and_fetch(&sapphire_elog_id, 1);
 	}
 
 	return buf;
@@ -111,19 +213,266 @@ struct errorlog *opal_elog_create(struct opal_err_info *e_info)
 
 void opal_elog_complete(struct errorlog *buf, bool success)
 {
+	unsigned int idx = buf - elog_records;
+
 	if (!success)
 		printf("Unable to log error\n");
 
-	lock(&elog_lock);
-	pool_free_object(&elog_pool, buf);
-	unlock(&elog_lock);
+	assert(idx < ELOG_WRITE_MAX_RECORD);
+
+	/* Only what was written needs clearing for the next user */
+	memset(buf->user_data_dump, 0, buf->user_section_size);
+
+	__sync_fetch_and_or(&elog_free_map, 1ull << idx);
+	__sync_fetch_and_add(&elog_free_count, 1);
+}
+
+/* FNV-1a over what makes two logs the same */
+static uint32_t elog_hash(struct errorlog *buf)
+{
+	const uint8_t *p = (const uint8_t *)buf->user_data_dump;
+	uint32_t hash = 2166136261u;
+	uint32_t i;
+
+	hash = (hash ^ buf->reason_code) * 16777619;
+	hash = (hash ^ buf->component_id) * 16777619;
+	for (i = 0; i < buf->user_section_size; i++)
+		hash = (hash ^ p[i]) * 16777619;
+
+	return hash;
+}
+
+/*
+ * Look for the window @buf falls in. If there is none, returns NULL and
+ * sets @victim to the entry a new window should use: a free or expired
+ * one, else the oldest.
+ */
+static struct elog_dedup *elog_dedup_find(struct errorlog *buf, uint32_t hash,
+					  uint64_t now,
+					  struct elog_dedup **victim)
+{
+	uint64_t window = secs_to_tb(ELOG_DEDUP_WINDOW_SECS);
+	struct elog_dedup *d;
+	unsigned int i;
+
+	*victim = NULL;
+	for (i = 0; i < ELOG_DEDUP_ENTRIES; i++) {
+		d = &elog_dedup[i];
+		if (!d->used) {
+			if (!*victim || (*victim)->used)
+				*victim = d;
+			continue;
+		}
+		if (d->hash == hash && d->reason_code == buf->reason_code &&
+		    d->component_id == buf->component_id) {
+			if (tb_compare(now, d->start + window) == TB_ABEFOREB)
+				return d;
+			*victim = d;
+			return NULL;
+		}
+		if (!*victim || ((*victim)->used &&
+				 tb_compare(d->start, (*victim)->start) ==
+				 TB_ABEFOREB))
+			*victim = d;
+	}
+
+	return NULL;
+}
+
+/* Open a new window for @buf, which is about to be committed */
+static void elog_dedup_open(struct elog_dedup *d, struct errorlog *buf,
+			    uint32_t hash, uint64_t now)
+{
+	d->used = true;
+	d->hash = hash;
+	d->reason_code = buf->reason_code;
+	d->component_id = buf->component_id;
+	d->error_event_type = buf->error_event_type;
+	d->subsystem_id = buf->subsystem_id;
+	d->event_severity = buf->event_severity;
+	d->event_subtype = buf->event_subtype;
+	d->plid = buf->plid;
+	d->repeats = 0;
+	d->start = d->last = now;
+
+	if (!elog_dedup_next) {
+		elog_dedup_next = now + secs_to_tb(ELOG_DEDUP_WINDOW_SECS);
+		schedule_timer_at(&elog_dedup_timer, elog_dedup_next);
+	}
+}
+
+/* Take a token from the bucket of @component_id */
+static bool elog_rate_ok(uint16_t component_id, uint64_t now,
+			 uint32_t *dropped)
+{
+	uint64_t interval = secs_to_tb(ELOG_RATE_INTERVAL_SECS);
+	struct elog_bucket *b = NULL;
+	uint64_t n;
+	unsigned int i;
+
+	for (i = 0; i < ELOG_RATE_COMPONENTS; i++) {
+		if (!elog_buckets[i].used ||
+		    elog_buckets[i].component_id == component_id) {
+			b = &elog_buckets[i];
+			break;
+		}
+	}
+	/* More components than buckets, don't limit the others */
+	if (!b)
+		return true;
+	if (!b->used) {
+		b->used = true;
+		b->component_id = component_id;
+		b->tokens = ELOG_RATE_BURST;
+		b->refill = now;
+	}
+
+	n = (now - b->refill) / interval;
+	if (b->tokens + n >= ELOG_RATE_BURST) {
+		b->tokens = ELOG_RATE_BURST;
+		b->refill = now;
+	} else {
+		b->tokens += n;
+		b->refill += n * interval;
+	}
+
+	if (!b->tokens) {
+		b->dropped++;
+		return false;
+	}
+	b->tokens--;
+	*dropped = b->dropped;
+	b->dropped = 0;
+
+	return true;
+}
+
+/* Report the repeats of a closed window with a log of its own */
+static void elog_commit_repeats(struct elog_dedup *d)
+{
+	struct errorlog *buf;
+	char msg[80];
+
+	buf = get_write_buffer(d->event_severity);
+	if (!buf) {
+		__sync_fetch_and_add(&elog_stats.no_buffer, 1);
+		prerror("ELOG: PLID 0x%x repeated %u times, no buffer to log"
+			" it\n", d->plid, d->repeats);
+		return;
+	}
+
+	buf->error_event_type = d->error_event_type;
+	buf->component_id = d->component_id;
+	buf->subsystem_id = d->subsystem_id;
+	buf->event_severity = d->event_severity;
+	buf->event_subtype = d->event_subtype;
+	buf->reason_code = d->reason_code;
+	buf->elog_origin = ORG_SAPPHIRE;
+	buf->plid = __sync_add_and_fetch(&sapphire_elog_id, 1);
+	buf->additional_info[0] = d->plid;
+	buf->additional_info[1] = d->repeats;
+	buf->additional_info[2] = tb_to_msecs(d->last - d->start);
+
+	snprintf(msg, sizeof(msg), "PLID 0x%x repeated %u times in %lu ms\n",
+		 d->plid, d->repeats, tb_to_msecs(d->last - d->start));
+	prlog(PR_NOTICE, "ELOG: %s", msg);
+	opal_elog_update_user_dump(buf, (unsigned char *)msg, ELOG_TAG_DESC,
+				   strlen(msg));
+
+	__sync_fetch_and_add(&elog_stats.summaries, 1);
+	if (platform.elog_commit(buf))
+		prerror("ELOG: Re-try error logging\n");
+}
+
+static void elog_dedup_expiry(struct timer *t __unused, void *data __unused)
+{
+	uint64_t window = secs_to_tb(ELOG_DEDUP_WINDOW_SECS);
+	struct elog_dedup closed[ELOG_DEDUP_ENTRIES];
+	uint64_t now = mftb(), end;
+	unsigned int i, nr_closed = 0;
+	struct elog_dedup *d;
+
+	lock(&elog_commit_lock);
+	elog_dedup_next = 0;
+	for (i = 0; i < ELOG_DEDUP_ENTRIES; i++) {
+		d = &elog_dedup[i];
+		if (!d->used)
+			continue;
+		end = d->start + window;
+		if (tb_compare(now, end) == TB_ABEFOREB) {
+			if (!elog_dedup_next ||
+			    tb_compare(end, elog_dedup_next) == TB_ABEFOREB)
+				elog_dedup_next = end;
+			continue;
+		}
+		if (d->repeats)
+			closed[nr_closed++] = *d;
+		d->used = false;
+	}
+	if (elog_dedup_next)
+		schedule_timer_at(&elog_dedup_timer, elog_dedup_next);
+	unlock(&elog_commit_lock);
+
+	for (i = 0; i < nr_closed; i++)
+		elog_commit_repeats(&closed[i]);
+}
+
+/*
+ * Hand a log over to the platform, unless it repeats one committed
+ * recently or its component is over its rate. Panics always go
+ * through.
+ */
+static void elog_commit(struct errorlog *buf)
+{
+	struct elog_dedup *d, *victim, evicted;
+	uint32_t hash, dropped = 0;
+	uint64_t now = mftb();
+	bool duplicate = false, limited = false;
+
+	evicted.repeats = 0;
+	if (buf->event_severity != OPAL_ERROR_PANIC) {
+		hash = elog_hash(buf);
+
+		lock(&elog_commit_lock);
+		d = elog_dedup_find(buf, hash, now, &victim);
+		if (d) {
+			d->repeats++;
+			d->last = now;
+			duplicate = true;
+		} else if (buf->event_severity < OPAL_UNRECOVERABLE_ERR_GENERAL &&
+			   !elog_rate_ok(buf->component_id, now, &dropped)) {
+			limited = true;
+		} else {
+			if (victim->used && victim->repeats)
+				evicted = *victim;
+			elog_dedup_open(victim, buf, hash, now);
+		}
+		unlock(&elog_commit_lock);
+	}
+
+	if (evicted.repeats)
+		elog_commit_repeats(&evicted);
+
+	if (duplicate || limited) {
+		__sync_fetch_and_add(duplicate ? &elog_stats.duplicates :
+				     &elog_stats.rate_limited, 1);
+		opal_elog_complete(buf, true);
+		return;
+	}
+
+	if (dropped)
+		prlog(PR_NOTICE, "ELOG: %u logs from component 0x%x were"
+		      " rate limited\n", dropped, buf->component_id);
+
+	__sync_fetch_and_add(&elog_stats.committed, 1);
+	if (platform.elog_commit(buf))
+		prerror("ELOG: Re-try error logging\n");
 }
 
 void log_error(struct opal_err_info *e_info, void *data, uint16_t size,
 	       const char *fmt, ...)
 {
 	struct errorlog *buf;
-	int tag = 0x44455343;  /* ASCII of DESC */
 	va_list list;
 	char err_msg[250];
 
@@ -135,22 +484,22 @@ void log_error(struct opal_err_info *e_info, void *data, uint16_t size,
 	prerror("%s", err_msg);
 
 	buf = opal_elog_create(e_info);
-	if (buf == NULL)
+	if (buf == NULL) {
+		__sync_fetch_and_add(&elog_stats.no_buffer, 1);
 		prerror("ELOG: Error getting buffer to log error\n");
-	else {
-		opal_elog_update_user_dump(buf, err_msg, tag, strlen(err_msg));
+	} else {
+		opal_elog_update_user_dump(buf, err_msg, ELOG_TAG_DESC,
+					   strlen(err_msg));
 		/* Append any number of call out dumps */
 		if (e_info->call_out)
 			e_info->call_out(buf, data, size);
-		if (platform.elog_commit(buf))
-			prerror("ELOG: Re-try error logging\n");
+		elog_commit(buf);
 	}
 }
 
 void log_simple_error(struct opal_err_info *e_info, const char *fmt, ...)
 {
 	struct errorlog *buf;
-	int tag = 0x44455343;  /* ASCII of DESC */
 	va_list list;
 	char err_msg[250];
 
@@ -162,21 +511,55 @@ void log_simple_error(struct opal_err_info *e_info, const char *fmt, ...)
 	prerror("%s", err_msg);
 
 	buf = opal_elog_create(e_info);
-	if (buf == NULL)
+	if (buf == NULL) {
+		__sync_fetch_and_add(&elog_stats.no_buffer, 1);
 		prerror("ELOG: Error getting buffer to log error\n");
-	else {
-		opal_elog_update_user_dump(buf, err_msg, tag, strlen(err_msg));
-		if (platform.elog_commit(buf))
-			prerror("ELOG: Re-try error logging\n");
+	} else {
+		opal_elog_update_user_dump(buf, err_msg, ELOG_TAG_DESC,
+					   strlen(err_msg));
+		elog_commit(buf);
 	}
 }
 
+static uint64_t elog_stat(uint64_t *stat, bool reset)
+{
+	return reset ? __sync_fetch_and_and(stat, 0) : *stat;
+}
+
+static int64_t opal_elog_stats(struct opal_elog_stats *stats, uint64_t flags)
+{
+	bool reset = flags & OPAL_ELOG_STATS_RESET;
+	struct opal_elog_stats s;
+
+	if (flags & ~OPAL_ELOG_STATS_RESET)
+		return OPAL_PARAMETER;
+
+	s.committed = cpu_to_be64(elog_stat(&elog_stats.committed, reset));
+	s.duplicates = cpu_to_be64(elog_stat(&elog_stats.duplicates, reset));
+	s.summaries = cpu_to_be64(elog_stat(&elog_stats.summaries, reset));
+	s.rate_limited = cpu_to_be64(elog_stat(&elog_stats.rate_limited,
+					       reset));
+	s.no_buffer = cpu_to_be64(elog_stat(&elog_stats.no_buffer, reset));
+	if (stats)
+		*stats = s;
+
+	return OPAL_SUCCESS;
+}
+opal_call(OPAL_ELOG_STATS, opal_elog_stats, 2);
+
 int elog_init(void)
 {
+	/* One bit per record in the free map */
+	BUILD_ASSERT(ELOG_WRITE_MAX_RECORD <= 64);
+
 	/* pre-allocate memory for records */
-	if (pool_init(&elog_pool, sizeof(struct errorlog), ELOG_WRITE_MAX_RECORD, 1))
+	elog_records = zalloc(sizeof(struct errorlog) * ELOG_WRITE_MAX_RECORD);
+	if (!elog_records)
 		return OPAL_RESOURCE;
 
+	elog_free_map = ~0ull >> (64 - ELOG_WRITE_MAX_RECORD);
+	elog_free_count = ELOG_WRITE_MAX_RECORD;
+	init_timer(&elog_dedup_timer, elog_dedup_expiry, NULL);
 	elog_available = true;
 	return 0;
 }
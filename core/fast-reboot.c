@@ -25,6 +25,7 @@
 #include <timebase.h>
 #include <pci.h>
 #include <chip.h>
+#include <mem_region.h>
 
 /*
  * To get control of all threads, we sreset them via XSCOM after
@@ -50,6 +51,15 @@
 uint8_t reboot_in_progress;
 static struct cpu_thread *resettor, *resettee;
 
+/* When the reboot was requested, each stage logs its time from there */
+static uint64_t fast_reboot_start;
+
+static void fast_reboot_stage(const char *stage)
+{
+	printf("RESET: %s done at +%lu ms\n", stage,
+	       tb_to_msecs(mftb() - fast_reboot_start));
+}
+
 static void flush_caches(void)
 {
 	uint64_t base = SKIBOOT_BASE;
@@ -178,6 +188,7 @@ void fast_reset(void)
 	uint32_t *dst, *src;
 
 	printf("RESET: Fast reboot request !\n");
+	fast_reboot_start = mftb();
 
 	/* XXX We need a way to ensure that no other CPU is in skiboot
 	 * holding locks (via the OPAL APIs) and if they are, we need
@@ -211,40 +222,35 @@ static void cleanup_cpu_state(void)
 	reset_cpu_icp();
 }
 
-#ifdef FAST_REBOOT_CLEARS_MEMORY
-static void fast_mem_clear(uint64_t start, uint64_t end)
+/* How long secondaries get to come back through the reset vector */
+#define FAST_REBOOT_CALLIN_TIMEOUT_MS	1000
+
+static bool fast_reboot_not_in(struct cpu_thread *cpu, void *data __unused)
 {
-	printf("MEMORY: Clearing %llx..%llx\n", start, end);
+	if (cpu == this_cpu() || cpu->state == cpu_state_disabled ||
+	    cpu->state == cpu_state_unavailable)
+		return false;
+	return cpu->state != cpu_state_present;
+}
 
-	while(start < end) {
-		asm volatile("dcbz 0,%0" : : "r" (start) : "memory");
-		start += 128;
-	}
+static bool fast_reboot_not_out(struct cpu_thread *cpu, void *data __unused)
+{
+	return cpu != this_cpu() && cpu->state == cpu_state_present;
 }
 
-static void memory_reset(void)
+/* Don't let the OS see CPUs that got lost on the way */
+static void fast_reboot_drop_cpus(cpu_barrier_fn pending)
 {
-	struct address_range *i;
-	uint64_t skistart = SKIBOOT_BASE;
-	uint64_t skiend = SKIBOOT_BASE + SKIBOOT_SIZE;
-
-	printf("MEMORY: Clearing ...\n");
-
-	list_for_each(&address_ranges, i, list) {
-		uint64_t start = cleanup_addr(i->arange->start);
-		uint64_t end = cleanup_addr(i->arange->end);
-
-		if (start >= skiend || end <= skistart)
-			fast_mem_clear(start, end);
-		else {
-			if (start < skistart)
-				fast_mem_clear(start, skistart);
-			if (end > skiend)
-				fast_mem_clear(skiend, end);
-		}
+	struct cpu_thread *cpu;
+
+	for_each_cpu(cpu) {
+		if (!pending(cpu, NULL))
+			continue;
+		prerror("RESET: Disabling CPU PIR 0x%04x\n", cpu->pir);
+		cpu->state = cpu_state_disabled;
+		cpu_remove_node(cpu);
 	}
 }
-#endif /* FAST_REBOOT_CLEARS_MEMORY */
 
 /* Entry from asm after a fast reset */
 void fast_reboot(void);
@@ -252,7 +258,6 @@ void fast_reboot(void);
 void fast_reboot(void)
 {
 	static volatile bool fast_boot_release;
-	struct cpu_thread *cpu;
 
 	printf("INIT: CPU PIR 0x%04x reset in\n", this_cpu()->pir);
 
@@ -280,17 +285,9 @@ void fast_reboot(void)
 	/* We are the original boot CPU, wait for secondaries to
 	 * be captured
 	 */
-	for_each_cpu(cpu) {
-		if (cpu == this_cpu())
-			continue;
-
-		/* XXX Add a callin timeout ? */
-		while (cpu->state != cpu_state_present) {
-			smt_very_low();
-			sync();
-		}
-		smt_medium();
-	}
+	if (cpu_barrier("calling in", fast_reboot_not_in, NULL,
+			FAST_REBOOT_CALLIN_TIMEOUT_MS))
+		fast_reboot_drop_cpus(fast_reboot_not_in);
 
 	printf("INIT: Releasing secondaries...\n");
 
@@ -299,18 +296,12 @@ void fast_reboot(void)
 	sync();
 
 	/* Wait for them to respond */
-	for_each_cpu(cpu) {
-		if (cpu == this_cpu())
-			continue;
-
-		/* XXX Add a callin timeout ? */
-		while (cpu->state == cpu_state_present) {
-			smt_very_low();
-			sync();
-		}
-	}
+	if (cpu_barrier("leaving the reset vector", fast_reboot_not_out, NULL,
+			FAST_REBOOT_CALLIN_TIMEOUT_MS))
+		fast_reboot_drop_cpus(fast_reboot_not_out);
 
 	printf("INIT: All done, resetting everything else...\n");
+	fast_reboot_stage("CPU reset");
 
 	/* Clear release flag for next time */
 	fast_boot_release = false;
@@ -333,13 +324,40 @@ void fast_reboot(void)
 
 	/* Reset IO Hubs */
 	cec_reset();
+	fast_reboot_stage("I/O reset");
+
+	/*
+	 * Reset the PHBs first: until then adapters may still DMA into
+	 * OS memory through the old TCE tables, which would corrupt both
+	 * a freshly loaded kernel and freshly cleared memory.
+	 */
+	pci_reset_slots();
+
+	/*
+	 * Load the kernel on another CPU while the slots get probed. When
+	 * memory gets cleared that has to be done first, so it only
+	 * overlaps with PCI when clearing is done in the background.
+	 */
+#if !defined(FAST_REBOOT_CLEARS_MEMORY)
+	start_kernel_preload(false);
+#elif defined(FAST_REBOOT_SCRUBS_IN_BACKGROUND)
+	mem_scrub_start();
+	start_kernel_preload(true);
+#endif
 
 	/* Re-Initialize all discovered PCI slots */
-	pci_init_slots();
+	pci_probe_slots();
+	fast_reboot_stage("PCI init");
 
 	/* Clear memory */
-#ifdef FAST_REBOOT_CLEARS_MEMORY
-	memory_reset();
+#if defined(FAST_REBOOT_CLEARS_MEMORY) && !defined(FAST_REBOOT_SCRUBS_IN_BACKGROUND)
+	mem_scrub_start();
+	mem_scrub_wait();
+	fast_reboot_stage("Memory clear");
+#else
+	wait_kernel_preload();
+	fast_reboot_stage("Kernel load");
 #endif
+
 	load_and_boot_kernel(true);
 }
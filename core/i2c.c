@@ -115,3 +115,56 @@ static int opal_i2c_request(uint64_t async_token, uint32_t bus_id,
 opal_call(OPAL_I2C_REQUEST, opal_i2c_request, 3);
 
 
+
+static int opal_i2c_transfer(uint64_t async_token, uint32_t bus_id,
+			     struct opal_i2c_msg *omsgs, uint32_t nr_msgs)
+{
+	struct i2c_bus *bus;
+	struct i2c_request *req;
+	uint32_t i;
+	int rc;
+
+	if (!nr_msgs || nr_msgs > I2C_MAX_MSGS)
+		return OPAL_PARAMETER;
+
+	bus = i2c_find_bus_by_id(bus_id);
+	if (!bus) {
+		prlog(PR_ERR, "I2C: Invalid 'bus_id' passed to the OPAL\n");
+		return OPAL_PARAMETER;
+	}
+
+	for (i = 0; i < nr_msgs; i++) {
+		if (omsgs[i].flags & ~OPAL_I2C_MSG_READ)
+			return OPAL_PARAMETER;
+		if (!omsgs[i].size || omsgs[i].addr > 0x7f)
+			return OPAL_PARAMETER;
+	}
+
+	req = i2c_alloc_req(bus);
+	if (!req) {
+		prlog(PR_ERR, "I2C: Failed to allocate 'i2c_request'\n");
+		return OPAL_NO_MEM;
+	}
+
+	req->op = I2C_MULTI;
+	for (i = 0; i < nr_msgs; i++) {
+		req->msgs[i].read = omsgs[i].flags & OPAL_I2C_MSG_READ;
+		req->msgs[i].dev_addr = omsgs[i].addr;
+		req->msgs[i].len = omsgs[i].size;
+		req->msgs[i].buf = (void *)omsgs[i].buffer_ra;
+	}
+	req->nr_msgs = nr_msgs;
+	req->dev_addr = omsgs[0].addr;
+	req->completion = opal_i2c_request_complete;
+	req->user_data = (void *)(unsigned long)async_token;
+	req->bus = bus;
+
+	rc = i2c_queue_req(req);
+	if (rc) {
+		i2c_free_req(req);
+		return rc;
+	}
+
+	return OPAL_ASYNC_COMPLETION;
+}
+opal_call(OPAL_I2C_TRANSFER, opal_i2c_transfer, 4);
@@ -43,6 +43,7 @@
 #include <centaur.h>
 #include <libfdt/libfdt.h>
 #include <hostservices.h>
+#include <timebase.h>
 #include <timer.h>
 
 #include <ipmi.h>
@@ -330,34 +331,109 @@ static bool load_kernel(void)
 	return false;
 }
 
-static void load_initramfs(void)
+static size_t load_initramfs(void)
 {
 	size_t size;
 	bool loaded;
 
 	if (!platform.load_resource)
-		return;
+		return 0;
 
 	size = INITRAMFS_LOAD_SIZE;
 	loaded = platform.load_resource(RESOURCE_ID_INITRAMFS,
 			INITRAMFS_LOAD_BASE, &size);
 
 	if (!loaded || !size)
-		return;
+		return 0;
 
 	printf("INIT: Initramfs loaded, size: %zu bytes\n", size);
 
+	return size;
+}
+
+static void add_initramfs_props(size_t size)
+{
+	struct dt_property *p;
+
+	/* Left over from before a fast reboot */
+	p = __dt_find_property(dt_chosen, "linux,initrd-start");
+	if (p)
+		dt_del_property(dt_chosen, p);
+	p = __dt_find_property(dt_chosen, "linux,initrd-end");
+	if (p)
+		dt_del_property(dt_chosen, p);
+
+	if (!size)
+		return;
+
 	dt_add_property_u64(dt_chosen, "linux,initrd-start",
 			(uint64_t)INITRAMFS_LOAD_BASE);
 	dt_add_property_u64(dt_chosen, "linux,initrd-end",
 			(uint64_t)INITRAMFS_LOAD_BASE + size);
 }
 
+/*
+ * Loading the kernel and initramfs from flash doesn't depend on
+ * anything else, so a fast reboot does it on another CPU while the
+ * PCI slots get probed. The device-tree is only updated once the
+ * boot CPU has waited for it.
+ */
+static struct cpu_job *kernel_preload_job;
+static bool kernel_preloaded, kernel_preload_ok;
+static size_t kernel_preload_initramfs;
+
+static void kernel_preload(void *data)
+{
+	uint64_t start = mftb();
+
+	/* Memory is still being cleared, wait for it */
+	if (data)
+		mem_scrub_wait();
+
+	kernel_preload_ok = load_kernel();
+	kernel_preload_initramfs = load_initramfs();
+	printf("INIT: Kernel and initramfs loaded in %lu ms\n",
+	       tb_to_msecs(mftb() - start));
+	lwsync();
+	kernel_preloaded = true;
+}
+
+void start_kernel_preload(bool after_mem_scrub)
+{
+	struct cpu_thread *cpu, *loader = NULL;
+
+	/*
+	 * Stay away from the first CPUs, PCI probing jobs go there. Also
+	 * stay off thread 0s: those run the memory scrub job, and waiting
+	 * for the scrub from a job nested under it would never finish.
+	 * Without a suitable CPU the load (and scrub wait) happens here.
+	 */
+	for_each_available_cpu(cpu) {
+		if (cpu != this_cpu() && !cpu_is_thread0(cpu))
+			loader = cpu;
+	}
+	if (loader)
+		kernel_preload_job = __cpu_queue_job(loader, kernel_preload,
+				after_mem_scrub ? loader : NULL, false);
+	if (!kernel_preload_job)
+		kernel_preload(after_mem_scrub ? this_cpu() : NULL);
+}
+
+void wait_kernel_preload(void)
+{
+	if (!kernel_preload_job)
+		return;
+	cpu_wait_job(kernel_preload_job, true);
+	kernel_preload_job = NULL;
+}
+
 void __noreturn load_and_boot_kernel(bool is_reboot)
 {
 	const struct dt_property *memprop;
 	uint64_t mem_top;
 	void *fdt;
+	bool loaded;
+	size_t initramfs_size;
 
 	memprop = dt_find_property(dt_root, DT_PRIVATE "maxmem");
 	if (memprop)
@@ -371,13 +447,22 @@ void __noreturn load_and_boot_kernel(bool is_reboot)
 	if (platform.exit)
 		platform.exit();
 
-	/* Load kernel LID */
-	if (!load_kernel()) {
+	/* Load kernel LID, unless it's been done already */
+	wait_kernel_preload();
+	if (kernel_preloaded) {
+		loaded = kernel_preload_ok;
+		initramfs_size = kernel_preload_initramfs;
+		kernel_preloaded = false;
+	} else {
+		loaded = load_kernel();
+		initramfs_size = load_initramfs();
+	}
+	if (!loaded) {
 		op_display(OP_FATAL, OP_MOD_INIT, 1);
 		abort();
 	}
 
-	load_initramfs();
+	add_initramfs_props(initramfs_size);
 
 	if (!is_reboot) {
 		/* We wait for the nvram read to complete here so we can
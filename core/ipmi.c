@@ -49,6 +49,7 @@ void ipmi_init_msg(struct ipmi_msg *msg, int interface,
 	msg->resp_size = resp_size;
 	msg->complete = complete;
 	msg->user_data = user_data;
+	msg->host_req = false;
 }
 
 struct ipmi_msg *ipmi_mkmsg_simple(uint32_t code, void *req_data, size_t req_size)
@@ -0,0 +1,249 @@
+/* Copyright 2013-2014 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <skiboot.h>
+#include <mem_region.h>
+#include <device.h>
+#include <lock.h>
+#include <timebase.h>
+#ifndef __TEST__
+#include <cpu.h>
+#endif
+
+/*
+ * Memory scrubbing
+ *
+ * Clearing all of the OS memory from the boot CPU, one cache line at
+ * a time, takes minutes on machines with terabytes of it. Instead the
+ * ranges handed over to the OS are cut into chunks which one thread
+ * per core clears in parallel. Threads take chunks from the memory
+ * behind their own chip first, and only help with other ranges once
+ * that's done, which also takes care of chips without CPUs.
+ */
+#ifndef MEM_SCRUB_CHUNK
+#define MEM_SCRUB_CHUNK		0x10000000ull	/* 256MB */
+#endif
+#define MEM_SCRUB_MAX_RANGES	128
+#define MEM_SCRUB_ANY_CHIP	0xffffffff
+
+struct mem_scrub_range {
+	uint64_t	start;		/* Next chunk */
+	uint64_t	end;
+	uint32_t	chip_id;
+};
+
+static struct lock mem_scrub_lock = LOCK_UNLOCKED;
+static struct mem_scrub_range mem_scrub_ranges[MEM_SCRUB_MAX_RANGES];
+static unsigned int mem_scrub_nr_ranges;
+static unsigned int mem_scrub_pct;
+static uint64_t mem_scrub_total, mem_scrub_done;
+
+#ifndef __TEST__
+static void mem_scrub_clear(uint64_t start, uint64_t end)
+{
+	uint64_t s = ALIGN_UP(start, 128);
+	uint64_t e = end & ~127ull;
+
+	/* dcbz clears whole lines, don't spill over the range */
+	if (s >= e) {
+		memset((void *)start, 0, end - start);
+		return;
+	}
+	memset((void *)start, 0, s - start);
+	while (s < e) {
+		asm volatile("dcbz 0,%0" : : "r" (s) : "memory");
+		s += 128;
+	}
+	memset((void *)e, 0, end - e);
+}
+#endif
+
+static uint32_t mem_scrub_chip(struct mem_region *region)
+{
+	const struct dt_property *prop;
+
+	if (!region->mem_node)
+		return MEM_SCRUB_ANY_CHIP;
+	prop = dt_find_property(region->mem_node, "ibm,chip-id");
+	if (!prop || prop->len < sizeof(u32))
+		return MEM_SCRUB_ANY_CHIP;
+	return be32_to_cpu(*(const __be32 *)prop->prop);
+}
+
+/* Collect the OS ranges, along with the chip they are attached to */
+static void mem_scrub_plan(void)
+{
+	struct mem_scrub_range *sr;
+	struct mem_region *r;
+
+	mem_scrub_nr_ranges = 0;
+	mem_scrub_total = mem_scrub_done = 0;
+	mem_scrub_pct = 0;
+
+	lock(&mem_region_lock);
+	for (r = mem_region_next(NULL); r; r = mem_region_next(r)) {
+		if (r->type != REGION_OS || !r->len)
+			continue;
+		if (mem_scrub_nr_ranges == MEM_SCRUB_MAX_RANGES) {
+			prerror("MEM: Too many ranges, clearing %llx..%llx"
+				" now\n", r->start, r->start + r->len);
+			mem_scrub_clear(r->start, r->start + r->len);
+			continue;
+		}
+		sr = &mem_scrub_ranges[mem_scrub_nr_ranges++];
+		sr->start = r->start;
+		sr->end = r->start + r->len;
+		sr->chip_id = mem_scrub_chip(r);
+		mem_scrub_total += r->len;
+	}
+	unlock(&mem_region_lock);
+}
+
+/* Next chunk for a thread of @chip_id: local memory, or the biggest left */
+static bool mem_scrub_next(uint32_t chip_id, uint64_t *start, uint64_t *end)
+{
+	struct mem_scrub_range *r, *best = NULL;
+	unsigned int i;
+
+	lock(&mem_scrub_lock);
+	for (i = 0; i < mem_scrub_nr_ranges; i++) {
+		r = &mem_scrub_ranges[i];
+		if (r->start == r->end)
+			continue;
+		if (r->chip_id == chip_id) {
+			best = r;
+			break;
+		}
+		if (!best || r->end - r->start > best->end - best->start)
+			best = r;
+	}
+	if (best) {
+		*start = best->start;
+		*end = best->end - best->start > MEM_SCRUB_CHUNK ?
+			best->start + MEM_SCRUB_CHUNK : best->end;
+		best->start = *end;
+	}
+	unlock(&mem_scrub_lock);
+
+	return best != NULL;
+}
+
+static void mem_scrub_account(uint64_t len)
+{
+	unsigned int pct;
+	uint64_t done;
+
+	lock(&mem_scrub_lock);
+	mem_scrub_done += len;
+	done = mem_scrub_done;
+	pct = done * 10 / mem_scrub_total * 10;
+	if (pct <= mem_scrub_pct)
+		pct = 0;
+	else
+		mem_scrub_pct = pct;
+	unlock(&mem_scrub_lock);
+
+	if (pct)
+		prlog(PR_INFO, "MEM: Scrubbed %u%% (%llu of %llu MB)\n",
+		      pct, done >> 20, mem_scrub_total >> 20);
+}
+
+static bool mem_scrub_one(uint32_t chip_id)
+{
+	uint64_t start, end;
+
+	if (!mem_scrub_next(chip_id, &start, &end))
+		return false;
+	mem_scrub_clear(start, end);
+	mem_scrub_account(end - start);
+
+	return true;
+}
+
+#ifndef __TEST__
+static unsigned int mem_scrub_workers;
+static uint64_t mem_scrub_start_tb;
+
+static void mem_scrub_job(void *data)
+{
+	uint32_t chip_id = (unsigned long)data;
+
+	/* Let jobs queued behind us (PCI probing) run between chunks */
+	while (mem_scrub_one(chip_id))
+		cpu_process_jobs();
+
+	lock(&mem_scrub_lock);
+	mem_scrub_workers--;
+	unlock(&mem_scrub_lock);
+}
+
+/*
+ * mem_scrub_start - Start clearing the OS memory in the background
+ *
+ * One job per core other than ours, mem_scrub_wait() must be called
+ * before anything gets loaded into that memory.
+ */
+void mem_scrub_start(void)
+{
+	struct cpu_thread *cpu;
+	unsigned int workers = 0;
+
+	mem_scrub_plan();
+	prlog(PR_NOTICE, "MEM: Scrubbing %llu MB in %u ranges...\n",
+	      mem_scrub_total >> 20, mem_scrub_nr_ranges);
+	mem_scrub_start_tb = mftb();
+
+	for_each_available_cpu(cpu) {
+		if (cpu == this_cpu() || !cpu_is_thread0(cpu))
+			continue;
+		lock(&mem_scrub_lock);
+		mem_scrub_workers++;
+		unlock(&mem_scrub_lock);
+		if (__cpu_queue_job(cpu, mem_scrub_job,
+				    (void *)(unsigned long)cpu->chip_id, true)) {
+			workers++;
+			continue;
+		}
+		lock(&mem_scrub_lock);
+		mem_scrub_workers--;
+		unlock(&mem_scrub_lock);
+	}
+	prlog(PR_DEBUG, "MEM: %u scrub threads\n", workers);
+}
+
+void mem_scrub_wait(void)
+{
+	unsigned int workers;
+	uint64_t ms;
+
+	/* Help with what's left, then wait for the last chunks */
+	while (mem_scrub_one(this_cpu()->chip_id))
+		;
+	for (;;) {
+		lock(&mem_scrub_lock);
+		workers = mem_scrub_workers;
+		unlock(&mem_scrub_lock);
+		if (!workers)
+			break;
+		time_wait_ms(1);
+	}
+
+	ms = tb_to_msecs(mftb() - mem_scrub_start_tb);
+	prlog(PR_NOTICE, "MEM: Scrubbed %llu MB in %llu ms (%llu MB/s)\n",
+	      mem_scrub_total >> 20, ms,
+	      ms ? (mem_scrub_total >> 20) * 1000 / ms : 0);
+}
+#endif /* __TEST__ */
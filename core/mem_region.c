@@ -725,6 +725,16 @@ struct mem_region *find_mem_region(const char *name)
 	return NULL;
 }
 
+/* Region after @region, or the first one if NULL */
+struct mem_region *mem_region_next(struct mem_region *region)
+{
+	struct list_node *n = region ? region->list.next : regions.n.next;
+
+	if (n == &regions.n)
+		return NULL;
+	return container_of(n, struct mem_region, list);
+}
+
 /* Trawl through device tree, create memory regions from nodes. */
 void mem_region_init(void)
 {
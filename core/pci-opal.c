@@ -21,7 +21,30 @@
 #include <timebase.h>
 #include <lock.h>
 
-#define OPAL_PCICFG_ACCESS(op, cb, type)	\
+/*
+ * The OS always gets what the PHB returns, never the config shadow:
+ * it relies on the PHB checks and on the all-ones data of a frozen
+ * PE to find errors.
+ */
+#define OPAL_PCICFG_READ(op, cb, type)					\
+static int64_t opal_pci_config_##op(uint64_t phb_id,			\
+				    uint64_t bus_dev_func,		\
+				    uint64_t offset, type *data)	\
+{									\
+	struct phb *phb = pci_get_phb(phb_id);				\
+	int64_t rc;							\
+									\
+	if (!phb)							\
+		return OPAL_PARAMETER;					\
+	phb->ops->lock(phb);						\
+	rc = phb->ops->cfg_##cb(phb, bus_dev_func, offset, data);	\
+	phb->ops->unlock(phb);						\
+	pci_put_phb(phb);						\
+									\
+	return rc;							\
+}
+
+#define OPAL_PCICFG_WRITE(op, cb, type)					\
 static int64_t opal_pci_config_##op(uint64_t phb_id,			\
 				    uint64_t bus_dev_func,		\
 				    uint64_t offset, type data)		\
@@ -33,18 +56,20 @@ static int64_t opal_pci_config_##op(uint64_t phb_id,			\
 		return OPAL_PARAMETER;					\
 	phb->ops->lock(phb);						\
 	rc = phb->ops->cfg_##cb(phb, bus_dev_func, offset, data);	\
+	pci_cfg_shadow_write(phb, bus_dev_func, offset,			\
+			     sizeof(type), data);			\
 	phb->ops->unlock(phb);						\
 	pci_put_phb(phb);						\
 									\
 	return rc;							\
 }
 
-OPAL_PCICFG_ACCESS(read_byte,		read8, uint8_t *)
-OPAL_PCICFG_ACCESS(read_half_word,	read16, uint16_t *)
-OPAL_PCICFG_ACCESS(read_word,		read32, uint32_t *)
-OPAL_PCICFG_ACCESS(write_byte,		write8, uint8_t)
-OPAL_PCICFG_ACCESS(write_half_word,	write16, uint16_t)
-OPAL_PCICFG_ACCESS(write_word,		write32, uint32_t)
+OPAL_PCICFG_READ(read_byte,		read8, uint8_t)
+OPAL_PCICFG_READ(read_half_word,	read16, uint16_t)
+OPAL_PCICFG_READ(read_word,		read32, uint32_t)
+OPAL_PCICFG_WRITE(write_byte,		write8, uint8_t)
+OPAL_PCICFG_WRITE(write_half_word,	write16, uint16_t)
+OPAL_PCICFG_WRITE(write_word,		write32, uint32_t)
 
 opal_call(OPAL_PCI_CONFIG_READ_BYTE, opal_pci_config_read_byte, 4);
 opal_call(OPAL_PCI_CONFIG_READ_HALF_WORD, opal_pci_config_read_half_word, 4);
@@ -53,6 +78,84 @@ opal_call(OPAL_PCI_CONFIG_WRITE_BYTE, opal_pci_config_write_byte, 4);
 opal_call(OPAL_PCI_CONFIG_WRITE_HALF_WORD, opal_pci_config_write_half_word, 4);
 opal_call(OPAL_PCI_CONFIG_WRITE_WORD, opal_pci_config_write_word, 4);
 
+static int64_t pci_cfg_op(struct phb *phb, struct opal_pci_cfg_op *op)
+{
+	uint32_t bdfn = be16_to_cpu(op->bdfn);
+	uint32_t offset = be16_to_cpu(op->offset);
+	uint32_t val = be32_to_cpu(op->value);
+	uint16_t val16;
+	uint8_t val8;
+	int64_t rc;
+
+	if (op->size != 1 && op->size != 2 && op->size != 4)
+		return OPAL_PARAMETER;
+
+	if (op->op == OPAL_PCI_CFG_OP_WRITE) {
+		switch (op->size) {
+		case 1:
+			rc = phb->ops->cfg_write8(phb, bdfn, offset, val);
+			break;
+		case 2:
+			rc = phb->ops->cfg_write16(phb, bdfn, offset, val);
+			break;
+		default:
+			rc = phb->ops->cfg_write32(phb, bdfn, offset, val);
+		}
+		pci_cfg_shadow_write(phb, bdfn, offset, op->size, val);
+		return rc;
+	}
+	if (op->op != OPAL_PCI_CFG_OP_READ)
+		return OPAL_PARAMETER;
+
+	switch (op->size) {
+	case 1:
+		rc = phb->ops->cfg_read8(phb, bdfn, offset, &val8);
+		val = val8;
+		break;
+	case 2:
+		rc = phb->ops->cfg_read16(phb, bdfn, offset, &val16);
+		val = val16;
+		break;
+	default:
+		rc = phb->ops->cfg_read32(phb, bdfn, offset, &val);
+	}
+	op->value = cpu_to_be32(val);
+	return rc;
+}
+
+/*
+ * Run a list of config space accesses on a PHB in one go, under a
+ * single PHB lock. Accesses are done in order, each gets its own
+ * return code and all of them are attempted. The call returns the
+ * first error, if any.
+ */
+static int64_t opal_pci_config_batch(uint64_t phb_id,
+				     struct opal_pci_cfg_op *ops,
+				     uint64_t count)
+{
+	struct phb *phb = pci_get_phb(phb_id);
+	int64_t rc, ret = OPAL_SUCCESS;
+	uint64_t i;
+
+	if (!phb)
+		return OPAL_PARAMETER;
+	if (!ops || !count || count > OPAL_PCI_CFG_BATCH_MAX)
+		return OPAL_PARAMETER;
+
+	phb->ops->lock(phb);
+	for (i = 0; i < count; i++) {
+		rc = pci_cfg_op(phb, &ops[i]);
+		ops[i].rc = cpu_to_be32(rc);
+		if (rc && ret == OPAL_SUCCESS)
+			ret = rc;
+	}
+	phb->ops->unlock(phb);
+	pci_put_phb(phb);
+
+	return ret;
+}
+opal_call(OPAL_PCI_CONFIG_BATCH, opal_pci_config_batch, 3);
+
 static int64_t opal_pci_eeh_freeze_status(uint64_t phb_id, uint64_t pe_number,
 					  uint8_t *freeze_state,
 					  uint16_t *pci_error_type,
@@ -68,6 +171,8 @@ static int64_t opal_pci_eeh_freeze_status(uint64_t phb_id, uint64_t pe_number,
 	phb->ops->lock(phb);
 	rc = phb->ops->eeh_freeze_status(phb, pe_number, freeze_state,
 					 pci_error_type, NULL, phb_status);
+	if (rc == OPAL_SUCCESS && *freeze_state != OPAL_EEH_STOPPED_NOT_FROZEN)
+		pci_cfg_shadow_flush(phb);
 	phb->ops->unlock(phb);
 	pci_put_phb(phb);
 
@@ -87,6 +192,7 @@ static int64_t opal_pci_eeh_freeze_clear(uint64_t phb_id, uint64_t pe_number,
 		return OPAL_UNSUPPORTED;
 	phb->ops->lock(phb);
 	rc = phb->ops->eeh_freeze_clear(phb, pe_number, eeh_action_token);
+	pci_cfg_shadow_flush(phb);
 	phb->ops->unlock(phb);
 	pci_put_phb(phb);
 
@@ -106,6 +212,7 @@ static int64_t opal_pci_eeh_freeze_set(uint64_t phb_id, uint64_t pe_number,
 		return OPAL_UNSUPPORTED;
 	phb->ops->lock(phb);
 	rc = phb->ops->eeh_freeze_set(phb, pe_number, eeh_action_token);
+	pci_cfg_shadow_flush(phb);
 	phb->ops->unlock(phb);
 	pci_put_phb(phb);
 
@@ -256,6 +363,107 @@ static int64_t opal_pci_set_peltv(uint64_t phb_id, uint32_t parent_pe,
 }
 opal_call(OPAL_PCI_SET_PELTV, opal_pci_set_peltv, 4);
 
+/*
+ * Generic version of one OPAL_PCI_SET_PE_BATCH descriptor built on
+ * the single entry PHB ops, for PHBs without a set_pe_batch op
+ */
+static int64_t pci_pe_op(struct phb *phb, struct opal_pci_pe_op *op)
+{
+	const struct phb_ops *ops = phb->ops;
+	uint16_t pe = be16_to_cpu(op->pe_number);
+	uint32_t first, count, i;
+	int64_t rc = OPAL_SUCCESS;
+
+	switch (op->op) {
+	case OPAL_PCI_PE_OP_SET_RID:
+	case OPAL_PCI_PE_OP_MAP_M32:
+		first = be16_to_cpu(op->u.range.first);
+		count = be16_to_cpu(op->u.range.count);
+		if (!count || first + count > 0x10000)
+			return OPAL_PARAMETER;
+		if (op->op == OPAL_PCI_PE_OP_SET_RID && !ops->set_pe)
+			return OPAL_UNSUPPORTED;
+		if (op->op == OPAL_PCI_PE_OP_MAP_M32 &&
+		    !ops->map_pe_mmio_window)
+			return OPAL_UNSUPPORTED;
+		for (i = first; i < first + count && rc == OPAL_SUCCESS; i++) {
+			if (op->op == OPAL_PCI_PE_OP_SET_RID)
+				rc = ops->set_pe(phb, pe, i, OpalPciBusAll,
+						 OPAL_COMPARE_RID_DEVICE_NUMBER,
+						 OPAL_COMPARE_RID_FUNCTION_NUMBER,
+						 op->action);
+			else
+				rc = ops->map_pe_mmio_window(phb, pe,
+						OPAL_M32_WINDOW_TYPE, 0, i);
+		}
+		return rc;
+	case OPAL_PCI_PE_OP_SET_PELTV:
+		if (!ops->set_peltv)
+			return OPAL_UNSUPPORTED;
+		for (i = 0; i < 8 * sizeof(op->u.peltv); i++) {
+			if (!(op->u.peltv[i / 8] & (0x80 >> (i % 8))))
+				continue;
+			rc = ops->set_peltv(phb, pe, i, op->action);
+			if (rc != OPAL_SUCCESS)
+				break;
+		}
+		return rc;
+	case OPAL_PCI_PE_OP_MAP_M64:
+		if (!ops->map_pe_mmio_window)
+			return OPAL_UNSUPPORTED;
+		return ops->map_pe_mmio_window(phb, pe, OPAL_M64_WINDOW_TYPE,
+					       be16_to_cpu(op->u.window_num), 0);
+	case OPAL_PCI_PE_OP_MAP_TVE:
+		if (!ops->map_pe_dma_window)
+			return OPAL_UNSUPPORTED;
+		return ops->map_pe_dma_window(phb, pe,
+				be16_to_cpu(op->u.tve.window_id),
+				be16_to_cpu(op->u.tve.tce_levels),
+				be64_to_cpu(op->u.tve.tce_table_addr),
+				be64_to_cpu(op->u.tve.tce_table_size),
+				be64_to_cpu(op->u.tve.tce_page_size));
+	}
+
+	return OPAL_PARAMETER;
+}
+
+/*
+ * Program a list of PE assignments in one go. The PHB backend can
+ * apply them all before touching the hardware, otherwise they are
+ * done one by one. Every descriptor gets its own return code and
+ * the call returns the first error, if any.
+ */
+static int64_t opal_pci_set_pe_batch(uint64_t phb_id,
+				     struct opal_pci_pe_op *ops,
+				     uint64_t count)
+{
+	struct phb *phb = pci_get_phb(phb_id);
+	int64_t rc, ret = OPAL_SUCCESS;
+	uint64_t i;
+
+	if (!phb)
+		return OPAL_PARAMETER;
+	if (!ops || !count || count > OPAL_PCI_PE_BATCH_MAX)
+		return OPAL_PARAMETER;
+
+	phb->ops->lock(phb);
+	if (phb->ops->set_pe_batch) {
+		ret = phb->ops->set_pe_batch(phb, ops, count);
+	} else {
+		for (i = 0; i < count; i++) {
+			rc = pci_pe_op(phb, &ops[i]);
+			ops[i].rc = cpu_to_be32(rc);
+			if (rc && ret == OPAL_SUCCESS)
+				ret = rc;
+		}
+	}
+	phb->ops->unlock(phb);
+	pci_put_phb(phb);
+
+	return ret;
+}
+opal_call(OPAL_PCI_SET_PE_BATCH, opal_pci_set_pe_batch, 3);
+
 static int64_t opal_pci_set_mve(uint64_t phb_id, uint32_t mve_number,
 				uint32_t pe_number)
 {
@@ -322,6 +530,11 @@ static int64_t opal_pci_msi_eoi(uint64_t phb_id,
 
 	if (!phb)
 		return OPAL_PARAMETER;
+	if (phb->ops->pci_msi_eoi_nolock) {
+		rc = phb->ops->pci_msi_eoi_nolock(phb, hwirq);
+		pci_put_phb(phb);
+		return rc;
+	}
 	if (!phb->ops->pci_msi_eoi)
 		return OPAL_UNSUPPORTED;
 	phb->ops->lock(phb);
@@ -333,6 +546,26 @@ static int64_t opal_pci_msi_eoi(uint64_t phb_id,
 }
 opal_call(OPAL_PCI_MSI_EOI, opal_pci_msi_eoi, 2);
 
+static int64_t opal_pci_msi_stats(uint64_t phb_id, uint64_t flags,
+				  uint32_t first, uint32_t count,
+				  struct opal_pci_msi_stats *stats)
+{
+	struct phb *phb = pci_get_phb(phb_id);
+	int64_t rc;
+
+	if (!phb || (count && !stats))
+		return OPAL_PARAMETER;
+	if (!phb->ops->msi_stats)
+		return OPAL_UNSUPPORTED;
+	phb->ops->lock(phb);
+	rc = phb->ops->msi_stats(phb, flags, first, count, count ? stats : NULL);
+	phb->ops->unlock(phb);
+	pci_put_phb(phb);
+
+	return rc;
+}
+opal_call(OPAL_PCI_MSI_STATS, opal_pci_msi_stats, 5);
+
 static int64_t opal_pci_set_xive_pe(uint64_t phb_id, uint32_t pe_number,
 				    uint32_t xive_num)
 {
@@ -461,6 +694,37 @@ static int64_t opal_pci_map_pe_dma_window_real(uint64_t phb_id,
 }
 opal_call(OPAL_PCI_MAP_PE_DMA_WINDOW_REAL, opal_pci_map_pe_dma_window_real, 5);
 
+/*
+ * Map and unmap TCE ranges of the DMA windows of a PHB in one go. The
+ * pool is a list of pages that can be used for missing indirect levels
+ * of multi-level tables, the ones used are zeroed in the list.
+ */
+static int64_t opal_pci_tce_batch(uint64_t phb_id,
+				  struct opal_pci_tce_op *ops,
+				  uint64_t count,
+				  __be64 *pool,
+				  uint64_t pool_count)
+{
+	struct phb *phb = pci_get_phb(phb_id);
+	int64_t rc;
+
+	if (!phb)
+		return OPAL_PARAMETER;
+	if (!ops || !count || count > OPAL_PCI_TCE_BATCH_MAX)
+		return OPAL_PARAMETER;
+	if ((pool_count && !pool) || pool_count > 0xffffffff)
+		return OPAL_PARAMETER;
+	if (!phb->ops->tce_batch)
+		return OPAL_UNSUPPORTED;
+	phb->ops->lock(phb);
+	rc = phb->ops->tce_batch(phb, ops, count, pool, pool_count);
+	phb->ops->unlock(phb);
+	pci_put_phb(phb);
+
+	return rc;
+}
+opal_call(OPAL_PCI_TCE_BATCH, opal_pci_tce_batch, 5);
+
 static int64_t opal_pci_reset(uint64_t phb_id, uint8_t reset_scope,
                               uint8_t assert_state)
 {
@@ -477,6 +741,10 @@ static int64_t opal_pci_reset(uint64_t phb_id, uint8_t reset_scope,
 
 	phb->ops->lock(phb);
 
+	/* Whatever is below may come back as something else */
+	pci_rescan_abort(phb);
+	pci_cfg_shadow_flush(phb);
+
 	switch(reset_scope) {
 	case OPAL_RESET_PHB_COMPLETE:
 		if (!phb->ops->complete_reset) {
@@ -554,7 +822,9 @@ static int64_t opal_pci_reinit(uint64_t phb_id,
 		return OPAL_UNSUPPORTED;
 
 	phb->ops->lock(phb);
+	pci_rescan_abort(phb);
 	rc = phb->ops->pci_reinit(phb, reinit_scope, data);
+	pci_cfg_shadow_flush(phb);
 	phb->ops->unlock(phb);
 	pci_put_phb(phb);
 
@@ -562,6 +832,61 @@ static int64_t opal_pci_reinit(uint64_t phb_id,
 }
 opal_call(OPAL_PCI_REINIT, opal_pci_reinit, 3);
 
+static int64_t opal_pci_slot_rescan(uint64_t phb_id, uint64_t bdfn,
+				    struct opal_pci_slot_rescan *res)
+{
+	struct phb *phb = pci_get_phb(phb_id);
+	int64_t rc;
+
+	if (!phb || bdfn > 0xffff)
+		return OPAL_PARAMETER;
+
+	phb->ops->lock(phb);
+	rc = pci_rescan_slot(phb, bdfn, res);
+	phb->ops->unlock(phb);
+	pci_put_phb(phb);
+
+	return rc;
+}
+opal_call(OPAL_PCI_SLOT_RESCAN, opal_pci_slot_rescan, 3);
+
+static int64_t opal_pci_cfg_shadow(uint64_t phb_id, uint64_t flags,
+				   struct opal_pci_cfg_shadow_stats *stats)
+{
+	struct phb *phb = pci_get_phb(phb_id);
+
+	if (!phb)
+		return OPAL_PARAMETER;
+	if ((flags & OPAL_PCI_CFG_SHADOW_ENABLE) &&
+	    (flags & OPAL_PCI_CFG_SHADOW_DISABLE)) {
+		pci_put_phb(phb);
+		return OPAL_PARAMETER;
+	}
+
+	phb->ops->lock(phb);
+	if (stats) {
+		stats->hits = cpu_to_be64(phb->cfg_shadow_hits);
+		stats->misses = cpu_to_be64(phb->cfg_shadow_misses);
+		stats->fills = cpu_to_be64(phb->cfg_shadow_fills);
+		stats->flushes = cpu_to_be64(phb->cfg_shadow_flushes);
+	}
+	if (flags & (OPAL_PCI_CFG_SHADOW_DISABLE | OPAL_PCI_CFG_SHADOW_FLUSH))
+		pci_cfg_shadow_flush(phb);
+	if (flags & OPAL_PCI_CFG_SHADOW_DISABLE)
+		phb->cfg_shadow_off = true;
+	if (flags & OPAL_PCI_CFG_SHADOW_ENABLE)
+		phb->cfg_shadow_off = false;
+	if (flags & OPAL_PCI_CFG_SHADOW_RESET_STATS) {
+		phb->cfg_shadow_hits = phb->cfg_shadow_misses = 0;
+		phb->cfg_shadow_fills = phb->cfg_shadow_flushes = 0;
+	}
+	phb->ops->unlock(phb);
+	pci_put_phb(phb);
+
+	return OPAL_SUCCESS;
+}
+opal_call(OPAL_PCI_CFG_SHADOW, opal_pci_cfg_shadow, 3);
+
 static int64_t opal_pci_poll(uint64_t phb_id)
 {
 	struct phb *phb = pci_get_phb(phb_id);
@@ -671,6 +996,33 @@ static int64_t opal_pci_next_error(uint64_t phb_id, uint64_t *first_frozen_pe,
 }
 opal_call(OPAL_PCI_NEXT_ERROR, opal_pci_next_error, 4);
 
+/*
+ * Like OPAL_PCI_NEXT_ERROR but reporting every frozen PE of the PHB
+ * along with its PEST, so a wide EEH event takes one call.
+ */
+static int64_t opal_pci_get_frozen_pes(uint64_t phb_id,
+				       struct opal_pci_frozen_pes *frozen,
+				       uint64_t len)
+{
+	struct phb *phb = pci_get_phb(phb_id);
+	int64_t rc;
+
+	if (!phb || !frozen || len < sizeof(*frozen))
+		return OPAL_PARAMETER;
+	if (!phb->ops->get_frozen_pes)
+		return OPAL_UNSUPPORTED;
+	phb->ops->lock(phb);
+
+	/* Any call to this function clears the error event */
+	opal_update_pending_evt(OPAL_EVENT_PCI_ERROR, 0);
+	rc = phb->ops->get_frozen_pes(phb, frozen);
+	phb->ops->unlock(phb);
+	pci_put_phb(phb);
+
+	return rc;
+}
+opal_call(OPAL_PCI_GET_FROZEN_PES, opal_pci_get_frozen_pes, 3);
+
 static int64_t opal_pci_eeh_freeze_status2(uint64_t phb_id, uint64_t pe_number,
 					   uint8_t *freeze_state,
 					   uint16_t *pci_error_type,
@@ -687,6 +1039,8 @@ static int64_t opal_pci_eeh_freeze_status2(uint64_t phb_id, uint64_t pe_number,
 	phb->ops->lock(phb);
 	rc = phb->ops->eeh_freeze_status(phb, pe_number, freeze_state,
 					 pci_error_type, severity, phb_status);
+	if (rc == OPAL_SUCCESS && *freeze_state != OPAL_EEH_STOPPED_NOT_FROZEN)
+		pci_cfg_shadow_flush(phb);
 	phb->ops->unlock(phb);
 	pci_put_phb(phb);
 
@@ -21,6 +21,8 @@
 #include <timebase.h>
 #include <lock.h>
 #include <device.h>
+#include <timer.h>
+#include <opal-api.h>
 
 static struct lock pci_lock = LOCK_UNLOCKED;
 static struct phb *phbs[64];
@@ -46,6 +48,263 @@ static struct phb *phbs[64];
 	      ((_bdfn) >> 8) & 0xff,			\
 	      ((_bdfn) >> 3) & 0x1f, (_bdfn) & 0x7, ## a)
 
+/*
+ * Config space shadow
+ *
+ * The IDs, class, header type, INTx pin and the capability list
+ * headers of a function can't change until it's reset or replaced, yet
+ * our scans and capability walks keep reading them. The first read of
+ * one of them captures them all, later ones are served from memory
+ * without going to the PHB, which is slow when config cycles go
+ * through the ASB. The shadow is flushed when the PHB or a slot is
+ * reset or rescanned, on EEH freezes and fences, and when bus numbers
+ * change. Config reads from the OS never use it.
+ */
+#define PCI_CFG_SHADOW_RO	(0xfull << PCI_CFG_VENDOR_ID |		\
+				 0xfull << PCI_CFG_REV_ID |		\
+				 1ull << PCI_CFG_HDR_TYPE |		\
+				 1ull << PCI_CFG_CAP |			\
+				 1ull << PCI_CFG_INT_PIN)
+#define PCI_CFG_SHADOW_RO_DEV	(PCI_CFG_SHADOW_RO |			\
+				 0xfull << PCI_CFG_SUBSYS_VENDOR_ID)
+
+static struct pci_cfg_shadow **pci_cfg_shadow_bucket(struct phb *phb,
+						     uint32_t bdfn)
+{
+	return &phb->cfg_shadow[(bdfn ^ (bdfn >> 8)) % PCI_CFG_SHADOW_HASH];
+}
+
+static struct pci_cfg_shadow *pci_cfg_shadow_find(struct phb *phb,
+						  uint32_t bdfn)
+{
+	struct pci_cfg_shadow *s;
+
+	for (s = *pci_cfg_shadow_bucket(phb, bdfn); s; s = s->next)
+		if (s->bdfn == bdfn)
+			return s;
+	return NULL;
+}
+
+static int64_t pci_cfg_shadow_hw_read(struct phb *phb, uint32_t bdfn,
+				      uint32_t offset, uint32_t size,
+				      uint32_t *data)
+{
+	uint16_t val16;
+	uint8_t val8;
+	int64_t rc;
+
+	phb->cfg_shadow_misses++;
+	switch (size) {
+	case 1:
+		rc = phb->ops->cfg_read8(phb, bdfn, offset, &val8);
+		*data = val8;
+		return rc;
+	case 2:
+		rc = phb->ops->cfg_read16(phb, bdfn, offset, &val16);
+		*data = val16;
+		return rc;
+	}
+	return phb->ops->cfg_read32(phb, bdfn, offset, data);
+}
+
+static void pci_cfg_shadow_set(struct pci_cfg_shadow *s, uint32_t offset,
+			       uint32_t size, uint32_t val)
+{
+	uint32_t i;
+
+	for (i = 0; i < size; i++)
+		s->hdr[offset + i] = val >> (8 * i);
+}
+
+static bool pci_cfg_shadow_add_cap(struct pci_cfg_shadow *s, uint16_t pos,
+				   uint32_t hdr)
+{
+	if (s->ncaps == PCI_CFG_SHADOW_CAPS)
+		return false;
+	s->cap_pos[s->ncaps] = pos;
+	s->cap_hdr[s->ncaps++] = hdr;
+	return true;
+}
+
+static struct pci_cfg_shadow *pci_cfg_shadow_fill(struct phb *phb,
+						  uint32_t bdfn,
+						  uint32_t *vdid,
+						  int64_t *rc)
+{
+	struct pci_cfg_shadow *s, **bucket;
+	uint32_t val, pos, prev, i;
+	bool pcie = false;
+
+	/* Nothing there, or Configuration Request Retry Status */
+	*rc = pci_cfg_shadow_hw_read(phb, bdfn, PCI_CFG_VENDOR_ID, 4, vdid);
+	if (*rc || (*vdid & 0xffff) == 0xffff || (*vdid & 0xffff) == 0x0001)
+		return NULL;
+
+	s = zalloc(sizeof(*s));
+	if (!s)
+		return NULL;
+	s->bdfn = bdfn;
+	pci_cfg_shadow_set(s, PCI_CFG_VENDOR_ID, 4, *vdid);
+	pci_cfg_shadow_hw_read(phb, bdfn, PCI_CFG_REV_ID, 4, &val);
+	pci_cfg_shadow_set(s, PCI_CFG_REV_ID, 4, val);
+	pci_cfg_shadow_hw_read(phb, bdfn, PCI_CFG_HDR_TYPE, 1, &val);
+	pci_cfg_shadow_set(s, PCI_CFG_HDR_TYPE, 1, val);
+	s->ro = PCI_CFG_SHADOW_RO;
+	if (!(val & 0x7f)) {
+		pci_cfg_shadow_hw_read(phb, bdfn, PCI_CFG_SUBSYS_VENDOR_ID, 4,
+				       &val);
+		pci_cfg_shadow_set(s, PCI_CFG_SUBSYS_VENDOR_ID, 4, val);
+		s->ro = PCI_CFG_SHADOW_RO_DEV;
+	}
+	pci_cfg_shadow_hw_read(phb, bdfn, PCI_CFG_INT_PIN, 1, &val);
+	pci_cfg_shadow_set(s, PCI_CFG_INT_PIN, 1, val);
+	pci_cfg_shadow_hw_read(phb, bdfn, PCI_CFG_CAP, 1, &val);
+	pci_cfg_shadow_set(s, PCI_CFG_CAP, 1, val);
+	pos = val & 0xfc;
+
+	/* Capability lists, stop at anything that looks wrong */
+	pci_cfg_shadow_hw_read(phb, bdfn, PCI_CFG_STAT, 2, &val);
+	s->has_caps = !!(val & PCI_CFG_STAT_CAP);
+	for (i = 0; s->has_caps && pos >= 0x40 && i < 48; i++) {
+		if (pci_cfg_shadow_hw_read(phb, bdfn, pos, 2, &val) ||
+		    val == 0xffff || !pci_cfg_shadow_add_cap(s, pos, val))
+			break;
+		if ((val & 0xff) == PCI_CFG_CAP_ID_EXP)
+			pcie = true;
+		pos = (val >> 8) & 0xfc;
+	}
+	for (pos = PCI_CFG_ECAP_START, prev = 0; pcie && pos > prev;) {
+		if (pci_cfg_shadow_hw_read(phb, bdfn, pos, 4, &val) ||
+		    !val || val == 0xffffffff ||
+		    !pci_cfg_shadow_add_cap(s, pos, val))
+			break;
+		prev = pos;
+		pos = (val >> 20) & 0xffc;
+	}
+
+	bucket = pci_cfg_shadow_bucket(phb, bdfn);
+	s->next = *bucket;
+	*bucket = s;
+	phb->cfg_shadow_fills++;
+
+	return s;
+}
+
+static bool pci_cfg_shadow_byte(struct pci_cfg_shadow *s, uint32_t offset,
+				uint8_t *val)
+{
+	uint32_t i, pos;
+
+	if (offset < sizeof(s->hdr)) {
+		*val = s->hdr[offset];
+		return !!(s->ro & (1ull << offset));
+	}
+	for (i = 0; i < s->ncaps; i++) {
+		pos = s->cap_pos[i];
+		if (offset >= pos &&
+		    offset < pos + (pos < PCI_CFG_ECAP_START ? 2 : 4)) {
+			*val = s->cap_hdr[i] >> (8 * (offset - pos));
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * pci_cfg_shadow_read - Config read, from the shadow when possible
+ *
+ * The shadow of a function is filled on the first read of one of its
+ * read-only header registers or of its first extended capability.
+ * Must be called with the PHB lock held.
+ */
+int64_t pci_cfg_shadow_read(struct phb *phb, uint32_t bdfn, uint32_t offset,
+			    uint32_t size, uint32_t *data)
+{
+	struct pci_cfg_shadow *s = NULL;
+	uint32_t i, val = 0, vdid;
+	int64_t rc;
+	uint8_t b;
+
+	if (phb->cfg_shadow_off || bdfn > 0xffff || offset + size > 0x1000)
+		goto hw;
+
+	s = pci_cfg_shadow_find(phb, bdfn);
+	if (!s && ((offset < sizeof(s->hdr) &&
+		    (PCI_CFG_SHADOW_RO & (1ull << offset))) ||
+		   (offset == PCI_CFG_ECAP_START && size == 4))) {
+		s = pci_cfg_shadow_fill(phb, bdfn, &vdid, &rc);
+
+		/* No function there, we already have the answer */
+		if (!s && !rc && offset + size <= 4) {
+			*data = vdid >> (8 * offset);
+			if (size < 4)
+				*data &= (1u << (8 * size)) - 1;
+			return OPAL_SUCCESS;
+		}
+	}
+	if (!s)
+		goto hw;
+
+	for (i = 0; i < size; i++) {
+		if (!pci_cfg_shadow_byte(s, offset + i, &b))
+			goto hw;
+		val |= b << (8 * i);
+	}
+	phb->cfg_shadow_hits++;
+	*data = val;
+	return OPAL_SUCCESS;
+ hw:
+	return pci_cfg_shadow_hw_read(phb, bdfn, offset, size, data);
+}
+
+/* Type 1 header, from the shadow or from the last scan */
+static bool pci_cfg_shadow_is_bridge(struct phb *phb, uint32_t bdfn)
+{
+	struct pci_cfg_shadow *s = pci_cfg_shadow_find(phb, bdfn);
+	struct pci_device *pd;
+
+	if (s)
+		return (s->hdr[PCI_CFG_HDR_TYPE] & 0x7f) == 1;
+	pd = pci_find_dev(phb, bdfn);
+	return pd && pd->is_bridge;
+}
+
+/*
+ * pci_cfg_shadow_write - Config write hook
+ *
+ * Changing the bus numbers of a bridge, or resetting what's below it,
+ * changes what functions the bdfns behind it refer to. The same
+ * offsets are BAR2 and Max_Lat on other functions, so only writes to
+ * known bridges count.
+ */
+void pci_cfg_shadow_write(struct phb *phb, uint32_t bdfn, uint32_t offset,
+			  uint32_t size, uint32_t data)
+{
+	bool bus = offset <= PCI_CFG_SUBORDINATE_BUS &&
+		offset + size > PCI_CFG_PRIMARY_BUS;
+	bool reset = offset <= PCI_CFG_BRCTL &&
+		offset + size > PCI_CFG_BRCTL &&
+		((data >> (8 * (PCI_CFG_BRCTL - offset))) &
+		 PCI_CFG_BRCTL_SECONDARY_RESET);
+
+	if ((bus || reset) && pci_cfg_shadow_is_bridge(phb, bdfn))
+		pci_cfg_shadow_flush(phb);
+}
+
+void pci_cfg_shadow_flush(struct phb *phb)
+{
+	struct pci_cfg_shadow *s;
+	unsigned int i;
+
+	for (i = 0; i < PCI_CFG_SHADOW_HASH; i++) {
+		while ((s = phb->cfg_shadow[i]) != NULL) {
+			phb->cfg_shadow[i] = s->next;
+			free(s);
+		}
+	}
+	phb->cfg_shadow_flushes++;
+}
+
 /*
  * Generic PCI utilities
  */
@@ -53,21 +312,28 @@ static struct phb *phbs[64];
 static int64_t __pci_find_cap(struct phb *phb, uint16_t bdfn,
 			      uint8_t want, bool check_cap_indicator)
 {
+	struct pci_cfg_shadow *s = NULL;
 	int64_t rc;
-	uint16_t stat, cap;
-	uint8_t pos, next;
+	uint32_t cap, pos, next;
+	uint16_t stat;
 
-	rc = pci_cfg_read16(phb, bdfn, PCI_CFG_STAT, &stat);
-	if (rc)
-		return rc;
-	if (check_cap_indicator && !(stat & PCI_CFG_STAT_CAP))
+	if (!phb->cfg_shadow_off)
+		s = pci_cfg_shadow_find(phb, bdfn);
+	if (check_cap_indicator && s && !s->has_caps)
 		return OPAL_UNSUPPORTED;
-	rc = pci_cfg_read8(phb, bdfn, PCI_CFG_CAP, &pos);
+	if (check_cap_indicator && !s) {
+		rc = pci_cfg_read16(phb, bdfn, PCI_CFG_STAT, &stat);
+		if (rc)
+			return rc;
+		if (!(stat & PCI_CFG_STAT_CAP))
+			return OPAL_UNSUPPORTED;
+	}
+	rc = pci_cfg_shadow_read(phb, bdfn, PCI_CFG_CAP, 1, &pos);
 	if (rc)
 		return rc;
 	pos &= 0xfc;
 	while(pos) {
-		rc = pci_cfg_read16(phb, bdfn, pos, &cap);
+		rc = pci_cfg_shadow_read(phb, bdfn, pos, 2, &cap);
 		if (rc)
 			return rc;
 		if ((cap & 0xff) == want)
@@ -116,7 +382,7 @@ int64_t pci_find_ecap(struct phb *phb, uint16_t bdfn, uint16_t want,
 			break;
 		}
 		prev = off;
-		rc = pci_cfg_read32(phb, bdfn, off, &cap);
+		rc = pci_cfg_shadow_read(phb, bdfn, off, 4, &cap);
 		if (rc)
 			return rc;
 		if ((cap & 0xffff) == want) {
@@ -129,32 +395,13 @@ int64_t pci_find_ecap(struct phb *phb, uint16_t bdfn, uint16_t want,
 }
 
 static struct pci_device *pci_scan_one(struct phb *phb, struct pci_device *parent,
-				       uint16_t bdfn)
+				       uint16_t bdfn, uint32_t vdid)
 {
 	struct pci_device *pd = NULL;
-	uint32_t retries, vdid, val;
+	uint32_t val, htype, intpin;
 	int64_t rc, ecap;
-	uint8_t htype;
 	uint16_t capreg;
-	bool had_crs = false;
 
-	for (retries = 40; retries; retries--) {
-		rc = pci_cfg_read32(phb, bdfn, 0, &vdid);
-		if (rc)
-			return NULL;
-		if (vdid == 0xffffffff || vdid == 0x00000000)
-			return NULL;
-		if (vdid != 0xffff0001)
-			break;
-		had_crs = true;
-		time_wait_ms(100);
-	}
-	if (vdid == 0xffff0001) {
-		PCIERR(phb, bdfn, "CRS timeout !\n");
-		return NULL;
-	}
-	if (had_crs)
-		PCIDBG(phb, bdfn, "Probe success after CRS\n");
 	pd = zalloc(sizeof(struct pci_device));
 	if (!pd) {
 		PCIERR(phb, bdfn,"Failed to allocate structure pci_device !\n");
@@ -162,12 +409,17 @@ static struct pci_device *pci_scan_one(struct phb *phb, struct pci_device *paren
 	}
 	pd->bdfn = bdfn;
 	pd->parent = parent;
+	pd->vdid = vdid;
 	list_head_init(&pd->children);
-	rc = pci_cfg_read8(phb, bdfn, PCI_CFG_HDR_TYPE, &htype);
+	/* Fills the config shadow, which the capability walks use */
+	rc = pci_cfg_shadow_read(phb, bdfn, PCI_CFG_HDR_TYPE, 1, &htype);
 	if (rc) {
 		PCIERR(phb, bdfn, "Failed to read header type !\n");
 		goto fail;
 	}
+	pci_cfg_shadow_read(phb, bdfn, PCI_CFG_REV_ID, 4, &pd->rev_class);
+	pci_cfg_shadow_read(phb, bdfn, PCI_CFG_INT_PIN, 1, &intpin);
+	pd->intpin = intpin;
 	pd->is_multifunction = !!(htype & 0x80);
 	pd->is_bridge = (htype & 0x7f) != 0;
 	pd->scan_map = 0xffffffff; /* Default */
@@ -179,10 +431,7 @@ static struct pci_device *pci_scan_one(struct phb *phb, struct pci_device *paren
 	 * limited to one that seats directly under root port.
 	 */
 	if (vdid == 0x872410b5 && parent && !parent->parent) {
-		uint8_t rev;
-
-		pci_cfg_read8(phb, bdfn, PCI_CFG_REV_ID, &rev);
-		if (rev == 0xba)
+		if ((pd->rev_class & 0xff) == 0xba)
 			ecap = __pci_find_cap(phb, bdfn,
 					      PCI_CFG_CAP_ID_EXP, false);
 		else
@@ -209,7 +458,10 @@ static struct pci_device *pci_scan_one(struct phb *phb, struct pci_device *paren
 			pd->dev_type = PCIE_TYPE_SWITCH_DNPORT;
 		}
 
-		/* XXX Handle ARI */
+		/*
+		 * Only device 0 lives below a port. With ARI its
+		 * functions span the whole devfn, see pci_scan_siblings()
+		 */
 		if (pd->dev_type == PCIE_TYPE_SWITCH_DNPORT ||
 		    pd->dev_type == PCIE_TYPE_ROOT_PORT)
 			pd->scan_map = 0x1;
@@ -219,6 +471,10 @@ static struct pci_device *pci_scan_one(struct phb *phb, struct pci_device *paren
 		pd->mps = (128 << GETFIELD(PCICAP_EXP_DEVCAP_MPSS, val));
 		if (pd->mps > 4096)
 			pd->mps = 4096;
+
+		ecap = pci_find_ecap(phb, bdfn, PCIECAP_ID_ARI, NULL);
+		if (ecap > 0)
+			pci_set_cap(pd, PCIECAP_ID_ARI, ecap, true);
 	} else {
 		pd->dev_type = PCIE_TYPE_LEGACY;
 	}
@@ -250,6 +506,14 @@ static struct pci_device *pci_scan_one(struct phb *phb, struct pci_device *paren
 	if (phb->ops->device_init)
 		phb->ops->device_init(phb, pd);
 
+	/* After the PHB hook, which sets up error reporting in there */
+	if (pci_has_cap(pd, PCI_CFG_CAP_ID_EXP, false)) {
+		ecap = pci_cap(pd, PCI_CFG_CAP_ID_EXP, false);
+		pci_cfg_read16(phb, bdfn, ecap + PCICAP_EXP_DEVCTL,
+			       &pd->devctl);
+		pd->devctl_valid = true;
+	}
+
 	return pd;
  fail:
 	if (pd)
@@ -286,124 +550,171 @@ static void pci_check_clear_freeze(struct phb *phb)
 	phb->ops->eeh_freeze_clear(phb, 0, OPAL_EEH_ACTION_CLEAR_FREEZE_ALL);
 }
 
-/* pci_enable_bridge - Called before scanning a bridge
+/* A bridge being brought up, see pci_enable_bridge_step() */
+enum pci_bridge_state {
+	PCI_BRIDGE_START,
+	PCI_BRIDGE_POWERED,
+	PCI_BRIDGE_RESET_DONE,
+	PCI_BRIDGE_LINK_WAIT,
+	PCI_BRIDGE_LINK_SETTLED,
+};
+
+struct pci_bridge_enable {
+	struct pci_device	*pd;
+	enum pci_bridge_state	state;
+	int64_t			ecap;
+	uint32_t		retries;
+	uint16_t		bctl;
+	bool			was_reset;
+	bool			link_up;
+};
+
+/* pci_enable_bridge_step - Called before scanning a bridge
  *
  * Ensures error flags are clean, disable master abort, and
  * check if the subordinate bus isn't reset, the slot is enabled
  * on PCIe, etc...
+ *
+ * The waits are left to the caller: this returns how long to wait,
+ * in timebase ticks, before calling it again, or 0 once done, with
+ * be->link_up false if we know there's nothing behind the bridge.
  */
-static bool pci_enable_bridge(struct phb *phb, struct pci_device *pd)
+static uint64_t pci_enable_bridge_step(struct phb *phb,
+				       struct pci_bridge_enable *be)
 {
-	uint16_t bctl;
-	bool was_reset = false;
-	int64_t ecap = 0;
-
-	/* Disable master aborts, clear errors */
-	pci_cfg_read16(phb, pd->bdfn, PCI_CFG_BRCTL, &bctl);
-	bctl &= ~PCI_CFG_BRCTL_MABORT_REPORT;
-	pci_cfg_write16(phb, pd->bdfn, PCI_CFG_BRCTL, bctl);
-
-	/* PCI-E bridge, check the slot state */
-	if (pd->dev_type == PCIE_TYPE_ROOT_PORT ||
-	    pd->dev_type == PCIE_TYPE_SWITCH_DNPORT) {
-		uint16_t slctl, slcap, slsta, lctl;
+	struct pci_device *pd = be->pd;
+	uint16_t slctl, slcap, slsta, lctl, lstat;
+	uint32_t lcap;
+	bool pcie_port;
+
+	pcie_port = pd->dev_type == PCIE_TYPE_ROOT_PORT ||
+		    pd->dev_type == PCIE_TYPE_SWITCH_DNPORT;
+
+	switch (be->state) {
+	case PCI_BRIDGE_START:
+		/* Disable master aborts, clear errors */
+		pci_cfg_read16(phb, pd->bdfn, PCI_CFG_BRCTL, &be->bctl);
+		be->bctl &= ~PCI_CFG_BRCTL_MABORT_REPORT;
+		pci_cfg_write16(phb, pd->bdfn, PCI_CFG_BRCTL, be->bctl);
+		be->state = PCI_BRIDGE_POWERED;
+
+		/* PCI-E bridge, check the slot state */
+		if (pcie_port) {
+			be->ecap = pci_cap(pd, PCI_CFG_CAP_ID_EXP, false);
+
+			/* Read the slot status & check for presence detect */
+			pci_cfg_read16(phb, pd->bdfn,
+				       be->ecap + PCICAP_EXP_SLOTSTAT, &slsta);
+			PCITRACE(phb, pd->bdfn, "slstat=%04x\n", slsta);
+			if (!(slsta & PCICAP_EXP_SLOTSTAT_PDETECTST)) {
+				PCIDBG(phb, pd->bdfn, "No card in slot\n");
+				return 0;
+			}
 
-		ecap = pci_cap(pd, PCI_CFG_CAP_ID_EXP, false);
+			/* Read the slot capabilities */
+			pci_cfg_read16(phb, pd->bdfn,
+				       be->ecap + PCICAP_EXP_SLOTCAP, &slcap);
+			PCITRACE(phb, pd->bdfn, "slcap=%04x\n", slcap);
+			if (!(slcap & PCICAP_EXP_SLOTCAP_PWCTRL))
+				goto power_is_on;
 
-		/* Read the slot status & check for presence detect */
-		pci_cfg_read16(phb, pd->bdfn, ecap+PCICAP_EXP_SLOTSTAT, &slsta);
-		PCITRACE(phb, pd->bdfn, "slstat=%04x\n", slsta);
-		if (!(slsta & PCICAP_EXP_SLOTSTAT_PDETECTST)) {
-			PCIDBG(phb, pd->bdfn, "No card in slot\n");
-			return false;
+			/* Read the slot control register, check if the
+			 * slot is off
+			 */
+			pci_cfg_read16(phb, pd->bdfn,
+				       be->ecap + PCICAP_EXP_SLOTCTL, &slctl);
+			PCITRACE(phb, pd->bdfn, "slctl=%04x\n", slctl);
+			if (!(slctl & PCICAP_EXP_SLOTCTL_PWRCTLR))
+				goto power_is_on;
+
+			/* Turn power on
+			 *
+			 * XXX This is a "command", we should wait for it to
+			 * complete etc... but just waiting 2s will do for now
+			 */
+			PCIDBG(phb, pd->bdfn,
+			       "Bridge power is off, turning on ...\n");
+			slctl &= ~PCICAP_EXP_SLOTCTL_PWRCTLR;
+			slctl |= SETFIELD(PCICAP_EXP_SLOTCTL_PWRI, 0,
+					  PCIE_INDIC_ON);
+			pci_cfg_write16(phb, pd->bdfn,
+					be->ecap + PCICAP_EXP_SLOTCTL, slctl);
+
+			/* Wait a couple of seconds */
+			return msecs_to_tb(2000);
 		}
-		
-		/* Read the slot capabilities */
-		pci_cfg_read16(phb, pd->bdfn, ecap+PCICAP_EXP_SLOTCAP, &slcap);
-		PCITRACE(phb, pd->bdfn, "slcap=%04x\n", slcap);
-		if (!(slcap & PCICAP_EXP_SLOTCAP_PWCTRL))
-			goto power_is_on;
-
-		/* Read the slot control register, check if the slot is off */
-		pci_cfg_read16(phb, pd->bdfn, ecap+PCICAP_EXP_SLOTCTL, &slctl);
-		PCITRACE(phb, pd->bdfn, "slctl=%04x\n", slctl);
-		if (!(slctl & PCICAP_EXP_SLOTCTL_PWRCTLR))
-			goto power_is_on;
-
-		/* Turn power on
-		 *
-		 * XXX This is a "command", we should wait for it to complete
-		 * etc... but just waiting 2s will do for now
-		 */
-		PCIDBG(phb, pd->bdfn, "Bridge power is off, turning on ...\n");
-		slctl &= ~PCICAP_EXP_SLOTCTL_PWRCTLR;
-		slctl |= SETFIELD(PCICAP_EXP_SLOTCTL_PWRI, 0, PCIE_INDIC_ON);
-		pci_cfg_write16(phb, pd->bdfn, ecap+PCICAP_EXP_SLOTCTL, slctl);
-
-		/* Wait a couple of seconds */
-		time_wait_ms(2000);
-
+		/* Fall through */
+	case PCI_BRIDGE_POWERED:
  power_is_on:
-		/* Enable link */
-		pci_cfg_read16(phb, pd->bdfn, ecap+PCICAP_EXP_LCTL, &lctl);
-		PCITRACE(phb, pd->bdfn, " lctl=%04x\n", lctl);
-		lctl &= ~PCICAP_EXP_LCTL_LINK_DIS;
-		pci_cfg_write16(phb, pd->bdfn, ecap+PCICAP_EXP_LCTL, lctl);
-	}
-
-	/* Clear secondary reset */
-	if (bctl & PCI_CFG_BRCTL_SECONDARY_RESET) {
-		PCIDBG(phb, pd->bdfn,
-		       "Bridge secondary reset is on, clearing it ...\n");
-		bctl &= ~PCI_CFG_BRCTL_SECONDARY_RESET;
-		pci_cfg_write16(phb, pd->bdfn, PCI_CFG_BRCTL, bctl);
-		time_wait_ms(1000);
-		was_reset = true;
-	}
-
-	/* PCI-E bridge, wait for link */
-	if (pd->dev_type == PCIE_TYPE_ROOT_PORT ||
-	    pd->dev_type == PCIE_TYPE_SWITCH_DNPORT) {
-		uint32_t lcap;
+		if (pcie_port) {
+			/* Enable link */
+			pci_cfg_read16(phb, pd->bdfn,
+				       be->ecap + PCICAP_EXP_LCTL, &lctl);
+			PCITRACE(phb, pd->bdfn, " lctl=%04x\n", lctl);
+			lctl &= ~PCICAP_EXP_LCTL_LINK_DIS;
+			pci_cfg_write16(phb, pd->bdfn,
+					be->ecap + PCICAP_EXP_LCTL, lctl);
+		}
+		be->state = PCI_BRIDGE_RESET_DONE;
+
+		/* Clear secondary reset */
+		if (be->bctl & PCI_CFG_BRCTL_SECONDARY_RESET) {
+			PCIDBG(phb, pd->bdfn,
+			       "Bridge secondary reset is on, clearing it ...\n");
+			be->bctl &= ~PCI_CFG_BRCTL_SECONDARY_RESET;
+			pci_cfg_write16(phb, pd->bdfn, PCI_CFG_BRCTL, be->bctl);
+			be->was_reset = true;
+			return msecs_to_tb(1000);
+		}
+		/* Fall through */
+	case PCI_BRIDGE_RESET_DONE:
+		/* PCI-E bridge, wait for link */
+		if (!pcie_port)
+			break;
 
 		/* Read link caps */
-		pci_cfg_read32(phb, pd->bdfn, ecap+PCICAP_EXP_LCAP, &lcap);
+		pci_cfg_read32(phb, pd->bdfn, be->ecap + PCICAP_EXP_LCAP, &lcap);
 
 		/* Did link capability say we got reporting ?
 		 *
 		 * If yes, wait up to 10s, if not, wait 1s if we didn't already
 		 */
-		if (lcap & PCICAP_EXP_LCAP_DL_ACT_REP) {
-			uint32_t retries = 100;
-			uint16_t lstat;
-
-			PCIDBG(phb, pd->bdfn, "waiting for link... \n");
-
-			while(retries--) {
-				pci_cfg_read16(phb, pd->bdfn,
-					       ecap+PCICAP_EXP_LSTAT, &lstat);
-				if (lstat & PCICAP_EXP_LSTAT_DLLL_ACT)
-					break;
-				time_wait_ms(100);
-			}
-			PCIDBG(phb, pd->bdfn, "end wait for link...\n");
-			if (!(lstat & PCICAP_EXP_LSTAT_DLLL_ACT)) {
-				PCIERR(phb, pd->bdfn, "Timeout waiting"
-					" for downstream link\n");
-				return false;
-			}
-			/* Need to wait another 100ms before touching
-			 * the config space
-			 */
-			time_wait_ms(100);
-		} else if (!was_reset)
-			time_wait_ms(1000);
+		if (!(lcap & PCICAP_EXP_LCAP_DL_ACT_REP)) {
+			be->state = PCI_BRIDGE_LINK_SETTLED;
+			if (!be->was_reset)
+				return msecs_to_tb(1000);
+			break;
+		}
+		PCIDBG(phb, pd->bdfn, "waiting for link... \n");
+		be->retries = 100;
+		be->state = PCI_BRIDGE_LINK_WAIT;
+		/* Fall through */
+	case PCI_BRIDGE_LINK_WAIT:
+		pci_cfg_read16(phb, pd->bdfn, be->ecap + PCICAP_EXP_LSTAT,
+			       &lstat);
+		if (!(lstat & PCICAP_EXP_LSTAT_DLLL_ACT)) {
+			if (--be->retries)
+				return msecs_to_tb(100);
+			PCIERR(phb, pd->bdfn, "Timeout waiting"
+			       " for downstream link\n");
+			return 0;
+		}
+		PCIDBG(phb, pd->bdfn, "end wait for link...\n");
+
+		/* Need to wait another 100ms before touching
+		 * the config space
+		 */
+		be->state = PCI_BRIDGE_LINK_SETTLED;
+		return msecs_to_tb(100);
+	case PCI_BRIDGE_LINK_SETTLED:
+		break;
 	}
 
 	/* Clear error status */
 	pci_cfg_write16(phb, pd->bdfn, PCI_CFG_STAT, 0xffff);
+	be->link_up = true;
 
-	return true;
+	return 0;
 }
 
 /* Clear up bridge resources */
@@ -434,82 +745,302 @@ static void pci_cleanup_bridge(struct phb *phb, struct pci_device *pd)
 }
 
 
-/* pci_scan - Perform a recursive scan of the bus at bus_number
- *            populating the list passed as an argument. This also
- *            performs the bus numbering, so it returns the largest
- *            bus number that was assigned.
+/*
+ * Functions can answer config requests with Configuration Request
+ * Retry Status for a while after their link came up. Rather than
+ * sleeping on each one in turn, the bus scan notes them in a bitmap
+ * and retries them all together every PCI_CRS_RETRY_MS, carrying on
+ * with their siblings and the bridges next to them meanwhile.
  *
- * Note: Eventually this might want to access some VPD information
- *       in order to know what slots to scan and what not etc..
+ * The scan of a bus is a state machine, with one pci_scan_state per
+ * bus on the way down to the one being scanned, so that it can be
+ * left while waiting on bridges and CRS (see pci_rescan_slot()).
+ */
+#define PCI_CRS_VDID		0xffff0001
+#define PCI_CRS_RETRY_MS	100
+#define PCI_CRS_TIMEOUT_MS	4000
+
+enum pci_scan_phase {
+	PCI_SCAN_ENABLE,	/* Enabling the new bridges */
+	PCI_SCAN_NUMBER,	/* Numbering them, scanning below */
+	PCI_SCAN_CRS,		/* Retrying functions that gave CRS */
+};
+
+struct pci_scan_state {
+	struct phb		*phb;
+	struct pci_device	*parent;
+	struct list_head	*list;
+	struct pci_scan_state	*up;		/* Scan of the bus above */
+	enum pci_scan_phase	phase;
+	uint8_t			bus;
+	uint8_t			max_bus;
+	uint8_t			next_bus;
+	uint8_t			max_sub;
+	bool			ari;
+	bool			scan_downstream;
+	bool			timeout;
+	uint64_t		deadline;
+	uint64_t		retry;
+
+	/* Bridge being enabled */
+	struct pci_bridge_enable be;
+
+	/* Bridge being scanned below */
+	struct pci_device	*bridge;
+	uint8_t			bridge_max;
+	bool			bridge_use_max;
+
+	/* Bitmaps indexed by devfn */
+	uint32_t		crs[8];		/* Waiting for CRS to end */
+	uint32_t		enabled[8];	/* Bridge enabled... */
+	uint32_t		link_up[8];	/* ...and worth scanning */
+};
+
+static inline bool pci_devfn_test(const uint32_t *map, uint8_t devfn)
+{
+	return !!(map[devfn / 32] & (1u << (devfn % 32)));
+}
+
+static inline void pci_devfn_set(uint32_t *map, uint8_t devfn)
+{
+	map[devfn / 32] |= 1u << (devfn % 32);
+}
+
+/* pci_enable_ari - Turn on ARI forwarding in the port above function 0
+ *                  of a bus if that function has ARI, which gives us
+ *                  function numbers up to 255 on that bus.
+ */
+static bool pci_enable_ari(struct phb *phb, struct pci_device *bridge,
+			   struct pci_device *pd)
+{
+	uint32_t ecap, dcap2;
+	uint16_t dctl2;
+
+	if (!bridge || !pci_has_cap(pd, PCIECAP_ID_ARI, true))
+		return false;
+	if (bridge->dev_type != PCIE_TYPE_ROOT_PORT &&
+	    bridge->dev_type != PCIE_TYPE_SWITCH_DNPORT)
+		return false;
+
+	ecap = pci_cap(bridge, PCI_CFG_CAP_ID_EXP, false);
+	pci_cfg_read32(phb, bridge->bdfn, ecap + PCIECAP_EXP_DCAP2, &dcap2);
+	if (!(dcap2 & PCICAP_EXP_DCAP2_ARI_FWD))
+		return false;
+
+	pci_cfg_read16(phb, bridge->bdfn, ecap + PCICAP_EXP_DCTL2, &dctl2);
+	dctl2 |= PCICAP_EXP_DCTL2_ARI_FWD;
+	pci_cfg_write16(phb, bridge->bdfn, ecap + PCICAP_EXP_DCTL2, dctl2);
+	PCIDBG(phb, bridge->bdfn, "ARI forwarding enabled\n");
+
+	return true;
+}
+
+/* pci_scan_fn - Probe one function of the bus being scanned
  *
- * XXX NOTE: We might want to enable ARI along the way...
+ * Returns the new device or NULL if there's nothing (yet) there. The
+ * device list is kept sorted as functions coming out of CRS are added
+ * after their siblings.
+ */
+static struct pci_device *pci_scan_fn(struct pci_scan_state *s, uint8_t devfn)
+{
+	struct phb *phb = s->phb;
+	uint16_t bdfn = ((uint16_t)s->bus << 8) | devfn;
+	struct pci_device *pd = NULL, *next;
+	uint32_t vdid;
+	int64_t rc;
+
+	rc = pci_cfg_read32(phb, bdfn, 0, &vdid);
+	if (!rc && vdid == PCI_CRS_VDID)
+		pci_devfn_set(s->crs, devfn);
+	else if (!rc && vdid != 0xffffffff && vdid != 0x00000000)
+		pd = pci_scan_one(phb, s->parent, bdfn, vdid);
+	pci_check_clear_freeze(phb);
+	if (!pd)
+		return NULL;
+
+	/* Get slot info if any */
+	if (platform.pci_get_slot_info)
+		platform.pci_get_slot_info(phb, pd);
+
+	if (devfn == 0 && pci_enable_ari(phb, s->parent, pd))
+		s->ari = true;
+
+	/* Link it up */
+	list_for_each(s->list, next, link) {
+		if (next->bdfn > bdfn) {
+			list_add_before(s->list, &pd->link, &next->link);
+			return pd;
+		}
+	}
+	list_add_tail(s->list, &pd->link);
+
+	return pd;
+}
+
+/* pci_scan_siblings - Probe the functions following a new device
  *
- * XXX NOTE: We might also want to setup the PCIe MPS/MRSS properly
- *           here as Linux may or may not do it
+ * With ARI each function gives the number of the next one, otherwise
+ * function 0 of a multifunction device is followed by functions 1..7
  */
-static uint8_t pci_scan(struct phb *phb, uint8_t bus, uint8_t max_bus,
-			struct list_head *list, struct pci_device *parent,
-			bool scan_downstream)
+static void pci_scan_siblings(struct pci_scan_state *s, struct pci_device *pd)
 {
-	struct pci_device *pd = NULL;
-	uint8_t dev, fn, next_bus, max_sub, save_max;
-	uint32_t scan_map;
+	uint8_t fn = pd->bdfn & 0xff, next;
+	unsigned int i;
+	uint16_t cap;
+	int pos;
 
-	/* Decide what to scan  */
-	scan_map = parent ? parent->scan_map : phb->scan_map;
+	if (!s->ari) {
+		if ((fn & 7) || !pd->is_multifunction)
+			return;
+		for (i = 1; i < 8; i++)
+			pci_scan_fn(s, fn + i);
+		return;
+	}
 
-	/* Do scan */
-	for (dev = 0; dev < 32; dev++) {
-		if (!(scan_map & (1ul << dev)))
-			continue;
+	while (pd && pci_has_cap(pd, PCIECAP_ID_ARI, true)) {
+		pos = pci_cap(pd, PCIECAP_ID_ARI, true);
+		pci_cfg_read16(s->phb, pd->bdfn, pos + PCIECAP_ARI_CAP, &cap);
+		next = GETFIELD(PCIECAP_ARI_CAP_NFN, cap);
 
-		/* Scan the device */
-		pd = pci_scan_one(phb, parent, (bus << 8) | (dev << 3));
-		pci_check_clear_freeze(phb);
-		if (!pd)
-			continue;
+		/* The list ends with 0 and can only go up */
+		if (next <= fn)
+			break;
+		pd = pci_scan_fn(s, next);
+		fn = next;
+	}
+}
 
-		/* Get slot info if any */
-		if (platform.pci_get_slot_info)
-			platform.pci_get_slot_info(phb, pd);
+static bool pci_scan_crs_pending(const struct pci_scan_state *s)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(s->crs); i++)
+		if (s->crs[i])
+			return true;
+	return false;
+}
 
-		/* Link it up */
-		list_add_tail(list, &pd->link);
+/* pci_scan_crs - Retry the functions that returned CRS, complaining
+ *                about the ones that still do if we timed out
+ */
+static void pci_scan_crs(struct pci_scan_state *s, bool timeout)
+{
+	struct pci_device *pd;
+	uint32_t crs[8];
+	unsigned int devfn;
 
-		/* XXX Handle ARI */
-		if (!pd->is_multifunction)
+	memcpy(crs, s->crs, sizeof(crs));
+	memset(s->crs, 0, sizeof(s->crs));
+	for (devfn = 0; devfn < 256; devfn++) {
+		if (!pci_devfn_test(crs, devfn))
 			continue;
-		for (fn = 1; fn < 8; fn++) {
-			pd = pci_scan_one(phb, parent,
-					  ((uint16_t)bus << 8) | (dev << 3) | fn);
-			pci_check_clear_freeze(phb);
-			if (pd) {
-				if (platform.pci_get_slot_info)
-					platform.pci_get_slot_info(phb, pd);
-				list_add_tail(list, &pd->link);
-			}
+		pd = pci_scan_fn(s, devfn);
+		if (pd) {
+			PCIDBG(s->phb, pd->bdfn, "Probe success after CRS\n");
+			pci_scan_siblings(s, pd);
+		} else if (timeout && pci_devfn_test(s->crs, devfn)) {
+			PCIERR(s->phb, (s->bus << 8) | devfn,
+			       "CRS timeout !\n");
 		}
 	}
+}
 
-	/*
-	 * We only scan downstream if instructed to do so by the
-	 * caller. Typically we avoid the scan when we know the
-	 * link is down already, which happens for the top level
-	 * root complex, and avoids a long secondary timeout
-	 */
-	if (!scan_downstream)
-		return bus;
-
-	next_bus = bus + 1;
-	max_sub = bus;
-	save_max = max_bus;
-
-	/* Scan down bridges */
-	list_for_each(list, pd, link) {
-		bool use_max, do_scan;
+/* Next bridge on the bus that's yet to be enabled, or numbered */
+static struct pci_device *pci_scan_next_bridge(struct pci_scan_state *s,
+					       bool to_number)
+{
+	struct pci_device *pd;
 
+	list_for_each(s->list, pd, link) {
 		if (!pd->is_bridge)
 			continue;
+		if (to_number ? !pd->secondary_bus :
+		    !pci_devfn_test(s->enabled, pd->bdfn & 0xff))
+			return pd;
+	}
+
+	return NULL;
+}
+
+/* pci_scan_enable_bridges - Configure the bridges found on the bus
+ *                           that haven't been yet
+ *
+ * All the bridges are enabled before any of them gets scanned, so
+ * that the devices below them come out of reset together instead of
+ * one switch port at a time. Returns how long to wait before calling
+ * it again, 0 once they are all done.
+ */
+static uint64_t pci_scan_enable_bridges(struct pci_scan_state *s)
+{
+	struct pci_device *pd;
+	uint64_t delay;
+
+	for (;;) {
+		if (!s->be.pd) {
+			pd = pci_scan_next_bridge(s, false);
+			if (!pd)
+				return 0;
+			pci_devfn_set(s->enabled, pd->bdfn & 0xff);
+
+			/* Clear up bridge resources */
+			pci_cleanup_bridge(s->phb, pd);
+			memset(&s->be, 0, sizeof(s->be));
+			s->be.pd = pd;
+		}
+
+		/* Configure the bridge. This will enable power to the slot
+		 * if it's currently disabled, lift reset, etc...
+		 */
+		delay = pci_enable_bridge_step(s->phb, &s->be);
+		if (delay)
+			return delay;
+		if (s->be.link_up)
+			pci_devfn_set(s->link_up, s->be.pd->bdfn & 0xff);
+		s->be.pd = NULL;
+	}
+}
+
+static struct pci_scan_state *pci_scan_start(struct phb *phb, uint8_t bus,
+					     uint8_t max_bus,
+					     struct list_head *list,
+					     struct pci_device *parent,
+					     bool scan_downstream,
+					     struct pci_scan_state *up);
+
+/* Update the max subordinate once the bridge has been scanned */
+static void pci_scan_bridge_done(struct pci_scan_state *s)
+{
+	struct pci_device *pd = s->bridge;
+
+	if (s->bridge_use_max)
+		s->max_sub = s->bridge_max;
+	pd->subordinate_bus = s->max_sub;
+	pci_cfg_write8(s->phb, pd->bdfn, PCI_CFG_SUBORDINATE_BUS, s->max_sub);
+	s->next_bus = s->max_sub + 1;
+	s->bridge = NULL;
+}
+
+/* pci_scan_number_bridges - Give bus numbers to the bridges found on
+ *                           the bus that haven't got any yet
+ *
+ * Returns the scan of the bus behind the first one with a link up,
+ * the following ones get numbered once that's complete.
+ */
+static struct pci_scan_state *pci_scan_number_bridges(struct pci_scan_state *s)
+{
+	struct phb *phb = s->phb;
+	struct pci_scan_state *child;
+	struct pci_device *pd;
+	uint8_t max_bus;
+	bool use_max;
+
+	for (;;) {
+		/* Out of bus numbers already */
+		if (!s->next_bus)
+			return NULL;
+		pd = pci_scan_next_bridge(s, true);
+		if (!pd)
+			return NULL;
 
 		/* We need to figure out a new bus number to start from.
 		 *
@@ -534,57 +1065,202 @@ static uint8_t pci_scan(struct phb *phb, uint8_t bus, uint8_t max_bus,
 		 *    subordinate bus number based on what we probed.
 		 *    
 		 */
-		max_bus = save_max;
-		next_bus = phb->ops->choose_bus(phb, pd, next_bus,
-						&max_bus, &use_max);
+		max_bus = s->max_bus;
+		s->next_bus = phb->ops->choose_bus(phb, pd, s->next_bus,
+						   &max_bus, &use_max);
 
 		/* Configure the bridge with the returned values */
-		if (next_bus <= bus) {
+		if (s->next_bus <= s->bus) {
 			PCIERR(phb, pd->bdfn, "Out of bus numbers !\n");
-			max_bus = next_bus = 0; /* Failure case */
+			max_bus = s->next_bus = 0; /* Failure case */
 		}
 
-		pd->secondary_bus = next_bus;
+		pd->secondary_bus = s->next_bus;
 		pd->subordinate_bus = max_bus;
-		pci_cfg_write8(phb, pd->bdfn, PCI_CFG_SECONDARY_BUS, next_bus);
+		pci_cfg_write8(phb, pd->bdfn, PCI_CFG_SECONDARY_BUS, s->next_bus);
 		pci_cfg_write8(phb, pd->bdfn, PCI_CFG_SUBORDINATE_BUS, max_bus);
-		if (!next_bus)
-			break;
+		if (!s->next_bus)
+			return NULL;
 
 		PCIDBG(phb, pd->bdfn, "Bus %02x..%02x %s scanning...\n",
-		       next_bus, max_bus, use_max ? "[use max]" : "");
-
-		/* Clear up bridge resources */
-		pci_cleanup_bridge(phb, pd);
-
-		/* Configure the bridge. This will enable power to the slot
-		 * if it's currently disabled, lift reset, etc...
-		 *
-		 * Return false if we know there's nothing behind the bridge
-		 */
-		do_scan = pci_enable_bridge(phb, pd);
+		       s->next_bus, max_bus, use_max ? "[use max]" : "");
+		s->bridge = pd;
+		s->bridge_max = max_bus;
+		s->bridge_use_max = use_max;
 
 		/* Perform recursive scan */
-		if (do_scan) {
-			max_sub = pci_scan(phb, next_bus, max_bus,
-					   &pd->children, pd, true);
+		if (pci_devfn_test(s->link_up, pd->bdfn & 0xff)) {
+			child = pci_scan_start(phb, s->next_bus, max_bus,
+					       &pd->children, pd, true, s);
+			if (child)
+				return child;
+			s->max_sub = s->next_bus;
 		} else if (!use_max) {
 			/* XXX Empty bridge... we leave room for hotplug
 			 * slots etc.. but we should be smarter at figuring
 			 * out if this is actually a hotpluggable one
 			 */
-			max_sub = next_bus + 4;
-			if (max_sub > max_bus)
-				max_sub = max_bus;
+			s->max_sub = s->next_bus + 4;
+			if (s->max_sub > max_bus)
+				s->max_sub = max_bus;
 		}
+		pci_scan_bridge_done(s);
+	}
+}
+
+/* pci_scan_start - Start the scan of a bus, probing what's on it */
+static struct pci_scan_state *pci_scan_start(struct phb *phb, uint8_t bus,
+					     uint8_t max_bus,
+					     struct list_head *list,
+					     struct pci_device *parent,
+					     bool scan_downstream,
+					     struct pci_scan_state *up)
+{
+	struct pci_scan_state *s;
+	struct pci_device *pd;
+	uint32_t scan_map;
+	unsigned int dev;
+	uint64_t now;
 
-		/* Update the max subordinate as described previously */
-		if (use_max)
-			max_sub = max_bus;
-		pd->subordinate_bus = max_sub;
-		pci_cfg_write8(phb, pd->bdfn, PCI_CFG_SUBORDINATE_BUS, max_sub);
-		next_bus = max_sub + 1;
+	s = zalloc(sizeof(*s));
+	if (!s) {
+		PCIERR(phb, parent ? parent->bdfn : 0,
+		       "Failed to allocate scan of bus %02x\n", bus);
+		return NULL;
 	}
+	s->phb = phb;
+	s->parent = parent;
+	s->list = list;
+	s->up = up;
+	s->bus = bus;
+	s->max_bus = max_bus;
+	s->next_bus = bus + 1;
+	s->max_sub = bus;
+	s->scan_downstream = scan_downstream;
+
+	/* Decide what to scan  */
+	scan_map = parent ? parent->scan_map : phb->scan_map;
+
+	/* Do scan */
+	now = mftb();
+	s->deadline = now + msecs_to_tb(PCI_CRS_TIMEOUT_MS);
+	s->retry = now + msecs_to_tb(PCI_CRS_RETRY_MS);
+	for (dev = 0; dev < 32; dev++) {
+		if (!(scan_map & (1ul << dev)))
+			continue;
+
+		pd = pci_scan_fn(s, dev << 3);
+		if (pd)
+			pci_scan_siblings(s, pd);
+	}
+
+	return s;
+}
+
+/* pci_scan_step - Carry on with a scan started by pci_scan_start()
+ *
+ * *sp is the scan of the innermost bus. Returns how long to wait
+ * before calling it again, or 0 once the scan is complete with the
+ * largest bus number that was assigned in *max_sub.
+ */
+static uint64_t pci_scan_step(struct pci_scan_state **sp, uint8_t *max_sub)
+{
+	struct pci_scan_state *s, *child;
+	uint64_t now, delay;
+
+	while ((s = *sp) != NULL) {
+		switch (s->phase) {
+		case PCI_SCAN_ENABLE:
+			/*
+			 * We only scan downstream if instructed to do so by
+			 * the caller. Typically we avoid the scan when we
+			 * know the link is down already, which happens for
+			 * the top level root complex, and avoids a long
+			 * secondary timeout
+			 */
+			if (!s->scan_downstream) {
+				s->phase = PCI_SCAN_CRS;
+				break;
+			}
+			delay = pci_scan_enable_bridges(s);
+			if (delay)
+				return delay;
+			s->phase = PCI_SCAN_NUMBER;
+			break;
+		case PCI_SCAN_NUMBER:
+			child = pci_scan_number_bridges(s);
+			if (child)
+				*sp = child;
+			else
+				s->phase = PCI_SCAN_CRS;
+			break;
+		case PCI_SCAN_CRS:
+			/* Time spent behind the bridges counts towards the
+			 * retry
+			 */
+			if (s->timeout || !pci_scan_crs_pending(s)) {
+				*sp = s->up;
+				if (s->up) {
+					s->up->max_sub = s->max_sub;
+					pci_scan_bridge_done(s->up);
+				} else
+					*max_sub = s->max_sub;
+				free(s);
+				break;
+			}
+			now = mftb();
+			if (tb_compare(now, s->retry) == TB_ABEFOREB)
+				return s->retry - now;
+			s->timeout = tb_compare(now, s->deadline) != TB_ABEFOREB;
+			s->retry = now + msecs_to_tb(PCI_CRS_RETRY_MS);
+			pci_scan_crs(s, s->timeout);
+			s->phase = PCI_SCAN_ENABLE;
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/* Give up on a scan that was left half way */
+static void pci_scan_abort(struct pci_scan_state *s)
+{
+	struct pci_scan_state *up;
+
+	for (; s; s = up) {
+		up = s->up;
+		free(s);
+	}
+}
+
+/* pci_scan - Perform a recursive scan of the bus at bus_number
+ *            populating the list passed as an argument. This also
+ *            performs the bus numbering, so it returns the largest
+ *            bus number that was assigned.
+ *
+ * Every device on the bus is probed first, then the bridges are
+ * scanned, and the functions that answered with CRS are retried
+ * until they come up or PCI_CRS_TIMEOUT_MS has passed since the
+ * start of the bus scan.
+ *
+ * Note: Eventually this might want to access some VPD information
+ *       in order to know what slots to scan and what not etc..
+ *
+ * XXX NOTE: We might also want to setup the PCIe MPS/MRSS properly
+ *           here as Linux may or may not do it
+ */
+static uint8_t pci_scan(struct phb *phb, uint8_t bus, uint8_t max_bus,
+			struct list_head *list, struct pci_device *parent,
+			bool scan_downstream)
+{
+	struct pci_scan_state *s;
+	uint8_t max_sub = bus;
+	uint64_t delay;
+
+	s = pci_scan_start(phb, bus, max_bus, list, parent, scan_downstream,
+			   NULL);
+	while ((delay = pci_scan_step(&s, &max_sub)) != 0)
+		time_wait(delay);
 
 	return max_sub;
 }
@@ -617,12 +1293,28 @@ static int pci_configure_mps(struct phb *phb,
 
 	/* PCIe deivce always has MPS capacity */
 	if (pd->mps) {
+		/* Hot-added below a PHB configured for more */
+		if (pd->mps < mps) {
+			PCIERR(phb, pd->bdfn, "MPS %d above capability %d\n",
+			       mps, pd->mps);
+			mps = pd->mps;
+		}
 		ecap = pci_cap(pd, PCI_CFG_CAP_ID_EXP, false);
 		mps = ilog2(mps) - 7;
 
-		pci_cfg_read16(phb, pd->bdfn, ecap + PCICAP_EXP_DEVCTL, &val);
+		/* Called by the PHB hook before the scan has a copy */
+		if (pd->devctl_valid)
+			val = pd->devctl;
+		else
+			pci_cfg_read16(phb, pd->bdfn, ecap + PCICAP_EXP_DEVCTL,
+				       &val);
+		if (pd->devctl_valid &&
+		    GETFIELD(PCICAP_EXP_DEVCTL_MPS, val) == mps)
+			return 0;
 		val = SETFIELD(PCICAP_EXP_DEVCTL_MPS, val, mps);
 		pci_cfg_write16(phb, pd->bdfn, ecap + PCICAP_EXP_DEVCTL, val);
+		if (pd->devctl_valid)
+			pd->devctl = val;
 	}
 
 	return 0;
@@ -655,14 +1347,61 @@ void pci_device_init(struct phb *phb, struct pci_device *pd)
 	pci_disable_completion_timeout(phb, pd);
 }
 
+/*
+ * PHB resets are state machines returning how long to wait before
+ * polling them again. Rather than having a CPU sleep on each PHB in
+ * turn, they are all driven from timers so that every PHB trains its
+ * link at the same time.
+ */
+struct pci_reset_state {
+	struct timer		timer;
+	struct phb		*phb;
+	const char		*desc;
+	uint64_t		start;
+	uint64_t		end;
+	int64_t			rc;
+	bool			done;
+};
+
+static struct pci_reset_state pci_resets[ARRAY_SIZE(phbs)];
+
+static void pci_reset_done(struct pci_reset_state *rs, int64_t rc)
+{
+	/* Don't warn if it's just an empty slot */
+	if (rc < 0 && rc != OPAL_CLOSED)
+		PCIERR(rs->phb, 0, "Failed to %s, rc=%lld\n", rs->desc, rc);
+
+	rs->rc = rc;
+	rs->end = mftb();
+	lwsync();
+	rs->done = true;
+}
+
+static void pci_reset_poll(struct timer *t __unused, void *data)
+{
+	struct pci_reset_state *rs = data;
+	struct phb *phb = rs->phb;
+	int64_t rc;
+
+	phb->ops->lock(phb);
+	rc = phb->ops->poll(phb);
+	phb->ops->unlock(phb);
+
+	/* Wait the internal state machine */
+	if (rc > 0)
+		schedule_timer(&rs->timer, rc);
+	else
+		pci_reset_done(rs, rc);
+}
+
 /*
  * The power state would be checked. If the power has
  * been on, we will issue fundamental reset. Otherwise,
  * we will power it on before issuing fundamental reset.
  */
-static int64_t pci_phb_reset(struct phb *phb)
+static int64_t pci_phb_reset(struct pci_reset_state *rs)
 {
-	const char *desc;
+	struct phb *phb = rs->phb;
 	int64_t rc;
 
 	rc = phb->ops->power_state(phb);
@@ -671,40 +1410,27 @@ static int64_t pci_phb_reset(struct phb *phb)
 		return rc;
 	}
 
+	phb->ops->lock(phb);
 	if (rc == OPAL_SHPC_POWER_ON) {
-		desc = "fundamental reset";
+		rs->desc = "fundamental reset";
 		rc = phb->ops->fundamental_reset(phb);
 	} else {
-		desc = "power on";
+		rs->desc = "power on";
 		rc = phb->ops->slot_power_on(phb);
 	}
+	phb->ops->unlock(phb);
 
-	if (rc < 0) {
-		/* Don't warn if it's just an empty slot */
-		if (rc != OPAL_CLOSED)
-			goto warn_err;
-		return rc;
-	}
-
-	/* Wait the internal state machine */
-	while (rc > 0) {
-		time_wait(rc);
-		rc = phb->ops->poll(phb);
-	}
-
- warn_err:
-	if (rc < 0)
-		PCIERR(phb, 0, "Failed to %s, rc=%lld\n", desc, rc);
-
-        return rc;
+	return rc;
 }
 
-static void pci_reset_phb(void *data)
+static void pci_reset_phb(struct pci_reset_state *rs)
 {
-	struct phb *phb = data;
+	struct phb *phb = rs->phb;
 	int64_t rc;
 
 	PCIDBG(phb, 0, "Init slot...\n");
+	rs->start = mftb();
+	rs->desc = "reset";
 
 	/*
 	 * For PCI/PCI-X, we get the slot info and we also
@@ -716,6 +1442,7 @@ static void pci_reset_phb(void *data)
 		rc = phb->ops->presence_detect(phb);
 		if (rc != OPAL_SHPC_DEV_PRESENT) {
 			PCIDBG(phb, 0, "Slot empty\n");
+			pci_reset_done(rs, OPAL_CLOSED);
 			return;
 		}
 	}
@@ -725,7 +1452,56 @@ static void pci_reset_phb(void *data)
 	 * fundamental way while powering on. The reset
 	 * state machine is going to wait for the link
 	 */
-	pci_phb_reset(phb);
+	rc = pci_phb_reset(rs);
+	if (rc > 0) {
+		init_timer(&rs->timer, pci_reset_poll, rs);
+		schedule_timer(&rs->timer, rc);
+	} else {
+		pci_reset_done(rs, rc);
+	}
+}
+
+static void pci_reset_phbs(void)
+{
+	struct pci_reset_state *rs;
+	uint64_t start = mftb();
+	unsigned int i, count = 0;
+	bool done;
+
+	for (i = 0; i < ARRAY_SIZE(phbs); i++) {
+		rs = &pci_resets[i];
+		memset(rs, 0, sizeof(*rs));
+		rs->phb = phbs[i];
+		if (!rs->phb) {
+			rs->done = true;
+			continue;
+		}
+		pci_reset_phb(rs);
+		count++;
+	}
+
+	/* The timers run from the pollers */
+	for (;;) {
+		done = true;
+		for (i = 0; i < ARRAY_SIZE(pci_resets); i++)
+			done &= pci_resets[i].done;
+		if (done)
+			break;
+		opal_run_pollers();
+		time_wait_ms_nopoll(1);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(pci_resets); i++) {
+		rs = &pci_resets[i];
+		if (!rs->phb)
+			continue;
+		PCINOTICE(rs->phb, 0, "Reset %s in %lu ms\n",
+			  rs->rc < 0 ? (rs->rc == OPAL_CLOSED ? "(empty)" :
+					"failed") : "done",
+			  tb_to_msecs(rs->end - rs->start));
+	}
+	prlog(PR_NOTICE, "PCI: Reset %d PHB(s) in %lu ms\n",
+	      count, tb_to_msecs(mftb() - start));
 }
 
 static void pci_scan_phb(void *data)
@@ -735,6 +1511,9 @@ static void pci_scan_phb(void *data)
 	bool has_link = false;
 	int64_t rc;
 
+	/* Left over from before a fast reboot */
+	pci_cfg_shadow_flush(phb);
+
 	rc = phb->ops->link_state(phb);
 	if (rc < 0) {
 		PCIERR(phb, 0, "Failed to query link state, rc=%lld\n", rc);
@@ -1167,12 +1946,10 @@ static void pci_print_summary_line(struct phb *phb, struct pci_device *pd,
 				   const char *cname)
 {
 	const char *label, *dtype, *s;
-	u32 vdid;
+	u32 vdid = pd->vdid;
 #define MAX_SLOTSTR 32
 	char slotstr[MAX_SLOTSTR  + 1] = { 0, };
 
-	pci_cfg_read32(phb, pd->bdfn, 0, &vdid);
-
 	/* If it's a slot, it has a slot-label */
 	label = dt_prop_get_def(np, "ibm,slot-label", NULL);
 	if (label) {
@@ -1232,13 +2009,9 @@ static void pci_add_one_node(struct phb *phb, struct pci_device *pd,
 #define MAX_NAME 256
 	char name[MAX_NAME];
 	char compat[MAX_NAME];
-	uint32_t rev_class, vdid;
+	uint32_t rev_class = pd->rev_class, vdid = pd->vdid;
 	uint32_t reg[5];
-	uint8_t intpin;
-
-	pci_cfg_read32(phb, pd->bdfn, 0, &vdid);
-	pci_cfg_read32(phb, pd->bdfn, PCI_CFG_REV_ID, &rev_class);
-	pci_cfg_read8(phb, pd->bdfn, PCI_CFG_INT_PIN, &intpin);
+	uint8_t intpin = pd->intpin;
 
 	/*
 	 * Quirk for IBM bridge bogus class on PCIe root complex.
@@ -1257,6 +2030,7 @@ static void pci_add_one_node(struct phb *phb, struct pci_device *pd,
 		snprintf(name, MAX_NAME - 1, "%s@%x",
 			 cname, (pd->bdfn >> 3) & 0x1f);
 	np = dt_new(parent_node, name);
+	pd->dn = np;
 
 	/* XXX FIXME: make proper "compatible" properties */
 	if (pci_has_cap(pd, PCI_CFG_CAP_ID_EXP, false)) {
@@ -1364,6 +2138,47 @@ static void __pci_reset(struct list_head *list)
 	}
 }
 
+/* A slot rescan in progress, see pci_rescan_slot() */
+struct pci_slot_rescan {
+	struct pci_device	*pd;
+	struct pci_bridge_enable be;
+	struct pci_scan_state	*scan;
+	bool			scanning;
+	struct list_head	old;		/* Devices we had */
+	struct list_head	children;	/* Devices being found */
+};
+
+static void pci_rescan_free(struct phb *phb)
+{
+	struct pci_slot_rescan *rs = phb->rescan;
+
+	if (!rs)
+		return;
+	pci_scan_abort(rs->scan);
+	__pci_reset(&rs->old);
+	__pci_reset(&rs->children);
+	free(rs);
+	phb->rescan = NULL;
+}
+
+/*
+ * Drop a slot rescan that won't be completed, the bridge gets back the
+ * devices it had before. Called with the PHB lock held.
+ */
+void pci_rescan_abort(struct phb *phb)
+{
+	struct pci_slot_rescan *rs = phb->rescan;
+	struct pci_device *child;
+
+	if (!rs)
+		return;
+	PCINOTICE(phb, rs->pd->bdfn, "Rescan aborted\n");
+	while ((child = list_pop(&rs->old, struct pci_device, link)))
+		list_add_tail(&rs->pd->children, &child->link);
+	pci_cfg_shadow_flush(phb);
+	pci_rescan_free(phb);
+}
+
 void pci_reset(void)
 {
 	unsigned int i;
@@ -1378,6 +2193,7 @@ void pci_reset(void)
 	for (i = 0; i < ARRAY_SIZE(phbs); i++) {
 		if (!phbs[i])
 			continue;
+		pci_rescan_free(phbs[i]);
 		__pci_reset(&phbs[i]->devices);
 	}
 	unlock(&pci_lock);
@@ -1425,15 +2241,25 @@ static void pci_do_jobs(void (*fn)(void *))
 	}
 }
 
-void pci_init_slots(void)
+/*
+ * Once this returns every PHB has been through a complete reset, so
+ * adapters can no longer DMA through whatever translations the
+ * previous OS left behind.
+ */
+void pci_reset_slots(void)
+{
+	lock(&pci_lock);
+	prlog(PR_NOTICE, "PCI: Resetting PHBs...\n");
+	pci_reset_phbs();
+	unlock(&pci_lock);
+}
+
+void pci_probe_slots(void)
 {
 	unsigned int i;
 
 	lock(&pci_lock);
 
-	prlog(PR_NOTICE, "PCI: Resetting PHBs...\n");
-	pci_do_jobs(pci_reset_phb);
-
 	prlog(PR_NOTICE, "PCI: Probing slots...\n");
 	pci_do_jobs(pci_scan_phb);
 
@@ -1451,6 +2277,12 @@ void pci_init_slots(void)
 	unlock(&pci_lock);
 }
 
+void pci_init_slots(void)
+{
+	pci_reset_slots();
+	pci_probe_slots();
+}
+
 /*
  * Complete iteration on current level before switching to
  * child level, which is the proper order for restoring
@@ -1530,3 +2362,134 @@ void pci_restore_bridge_buses(struct phb *phb)
 {
 	pci_walk_dev(phb, __pci_restore_bridge_buses, NULL);
 }
+
+/* Interrupt swizzling of the devices below a bridge */
+static uint8_t pci_child_swizzle(struct pci_device *pd)
+{
+	uint8_t swizzle = 0;
+
+	for (; pd; pd = pd->parent)
+		swizzle += (pd->bdfn >> 3) & 0x1f;
+
+	return swizzle & 3;
+}
+
+/* Note the functions of a subtree that aren't in the other one */
+static void pci_rescan_diff(struct phb *phb, struct list_head *list,
+			    struct list_head *other, __be16 *bdfns,
+			    uint16_t *count)
+{
+	struct pci_device *pd, *match;
+	uint16_t bdfn;
+
+	list_for_each(list, pd, link) {
+		bdfn = pd->bdfn;
+		match = __pci_walk_dev(phb, other, __pci_find_dev, &bdfn);
+		if (!match || match->vdid != pd->vdid) {
+			if (*count < OPAL_PCI_RESCAN_MAX_FNS)
+				bdfns[*count] = cpu_to_be16(bdfn);
+			(*count)++;
+		}
+		pci_rescan_diff(phb, &pd->children, other, bdfns, count);
+	}
+}
+
+/*
+ * pci_rescan_slot - Rescan what's below one bridge after an adapter
+ *                   was added or removed, leaving the rest of the PHB
+ *                   alone.
+ *
+ * The bridge keeps the bus range it got at boot and the new devices
+ * are numbered within it. Its device-tree node gets new children.
+ * Functions that appeared, went away or changed IDs are reported.
+ *
+ * Bringing the slot up and waiting for CRS can take seconds, so this
+ * returns how many milliseconds to wait before calling it again with
+ * the same bridge instead. The devices found are only added once the
+ * scan is complete. A NULL res cancels the rescan in progress on that
+ * bridge instead. Called with the PHB lock held.
+ */
+int64_t pci_rescan_slot(struct phb *phb, uint16_t bdfn,
+			struct opal_pci_slot_rescan *res)
+{
+	struct pci_slot_rescan *rs = phb->rescan;
+	struct pci_device *pd, *child;
+	uint16_t added = 0, removed = 0;
+	uint64_t delay;
+	uint8_t max_sub;
+
+	if (rs && rs->pd->bdfn != bdfn)
+		return OPAL_BUSY;
+	if (!res) {
+		if (!rs)
+			return OPAL_PARAMETER;
+		pci_rescan_abort(phb);
+		return OPAL_SUCCESS;
+	}
+	if (!rs) {
+		pd = pci_find_dev(phb, bdfn);
+		if (!pd || !pd->is_bridge)
+			return OPAL_PARAMETER;
+		if (!pd->secondary_bus)
+			return OPAL_RESOURCE;
+
+		rs = zalloc(sizeof(*rs));
+		if (!rs)
+			return OPAL_NO_MEM;
+		rs->pd = pd;
+		rs->be.pd = pd;
+		list_head_init(&rs->old);
+		list_head_init(&rs->children);
+		phb->rescan = rs;
+
+		pci_cfg_shadow_flush(phb);
+		while ((child = list_pop(&pd->children, struct pci_device,
+					 link)))
+			list_add_tail(&rs->old, &child->link);
+	}
+	pd = rs->pd;
+
+	if (!rs->scanning) {
+		delay = pci_enable_bridge_step(phb, &rs->be);
+		if (delay)
+			goto wait;
+		rs->scanning = true;
+		if (rs->be.link_up)
+			rs->scan = pci_scan_start(phb, pd->secondary_bus,
+						  pd->subordinate_bus,
+						  &rs->children, pd, true,
+						  NULL);
+	}
+	delay = pci_scan_step(&rs->scan, &max_sub);
+	if (delay)
+		goto wait;
+
+	while ((child = list_pop(&rs->children, struct pci_device, link)))
+		list_add_tail(&pd->children, &child->link);
+	__pci_walk_dev(phb, &pd->children, pci_configure_mps, NULL);
+
+	pci_rescan_diff(phb, &pd->children, &rs->old, res->added, &added);
+	pci_rescan_diff(phb, &rs->old, &pd->children, res->removed, &removed);
+	res->num_added = cpu_to_be16(added);
+	res->num_removed = cpu_to_be16(removed);
+	PCINOTICE(phb, bdfn, "Rescan: %d functions added, %d removed\n",
+		  added, removed);
+
+	/* Replace the subtree in the device-tree if it's been built */
+	if (pd->dn) {
+		list_for_each(&rs->old, child, link) {
+			if (child->dn)
+				dt_free(child->dn);
+		}
+		list_for_each(&pd->children, child, link)
+			pci_add_one_node(phb, child, pd->dn, &phb->lstate,
+					 pci_child_swizzle(pd));
+	}
+	pci_rescan_free(phb);
+
+	return OPAL_SUCCESS;
+
+ wait:
+	/* Rounded up, 0 would be taken for completion */
+	return tb_to_msecs(delay + msecs_to_tb(1) - 1);
+}
@@ -6,11 +6,10 @@
 #include <rtc.h>
 
 /* Create MTMS section for sapphire log */
-static void create_mtms_section(struct errorlog *elog_data,
-					char *pel_buffer, int *pel_offset)
+static void create_mtms_section(struct pel_stream *ps, void *sec)
 {
-	struct opal_mtms_section *mtms = (struct opal_mtms_section *)
-				(pel_buffer + *pel_offset);
+	struct errorlog *elog_data = ps->elog;
+	struct opal_mtms_section *mtms = sec;
 
 	mtms->v6header.id = ELOG_SID_MACHINE_TYPE;
 	mtms->v6header.length = MTMS_SECTION_SIZE;
@@ -24,19 +23,14 @@ static void create_mtms_section(struct errorlog *elog_data,
 
 	memcpy(mtms->serial_no, dt_prop_get(dt_root, "system-id"),
 						 OPAL_SYS_SERIAL_LEN);
-	*pel_offset += MTMS_SECTION_SIZE;
 }
 
 /* Create extended header section */
-static void create_extended_header_section(struct errorlog *elog_data,
-					char *pel_buffer, int *pel_offset)
+static void create_extended_header_section(struct pel_stream *ps, void *sec)
 {
+	struct errorlog *elog_data = ps->elog;
 	const char  *opalmodel = NULL;
-	uint64_t extd_time;
-
-	struct opal_extended_header_section *extdhdr =
-			(struct opal_extended_header_section *)
-					(pel_buffer + *pel_offset);
+	struct opal_extended_header_section *extdhdr = sec;
 
 	extdhdr->v6header.id = ELOG_SID_EXTENDED_HEADER;
 	extdhdr->v6header.length = EXTENDED_HEADER_SECTION_SIZE;
@@ -57,11 +51,9 @@ static void create_extended_header_section(struct errorlog *elog_data,
 	memset(extdhdr->opal_subsys_version, 0x00,
 				sizeof(extdhdr->opal_subsys_version));
 
-	rtc_cache_get_datetime(&extdhdr->extended_header_date, &extd_time);
-	extdhdr->extended_header_time = extd_time >> 32;
+	extdhdr->extended_header_date = ps->date;
+	extdhdr->extended_header_time = ps->time >> 32;
 	extdhdr->opal_symid_len = 0;
-
-	*pel_offset += EXTENDED_HEADER_SECTION_SIZE;
 }
 
 /* set src type */
@@ -89,11 +81,10 @@ static void setrefcode(struct opal_src_section *src, uint16_t src_refcode)
 }
 
 /* Create SRC section of OPAL log */
-static void create_src_section(struct errorlog *elog_data,
-					char *pel_buffer, int *pel_offset)
+static void create_src_section(struct pel_stream *ps, void *sec)
 {
-	struct opal_src_section *src = (struct opal_src_section *)
-						(pel_buffer + *pel_offset);
+	struct errorlog *elog_data = ps->elog;
+	struct opal_src_section *src = sec;
 
 	src->v6header.id = ELOG_SID_PRIMARY_SRC;
 	src->v6header.length = SRC_SECTION_SIZE;
@@ -114,16 +105,13 @@ static void create_src_section(struct errorlog *elog_data,
 	src->hexwords[5] = elog_data->additional_info[1];
 	src->hexwords[6] = elog_data->additional_info[2];
 	src->hexwords[7] = elog_data->additional_info[3];
-	*pel_offset += SRC_SECTION_SIZE;
 }
 
 /* Create user header section */
-static void create_user_header_section(struct errorlog *elog_data,
-					char *pel_buffer, int *pel_offset)
+static void create_user_header_section(struct pel_stream *ps, void *sec)
 {
-	struct opal_user_header_section *usrhdr =
-				(struct opal_user_header_section *)
-						(pel_buffer + *pel_offset);
+	struct errorlog *elog_data = ps->elog;
+	struct opal_user_header_section *usrhdr = sec;
 
 	usrhdr->v6header.id = ELOG_SID_USER_HEADER;
 	usrhdr->v6header.length = USER_HEADER_SECTION_SIZE;
@@ -140,18 +128,13 @@ static void create_user_header_section(struct errorlog *elog_data,
 		usrhdr->action_flags = ERRL_ACTION_REPORT;
 	else
 		usrhdr->action_flags = ERRL_ACTION_NONE;
-
-	*pel_offset += USER_HEADER_SECTION_SIZE;
 }
 
 /* Create private header section */
-static void create_private_header_section(struct errorlog *elog_data,
-					char *pel_buffer, int *pel_offset)
+static void create_private_header_section(struct pel_stream *ps, void *sec)
 {
-	uint64_t ctime;
-	struct opal_private_header_section *privhdr =
-				(struct opal_private_header_section *)
-								pel_buffer;
+	struct errorlog *elog_data = ps->elog;
+	struct opal_private_header_section *privhdr = sec;
 
 	privhdr->v6header.id = ELOG_SID_PRIVATE_HEADER;
 	privhdr->v6header.length = PRIVATE_HEADER_SECTION_SIZE;
@@ -160,9 +143,9 @@ static void create_private_header_section(struct errorlog *elog_data,
 	privhdr->v6header.component_id = elog_data->component_id;
 	privhdr->plid = elog_data->plid;
 
-	rtc_cache_get_datetime(&privhdr->create_date, &ctime);
-	privhdr->create_time = ctime >> 32;
-	privhdr->section_count = 5;
+	privhdr->create_date = ps->date;
+	privhdr->create_time = ps->time >> 32;
+	privhdr->section_count = 5 + elog_data->user_section_count;
 
 	privhdr->creator_subid_hi = 0x00;
 	privhdr->creator_subid_lo = 0x00;
@@ -173,39 +156,33 @@ static void create_private_header_section(struct errorlog *elog_data,
 		privhdr->creator_id = OPAL_CID_POWERNV;
 
 	privhdr->log_entry_id = elog_data->plid; /*entry id is updated by FSP*/
-
-	*pel_offset += PRIVATE_HEADER_SECTION_SIZE;
 }
 
-static void create_user_defined_section(struct errorlog *elog_data,
-					char *pel_buffer, int *pel_offset)
+/* The fixed sections, in the order they appear in the PEL */
+static const struct pel_section {
+	size_t	size;
+	void	(*create)(struct pel_stream *ps, void *sec);
+} pel_sections[] = {
+	{ PRIVATE_HEADER_SECTION_SIZE,	create_private_header_section },
+	{ USER_HEADER_SECTION_SIZE,	create_user_header_section },
+	{ SRC_SECTION_SIZE,		create_src_section },
+	{ EXTENDED_HEADER_SECTION_SIZE,	create_extended_header_section },
+	{ MTMS_SECTION_SIZE,		create_mtms_section },
+};
+
+/* Copy the part of a piece of the PEL at @pos that falls in the window */
+static void pel_copy(size_t pos, const void *src, size_t len,
+		     size_t offset, char *buf, size_t buf_len)
 {
-	char *dump = (char *)pel_buffer + *pel_offset;
-	char *opal_buf = (char *)elog_data->user_data_dump;
-	struct opal_user_section *usrhdr;
-	struct elog_user_data_section *opal_usr_data;
-	struct opal_private_header_section *privhdr =
-			 (struct opal_private_header_section *)pel_buffer;
-	int i;
-
-	for (i = 0; i < elog_data->user_section_count; i++) {
-
-		usrhdr = (struct opal_user_section *)dump;
-		opal_usr_data = (struct elog_user_data_section *)opal_buf;
-
-		usrhdr->v6header.id = ELOG_SID_USER_DEFINED;
-		usrhdr->v6header.version = OPAL_ELOG_VERSION;
-		usrhdr->v6header.length = sizeof(struct opal_v6_header) +
-							opal_usr_data->size;
-		usrhdr->v6header.subtype = OPAL_ELOG_SST;
-		usrhdr->v6header.component_id = elog_data->component_id;
-
-		memcpy(usrhdr->dump, opal_buf, opal_usr_data->size);
-		*pel_offset += usrhdr->v6header.length;
-		dump += usrhdr->v6header.length;
-		opal_buf += opal_usr_data->size;
-		privhdr->section_count++;
-	}
+	size_t start = pos > offset ? pos : offset;
+	size_t end = pos + len;
+
+	if (end > offset + buf_len)
+		end = offset + buf_len;
+	if (start >= end)
+		return;
+	memcpy(buf + start - offset, (const char *)src + start - pos,
+	       end - start);
 }
 
 static size_t pel_user_section_size(struct errorlog *elog_data)
@@ -230,26 +207,83 @@ size_t pel_size(struct errorlog *elog_data)
 	return PEL_MIN_SIZE + pel_user_section_size(elog_data);
 }
 
+void pel_stream_init(struct pel_stream *ps, struct errorlog *elog_data)
+{
+	ps->elog = elog_data;
+	ps->size = pel_size(elog_data);
+	rtc_cache_get_datetime(&ps->date, &ps->time);
+}
+
+/*
+ * Write @len bytes of the PEL, starting at @offset, to @buf. Only the
+ * sections overlapping that window are built, the user data is copied
+ * straight from the errorlog. Returns the number of bytes written,
+ * less than @len at the end of the PEL.
+ */
+size_t pel_stream_read(struct pel_stream *ps, size_t offset, void *buf,
+		       size_t len)
+{
+	struct errorlog *elog_data = ps->elog;
+	char *opal_buf = (char *)elog_data->user_data_dump;
+	struct elog_user_data_section *opal_usr_data;
+	const struct pel_section *s;
+	struct opal_v6_header usrhdr;
+	union {
+		struct opal_private_header_section	privhdr;
+		struct opal_user_header_section		usrhdr;
+		struct opal_src_section			src;
+		struct opal_extended_header_section	extdhdr;
+		struct opal_mtms_section		mtms;
+	} sec;
+	size_t pos = 0, end;
+	unsigned int i;
+
+	if (offset >= ps->size)
+		return 0;
+	if (len > ps->size - offset)
+		len = ps->size - offset;
+	end = offset + len;
+
+	for (i = 0; i < ARRAY_SIZE(pel_sections) && pos < end; i++) {
+		s = &pel_sections[i];
+		if (pos + s->size > offset) {
+			memset(&sec, 0, sizeof(sec));
+			s->create(ps, &sec);
+			pel_copy(pos, &sec, s->size, offset, buf, len);
+		}
+		pos += s->size;
+	}
+
+	for (i = 0; i < elog_data->user_section_count && pos < end; i++) {
+		opal_usr_data = (struct elog_user_data_section *)opal_buf;
+
+		usrhdr.id = ELOG_SID_USER_DEFINED;
+		usrhdr.version = OPAL_ELOG_VERSION;
+		usrhdr.length = sizeof(usrhdr) + opal_usr_data->size;
+		usrhdr.subtype = OPAL_ELOG_SST;
+		usrhdr.component_id = elog_data->component_id;
+
+		pel_copy(pos, &usrhdr, sizeof(usrhdr), offset, buf, len);
+		pos += sizeof(usrhdr);
+		pel_copy(pos, opal_buf, opal_usr_data->size, offset, buf, len);
+		pos += opal_usr_data->size;
+		opal_buf += opal_usr_data->size;
+	}
+
+	return len;
+}
+
 /* Converts an OPAL errorlog into a PEL formatted log */
 int create_pel_log(struct errorlog *elog_data, char *pel_buffer,
 		   size_t pel_buffer_size)
 {
-	int pel_offset = 0;
+	struct pel_stream ps;
 
-	if (pel_buffer_size < pel_size(elog_data)) {
+	pel_stream_init(&ps, elog_data);
+	if (pel_buffer_size < ps.size) {
 		prerror("PEL buffer too small to create record\n");
 		return 0;
 	}
 
-	memset(pel_buffer, 0, pel_buffer_size);
-
-	create_private_header_section(elog_data, pel_buffer, &pel_offset);
-	create_user_header_section(elog_data, pel_buffer, &pel_offset);
-	create_src_section(elog_data, pel_buffer, &pel_offset);
-	create_extended_header_section(elog_data, pel_buffer, &pel_offset);
-	create_mtms_section(elog_data, pel_buffer, &pel_offset);
-	if (elog_data->user_section_count)
-		create_user_defined_section(elog_data, pel_buffer, &pel_offset);
-
-	return pel_offset;
+	return pel_stream_read(&ps, 0, pel_buffer, ps.size);
 }
@@ -49,6 +49,13 @@ static inline unsigned long mftb(void)
 
 char console_buffer[4096];
 struct debug_descriptor debug_descriptor;
+char __rodata_start[1], __rodata_end[1];
+
+/* Binary logging is off, trace_mask is 0 */
+void trace_add(union trace *trace __unused, u8 type __unused,
+	       u16 len __unused)
+{
+}
 
 bool flushed_to_drivers;
 
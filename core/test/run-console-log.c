@@ -27,10 +27,27 @@ static inline unsigned long mftb(void)
 	return 42;
 }
 
+/* Use the host linker symbols, our string literals are in there */
+#define __rodata_start	__executable_start
+#define __rodata_end	edata
+
 #include "../console-log.c"
 
 struct debug_descriptor debug_descriptor;
 
+static union trace last_trace;
+static int traces;
+
+void trace_add(union trace *trace, u8 type, u16 len)
+{
+	assert(type == TRACE_PRLOG);
+	assert(len <= sizeof(*trace));
+	memset(&last_trace, 0, sizeof(last_trace));
+	memcpy(&last_trace, trace, len);
+	last_trace.hdr.len_div_8 = (len + 7) >> 3;
+	traces++;
+}
+
 bool flushed_to_drivers;
 char console_buffer[4096];
 
@@ -43,6 +60,9 @@ ssize_t console_write(bool flush_to_drivers, const void *buf, size_t count)
 
 int main(void)
 {
+	char stack_fmt[16];
+	const char *fmt;
+
 	debug_descriptor.console_log_levels = 0x75;
 
 	prlog(PR_EMERG, "Hello World");
@@ -64,5 +84,47 @@ int main(void)
 	assert(memcmp(console_buffer, "[42,5] Hello World", strlen("[42,5] Hello World")) == 0);
 	assert(flushed_to_drivers==true);
 
+	/* Binary logging of memory only messages */
+	debug_descriptor.trace_mask = 1ul << TRACE_PRLOG;
+	memset(console_buffer, 0, sizeof(console_buffer));
+
+	fmt = "PHB#%04x: state %d -> %lx %p\n";
+	prlog(PR_DEBUG, fmt, 0x1f, -2, 0x123456789ul, (void *)fmt);
+	assert(console_buffer[0] == 0);
+	assert(traces == 1);
+	assert(last_trace.prlog.level == PR_DEBUG);
+	assert(last_trace.prlog.nargs == 4);
+	assert(!last_trace.prlog.unused[0] && !last_trace.prlog.unused[1]);
+	assert(be32_to_cpu(last_trace.prlog.fmt) ==
+	       (u32)((unsigned long)fmt - SKIBOOT_BASE));
+	assert(be64_to_cpu(last_trace.prlog.args[0]) == 0x1f);
+	assert((s64)be64_to_cpu(last_trace.prlog.args[1]) == -2);
+	assert(be64_to_cpu(last_trace.prlog.args[2]) == 0x123456789ul);
+	assert(be64_to_cpu(last_trace.prlog.args[3]) == (unsigned long)fmt);
+
+	/* "%%" doesn't take an argument */
+	prlog(PR_DEBUG, "%d%% done\n", 50);
+	assert(traces == 2 && last_trace.prlog.nargs == 1);
+
+	/* Messages going to the console are still formatted */
+	prlog(PR_EMERG, "Hello %d", 1);
+	assert(traces == 2);
+	assert(memcmp(console_buffer, "[42,0] Hello 1", strlen("[42,0] Hello 1")) == 0);
+
+	/* So are formats we can't record */
+	memset(console_buffer, 0, sizeof(console_buffer));
+	prlog(PR_DEBUG, "Hello %s", "World");
+	assert(traces == 2);
+	assert(memcmp(console_buffer, "[42,7] Hello World", strlen("[42,7] Hello World")) == 0);
+
+	prlog(PR_DEBUG, "%d %d %d %d %d %d %d %d %d", 1, 2, 3, 4, 5, 6, 7, 8, 9);
+	assert(traces == 2);
+	assert(memcmp(console_buffer, "[42,7] 1 2 3 4 5 6 7 8 9", strlen("[42,7] 1 2 3 4 5 6 7 8 9")) == 0);
+
+	strcpy(stack_fmt, "Stack %d");
+	prlog(PR_DEBUG, stack_fmt, 3);
+	assert(traces == 2);
+	assert(memcmp(console_buffer, "[42,7] Stack 3", strlen("[42,7] Stack 3")) == 0);
+
 	return 0;
 }
@@ -0,0 +1,326 @@
+/* Copyright 2013-2014 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <config.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Don't include these: PPC-specific */
+#define __CPU_H
+#define __PROCESSOR_H
+#define __TEST__
+
+struct cpu_thread {
+	uint32_t con_suspend;
+	bool con_need_flush;
+};
+
+static __thread struct cpu_thread fake_cpu;
+
+static struct cpu_thread *this_cpu(void)
+{
+	return &fake_cpu;
+}
+
+static void cpu_relax(void)
+{
+	sched_yield();
+}
+
+#define lwsync()	__sync_synchronize()
+#define sync()		__sync_synchronize()
+
+/* A 512MHz timebase out of the monotonic clock */
+static unsigned long mftb(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 512000000ul + ts.tv_nsec * 64 / 125;
+}
+
+#include "../console.c"
+
+/* Lock stubs, the console relies on try_lock() actually excluding */
+bool bust_locks;
+
+bool try_lock(struct lock *l)
+{
+	return !__sync_lock_test_and_set(&l->lock_val, 1);
+}
+
+void lock(struct lock *l)
+{
+	while (!try_lock(l))
+		cpu_relax();
+}
+
+void unlock(struct lock *l)
+{
+	__sync_lock_release(&l->lock_val);
+}
+
+bool lock_recursive(struct lock *l)
+{
+	lock(l);
+	return true;
+}
+
+/* Other stubs */
+struct dt_node *dt_root, *dt_chosen, *opal_node;
+
+bool dt_has_node_property(const struct dt_node *node __unused,
+			  const char *name __unused,
+			  const char *val __unused)
+{
+	return false;
+}
+
+struct dt_property *dt_add_property(struct dt_node *node __unused,
+				    const char *name __unused,
+				    const void *val __unused,
+				    size_t size __unused)
+{
+	return NULL;
+}
+
+struct dt_property *__dt_add_property_cells(struct dt_node *node __unused,
+					    const char *name __unused,
+					    int count __unused, ...)
+{
+	return NULL;
+}
+
+struct dt_property *dt_add_property_string(struct dt_node *node __unused,
+					   const char *name __unused,
+					   const char *value __unused)
+{
+	return NULL;
+}
+
+struct dt_node *dt_new(struct dt_node *parent __unused,
+		       const char *name __unused)
+{
+	return NULL;
+}
+
+struct dt_node *dt_new_addr(struct dt_node *parent __unused,
+			    const char *name __unused,
+			    uint64_t unit_addr __unused)
+{
+	return NULL;
+}
+
+struct dt_property *__dt_find_property(struct dt_node *node __unused,
+				       const char *name __unused)
+{
+	return NULL;
+}
+
+void dt_del_property(struct dt_node *node __unused,
+		     struct dt_property *prop __unused)
+{
+}
+
+void opal_update_pending_evt(uint64_t evt_mask __unused,
+			     uint64_t evt_values __unused)
+{
+}
+
+void opal_add_poller(void (*poller)(void *data) __unused,
+		     void *data __unused)
+{
+}
+
+int mambo_read(void)
+{
+	return -1;
+}
+
+void mambo_write(const char *buf __unused, size_t count __unused)
+{
+}
+
+void prlog(int log_level __unused, const char *fmt __unused, ...)
+{
+}
+
+/* Console driver that keeps everything it's handed */
+#define DRV_MAX		(2 * INMEM_CON_LEN)
+
+static char drv_buf[DRV_MAX];
+static size_t drv_len;
+
+static size_t drv_write(const char *buf, size_t len)
+{
+	assert(con_lock.lock_val);
+	assert(drv_len + len <= DRV_MAX);
+	memcpy(drv_buf + drv_len, buf, len);
+	drv_len += len;
+	return len;
+}
+
+static struct con_ops drv_ops = {
+	.write = drv_write,
+};
+
+static void reset_console(void)
+{
+	con_driver = NULL;
+	con_reserved = con_in = con_out = 0;
+	memcons.out_pos = 0;
+	drv_len = 0;
+}
+
+/* Writers format a line with their id and a sequence number */
+#define WRITERS		4
+#define LINES		8000
+#define LINE_FMT	"w%d:%06d\n"
+#define LINE_LEN	(sizeof("w0:000000\r\n") - 1)
+
+static void *writer(void *arg)
+{
+	int id = (long)arg, i, len;
+	char line[32];
+
+	for (i = 0; i < LINES; i++) {
+		len = snprintf(line, sizeof(line), LINE_FMT, id, i);
+		console_write(true, line, len);
+	}
+	return NULL;
+}
+
+static double run_writers(int n)
+{
+	pthread_t threads[WRITERS];
+	struct timespec start, end;
+	long i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < n; i++)
+		assert(!pthread_create(&threads[i], NULL, writer, (void *)i));
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return (end.tv_sec - start.tv_sec) +
+		(end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/* Every line must come out whole, and in order for each writer */
+static void check_lines(int n)
+{
+	int next[WRITERS] = { 0 };
+	size_t off;
+	int id, seq;
+
+	assert(drv_len == (size_t)n * LINES * LINE_LEN);
+	for (off = 0; off < drv_len; off += LINE_LEN) {
+		assert(sscanf(drv_buf + off, "w%d:%d", &id, &seq) == 2);
+		assert(drv_buf[off + LINE_LEN - 2] == '\r');
+		assert(drv_buf[off + LINE_LEN - 1] == '\n');
+		assert(id >= 0 && id < n);
+		assert(seq == next[id]);
+		next[id]++;
+	}
+	for (id = 0; id < n; id++)
+		assert(next[id] == LINES);
+}
+
+int main(void)
+{
+	static char big[3 * INMEM_CON_OUT_LEN];
+	char *ibuf;
+	unsigned long start;
+	double secs;
+	size_t i;
+	int n;
+
+	con_buf = malloc(INMEM_CON_LEN);
+	assert(con_buf);
+	ibuf = con_buf + INMEM_CON_OUT_LEN;
+	memcons.ibuf_phys = (uint64_t)ibuf;
+
+	/* Without a driver everything stays in memory, NULs dropped */
+	reset_console();
+	assert(console_write(true, "a\nb\0c", 5) == 5);
+	assert(con_in == 5);
+	assert(memcmp(con_buf, "a\r\nbc", 5) == 0);
+	assert(memcons.out_pos == 5);
+	set_console(&drv_ops);
+	assert(drv_len == 5 && memcmp(drv_buf, "a\r\nbc", 5) == 0);
+
+	/* Memory only messages aren't handed to the driver */
+	console_write(false, "quiet", 5);
+	assert(drv_len == 5 && con_out == con_in);
+	console_write(true, "loud", 4);
+	assert(drv_len == 9 && memcmp(drv_buf + 5, "loud", 4) == 0);
+
+	/* Going around the ring keeps the newest data */
+	reset_console();
+	for (i = 0; i < sizeof(big); i++)
+		big[i] = 'A' + i % 23;
+	console_write(true, big, sizeof(big));
+	assert(con_in == sizeof(big));
+	assert(memcons.out_pos == (MEMCONS_OUT_POS_WRAP |
+				   (sizeof(big) % INMEM_CON_OUT_LEN)));
+	set_console(&drv_ops);
+	assert(drv_len == INMEM_CON_OUT_LEN - 1);
+	assert(memcmp(drv_buf, big + sizeof(big) - drv_len, drv_len) == 0);
+
+	/*
+	 * A writer that reserved space and never published, as when
+	 * interrupted by something printing on the same CPU, only holds
+	 * the others up for a while, and not at all with locks busted
+	 */
+	reset_console();
+	set_console(&drv_ops);
+	__sync_fetch_and_add(&con_reserved, 3);
+	bust_locks = true;
+	console_write(false, "bust", 4);
+	bust_locks = false;
+	assert(con_in == 7 && memcmp(con_buf + 3, "bust", 4) == 0);
+	__sync_fetch_and_add(&con_reserved, 3);
+	start = mftb();
+	console_write(true, "late", 4);
+	assert(mftb() - start >= msecs_to_tb(INMEM_PUBLISH_TIMEOUT_MS));
+	assert(con_in == 14 && memcmp(con_buf + 10, "late", 4) == 0);
+	console_write(true, "next", 4);
+	assert(con_in == 18 && memcmp(drv_buf + drv_len - 4, "next", 4) == 0);
+
+	/* Concurrent writers, measuring how many lines we get through */
+	for (n = 1; n <= WRITERS; n *= 2) {
+		reset_console();
+		set_console(&drv_ops);
+		secs = run_writers(n);
+		flush_console();
+		assert(con_in == con_reserved && con_out == con_in);
+		check_lines(n);
+		printf("%d writer(s): %d lines, %.0f lines/s\n", n,
+		       n * LINES, secs > 0 ? n * LINES / secs : 0);
+	}
+
+	free(con_buf);
+	return 0;
+}
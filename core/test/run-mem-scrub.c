@@ -0,0 +1,250 @@
+/* Copyright 2013-2014 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <config.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+
+#define __TEST__
+#include <skiboot.h>
+
+#define zalloc(bytes)	calloc((bytes), 1)
+#define MEM_SCRUB_CHUNK	0x1000000ull	/* 16MB */
+
+/* Every chunk cleared, and by which chip */
+struct scrub_log {
+	uint64_t	start;
+	uint64_t	end;
+	uint32_t	chip_id;
+};
+
+#define LOG_MAX		4096
+
+static struct scrub_log scrub_log[LOG_MAX];
+static unsigned int log_count;
+static uint32_t cur_chip;
+static bool real_memory;
+
+static void mem_scrub_clear(uint64_t start, uint64_t end)
+{
+	assert(log_count < LOG_MAX);
+	scrub_log[log_count].start = start;
+	scrub_log[log_count].end = end;
+	scrub_log[log_count++].chip_id = cur_chip;
+	if (real_memory)
+		memset((void *)start, 0, end - start);
+}
+
+#include "../mem-scrub.c"
+
+/* The device-tree is all in heap */
+#define is_rodata(p)	false
+
+#include "../device.c"
+
+/* Stubs */
+struct lock mem_region_lock;
+
+void lock(struct lock *l __unused)
+{
+}
+
+void unlock(struct lock *l __unused)
+{
+}
+
+static struct mem_region *regions;
+static unsigned int nr_regions;
+
+struct mem_region *mem_region_next(struct mem_region *region)
+{
+	unsigned int i = region ? region - regions + 1 : 0;
+
+	return i < nr_regions ? &regions[i] : NULL;
+}
+
+static struct dt_node *mem_nodes[9];
+
+static struct dt_node *mem_node(uint32_t chip_id)
+{
+	struct dt_node *np = mem_nodes[chip_id];
+
+	if (!np) {
+		np = dt_new_addr(dt_root, "memory", chip_id);
+		dt_add_property_cells(np, "ibm,chip-id", chip_id);
+		mem_nodes[chip_id] = np;
+	}
+	return np;
+}
+
+#define GB	0x40000000ull
+
+/*
+ * Low memory that isn't attached to any chip, skiboot in the middle,
+ * then 16GB behind chips 0 and 1, 4GB behind chip 8 which has no CPUs
+ */
+static struct mem_region test_regions[] = {
+	{ .start = 0,		.len = 0x30000000,	.type = REGION_OS },
+	{ .start = 0x30000000,	.len = 0x01000000,
+	  .type = REGION_SKIBOOT_FIRMWARE },
+	{ .start = 0x31000000,	.len = 16 * GB - 0x31000000,
+	  .type = REGION_OS },
+	{ .start = 32 * GB,	.len = 0x100040,
+	  .type = REGION_SKIBOOT_HEAP },
+	{ .start = 32 * GB + 0x100040, .len = 16 * GB - 0x100040,
+	  .type = REGION_OS },
+	{ .start = 64 * GB,	.len = 4 * GB,		.type = REGION_OS },
+	{ .start = 68 * GB,	.len = GB,		.type = REGION_RESERVED },
+};
+
+static const uint32_t region_chip[] = { -1, 0, 0, 1, 1, 8, 8 };
+
+/* Threads of chips 0 and 1 take turns until there's nothing left */
+static const uint32_t workers[] = { 0, 0, 0, 0, 1, 1, 1, 1 };
+
+static int log_cmp(const void *a, const void *b)
+{
+	const struct scrub_log *la = a, *lb = b;
+
+	return la->start < lb->start ? -1 : la->start > lb->start;
+}
+
+static uint32_t chip_of(uint64_t addr)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(test_regions); i++)
+		if (addr >= test_regions[i].start &&
+		    addr < test_regions[i].start + test_regions[i].len)
+			return region_chip[i];
+	assert(0);
+}
+
+static void run_workers(void)
+{
+	bool busy = true;
+	unsigned int i;
+
+	while (busy) {
+		busy = false;
+		for (i = 0; i < ARRAY_SIZE(workers); i++) {
+			cur_chip = workers[i];
+			busy |= mem_scrub_one(cur_chip);
+		}
+	}
+}
+
+static void test_dispatch(void)
+{
+	uint64_t last_local[2] = { 0, 0 }, total = 0, pos;
+	unsigned int i, r;
+
+	dt_root = dt_new_root("");
+	for (i = 0; i < ARRAY_SIZE(test_regions); i++)
+		if (region_chip[i] != (uint32_t)-1)
+			test_regions[i].mem_node = mem_node(region_chip[i]);
+	regions = test_regions;
+	nr_regions = ARRAY_SIZE(test_regions);
+
+	mem_scrub_plan();
+	assert(mem_scrub_nr_ranges == 4);
+	run_workers();
+	assert(mem_scrub_done == mem_scrub_total && mem_scrub_pct == 100);
+
+	/* A thread only leaves its chip once the chip's memory is taken */
+	for (i = 0; i < log_count; i++) {
+		if (chip_of(scrub_log[i].start) == scrub_log[i].chip_id)
+			last_local[scrub_log[i].chip_id] = i;
+	}
+	for (i = 0; i < log_count; i++) {
+		if (chip_of(scrub_log[i].start) != scrub_log[i].chip_id)
+			assert(i > last_local[scrub_log[i].chip_id]);
+	}
+
+	/* Exactly the OS ranges, each byte once */
+	qsort(scrub_log, log_count, sizeof(scrub_log[0]), log_cmp);
+	for (i = 0, r = 0; r < ARRAY_SIZE(test_regions); r++) {
+		if (test_regions[r].type != REGION_OS)
+			continue;
+		pos = test_regions[r].start;
+		while (pos < test_regions[r].start + test_regions[r].len) {
+			assert(i < log_count && scrub_log[i].start == pos);
+			assert(scrub_log[i].end - pos <= MEM_SCRUB_CHUNK);
+			total += scrub_log[i].end - pos;
+			pos = scrub_log[i++].end;
+		}
+		assert(pos == test_regions[r].start + test_regions[r].len);
+	}
+	assert(i == log_count && total == mem_scrub_total);
+	printf("%llu GB in %u chunks\n", (unsigned long long)(total / GB),
+	       log_count);
+
+	dt_free(dt_root);
+}
+
+#define BENCH_SIZE	(64 << 20)
+#define GUARD		64
+
+/* Scrub real memory and see how fast it goes */
+static void test_bandwidth(void)
+{
+	struct timespec start, end;
+	unsigned char *buf;
+	struct mem_region r;
+	double secs;
+	uint64_t i;
+
+	buf = malloc(BENCH_SIZE + 2 * GUARD);
+	assert(buf);
+	memset(buf, 0xaa, BENCH_SIZE + 2 * GUARD);
+	memset(&r, 0, sizeof(r));
+	r.start = (uint64_t)(buf + GUARD);
+	r.len = BENCH_SIZE;
+	r.type = REGION_OS;
+	regions = &r;
+	nr_regions = 1;
+
+	real_memory = true;
+	log_count = 0;
+	mem_scrub_plan();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	run_workers();
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	real_memory = false;
+
+	for (i = 0; i < GUARD; i++)
+		assert(buf[i] == 0xaa && buf[GUARD + BENCH_SIZE + i] == 0xaa);
+	for (i = 0; i < BENCH_SIZE; i++)
+		assert(!buf[GUARD + i]);
+	assert(log_count == BENCH_SIZE / MEM_SCRUB_CHUNK);
+
+	secs = (end.tv_sec - start.tv_sec) +
+		(end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("Scrubbed %d MB in %u chunks: %.0f MB/s on one host thread\n",
+	       BENCH_SIZE >> 20, log_count, (BENCH_SIZE >> 20) / secs);
+	free(buf);
+}
+
+int main(void)
+{
+	test_dispatch();
+	test_bandwidth();
+
+	return 0;
+}
@@ -0,0 +1,316 @@
+/* Copyright 2013-2014 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <config.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "../pci-opal.c"
+
+/*
+ * PHB register model. Config accesses go through an address and a
+ * data register like on PHB3: the address register holds the bdfn
+ * and the dword aligned offset, the data register gives access to
+ * that dword in little endian. Devices that aren't present read as
+ * all ones and drop writes.
+ */
+#define MODEL_DEVS		4
+#define MODEL_CFG_SIZE		0x1000
+
+#define REG_CONFIG_ADDRESS	0x130
+#define REG_CONFIG_DATA		0x140
+
+#define CFG_ADDR_ENABLE		0x8000000000000000ull
+#define CFG_ADDR_BDFN_SHIFT	28
+#define CFG_ADDR_OFFSET_MASK	0xffcull
+
+static struct {
+	uint8_t cfg[MODEL_DEVS][MODEL_CFG_SIZE];
+	bool present[MODEL_DEVS];
+	uint64_t config_address;
+
+	bool locked;
+	unsigned long locks;
+	unsigned long mmio;
+	unsigned long accesses;
+} model;
+
+static uint8_t *model_dword(void)
+{
+	uint32_t bdfn = model.config_address >> CFG_ADDR_BDFN_SHIFT & 0xffff;
+	uint32_t offset = model.config_address & CFG_ADDR_OFFSET_MASK;
+
+	assert(model.config_address & CFG_ADDR_ENABLE);
+	if (bdfn >= MODEL_DEVS || !model.present[bdfn])
+		return NULL;
+	return &model.cfg[bdfn][offset];
+}
+
+static void model_write(uint64_t reg, uint64_t val, unsigned int size,
+			unsigned int byte)
+{
+	uint8_t *p;
+	unsigned int i;
+
+	model.mmio++;
+	switch (reg) {
+	case REG_CONFIG_ADDRESS:
+		model.config_address = val;
+		break;
+	case REG_CONFIG_DATA:
+		p = model_dword();
+		if (!p)
+			break;
+		for (i = 0; i < size; i++)
+			p[byte + i] = val >> (8 * i);
+		break;
+	default:
+		assert(0);
+	}
+}
+
+static uint64_t model_read(uint64_t reg, unsigned int size,
+			   unsigned int byte)
+{
+	uint64_t val = 0;
+	uint8_t *p;
+	unsigned int i;
+
+	model.mmio++;
+	assert(reg == REG_CONFIG_DATA);
+	p = model_dword();
+	if (!p)
+		return (1ull << (8 * size)) - 1;
+	for (i = 0; i < size; i++)
+		val |= (uint64_t)p[byte + i] << (8 * i);
+	return val;
+}
+
+static int64_t model_cfg_setup(uint32_t bdfn, uint32_t offset, uint32_t size)
+{
+	assert(model.locked);
+	if (bdfn > 0xffff || offset + size > MODEL_CFG_SIZE ||
+	    (offset & (size - 1)))
+		return OPAL_PARAMETER;
+
+	model.accesses++;
+	model_write(REG_CONFIG_ADDRESS, CFG_ADDR_ENABLE |
+		    (uint64_t)bdfn << CFG_ADDR_BDFN_SHIFT |
+		    (offset & CFG_ADDR_OFFSET_MASK), 8, 0);
+	return OPAL_SUCCESS;
+}
+
+#define MODEL_CFG_READ(size, type)					\
+static int64_t model_cfg_read##size(struct phb *phb __unused,		\
+				    uint32_t bdfn, uint32_t offset,	\
+				    type *data)				\
+{									\
+	int64_t rc = model_cfg_setup(bdfn, offset, sizeof(type));	\
+									\
+	if (rc)								\
+		return rc;						\
+	*data = model_read(REG_CONFIG_DATA, sizeof(type), offset & 3);	\
+	return OPAL_SUCCESS;						\
+}
+
+#define MODEL_CFG_WRITE(size, type)					\
+static int64_t model_cfg_write##size(struct phb *phb __unused,		\
+				     uint32_t bdfn, uint32_t offset,	\
+				     type data)				\
+{									\
+	int64_t rc = model_cfg_setup(bdfn, offset, sizeof(type));	\
+									\
+	if (rc)								\
+		return rc;						\
+	model_write(REG_CONFIG_DATA, data, sizeof(type), offset & 3);	\
+	return OPAL_SUCCESS;						\
+}
+
+MODEL_CFG_READ(8, uint8_t)
+MODEL_CFG_READ(16, uint16_t)
+MODEL_CFG_READ(32, uint32_t)
+MODEL_CFG_WRITE(8, uint8_t)
+MODEL_CFG_WRITE(16, uint16_t)
+MODEL_CFG_WRITE(32, uint32_t)
+
+static void model_lock(struct phb *phb __unused)
+{
+	assert(!model.locked);
+	model.locked = true;
+	model.locks++;
+}
+
+static void model_unlock(struct phb *phb __unused)
+{
+	assert(model.locked);
+	model.locked = false;
+}
+
+static const struct phb_ops model_ops = {
+	.lock		= model_lock,
+	.unlock		= model_unlock,
+	.cfg_read8	= model_cfg_read8,
+	.cfg_read16	= model_cfg_read16,
+	.cfg_read32	= model_cfg_read32,
+	.cfg_write8	= model_cfg_write8,
+	.cfg_write16	= model_cfg_write16,
+	.cfg_write32	= model_cfg_write32,
+};
+
+static struct phb model_phb = {
+	.ops		= &model_ops,
+};
+
+struct phb *pci_get_phb(uint64_t phb_id)
+{
+	return phb_id == 0 ? &model_phb : NULL;
+}
+
+/* Other stubs */
+void opal_update_pending_evt(uint64_t evt_mask __unused,
+			     uint64_t evt_values __unused)
+{
+}
+
+/* No config shadow here */
+void pci_cfg_shadow_write(struct phb *phb __unused, uint32_t bdfn __unused,
+			  uint32_t offset __unused, uint32_t size __unused,
+			  uint32_t data __unused)
+{
+}
+
+static void set_op(struct opal_pci_cfg_op *op, uint16_t bdfn, uint16_t offset,
+		   uint8_t size, uint8_t type, uint32_t value)
+{
+	memset(op, 0, sizeof(*op));
+	op->bdfn = cpu_to_be16(bdfn);
+	op->offset = cpu_to_be16(offset);
+	op->size = size;
+	op->op = type;
+	op->value = cpu_to_be32(value);
+}
+
+static double elapsed(struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) +
+		(end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+#define BENCH_LOOPS	2000
+
+int main(void)
+{
+	static struct opal_pci_cfg_op ops[OPAL_PCI_CFG_BATCH_MAX];
+	unsigned long locks, mmio;
+	struct timespec start;
+	double single, batch;
+	uint32_t val32;
+	int i, j;
+
+	model.present[0] = model.present[1] = true;
+
+	/* Mixed sizes and ops, done in order */
+	set_op(&ops[0], 1, 0x10, 4, OPAL_PCI_CFG_OP_WRITE, 0xdeadbeef);
+	set_op(&ops[1], 1, 0x10, 4, OPAL_PCI_CFG_OP_READ, 0);
+	set_op(&ops[2], 1, 0x12, 2, OPAL_PCI_CFG_OP_READ, 0);
+	set_op(&ops[3], 1, 0x13, 1, OPAL_PCI_CFG_OP_READ, 0);
+	set_op(&ops[4], 1, 0x11, 1, OPAL_PCI_CFG_OP_WRITE, 0x55);
+	set_op(&ops[5], 1, 0x10, 4, OPAL_PCI_CFG_OP_READ, 0);
+	set_op(&ops[6], 0, 0x04, 2, OPAL_PCI_CFG_OP_WRITE, 0x1234);
+	set_op(&ops[7], 0, 0x04, 2, OPAL_PCI_CFG_OP_READ, 0);
+	assert(opal_pci_config_batch(0, ops, 8) == OPAL_SUCCESS);
+	assert(model.locks == 1 && !model.locked);
+	for (i = 0; i < 8; i++)
+		assert(be32_to_cpu(ops[i].rc) == OPAL_SUCCESS);
+	assert(be32_to_cpu(ops[1].value) == 0xdeadbeef);
+	assert(be32_to_cpu(ops[2].value) == 0xdead);
+	assert(be32_to_cpu(ops[3].value) == 0xde);
+	assert(be32_to_cpu(ops[5].value) == 0xdead55ef);
+	assert(be32_to_cpu(ops[7].value) == 0x1234);
+
+	/* Same results as the single access calls */
+	assert(opal_pci_config_read_word(0, 1, 0x10, &val32) == OPAL_SUCCESS);
+	assert(val32 == 0xdead55ef);
+
+	/* Absent devices read all ones, like single accesses */
+	set_op(&ops[0], 3, 0x00, 4, OPAL_PCI_CFG_OP_READ, 0);
+	set_op(&ops[1], 3, 0x00, 2, OPAL_PCI_CFG_OP_READ, 0);
+	assert(opal_pci_config_batch(0, ops, 2) == OPAL_SUCCESS);
+	assert(be32_to_cpu(ops[0].value) == 0xffffffff);
+	assert(be32_to_cpu(ops[1].value) == 0xffff);
+
+	/* A bad entry gets its error, the others still go through */
+	set_op(&ops[0], 0, 0x08, 4, OPAL_PCI_CFG_OP_WRITE, 0xcafe);
+	set_op(&ops[1], 0, 0x0a, 4, OPAL_PCI_CFG_OP_READ, 0);
+	set_op(&ops[2], 0, 0x08, 3, OPAL_PCI_CFG_OP_READ, 0);
+	set_op(&ops[3], 0, 0x08, 4, 7, 0);
+	set_op(&ops[4], 0, 0x08, 4, OPAL_PCI_CFG_OP_READ, 0);
+	assert(opal_pci_config_batch(0, ops, 5) == OPAL_PARAMETER);
+	assert(be32_to_cpu(ops[0].rc) == OPAL_SUCCESS);
+	assert((int32_t)be32_to_cpu(ops[1].rc) == OPAL_PARAMETER);
+	assert((int32_t)be32_to_cpu(ops[2].rc) == OPAL_PARAMETER);
+	assert((int32_t)be32_to_cpu(ops[3].rc) == OPAL_PARAMETER);
+	assert(be32_to_cpu(ops[4].rc) == OPAL_SUCCESS);
+	assert(be32_to_cpu(ops[4].value) == 0xcafe);
+
+	/* Bad calls don't touch the PHB */
+	locks = model.locks;
+	assert(opal_pci_config_batch(1, ops, 1) == OPAL_PARAMETER);
+	assert(opal_pci_config_batch(0, NULL, 1) == OPAL_PARAMETER);
+	assert(opal_pci_config_batch(0, ops, 0) == OPAL_PARAMETER);
+	assert(opal_pci_config_batch(0, ops, OPAL_PCI_CFG_BATCH_MAX + 1)
+	       == OPAL_PARAMETER);
+	assert(model.locks == locks);
+
+	/* Per access cost, dumping a device's config space dword by dword */
+	locks = model.locks;
+	mmio = model.mmio;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (j = 0; j < BENCH_LOOPS; j++)
+		for (i = 0; i < OPAL_PCI_CFG_BATCH_MAX; i++)
+			opal_pci_config_read_word(0, 1, i * 4, &val32);
+	single = elapsed(&start);
+	assert(model.locks - locks == BENCH_LOOPS * OPAL_PCI_CFG_BATCH_MAX);
+	assert(model.mmio - mmio == 2 * BENCH_LOOPS * OPAL_PCI_CFG_BATCH_MAX);
+
+	locks = model.locks;
+	mmio = model.mmio;
+	for (i = 0; i < OPAL_PCI_CFG_BATCH_MAX; i++)
+		set_op(&ops[i], 1, i * 4, 4, OPAL_PCI_CFG_OP_READ, 0);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (j = 0; j < BENCH_LOOPS; j++)
+		opal_pci_config_batch(0, ops, OPAL_PCI_CFG_BATCH_MAX);
+	batch = elapsed(&start);
+	assert(model.locks - locks == BENCH_LOOPS);
+	assert(model.mmio - mmio == 2 * BENCH_LOOPS * OPAL_PCI_CFG_BATCH_MAX);
+
+	for (i = 0; i < OPAL_PCI_CFG_BATCH_MAX; i++) {
+		memcpy(&val32, &model.cfg[1][i * 4], 4);
+		assert(be32_to_cpu(ops[i].value) == le32_to_cpu(val32));
+	}
+
+	printf("single: %.1f ns/access, batch: %.1f ns/access\n",
+	       single * 1e9 / (BENCH_LOOPS * OPAL_PCI_CFG_BATCH_MAX),
+	       batch * 1e9 / (BENCH_LOOPS * OPAL_PCI_CFG_BATCH_MAX));
+
+	return 0;
+}
@@ -0,0 +1,213 @@
+/* Copyright 2013-2014 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <config.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdio.h>
+
+#define __TEST__
+#include <skiboot.h>
+#include <processor.h>
+#include <timebase.h>
+
+static uint64_t stamp;
+#define mftb()		(stamp)
+#define lwsync()
+#define sync()
+#define ilog2(val)	(63 - __builtin_clzl(val))
+#define zalloc(bytes)	calloc((bytes), 1)
+
+#include "../pci.c"
+#include "../timer.c"
+
+/*
+ * Simulated PHBs going through PERST and link training like PHB3
+ * does: 1s of PERST, 1s before polling the link, then 100ms polls
+ * until the link is up, link_ms after PERST, or 2s have passed.
+ * Empty slots fail straight away with OPAL_CLOSED.
+ */
+enum sim_state {
+	SIM_IDLE,
+	SIM_PERST,
+	SIM_DEASSERT,
+	SIM_LINK,
+};
+
+struct sim_phb {
+	struct phb	phb;
+	bool		present;
+	bool		broken;
+	uint32_t	link_ms;	/* Link up after PERST */
+	enum sim_state	state;
+	uint64_t	link_tb;
+	int		retries;
+	bool		locked;
+	unsigned int	polls;
+};
+
+#define SIM_PHBS	6
+
+static struct sim_phb sim[SIM_PHBS];
+
+static struct sim_phb *to_sim(struct phb *phb)
+{
+	return container_of(phb, struct sim_phb, phb);
+}
+
+static void sim_lock(struct phb *phb)
+{
+	assert(!to_sim(phb)->locked);
+	to_sim(phb)->locked = true;
+}
+
+static void sim_unlock(struct phb *phb)
+{
+	assert(to_sim(phb)->locked);
+	to_sim(phb)->locked = false;
+}
+
+static int64_t sim_power_state(struct phb *phb __unused)
+{
+	return OPAL_SHPC_POWER_ON;
+}
+
+static int64_t sim_fundamental_reset(struct phb *phb)
+{
+	struct sim_phb *s = to_sim(phb);
+
+	assert(s->locked && s->state == SIM_IDLE);
+	if (!s->present)
+		return OPAL_CLOSED;
+	s->state = SIM_PERST;
+	return secs_to_tb(1);
+}
+
+static int64_t sim_poll(struct phb *phb)
+{
+	struct sim_phb *s = to_sim(phb);
+
+	assert(s->locked);
+	s->polls++;
+	switch (s->state) {
+	case SIM_PERST:
+		s->state = SIM_DEASSERT;
+		s->link_tb = stamp + msecs_to_tb(s->link_ms);
+		return secs_to_tb(1);
+	case SIM_DEASSERT:
+		if (s->broken)
+			break;
+		s->state = SIM_LINK;
+		s->retries = 20;
+		return msecs_to_tb(100);
+	case SIM_LINK:
+		if (tb_compare(stamp, s->link_tb) != TB_ABEFOREB ||
+		    s->retries-- == 0) {
+			s->state = SIM_IDLE;
+			return OPAL_SUCCESS;
+		}
+		return msecs_to_tb(100);
+	default:
+		assert(0);
+	}
+	s->state = SIM_IDLE;
+	return OPAL_HARDWARE;
+}
+
+static const struct phb_ops sim_ops = {
+	.lock			= sim_lock,
+	.unlock			= sim_unlock,
+	.power_state		= sim_power_state,
+	.fundamental_reset	= sim_fundamental_reset,
+	.poll			= sim_poll,
+};
+
+/* Stubs */
+struct platform platform;
+
+void lock(struct lock *l __unused)
+{
+}
+
+void unlock(struct lock *l __unused)
+{
+}
+
+/* The pollers run every millisecond while we wait */
+void opal_run_pollers(void)
+{
+	check_timers(false);
+}
+
+void time_wait_ms_nopoll(unsigned long ms)
+{
+	stamp += msecs_to_tb(ms);
+}
+
+int main(void)
+{
+	uint64_t start, serial = 0, ms;
+	unsigned int i;
+
+	for (i = 0; i < SIM_PHBS; i++) {
+		sim[i].phb.ops = &sim_ops;
+		sim[i].phb.phb_type = phb_type_pcie_v3;
+		sim[i].present = i != 2;
+		sim[i].broken = i == 4;
+		sim[i].link_ms = 1300 + 250 * i;
+		phbs[i] = &sim[i].phb;
+		phbs[i]->opal_id = i;
+	}
+
+	start = stamp;
+	pci_reset_phbs();
+	ms = tb_to_msecs(stamp - start);
+
+	for (i = 0; i < SIM_PHBS; i++) {
+		struct pci_reset_state *rs = &pci_resets[i];
+		uint64_t took = tb_to_msecs(rs->end - rs->start);
+
+		assert(rs->done && rs->phb == &sim[i].phb);
+		assert(sim[i].state == SIM_IDLE && !sim[i].locked);
+		if (!sim[i].present) {
+			assert(rs->rc == OPAL_CLOSED && took == 0);
+			continue;
+		}
+		if (sim[i].broken) {
+			assert(rs->rc == OPAL_HARDWARE);
+			assert(took >= 2000 && took <= 2002);
+			serial += took;
+			continue;
+		}
+
+		/* Link polls are 100ms apart, timers fire within 1ms */
+		assert(rs->rc == OPAL_SUCCESS);
+		assert(took >= 1000 + sim[i].link_ms);
+		assert(took <= 1000 + sim[i].link_ms + 100 + sim[i].polls);
+		serial += took;
+	}
+	for (; i < ARRAY_SIZE(pci_resets); i++)
+		assert(pci_resets[i].done && !pci_resets[i].phb);
+
+	/* Every PHB trained at the same time */
+	printf("%d PHBs reset in %llu ms, %llu ms one after the other\n",
+	       SIM_PHBS, (unsigned long long)ms, (unsigned long long)serial);
+	assert(ms <= 1000 + sim[SIM_PHBS - 1].link_ms + 100 + 50);
+	assert(ms * 3 < serial);
+
+	return 0;
+}
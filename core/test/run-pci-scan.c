@@ -0,0 +1,770 @@
+/* Copyright 2013-2014 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <config.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdio.h>
+
+#define __TEST__
+#include <skiboot.h>
+#include <processor.h>
+#include <timebase.h>
+
+static uint64_t stamp;
+#define mftb()		(stamp)
+#define lwsync()
+#define ilog2(val)	(63 - __builtin_clzl(val))
+#define zalloc(bytes)	calloc((bytes), 1)
+
+#include "../pci.c"
+
+/* The device-tree is all in heap */
+#define is_rodata(p)	false
+
+#include "../device.c"
+
+/*
+ * Simulated PCIe topology. Every function has a config space and a
+ * parent bridge, bus numbers are decoded from what the scan writes
+ * into the bridges. A root or downstream port brings the functions
+ * below it out of reset when its link gets enabled, after which they
+ * answer with CRS for crs_ms. Config accesses cost a microsecond.
+ */
+#define SIM_MAX_FNS		128
+#define SIM_CFG_SIZE		0x1000
+#define SIM_EXP_CAP		0x40
+
+struct sim_fn {
+	int		parent;
+	uint8_t		devfn;
+	uint32_t	crs_ms;
+	uint64_t	link_tb;	/* Ports: when the link got enabled */
+	bool		found;
+	uint8_t		cfg[SIM_CFG_SIZE];
+};
+
+static struct sim_fn sim[SIM_MAX_FNS];
+static int sim_count;
+static unsigned long sim_accesses, sim_reads, sim_crs;
+
+static uint16_t sim_cfg16(struct sim_fn *f, uint32_t off)
+{
+	return f->cfg[off] | f->cfg[off + 1] << 8;
+}
+
+static void sim_set(struct sim_fn *f, uint32_t off, uint32_t val, int size)
+{
+	int i;
+
+	for (i = 0; i < size; i++)
+		f->cfg[off + i] = val >> (8 * i);
+}
+
+static uint8_t sim_type(struct sim_fn *f)
+{
+	return GETFIELD(PCICAP_EXP_CAP_TYPE,
+			sim_cfg16(f, SIM_EXP_CAP + PCICAP_EXP_CAPABILITY_REG));
+}
+
+static bool sim_is_port(struct sim_fn *f)
+{
+	return sim_type(f) == PCIE_TYPE_ROOT_PORT ||
+		sim_type(f) == PCIE_TYPE_SWITCH_DNPORT;
+}
+
+static int sim_add(int parent, uint8_t devfn, uint32_t vdid, uint8_t type,
+		   uint32_t crs_ms)
+{
+	struct sim_fn *f = &sim[sim_count];
+	bool bridge = type != PCIE_TYPE_ENDPOINT;
+
+	assert(sim_count < SIM_MAX_FNS);
+	f->parent = parent;
+	f->devfn = devfn;
+	f->crs_ms = crs_ms;
+
+	sim_set(f, 0, vdid, 4);
+	sim_set(f, PCI_CFG_STAT, PCI_CFG_STAT_CAP, 2);
+	sim_set(f, PCI_CFG_HDR_TYPE, bridge ? 1 : 0, 1);
+	sim_set(f, PCI_CFG_CAP, SIM_EXP_CAP, 1);
+	sim_set(f, SIM_EXP_CAP, PCI_CFG_CAP_ID_EXP, 1);
+	sim_set(f, SIM_EXP_CAP + PCICAP_EXP_CAPABILITY_REG,
+		SETFIELD(PCICAP_EXP_CAP_TYPE, 0, type), 2);
+	sim_set(f, SIM_EXP_CAP + PCICAP_EXP_DEVCAP,
+		SETFIELD(PCICAP_EXP_DEVCAP_MPSS, 0, 1), 4);
+	sim_set(f, PCI_CFG_REV_ID, bridge ? 0x06040001 : 0x02000002, 4);
+	sim_set(f, PCI_CFG_INT_PIN, bridge ? 0 : 1, 1);
+	if (type == PCIE_TYPE_ROOT_PORT || type == PCIE_TYPE_SWITCH_DNPORT) {
+		sim_set(f, SIM_EXP_CAP + PCICAP_EXP_SLOTSTAT,
+			PCICAP_EXP_SLOTSTAT_PDETECTST, 2);
+		sim_set(f, SIM_EXP_CAP + PCICAP_EXP_LCAP,
+			PCICAP_EXP_LCAP_DL_ACT_REP, 4);
+		sim_set(f, SIM_EXP_CAP + PCICAP_EXP_LSTAT,
+			PCICAP_EXP_LSTAT_DLLL_ACT, 2);
+		sim_set(f, SIM_EXP_CAP + PCIECAP_EXP_DCAP2,
+			PCICAP_EXP_DCAP2_ARI_FWD, 4);
+	}
+
+	return sim_count++;
+}
+
+static void sim_set_multifunction(int idx)
+{
+	sim[idx].cfg[PCI_CFG_HDR_TYPE] |= 0x80;
+}
+
+static void sim_set_ari(int idx, uint8_t next_fn)
+{
+	sim_set(&sim[idx], PCI_CFG_ECAP_START, PCIECAP_ID_ARI | 1 << 16, 4);
+	sim_set(&sim[idx], PCI_CFG_ECAP_START + PCIECAP_ARI_CAP,
+		SETFIELD(PCIECAP_ARI_CAP_NFN, 0, next_fn), 2);
+}
+
+/* Bus behind a bridge, or -1 if it doesn't decode anything yet */
+static int sim_bus(int idx)
+{
+	int bus;
+
+	if (idx < 0)
+		return 0;
+	if (sim_bus(sim[idx].parent) < 0)
+		return -1;
+	bus = sim[idx].cfg[PCI_CFG_SECONDARY_BUS];
+	return bus ? bus : -1;
+}
+
+/* When a function comes out of reset, or 0 if it's still held there */
+static uint64_t sim_reset_end(int idx)
+{
+	int p;
+
+	for (p = sim[idx].parent; p >= 0; p = sim[p].parent)
+		if (sim_is_port(&sim[p]))
+			return sim[p].link_tb;
+	return 1;
+}
+
+static struct sim_fn *sim_find(uint32_t bdfn, bool *crs)
+{
+	struct sim_fn *f;
+	uint16_t dctl2;
+	uint64_t tb;
+	int i;
+
+	*crs = false;
+	for (i = 0; i < sim_count; i++) {
+		f = &sim[i];
+		if (f->devfn != (bdfn & 0xff) || sim_bus(f->parent) != bdfn >> 8)
+			continue;
+
+		/* Ports only pass device 0 along unless ARI is on */
+		if (f->parent >= 0 && sim_is_port(&sim[f->parent])) {
+			dctl2 = sim_cfg16(&sim[f->parent],
+					  SIM_EXP_CAP + PCICAP_EXP_DCTL2);
+			if ((f->devfn >> 3) &&
+			    !(dctl2 & PCICAP_EXP_DCTL2_ARI_FWD))
+				return NULL;
+		}
+
+		tb = sim_reset_end(i);
+		if (!tb)
+			return NULL;
+		*crs = tb_compare(stamp, tb + msecs_to_tb(f->crs_ms)) ==
+			TB_ABEFOREB;
+		return f;
+	}
+	return NULL;
+}
+
+static int64_t sim_cfg_read(uint32_t bdfn, uint32_t offset, uint32_t size,
+			    uint32_t *data)
+{
+	struct sim_fn *f;
+	bool crs;
+	uint32_t i;
+
+	stamp += usecs_to_tb(1);
+	sim_accesses++;
+	sim_reads++;
+	f = sim_find(bdfn, &crs);
+	if (crs && offset == 0 && size == 4) {
+		sim_crs++;
+		*data = PCI_CRS_VDID;
+		return OPAL_SUCCESS;
+	}
+	if (!f || crs) {
+		*data = 0xffffffff >> (32 - 8 * size);
+		return OPAL_SUCCESS;
+	}
+
+	*data = 0;
+	for (i = 0; i < size; i++)
+		*data |= f->cfg[offset + i] << (8 * i);
+	return OPAL_SUCCESS;
+}
+
+static int64_t sim_cfg_write(uint32_t bdfn, uint32_t offset, uint32_t size,
+			     uint32_t data)
+{
+	struct sim_fn *f;
+	bool crs;
+
+	stamp += usecs_to_tb(1);
+	sim_accesses++;
+	f = sim_find(bdfn, &crs);
+	if (!f || crs)
+		return OPAL_SUCCESS;
+
+	/* Read only bits the scan touches */
+	if (offset == PCI_CFG_STAT || offset == SIM_EXP_CAP + PCICAP_EXP_LSTAT)
+		return OPAL_SUCCESS;
+
+	sim_set(f, offset, data, size);
+	if (offset == SIM_EXP_CAP + PCICAP_EXP_LCTL &&
+	    !(data & PCICAP_EXP_LCTL_LINK_DIS) && !f->link_tb)
+		f->link_tb = stamp;
+	return OPAL_SUCCESS;
+}
+
+#define SIM_CFG_READ(size, type)					\
+static int64_t sim_cfg_read##size(struct phb *phb __unused,		\
+				  uint32_t bdfn, uint32_t offset,	\
+				  type *data)				\
+{									\
+	uint32_t val;							\
+	int64_t rc;							\
+									\
+	rc = sim_cfg_read(bdfn, offset, sizeof(type), &val);		\
+	*data = val;							\
+	return rc;							\
+}
+
+#define SIM_CFG_WRITE(size, type)					\
+static int64_t sim_cfg_write##size(struct phb *phb __unused,		\
+				   uint32_t bdfn, uint32_t offset,	\
+				   type data)				\
+{									\
+	return sim_cfg_write(bdfn, offset, sizeof(type), data);	\
+}
+
+SIM_CFG_READ(8, uint8_t)
+SIM_CFG_READ(16, uint16_t)
+SIM_CFG_READ(32, uint32_t)
+SIM_CFG_WRITE(8, uint8_t)
+SIM_CFG_WRITE(16, uint16_t)
+SIM_CFG_WRITE(32, uint32_t)
+
+static uint8_t sim_choose_bus(struct phb *phb __unused,
+			      struct pci_device *bridge __unused,
+			      uint8_t candidate, uint8_t *max_bus __unused,
+			      bool *use_max)
+{
+	*use_max = false;
+	return candidate;
+}
+
+static int64_t sim_eeh_freeze_status(struct phb *phb __unused,
+				     uint64_t pe_number __unused,
+				     uint8_t *freeze_state,
+				     uint16_t *pci_error_type __unused,
+				     uint16_t *severity __unused,
+				     uint64_t *phb_status __unused)
+{
+	*freeze_state = OPAL_EEH_STOPPED_NOT_FROZEN;
+	return OPAL_SUCCESS;
+}
+
+static const struct phb_ops sim_ops = {
+	.cfg_read8		= sim_cfg_read8,
+	.cfg_read16		= sim_cfg_read16,
+	.cfg_read32		= sim_cfg_read32,
+	.cfg_write8		= sim_cfg_write8,
+	.cfg_write16		= sim_cfg_write16,
+	.cfg_write32		= sim_cfg_write32,
+	.choose_bus		= sim_choose_bus,
+	.eeh_freeze_status	= sim_eeh_freeze_status,
+};
+
+/* Stubs */
+struct platform platform;
+
+void time_wait(unsigned long duration)
+{
+	stamp += duration;
+}
+
+void time_wait_ms(unsigned long ms)
+{
+	stamp += msecs_to_tb(ms);
+}
+
+/* Check every device found against the topology */
+static int check_devices(struct list_head *list, int parent)
+{
+	struct pci_device *pd;
+	struct sim_fn *f;
+	uint16_t prev = 0;
+	bool crs;
+	int n = 0;
+
+	list_for_each(list, pd, link) {
+		assert(!n || pd->bdfn > prev);
+		prev = pd->bdfn;
+
+		f = sim_find(pd->bdfn, &crs);
+		assert(f && !crs && !f->found);
+		assert(f->parent == parent);
+		f->found = true;
+		n += 1 + check_devices(&pd->children, f - sim);
+	}
+	return n;
+}
+
+static struct phb phb;
+
+static struct dt_node *nth_child(struct dt_node *np, int n)
+{
+	struct dt_node *child;
+
+	dt_for_each_child(np, child)
+		if (!n--)
+			return child;
+	return NULL;
+}
+
+/* Every DT node matches the config space it was made from */
+static void check_nodes(struct dt_node *np, struct list_head *list)
+{
+	struct pci_device *pd;
+	struct dt_node *child;
+	struct sim_fn *f;
+	bool crs;
+	int n = 0;
+
+	/* Nodes are added in scan order */
+	list_for_each(list, pd, link) {
+		f = sim_find(pd->bdfn, &crs);
+		child = nth_child(np, n++);
+		assert(child);
+		assert(dt_prop_get_u32(child, "vendor-id") ==
+		       (f->cfg[0] | f->cfg[1] << 8));
+		assert(dt_prop_get_u32(child, "device-id") ==
+		       (f->cfg[2] | f->cfg[3] << 8));
+		assert(dt_prop_get_u32(child, "revision-id") ==
+		       f->cfg[PCI_CFG_REV_ID]);
+		assert(dt_prop_get_u32_def(child, "interrupts", 0) ==
+		       f->cfg[PCI_CFG_INT_PIN]);
+		assert(GETFIELD(PCICAP_EXP_DEVCTL_MPS,
+				sim_cfg16(f, SIM_EXP_CAP + PCICAP_EXP_DEVCTL))
+		       == ilog2(phb.mps) - 7);
+		check_nodes(child, &pd->children);
+	}
+	assert(!nth_child(np, n));
+}
+
+static void free_devices(struct list_head *list)
+{
+	struct pci_device *pd;
+
+	while ((pd = list_pop(list, struct pci_device, link)) != NULL) {
+		free_devices(&pd->children);
+		free(pd);
+	}
+}
+
+static uint64_t scan(void)
+{
+	unsigned long scan_accesses;
+	uint32_t mps = 0xffffffff;
+	uint64_t start, ms;
+	int i, found;
+
+	for (i = 0; i < sim_count; i++) {
+		sim[i].found = false;
+		sim[i].link_tb = 0;
+		sim[i].cfg[PCI_CFG_SECONDARY_BUS] = 0;
+		sim_set(&sim[i], SIM_EXP_CAP + PCICAP_EXP_DCTL2, 0, 2);
+	}
+	memset(&phb, 0, sizeof(phb));
+	phb.ops = &sim_ops;
+	phb.scan_map = 0x1;
+	phb.dt_node = dt_new_root("pciex");
+	list_head_init(&phb.devices);
+	sim_accesses = sim_crs = 0;
+
+	start = stamp;
+	pci_scan(&phb, 0, 0xff, &phb.devices, NULL, true);
+	found = check_devices(&phb.devices, -1);
+	ms = tb_to_msecs(stamp - start);
+	scan_accesses = sim_accesses;
+
+	/* What happens after the scan works from what it captured */
+	sim_reads = sim_accesses = 0;
+	pci_walk_dev(&phb, pci_get_mps, &mps);
+	phb.mps = mps;
+	pci_walk_dev(&phb, pci_configure_mps, NULL);
+	pci_add_nodes(&phb);
+	assert(sim_reads == 0 && sim_accesses <= (unsigned long)found);
+	check_nodes(phb.dt_node, &phb.devices);
+
+	for (i = 0; i < sim_count; i++)
+		if (sim[i].crs_ms < PCI_CRS_TIMEOUT_MS)
+			assert(sim[i].found);
+		else
+			assert(!sim[i].found);
+	printf("%d devices, %lu config accesses (%lu CRS), %lu ms, "
+	       "%lu to set MPS and build the device-tree\n",
+	       found, scan_accesses, sim_crs, ms, sim_accesses);
+	pci_cfg_shadow_flush(&phb);
+	free_devices(&phb.devices);
+	dt_free(phb.dt_node);
+
+	return ms;
+}
+
+static struct pci_device *find_dev(int idx)
+{
+	struct sim_fn *f;
+	int bus = sim_bus(sim[idx].parent);
+	bool crs;
+
+	assert(bus >= 0);
+	f = sim_find(bus << 8 | sim[idx].devfn, &crs);
+	assert(f == &sim[idx]);
+	return pci_find_dev(&phb, bus << 8 | sim[idx].devfn);
+}
+
+static int count_children(struct dt_node *np)
+{
+	struct dt_node *child;
+	int n = 0;
+
+	dt_for_each_child(np, child)
+		n++;
+	return n;
+}
+
+/*
+ * Hot-add, removal and replacement of adapters below switch ports,
+ * without touching the rest of the PHB
+ */
+static struct opal_pci_slot_rescan res;
+
+/*
+ * Keep calling back after the delay we're given, like the OS would,
+ * checking that no call holds on to the CPU for long
+ */
+static int64_t rescan(uint16_t bdfn, int *calls)
+{
+	uint64_t start;
+	int64_t rc;
+
+	for (*calls = 1;; (*calls)++) {
+		start = stamp;
+		rc = pci_rescan_slot(&phb, bdfn, &res);
+		assert(stamp - start < msecs_to_tb(1));
+		if (rc <= 0)
+			return rc;
+		time_wait_ms(rc);
+	}
+}
+
+static void test_rescan(void)
+{
+	struct pci_device *port[3], *pd;
+	struct dt_node *kept;
+	int rp, up, dn[3], ep[3], i;
+	unsigned long full;
+	uint32_t mps = 0xffffffff;
+	int calls;
+
+	memset(sim, 0, sizeof(sim));
+	sim_count = 0;
+	rp = sim_add(-1, 0, 0x10001014, PCIE_TYPE_ROOT_PORT, 0);
+	up = sim_add(rp, 0, 0x874810b5, PCIE_TYPE_SWITCH_UPPORT, 0);
+	for (i = 0; i < 3; i++)
+		dn[i] = sim_add(up, i << 3, 0x874810b5,
+				PCIE_TYPE_SWITCH_DNPORT, 0);
+	ep[0] = sim_add(dn[0], 0, 0x15b31003, PCIE_TYPE_ENDPOINT, 0);
+	ep[2] = sim_add(dn[2], 0, 0x15b31003, PCIE_TYPE_ENDPOINT, 0);
+
+	/* Port 1 is empty at boot */
+	sim_set(&sim[dn[1]], SIM_EXP_CAP + PCICAP_EXP_SLOTSTAT, 0, 2);
+
+	memset(&phb, 0, sizeof(phb));
+	phb.ops = &sim_ops;
+	phb.scan_map = 0x1;
+	phb.dt_node = dt_new_root("pciex");
+	list_head_init(&phb.devices);
+	sim_accesses = 0;
+	pci_scan(&phb, 0, 0xff, &phb.devices, NULL, true);
+	full = sim_accesses;
+	pci_walk_dev(&phb, pci_get_mps, &mps);
+	phb.mps = mps;
+	pci_walk_dev(&phb, pci_configure_mps, NULL);
+	pci_add_nodes(&phb);
+	for (i = 0; i < 3; i++)
+		port[i] = find_dev(dn[i]);
+	assert(list_empty(&port[1]->children) && port[1]->secondary_bus);
+	kept = find_dev(ep[0])->dn;
+
+	/* Not a bridge, or not a device */
+	assert(pci_rescan_slot(&phb, find_dev(ep[0])->bdfn, &res) ==
+	       OPAL_PARAMETER);
+	assert(pci_rescan_slot(&phb, 0xfff8, &res) == OPAL_PARAMETER);
+
+	/* Two function adapter plugged in port 1 */
+	ep[1] = sim_add(dn[1], 0, 0x16a414e4, PCIE_TYPE_ENDPOINT, 200);
+	sim_set_multifunction(ep[1]);
+	sim_add(dn[1], 1, 0x16a414e4, PCIE_TYPE_ENDPOINT, 0);
+	sim_set(&sim[dn[1]], SIM_EXP_CAP + PCICAP_EXP_SLOTSTAT,
+		PCICAP_EXP_SLOTSTAT_PDETECTST, 2);
+	sim_accesses = 0;
+	assert(pci_rescan_slot(&phb, port[1]->bdfn, &res) > 0);
+
+	/* One slot at a time, and nothing shows up until it's done */
+	assert(pci_rescan_slot(&phb, port[0]->bdfn, &res) == OPAL_BUSY);
+	assert(list_empty(&port[1]->children));
+	assert(rescan(port[1]->bdfn, &calls) == OPAL_SUCCESS);
+	printf("Slot rescan: %lu config accesses, %lu for the PHB, "
+	       "%d calls\n", sim_accesses, full, calls + 1);
+	assert(sim_accesses < full);
+	assert(calls > 1);
+	assert(be16_to_cpu(res.num_added) == 2 && !res.num_removed);
+	assert(be16_to_cpu(res.added[0]) == port[1]->secondary_bus << 8);
+	assert(be16_to_cpu(res.added[1]) == (port[1]->secondary_bus << 8 | 1));
+	assert(count_children(port[1]->dn) == 2);
+	assert(find_dev(ep[0])->dn == kept);
+	assert(find_dev(ep[1])->dn);
+
+	/* Nothing changed */
+	assert(rescan(port[1]->bdfn, &calls) == OPAL_SUCCESS);
+	assert(!res.num_added && !res.num_removed);
+	assert(count_children(port[1]->dn) == 2);
+
+	/* Cancelled, or dropped by a reset, the slot keeps its devices */
+	assert(pci_rescan_slot(&phb, port[1]->bdfn, NULL) == OPAL_PARAMETER);
+	pd = find_dev(ep[1]);
+	assert(pci_rescan_slot(&phb, port[1]->bdfn, &res) > 0);
+	assert(pci_rescan_slot(&phb, port[0]->bdfn, NULL) == OPAL_BUSY);
+	assert(pci_rescan_slot(&phb, port[1]->bdfn, NULL) == OPAL_SUCCESS);
+	assert(!phb.rescan && find_dev(ep[1]) == pd && pd->dn);
+	assert(count_children(port[1]->dn) == 2);
+	assert(pci_rescan_slot(&phb, port[0]->bdfn, &res) > 0);
+	pci_rescan_abort(&phb);
+	assert(!phb.rescan && find_dev(ep[0])->dn == kept);
+	check_nodes(phb.dt_node, &phb.devices);
+
+	/* Adapter in port 2 pulled, the one in port 0 replaced */
+	sim_set(&sim[dn[2]], SIM_EXP_CAP + PCICAP_EXP_SLOTSTAT, 0, 2);
+	assert(rescan(port[2]->bdfn, &calls) == OPAL_SUCCESS);
+	assert(!res.num_added && be16_to_cpu(res.num_removed) == 1);
+	assert(be16_to_cpu(res.removed[0]) == port[2]->secondary_bus << 8);
+	assert(count_children(port[2]->dn) == 0);
+
+	sim_set(&sim[ep[0]], 0, 0x10021077, 4);
+	assert(rescan(port[0]->bdfn, &calls) == OPAL_SUCCESS);
+	assert(be16_to_cpu(res.num_added) == 1);
+	assert(be16_to_cpu(res.num_removed) == 1);
+	pd = find_dev(ep[0]);
+	assert(pd->vdid == 0x10021077);
+	assert(dt_prop_get_u32(pd->dn, "vendor-id") == 0x1077);
+	assert(count_children(port[0]->dn) == 1);
+
+	check_nodes(phb.dt_node, &phb.devices);
+	pci_cfg_shadow_flush(&phb);
+	free_devices(&phb.devices);
+	dt_free(phb.dt_node);
+}
+
+/* Read-mostly registers are served without config cycles */
+static void test_cfg_shadow(void)
+{
+	struct pci_device *port, *pd;
+	uint32_t val, misses;
+	int rp, ep;
+
+	memset(sim, 0, sizeof(sim));
+	sim_count = 0;
+	rp = sim_add(-1, 0, 0x10001014, PCIE_TYPE_ROOT_PORT, 0);
+	ep = sim_add(rp, 0, 0x15b31003, PCIE_TYPE_ENDPOINT, 0);
+	sim_set_ari(ep, 0);
+
+	memset(&phb, 0, sizeof(phb));
+	phb.ops = &sim_ops;
+	phb.scan_map = 0x1;
+	list_head_init(&phb.devices);
+	pci_scan(&phb, 0, 0xff, &phb.devices, NULL, true);
+	port = find_dev(rp);
+	pd = find_dev(ep);
+	assert(phb.cfg_shadow_fills == 2);
+
+	sim_reads = 0;
+	misses = phb.cfg_shadow_misses;
+	pci_cfg_shadow_read(&phb, pd->bdfn, PCI_CFG_VENDOR_ID, 4, &val);
+	assert(val == 0x15b31003);
+	pci_cfg_shadow_read(&phb, pd->bdfn, PCI_CFG_DEVICE_ID, 2, &val);
+	assert(val == 0x15b3);
+	pci_cfg_shadow_read(&phb, pd->bdfn, PCI_CFG_REV_ID, 4, &val);
+	assert(val == 0x02000002);
+	pci_cfg_shadow_read(&phb, pd->bdfn, PCI_CFG_INT_PIN, 1, &val);
+	assert(val == 1);
+	pci_cfg_shadow_read(&phb, pd->bdfn, PCI_CFG_CAP, 1, &val);
+	assert(val == SIM_EXP_CAP);
+	pci_cfg_shadow_read(&phb, pd->bdfn, SIM_EXP_CAP, 2, &val);
+	assert(val == PCI_CFG_CAP_ID_EXP);
+	pci_cfg_shadow_read(&phb, pd->bdfn, PCI_CFG_ECAP_START, 4, &val);
+	assert(val == (PCIECAP_ID_ARI | 1 << 16));
+	assert(pci_find_ecap(&phb, pd->bdfn, PCIECAP_ID_ARI, NULL) ==
+	       PCI_CFG_ECAP_START);
+	assert(pci_find_cap(&phb, port->bdfn, PCI_CFG_CAP_ID_EXP) ==
+	       SIM_EXP_CAP);
+	assert(sim_reads == 0 && phb.cfg_shadow_misses == misses);
+
+	/* Anything else goes to the device */
+	pci_cfg_shadow_read(&phb, pd->bdfn, SIM_EXP_CAP + PCICAP_EXP_DEVCAP,
+			    4, &val);
+	pci_cfg_shadow_read(&phb, pd->bdfn, PCI_CFG_CMD, 2, &val);
+	pci_cfg_shadow_read(&phb, pd->bdfn, PCI_CFG_CACHE_LINE_SIZE, 4, &val);
+	assert(sim_reads == 3 && phb.cfg_shadow_misses == misses + 3);
+
+	/* Nothing gets shadowed for functions that aren't there */
+	sim_reads = 0;
+	pci_cfg_shadow_read(&phb, pd->bdfn + 1, PCI_CFG_VENDOR_ID, 2, &val);
+	assert(val == 0xffff && sim_reads == 1);
+	pci_cfg_shadow_read(&phb, pd->bdfn + 1, PCI_CFG_VENDOR_ID, 2, &val);
+	assert(val == 0xffff && sim_reads == 2);
+	assert(phb.cfg_shadow_fills == 2);
+
+	/* Stale until flushed, writing bus numbers flushes */
+	sim_set(&sim[ep], 0, 0x10021077, 4);
+	pci_cfg_shadow_read(&phb, pd->bdfn, PCI_CFG_VENDOR_ID, 4, &val);
+	assert(val == 0x15b31003);
+	pci_cfg_shadow_write(&phb, pd->bdfn, PCI_CFG_CMD, 2, 0);
+	pci_cfg_shadow_write(&phb, port->bdfn, PCI_CFG_BRCTL, 2, 0);
+	pci_cfg_shadow_read(&phb, pd->bdfn, PCI_CFG_VENDOR_ID, 4, &val);
+	assert(val == 0x15b31003 && !phb.cfg_shadow_flushes);
+	pci_cfg_shadow_write(&phb, port->bdfn, PCI_CFG_SECONDARY_BUS, 1,
+			     sim[rp].cfg[PCI_CFG_SECONDARY_BUS]);
+	assert(phb.cfg_shadow_flushes == 1);
+	pci_cfg_shadow_read(&phb, pd->bdfn, PCI_CFG_VENDOR_ID, 4, &val);
+	assert(val == 0x10021077);
+	pci_cfg_shadow_write(&phb, port->bdfn, PCI_CFG_BRCTL, 2,
+			     PCI_CFG_BRCTL_SECONDARY_RESET);
+	assert(phb.cfg_shadow_flushes == 2);
+
+	/* BARs of endpoints sit at the same offsets, shadowed or not */
+	pci_cfg_shadow_read(&phb, pd->bdfn, PCI_CFG_VENDOR_ID, 4, &val);
+	pci_cfg_shadow_write(&phb, pd->bdfn, PCI_CFG_SECONDARY_BUS, 4, ~0);
+	pci_cfg_shadow_write(&phb, pd->bdfn, PCI_CFG_BRCTL, 2,
+			     PCI_CFG_BRCTL_SECONDARY_RESET);
+	pci_cfg_shadow_flush(&phb);
+	pci_cfg_shadow_write(&phb, pd->bdfn, PCI_CFG_SECONDARY_BUS, 4, ~0);
+	pci_cfg_shadow_write(&phb, pd->bdfn + 1, PCI_CFG_SECONDARY_BUS, 4, ~0);
+	assert(phb.cfg_shadow_flushes == 3);
+
+	/* The bridge isn't shadowed now, the scan still knows it */
+	pci_cfg_shadow_write(&phb, port->bdfn, PCI_CFG_SECONDARY_BUS, 1,
+			     sim[rp].cfg[PCI_CFG_SECONDARY_BUS]);
+	assert(phb.cfg_shadow_flushes == 4);
+
+	/* Turned off */
+	phb.cfg_shadow_off = true;
+	sim_reads = 0;
+	pci_cfg_shadow_read(&phb, pd->bdfn, PCI_CFG_VENDOR_ID, 4, &val);
+	assert(val == 0x10021077 && sim_reads == 1);
+
+	printf("Config shadow: %llu hits, %llu misses, %llu fills\n",
+	       (unsigned long long)phb.cfg_shadow_hits,
+	       (unsigned long long)phb.cfg_shadow_misses,
+	       (unsigned long long)phb.cfg_shadow_fills);
+	pci_cfg_shadow_flush(&phb);
+	free_devices(&phb.devices);
+}
+
+#define SWITCHES	8
+#define SWITCH_PORTS	4
+#define CRS_MS		1000
+
+int main(void)
+{
+	int rp, up, dn, sw_up, sw_dn, ep, i, j;
+	uint64_t ms;
+
+	/* Root port, switch, and a switch below each of its ports */
+	rp = sim_add(-1, 0, 0x10001014, PCIE_TYPE_ROOT_PORT, 0);
+	up = sim_add(rp, 0, 0x874810b5, PCIE_TYPE_SWITCH_UPPORT, 0);
+	for (i = 0; i < SWITCHES; i++) {
+		dn = sim_add(up, i << 3, 0x874810b5,
+			     PCIE_TYPE_SWITCH_DNPORT, 0);
+		sw_up = sim_add(dn, 0, 0x872410b5,
+				PCIE_TYPE_SWITCH_UPPORT, 0);
+		for (j = 0; j < SWITCH_PORTS; j++) {
+			sw_dn = sim_add(sw_up, j << 3, 0x872410b5,
+					PCIE_TYPE_SWITCH_DNPORT, 0);
+			sim_add(sw_dn, 0, 0x15b31003, PCIE_TYPE_ENDPOINT,
+				CRS_MS);
+		}
+	}
+
+	/*
+	 * Every endpoint sits in CRS for a second after its link is up.
+	 * Waiting for them one at a time would take that second for each
+	 * of them, on top of the link waits.
+	 */
+	ms = scan();
+	assert(ms < SWITCHES * (CRS_MS + SWITCH_PORTS * 2 * PCI_CRS_RETRY_MS));
+	assert(ms < SWITCHES * SWITCH_PORTS * CRS_MS / 2);
+
+	/* ARI device with functions 0, 8, 17 and 200, 17 is slow */
+	dn = sim_add(up, SWITCHES << 3, 0x874810b5,
+		     PCIE_TYPE_SWITCH_DNPORT, 0);
+	sim_set_ari(sim_add(dn, 0, 0x000c1077, PCIE_TYPE_ENDPOINT, 0), 8);
+	sim_set_ari(sim_add(dn, 8, 0x000c1077, PCIE_TYPE_ENDPOINT, 0), 17);
+	sim_set_ari(sim_add(dn, 17, 0x000c1077, PCIE_TYPE_ENDPOINT, 500), 200);
+	sim_set_ari(sim_add(dn, 200, 0x000c1077, PCIE_TYPE_ENDPOINT, 0), 0);
+
+	/*
+	 * Multifunction device next to a device that never leaves CRS,
+	 * function 0 comes up after function 3 and the scan has to go
+	 * back to the other functions
+	 */
+	sw_up = sim_add(up, (SWITCHES + 1) << 3, 0x874810b5,
+			PCIE_TYPE_SWITCH_DNPORT, 0);
+	sw_up = sim_add(sw_up, 0, 0x872410b5, PCIE_TYPE_SWITCH_UPPORT, 0);
+	sw_dn = sim_add(sw_up, 0, 0x872410b5, PCIE_TYPE_SWITCH_DNPORT, 0);
+	ep = sim_add(sw_dn, 0, 0x16a414e4, PCIE_TYPE_ENDPOINT, 300);
+	sim_set_multifunction(ep);
+	sim_add(sw_dn, 3, 0x16a414e4, PCIE_TYPE_ENDPOINT, 0);
+	sw_dn = sim_add(sw_up, 1 << 3, 0x872410b5, PCIE_TYPE_SWITCH_DNPORT, 0);
+	sim_add(sw_dn, 0, 0xdeadbeef, PCIE_TYPE_ENDPOINT, 2 * PCI_CRS_TIMEOUT_MS);
+
+	/* Multifunction device 31, its last function is devfn 0xff */
+	ep = sim_add(up, 31 << 3, 0x16a414e4, PCIE_TYPE_ENDPOINT, 0);
+	sim_set_multifunction(ep);
+	sim_add(up, 31 << 3 | 7, 0x16a414e4, PCIE_TYPE_ENDPOINT, 0);
+
+	ms = scan();
+	assert(ms < SWITCHES * (CRS_MS + SWITCH_PORTS * 2 * PCI_CRS_RETRY_MS) +
+	       PCI_CRS_TIMEOUT_MS + 2 * PCI_CRS_RETRY_MS);
+
+	test_rescan();
+	test_cfg_shadow();
+
+	return 0;
+}
@@ -17,15 +17,23 @@
 /* Test for our PEL record generation. Currently this doesn't actually
  * test that the records we generate are correct, but it at least lets
  * us run valgrind over the generation routines to check for buffer
- * overflows, etc.
+ * overflows, etc. The errorlog record allocator is exercised as well,
+ * from several threads at once, and so are the commit time dedup and
+ * rate limiting.
  */
 
+#define __TEST__
 #include <skiboot.h>
 #include <inttypes.h>
 #include <assert.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <pel.h>
 #include <errorlog.h>
 
+#define zalloc(bytes)	calloc((bytes), 1)
+#define ilog2(val)	(63 - __builtin_clzl(val))
+
 #define TEST_ERROR 0x1234
 #define TEST_SUBSYS 0x5678
 
@@ -33,7 +41,33 @@ DEFINE_LOG_ENTRY(TEST_ERROR, OPAL_PLATFORM_ERR_EVT, TEST_SUBSYS,
 			OPAL_PLATFORM_FIRMWARE, OPAL_INFO,
 			OPAL_NA, NULL);
 
+static uint64_t stamp;
+#define mftb()	(stamp)
+
 #include "../pel.c"
+#include "../errorlog.c"
+
+struct platform platform;
+
+void lock(struct lock *l __unused)
+{
+}
+
+void unlock(struct lock *l __unused)
+{
+}
+
+void init_timer(struct timer *t, timer_func_t expiry, void *data)
+{
+	t->expiry = expiry;
+	t->user_data = data;
+	t->target = 0;
+}
+
+void schedule_timer_at(struct timer *t, uint64_t when)
+{
+	t->target = when;
+}
 
 struct dt_node *dt_root = NULL;
 char dt_prop[] = "DUMMY DT PROP";
@@ -51,7 +85,32 @@ int rtc_cache_get_datetime(uint32_t *year_month_day,
 	return 0;
 }
 
-int main(void)
+/* Any window of the stream matches the PEL built in one go */
+static void test_pel_stream(struct errorlog *elog, char *pel, size_t size)
+{
+	struct pel_stream ps;
+	char *buf = malloc(size + 1);
+	size_t chunk, off, len;
+
+	assert(buf);
+	pel_stream_init(&ps, elog);
+	assert(ps.size == size);
+
+	for (chunk = 1; chunk <= size; chunk += 7) {
+		memset(buf, 0xa5, size + 1);
+		for (off = 0; off < size; off += len) {
+			len = pel_stream_read(&ps, off, buf + off, chunk);
+			assert(len == (chunk < size - off ? chunk : size - off));
+		}
+		assert(!memcmp(buf, pel, size));
+		assert(buf[size] == (char)0xa5);
+	}
+	assert(pel_stream_read(&ps, size, buf, 1) == 0);
+	assert(pel_stream_read(&ps, size - 1, buf, 4) == 1);
+	free(buf);
+}
+
+static void test_pel(void)
 {
 	char *pel_buf;
 	size_t size;
@@ -111,8 +170,305 @@ int main(void)
 
 	assert(size == create_pel_log(elog, pel_buf, size));
 
+	test_pel_stream(elog, pel_buf, size);
+
 	free(pel_buf);
 	free(elog);
+}
+
+static struct opal_err_info err_info = {
+	.reason_code = TEST_ERROR,
+	.cmp_id = TEST_SUBSYS,
+	.sev = OPAL_INFO,
+};
+static struct opal_err_info err_unrecoverable = {
+	.reason_code = TEST_ERROR,
+	.cmp_id = TEST_SUBSYS,
+	.sev = OPAL_UNRECOVERABLE_ERR_GENERAL,
+};
+static struct opal_err_info err_panic = {
+	.reason_code = TEST_ERROR,
+	.cmp_id = TEST_SUBSYS,
+	.sev = OPAL_ERROR_PANIC,
+};
+
+static struct opal_err_info *err_sevs[] = {
+	&err_info, &err_unrecoverable, &err_panic,
+};
+
+/* Less severe errors can't take the records kept for the others */
+static void test_reservations(void)
+{
+	struct errorlog *bufs[ELOG_WRITE_MAX_RECORD + 1];
+	int n = 0, i;
+
+	while ((bufs[n] = opal_elog_create(&err_info)) != NULL)
+		n++;
+	assert(n == ELOG_WRITE_MAX_RECORD - ELOG_RESERVED_PANIC -
+	       ELOG_RESERVED_UNRECOVERABLE);
+	while ((bufs[n] = opal_elog_create(&err_unrecoverable)) != NULL)
+		n++;
+	assert(n == ELOG_WRITE_MAX_RECORD - ELOG_RESERVED_PANIC);
+	while ((bufs[n] = opal_elog_create(&err_panic)) != NULL)
+		n++;
+	assert(n == ELOG_WRITE_MAX_RECORD);
+
+	/* Each record once, with consecutive PLIDs */
+	for (i = 1; i < n; i++) {
+		assert(bufs[i] != bufs[0]);
+		assert(bufs[i]->plid == bufs[0]->plid + i);
+	}
+
+	for (i = 0; i < n; i++)
+		opal_elog_complete(bufs[i], true);
+	assert(elog_free_count == ELOG_WRITE_MAX_RECORD);
+	assert(elog_free_map == ~0ull);
+}
+
+#define STRESS_THREADS	8
+#define STRESS_LOOPS	100000
+#define STRESS_BURST	10	/* Held at once, enough to run out */
+
+static uint32_t stress_first_plid;
+static uint8_t stress_plids[STRESS_THREADS * STRESS_LOOPS];
+static unsigned int stress_created, stress_failed;
+static pthread_barrier_t stress_start;
+
+static unsigned int stress_flush(struct errorlog **bufs, unsigned int n,
+				 unsigned long id)
+{
+	/* Nobody else wrote over our records */
+	while (n--) {
+		assert(bufs[n]->additional_info[0] == id);
+		opal_elog_complete(bufs[n], true);
+	}
+	return 0;
+}
+
+static void *stress(void *arg)
+{
+	unsigned long id = (unsigned long)arg;
+	struct errorlog *bufs[STRESS_BURST], *buf;
+	struct opal_err_info *e_info;
+	unsigned int i, j, n = 0;
+	uint32_t data[16];
+
+	pthread_barrier_wait(&stress_start);
+	for (i = 0; i < STRESS_LOOPS; i++) {
+		if (n == STRESS_BURST)
+			n = stress_flush(bufs, n, id);
+
+		e_info = err_sevs[(i + id) % ARRAY_SIZE(err_sevs)];
+		buf = opal_elog_create(e_info);
+		if (!buf) {
+			__sync_fetch_and_add(&stress_failed, 1);
+			continue;
+		}
+		__sync_fetch_and_add(&stress_created, 1);
+		bufs[n++] = buf;
+
+		/* A fresh record, whatever the previous user left */
+		assert(buf->event_severity == e_info->sev);
+		assert(!buf->user_section_count && !buf->user_section_size);
+		assert(!buf->additional_info[0] && !buf->log_size);
+		for (j = 0; j < 64; j++)
+			assert(!buf->user_data_dump[j]);
+
+		/* PLIDs are never handed out twice */
+		assert(buf->plid > stress_first_plid);
+		assert(!__sync_lock_test_and_set(
+			&stress_plids[buf->plid - stress_first_plid - 1], 1));
+
+		for (j = 0; j < ARRAY_SIZE(data); j++)
+			data[j] = id << 24 | i;
+		buf->additional_info[0] = id;
+		buf->log_size = i;
+		assert(!opal_elog_update_user_dump(buf, (void *)data, id,
+						   sizeof(data)));
+		assert(!memcmp(((struct elog_user_data_section *)
+				buf->user_data_dump)->data_dump, data,
+			       sizeof(data)));
+	}
+
+	stress_flush(bufs, n, id);
+	return NULL;
+}
+
+/* Many threads creating and completing records at once */
+static void test_stress(void)
+{
+	pthread_t threads[STRESS_THREADS];
+	unsigned long i;
+
+	stress_first_plid = sapphire_elog_id;
+	pthread_barrier_init(&stress_start, NULL, STRESS_THREADS);
+	for (i = 0; i < STRESS_THREADS; i++)
+		assert(!pthread_create(&threads[i], NULL, stress, (void *)i));
+	for (i = 0; i < STRESS_THREADS; i++)
+		pthread_join(threads[i], NULL);
+	pthread_barrier_destroy(&stress_start);
+
+	assert(elog_free_count == ELOG_WRITE_MAX_RECORD);
+	assert(elog_free_map == ~0ull);
+	assert(sapphire_elog_id - stress_first_plid == stress_created);
+	for (i = 0; i < stress_created; i++)
+		assert(stress_plids[i]);
+	assert(stress_created + stress_failed == STRESS_THREADS * STRESS_LOOPS);
+	printf("%u records created by %d threads, %u out of records\n",
+	       stress_created, STRESS_THREADS, stress_failed);
+}
+
+/* What the platform was given to log */
+static struct {
+	uint32_t plid;
+	uint16_t component_id;
+	uint32_t info[3];
+} committed[64];
+static unsigned int nr_committed;
+
+static int test_commit(struct errorlog *buf)
+{
+	assert(nr_committed < ARRAY_SIZE(committed));
+	committed[nr_committed].plid = buf->plid;
+	committed[nr_committed].component_id = buf->component_id;
+	memcpy(committed[nr_committed].info, buf->additional_info,
+	       sizeof(committed[0].info));
+	nr_committed++;
+	opal_elog_complete(buf, true);
+	return 0;
+}
+
+/* Run the dedup timer as the timer core would */
+static void run_dedup_timer(void)
+{
+	assert(elog_dedup_timer.target);
+	if (tb_compare(stamp, elog_dedup_timer.target) == TB_ABEFOREB)
+		stamp = elog_dedup_timer.target;
+	elog_dedup_timer.target = 0;
+	elog_dedup_timer.expiry(&elog_dedup_timer, NULL);
+}
+
+static void read_stats(struct opal_elog_stats *stats)
+{
+	assert(opal_elog_stats(stats, OPAL_ELOG_STATS_RESET) == OPAL_SUCCESS);
+}
+
+static struct opal_err_info err_comp[ELOG_DEDUP_ENTRIES + 1];
+
+static void test_dedup(void)
+{
+	struct opal_elog_stats stats;
+	uint32_t plid;
+	unsigned int i, n;
+
+	platform.elog_commit = test_commit;
+	stamp = secs_to_tb(1000);
+
+	/* Repeats within the window are only counted */
+	for (i = 0; i < 5; i++) {
+		log_simple_error(&err_info, "Link flapped\n");
+		stamp += secs_to_tb(1);
+	}
+	log_simple_error(&err_info, "Link down\n");
+	assert(nr_committed == 2);
+	plid = committed[0].plid;
+
+	/* Once it closes, one more log reports them */
+	run_dedup_timer();
+	assert(nr_committed == 3);
+	assert(committed[2].plid > committed[1].plid);
+	assert(committed[2].component_id == TEST_SUBSYS);
+	assert(committed[2].info[0] == plid && committed[2].info[1] == 4);
+	assert(committed[2].info[2] == 4000);
+
+	/* Nothing to report for the other one */
+	run_dedup_timer();
+	assert(nr_committed == 3 && !elog_dedup_timer.target);
+
+	/* Then the same log goes through again, panics always do */
+	log_simple_error(&err_info, "Link flapped\n");
+	log_simple_error(&err_panic, "Panic\n");
+	log_simple_error(&err_panic, "Panic\n");
+	assert(nr_committed == 6);
+
+	/* A window that's evicted still reports its repeats */
+	for (i = 0; i < ARRAY_SIZE(err_comp); i++) {
+		err_comp[i].reason_code = TEST_ERROR;
+		err_comp[i].cmp_id = 0x100 + i;
+		err_comp[i].sev = OPAL_INFO;
+		stamp++;
+		log_simple_error(&err_comp[i], "Sensor failed\n");
+		log_simple_error(&err_comp[i], "Sensor failed\n");
+	}
+	n = nr_committed - 6;
+	assert(n == ARRAY_SIZE(err_comp) + 1);
+	assert(committed[nr_committed - 2].info[0] == committed[6].plid);
+	assert(committed[nr_committed - 2].info[1] == 1);
+	assert(committed[nr_committed - 1].component_id ==
+	       0x100 + ELOG_DEDUP_ENTRIES);
+
+	/* The rest are reported when their windows close */
+	stamp += secs_to_tb(ELOG_DEDUP_WINDOW_SECS);
+	run_dedup_timer();
+	assert(nr_committed - 6 == n + ELOG_DEDUP_ENTRIES);
+
+	read_stats(&stats);
+	assert(be64_to_cpu(stats.committed) == 5 + ARRAY_SIZE(err_comp));
+	assert(be64_to_cpu(stats.duplicates) == 4 + ARRAY_SIZE(err_comp));
+	assert(be64_to_cpu(stats.summaries) == 1 + ARRAY_SIZE(err_comp));
+	assert(!stats.rate_limited && !stats.no_buffer);
+	read_stats(&stats);
+	assert(!stats.committed && !stats.duplicates && !stats.summaries);
+	assert(opal_elog_stats(NULL, 0x2) == OPAL_PARAMETER);
+
+	assert(elog_free_count == ELOG_WRITE_MAX_RECORD);
+	nr_committed = 0;
+}
+
+static void test_rate_limit(void)
+{
+	struct opal_elog_stats stats;
+	unsigned int i;
+
+	/* A component gets a burst of logs */
+	for (i = 0; i < ELOG_RATE_BURST + 2; i++)
+		log_simple_error(&err_info, "Sensor %u failed\n", i);
+	assert(nr_committed == ELOG_RATE_BURST);
+
+	/* Other components, and unrecoverable errors, aren't limited */
+	log_simple_error(&err_comp[0], "Sensor failed\n");
+	log_simple_error(&err_unrecoverable, "Sensor broke\n");
+	assert(nr_committed == ELOG_RATE_BURST + 2);
+
+	/* Then one per interval */
+	stamp += secs_to_tb(ELOG_RATE_INTERVAL_SECS);
+	log_simple_error(&err_info, "Sensor 100 failed\n");
+	log_simple_error(&err_info, "Sensor 101 failed\n");
+	assert(nr_committed == ELOG_RATE_BURST + 3);
+
+	/* And the full burst once it had time to refill */
+	stamp += secs_to_tb(ELOG_RATE_INTERVAL_SECS * ELOG_RATE_BURST * 2);
+	for (i = 0; i < ELOG_RATE_BURST + 1; i++)
+		log_simple_error(&err_info, "Sensor %u failed\n", 200 + i);
+	assert(nr_committed == 2 * ELOG_RATE_BURST + 3);
+
+	read_stats(&stats);
+	assert(be64_to_cpu(stats.committed) == 2 * ELOG_RATE_BURST + 3);
+	assert(be64_to_cpu(stats.rate_limited) == 4);
+	assert(!stats.duplicates && !stats.summaries);
+	assert(elog_free_count == ELOG_WRITE_MAX_RECORD);
+}
+
+int main(void)
+{
+	test_pel();
+
+	assert(elog_init() == 0);
+	test_reservations();
+	test_stress();
+	test_dedup();
+	test_rate_limit();
+	free(elog_records);
 
 	return 0;
 }
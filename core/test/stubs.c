@@ -54,3 +54,54 @@ STUB(dt_next);
 STUB(dt_has_node_property);
 STUB(dt_get_address);
 STUB(add_chip_dev_associativity);
+STUB(dt_new);
+STUB(dt_free);
+STUB(dt_add_property);
+STUB(dt_add_property_string);
+STUB(__dt_add_property_cells);
+STUB(dt_prop_get_def);
+STUB(dt_prop_get_u32_def);
+STUB(lock);
+STUB(unlock);
+STUB(first_available_cpu);
+STUB(next_available_cpu);
+STUB(__cpu_queue_job);
+STUB(cpu_wait_job);
+STUB(init_timer);
+STUB(schedule_timer);
+STUB(opal_run_pollers);
+STUB(time_wait_ms_nopoll);
+STUB(time_wait);
+STUB(time_wait_ms);
+STUB(__dt_add_property_strings);
+STUB(dt_find_by_path);
+STUB(dt_find_compatible_node);
+STUB(dt_find_property);
+STUB(dt_get_chip_id);
+STUB(dt_get_path);
+STUB(dt_new_addr);
+STUB(dt_prop_get);
+STUB(dt_prop_get_def_size);
+STUB(dt_prop_get_u32);
+STUB(dt_require_property);
+STUB(__local_alloc);
+STUB(xscom_read);
+STUB(xscom_write);
+STUB(get_ics_phandle);
+STUB(register_irq_source);
+STUB(opal_update_pending_evt);
+STUB(fsp_present);
+STUB(fsp_fetch_data);
+STUB(fsp_adjust_lid_side);
+STUB(vpd_iohub_load);
+STUB(pci_register_phb);
+STUB(pci_device_init);
+STUB(pci_find_dev);
+STUB(pci_find_cap);
+STUB(pci_find_ecap);
+STUB(pci_restore_bridge_buses);
+STUB(pci_rescan_slot);
+STUB(pci_rescan_abort);
+STUB(pci_cfg_shadow_read);
+STUB(pci_cfg_shadow_write);
+STUB(pci_cfg_shadow_flush);
@@ -19,6 +19,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
 #include <stdbool.h>
@@ -150,14 +151,113 @@ static void dump_uart(struct trace_uart *t)
 	}
 }
 
+/* The skiboot image, to find prlog() format strings in */
+static char *image;
+static size_t image_len;
+
+static void load_image(const char *name)
+{
+	struct stat st;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0)
+		err(1, "Opening %s", name);
+	image_len = st.st_size;
+	image = malloc(image_len + 1);
+	if (!image || read(fd, image, image_len) != image_len)
+		err(1, "Reading %s", name);
+	image[image_len] = 0;
+	close(fd);
+}
+
+/* Same conversions as the firmware side accepts, one at a time */
+static void format_prlog(const char *fmt, const u64 *args, unsigned int nargs)
+{
+	unsigned int n = 0, longs;
+	const char *p, *spec;
+	char sub[32];
+
+	for (p = fmt; *p; p++) {
+		if (*p != '%') {
+			if (*p != '\n')
+				putchar(*p);
+			continue;
+		}
+		spec = p++;
+		while (*p && strchr("-+ #0123456789.", *p))
+			p++;
+		for (longs = 0; *p && strchr("hlzjt", *p); p++)
+			if (*p != 'h')
+				longs++;
+		if (*p == '%') {
+			putchar('%');
+			continue;
+		}
+		if (!*p || n == nargs || p - spec + 2 > sizeof(sub)) {
+			printf("<bad format>");
+			return;
+		}
+
+		/* Rebuild the spec with a fixed 64-bit length modifier */
+		memcpy(sub, spec, p - spec);
+		sub[p - spec] = 0;
+		while (strchr("hlzjt", sub[strlen(sub) - 1]))
+			sub[strlen(sub) - 1] = 0;
+		if (*p == 'p' || *p == 'c')
+			strncat(sub, p, 1);
+		else {
+			strcat(sub, "ll");
+			strncat(sub, p, 1);
+		}
+
+		if (*p == 'p')
+			printf(sub, (void *)(uintptr_t)args[n]);
+		else if (*p == 'c')
+			printf(sub, (int)args[n]);
+		else if (longs || !strchr("di", *p))
+			printf(sub, longs ? args[n] : (u64)(u32)args[n]);
+		else
+			printf(sub, (long long)(int)args[n]);
+		n++;
+	}
+}
+
+static void dump_prlog(struct trace_prlog *t)
+{
+	unsigned int i, n = t->nargs;
+	u32 fmt = be32_to_cpu(t->fmt);
+	u64 args[TRACE_PRLOG_MAX_ARGS];
+
+	if (n > TRACE_PRLOG_MAX_ARGS)
+		n = TRACE_PRLOG_MAX_ARGS;
+	for (i = 0; i < n; i++)
+		args[i] = be64_to_cpu(t->args[i]);
+
+	printf("PRLOG %u: ", t->level);
+	if (image && fmt < image_len)
+		format_prlog(image + fmt, args, n);
+	else {
+		printf("fmt@0x%x", fmt);
+		for (i = 0; i < n; i++)
+			printf(" 0x%"PRIx64, args[i]);
+	}
+	printf("\n");
+}
+
 int main(int argc, char *argv[])
 {
 	int fd, len = 0;
 	union trace t;
 	const char *in = "/sys/kernel/debug/powerpc/opal-trace";
 
+	if (argc > 2 && !strcmp(argv[1], "-s")) {
+		load_image(argv[2]);
+		argv += 2;
+		argc -= 2;
+	}
 	if (argc > 2)
-		errx(1, "Usage: dump_trace [file]");
+		errx(1, "Usage: dump_trace [-s skiboot.lid] [file]");
 
 	if (argv[1])
 		in = argv[1];
@@ -188,6 +288,9 @@ int main(int argc, char *argv[])
 		case TRACE_UART:
 			dump_uart(&t.uart);
 			break;
+		case TRACE_PRLOG:
+			dump_prlog(&t.prlog);
+			break;
 		default:
 			printf("UNKNOWN(%u) CPU %u length %u\n",
 			       t.hdr.type, be16_to_cpu(t.hdr.cpu),
@@ -55,36 +55,70 @@
 #define POLL_TIMEOUT 10000
 
 /*
- * Maximum number of outstanding messages to allow in the queue.
+ * Maximum number of messages the OS may have queued at once. Further
+ * OPAL_IPMI_SEND calls get OPAL_BUSY until some complete. Firmware
+ * generated messages are never rejected or dropped.
  */
 #define BT_MAX_QUEUE_LEN 5
 
 /*
- * How long (in TB ticks) before a message is timed out.
+ * Upper bound on the number of requests we keep outstanding at the
+ * BMC, whatever it advertises. Must be well below the 256 sequence
+ * numbers available.
+ */
+#define BT_MAX_OUTSTANDING 8
+
+/*
+ * How long (in TB ticks) before a message is timed out, unless the
+ * BMC advertises a longer request-to-response time.
  */
 #define BT_MSG_TIMEOUT (secs_to_tb(3))
 
+/* Print the statistics every that many completed messages */
+#define BT_STATS_INTERVAL 256
+
 #define BT_QUEUE_DEBUG 0
 
 enum bt_states {
 	BT_STATE_IDLE = 0,
-	BT_STATE_RESP_WAIT,
 	BT_STATE_B_BUSY,
 };
 
 const char *state_str[] = {
 	"BT_STATE_IDLE",
-	"BT_STATE_RESP_WAIT",
 	"BT_STATE_B_BUSY",
 };
 
 struct bt_msg {
 	struct list_node link;
-	unsigned long tb;
+	unsigned long tb;		/* When sent, 0 if not sent yet */
+	unsigned long queued_tb;
 	uint8_t seq;
 	struct ipmi_msg ipmi_msg;
 };
 
+/* As returned by Get BT Interface Capabilities */
+struct bt_caps {
+	uint8_t num_requests;
+	uint16_t input_buf_size;
+	uint16_t output_buf_size;
+	uint8_t msg_timeout;		/* seconds */
+	uint8_t max_retries;
+};
+
+struct bt_stats {
+	unsigned long sent;
+	unsigned long completed;
+	unsigned long timeouts;
+	unsigned long rejected;
+	unsigned long unmatched;
+	unsigned int max_queue_len;
+	unsigned int max_inflight;
+	unsigned long lat_min;
+	unsigned long lat_max;
+	unsigned long lat_total;
+};
+
 struct bt {
 	uint32_t base_addr;
 	enum bt_states state;
@@ -94,6 +128,11 @@ struct bt {
 	struct timer poller;
 	bool irq_ok;
 	int queue_len;
+	int host_queue_len;
+	int inflight;
+	unsigned long msg_timeout;
+	struct bt_caps caps;
+	struct bt_stats stats;
 };
 static struct bt bt;
 
@@ -128,12 +167,43 @@ static inline void bt_set_state(enum bt_states next_state)
 	bt.state = next_state;
 }
 
-static void bt_msg_del(struct bt_msg *bt_msg)
+/* Must be called with msgq_lock held */
+static void bt_msg_unlink(struct bt_msg *bt_msg)
 {
 	list_del(&bt_msg->link);
 	bt.queue_len--;
-	ipmi_cmd_done(bt_msg->ipmi_msg.cmd, bt_msg->ipmi_msg.netfn + 1,
-		      IPMI_TIMEOUT_ERR, &bt_msg->ipmi_msg);
+	if (bt_msg->ipmi_msg.host_req)
+		bt.host_queue_len--;
+	if (bt_msg->tb)
+		bt.inflight--;
+}
+
+static void bt_print_stats(void)
+{
+	struct bt_stats *s = &bt.stats;
+
+	prlog(PR_DEBUG, "BT: sent %lu done %lu timeouts %lu busy %lu"
+	      " unmatched %lu max queue %u max inflight %u\n",
+	      s->sent, s->completed, s->timeouts, s->rejected, s->unmatched,
+	      s->max_queue_len, s->max_inflight);
+	if (s->completed)
+		prlog(PR_DEBUG, "BT: latency min %lu avg %lu max %lu us\n",
+		      tb_to_usecs(s->lat_min),
+		      tb_to_usecs(s->lat_total / s->completed),
+		      tb_to_usecs(s->lat_max));
+}
+
+static void bt_account_latency(struct bt_msg *bt_msg)
+{
+	struct bt_stats *s = &bt.stats;
+	unsigned long lat = mftb() - bt_msg->queued_tb;
+
+	if (!s->completed || lat < s->lat_min)
+		s->lat_min = lat;
+	if (lat > s->lat_max)
+		s->lat_max = lat;
+	s->lat_total += lat;
+	s->completed++;
 }
 
 static void bt_init_interface(void)
@@ -153,27 +223,44 @@ static void bt_reset_interface(void)
 	bt_init_interface();
 }
 
+/*
+ * Send the first message that hasn't been sent yet, provided the BMC
+ * has consumed the previous one and can take one more outstanding
+ * request. Returns false if a message was sent.
+ */
 static bool bt_try_send_msg(void)
 {
 	int i;
-	struct bt_msg *bt_msg;
+	struct bt_msg *bt_msg, *pos;
 	struct ipmi_msg *ipmi_msg;
 
 	lock(&bt.msgq_lock);
-	bt_msg = list_top(&bt.msgq, struct bt_msg, link);
-	if (!bt_msg) {
+	if (bt.inflight >= bt.caps.num_requests) {
 		unlock(&bt.msgq_lock);
 		return true;
 	}
 
-	ipmi_msg = &bt_msg->ipmi_msg;
+	bt_msg = NULL;
+	list_for_each(&bt.msgq, pos, link) {
+		if (!pos->tb) {
+			bt_msg = pos;
+			break;
+		}
+	}
+	if (!bt_msg) {
+		unlock(&bt.msgq_lock);
+		return true;
+	}
 
+	/* Wait for the BMC to pick up the previous request */
 	if (!bt_idle()) {
-		prerror("BT: Interface in an unexpected state, attempting reset\n");
-		bt_reset_interface();
+		bt_set_state(BT_STATE_B_BUSY);
 		unlock(&bt.msgq_lock);
-		return false;
+		return true;
 	}
+	bt_set_state(BT_STATE_IDLE);
+
+	ipmi_msg = &bt_msg->ipmi_msg;
 
 	/* Send the message */
 	bt_outb(BT_CTRL_CLR_WR_PTR, BT_CTRL);
@@ -196,10 +283,15 @@ static bool bt_try_send_msg(void)
 
 	bt_msg->tb = mftb();
 	bt_outb(BT_CTRL_H2B_ATN, BT_CTRL);
-	bt_set_state(BT_STATE_RESP_WAIT);
+	bt_set_state(BT_STATE_B_BUSY);
+
+	bt.inflight++;
+	bt.stats.sent++;
+	if (bt.inflight > bt.stats.max_inflight)
+		bt.stats.max_inflight = bt.inflight;
 	unlock(&bt.msgq_lock);
 
-	return true;
+	return false;
 }
 
 static void bt_flush_msg(void)
@@ -208,10 +300,15 @@ static void bt_flush_msg(void)
 	bt_set_h_busy(false);
 }
 
+/*
+ * Read a response if the BMC has one for us and match it against the
+ * outstanding requests by sequence number. Returns false if a response
+ * was processed.
+ */
 static bool bt_get_resp(void)
 {
 	int i;
-	struct bt_msg *bt_msg;
+	struct bt_msg *bt_msg, *pos;
 	struct ipmi_msg *ipmi_msg;
 	uint8_t resp_len, netfn, seq, cmd;
 	uint8_t cc = IPMI_CC_NO_ERROR;
@@ -246,18 +343,19 @@ static bool bt_get_resp(void)
 	/* Byte 5 - Completion Code */
 	cc = bt_inb(BT_HOST2BMC);
 
-	/* Find the corresponding messasge */
-	list_for_each(&bt.msgq, bt_msg, link) {
-		if (bt_msg->seq == seq) {
+	/* Find the corresponding outstanding message */
+	bt_msg = NULL;
+	list_for_each(&bt.msgq, pos, link) {
+		if (pos->tb && pos->seq == seq) {
+			bt_msg = pos;
 			break;
 		}
-
 	}
-	if (!bt_msg || (bt_msg->seq != seq)) {
+	if (!bt_msg) {
 		/* A response to a message we no longer care about. */
 		prlog(PR_INFO, "BT: Nobody cared about a response to an BT/IPMI message\n");
 		bt_flush_msg();
-		bt_set_state(BT_STATE_B_BUSY);
+		bt.stats.unmatched++;
 		unlock(&bt.msgq_lock);
 		return false;
 	}
@@ -281,10 +379,10 @@ static bool bt_get_resp(void)
 		ipmi_msg->data[i] = bt_inb(BT_HOST2BMC);
 	bt_set_h_busy(false);
 
-	/* Make sure the other side is idle before we move to the idle state */
-	bt_set_state(BT_STATE_B_BUSY);
-	list_del(&bt_msg->link);
-	bt.queue_len--;
+	bt_msg_unlink(bt_msg);
+	bt_account_latency(bt_msg);
+	if (!(bt.stats.completed % BT_STATS_INTERVAL))
+		bt_print_stats();
 	unlock(&bt.msgq_lock);
 
 	/*
@@ -296,30 +394,40 @@ static bool bt_get_resp(void)
 
 	ipmi_cmd_done(cmd, netfn, cc, ipmi_msg);
 
-	/* Immediately send the next message */
+	/* Immediately look for the next response or send the next message */
 	return false;
 }
 
 static void bt_expire_old_msg(void)
 {
 	unsigned long tb;
-	struct bt_msg *bt_msg;
+	struct bt_msg *bt_msg, *next;
+	LIST_HEAD(expired);
 
 	lock(&bt.msgq_lock);
 	tb = mftb();
-	bt_msg = list_top(&bt.msgq, struct bt_msg, link);
+	list_for_each_safe(&bt.msgq, bt_msg, next, link) {
+		if (!bt_msg->tb || (bt_msg->tb + bt.msg_timeout) >= tb)
+			continue;
 
-	if (bt_msg && bt_msg->tb > 0 && (bt_msg->tb + BT_MSG_TIMEOUT) < tb) {
 		prerror("BT: Expiring old messsage number 0x%02x\n", bt_msg->seq);
-		bt_msg_del(bt_msg);
-
-		/* Timing out a message is inherently racy as the BMC
-		   may start writing just as we decide to kill the
-		   message. Hopefully resetting the interface is
-		   sufficient to guard against such things. */
-		   bt_reset_interface();
+		bt.stats.timeouts++;
+		bt_msg_unlink(bt_msg);
+		list_add_tail(&expired, &bt_msg->link);
 	}
+
+	/* Timing out a message is inherently racy as the BMC
+	   may start writing just as we decide to kill the
+	   message. Hopefully resetting the interface is
+	   sufficient to guard against such things. */
+	if (!list_empty(&expired))
+		bt_reset_interface();
 	unlock(&bt.msgq_lock);
+
+	/* The completion may queue new messages, don't hold the lock */
+	while ((bt_msg = list_pop(&expired, struct bt_msg, link)))
+		ipmi_cmd_done(bt_msg->ipmi_msg.cmd, bt_msg->ipmi_msg.netfn + 1,
+			      IPMI_TIMEOUT_ERR, &bt_msg->ipmi_msg);
 }
 
 static void bt_poll(struct timer *t __unused, void *data __unused)
@@ -336,7 +444,8 @@ static void bt_poll(struct timer *t __unused, void *data __unused)
 			printed = false;
 			prlog(PR_DEBUG, "-------- BT Msg Queue --------\n");
 			list_for_each(&bt.msgq, msg, link) {
-				prlog(PR_DEBUG, "Seq: 0x%02x Cmd: 0x%02x\n", msg->seq, msg->ipmi_msg.cmd);
+				prlog(PR_DEBUG, "Seq: 0x%02x Cmd: 0x%02x Sent: %d\n",
+				      msg->seq, msg->ipmi_msg.cmd, !!msg->tb);
 			}
 			prlog(PR_DEBUG, "-----------------------------\n");
 		} else if (!printed) {
@@ -350,69 +459,94 @@ static void bt_poll(struct timer *t __unused, void *data __unused)
 		if (try_lock(&bt.bt_lock)) {
 			bt_expire_old_msg();
 
-			switch(bt.state) {
-			case BT_STATE_IDLE:
+			/* Responses first, they free up room for more
+			 * outstanding requests */
+			ret = bt_get_resp();
+			if (ret)
 				ret = bt_try_send_msg();
-				break;
-
-			case BT_STATE_RESP_WAIT:
-				ret = bt_get_resp();
-				break;
-
-			case BT_STATE_B_BUSY:
-				if (bt_idle()) {
-					bt_set_state(BT_STATE_IDLE);
-					ret = false;
-				}
-				break;
-			}
 			unlock(&bt.bt_lock);
 		}
 	} while(!ret);
 
-	schedule_timer(&bt.poller,
-		       bt.irq_ok ? TIMER_POLL : msecs_to_tb(BT_DEFAULT_POLL_MS));
+	/* Without interrupts, poll faster while messages are queued */
+	if (bt.irq_ok)
+		schedule_timer(&bt.poller, TIMER_POLL);
+	else if (bt.queue_len)
+		schedule_timer(&bt.poller, usecs_to_tb(POLL_TIMEOUT));
+	else
+		schedule_timer(&bt.poller, msecs_to_tb(BT_DEFAULT_POLL_MS));
 }
 
-static void bt_add_msg(struct bt_msg *bt_msg)
+/*
+ * Add a message to the queue. Requests from the host go after any
+ * other unsent host request but ahead of firmware generated ones so
+ * the OS doesn't queue up behind sensor or SEL traffic.
+ */
+static int bt_add_msg(struct bt_msg *bt_msg, bool head)
 {
+	struct bt_msg *pos, *before = NULL;
+	bool host = bt_msg->ipmi_msg.host_req;
+
+	lock(&bt.msgq_lock);
+	if (host && bt.host_queue_len >= BT_MAX_QUEUE_LEN) {
+		bt.stats.rejected++;
+		unlock(&bt.msgq_lock);
+		return OPAL_BUSY;
+	}
+
 	bt_msg->tb = 0;
+	bt_msg->queued_tb = mftb();
 	bt_msg->seq = ipmi_seq++;
 	bt.queue_len++;
-	if (bt.queue_len > BT_MAX_QUEUE_LEN) {
-		/* Maximum ueue lenght exceeded - remove the oldest message
-		   from the queue. */
-		prerror("BT: Maximum queue length exceeded\n");
-		bt_msg = list_tail(&bt.msgq, struct bt_msg, link);
-		assert(bt_msg);
-		bt_msg_del(bt_msg);
+	if (host)
+		bt.host_queue_len++;
+	if (bt.queue_len > bt.stats.max_queue_len)
+		bt.stats.max_queue_len = bt.queue_len;
+
+	if (!head && !host) {
+		list_add_tail(&bt.msgq, &bt_msg->link);
+		goto out;
 	}
+
+	/* Find the first unsent message we should go in front of */
+	list_for_each(&bt.msgq, pos, link) {
+		if (pos->tb)
+			continue;
+		if (head || !pos->ipmi_msg.host_req) {
+			before = pos;
+			break;
+		}
+	}
+	if (before)
+		list_add_before(&bt.msgq, &bt_msg->link, &before->link);
+	else
+		list_add_tail(&bt.msgq, &bt_msg->link);
+out:
+	unlock(&bt.msgq_lock);
+
+	return 0;
 }
 
 static int bt_add_ipmi_msg_head(struct ipmi_msg *ipmi_msg)
 {
 	struct bt_msg *bt_msg = container_of(ipmi_msg, struct bt_msg, ipmi_msg);
+	int rc;
 
-	lock(&bt.msgq_lock);
-	bt_add_msg(bt_msg);
-	list_add(&bt.msgq, &bt_msg->link);
-	unlock(&bt.msgq_lock);
-
-	bt_poll(NULL, NULL);
-	return 0;
+	rc = bt_add_msg(bt_msg, true);
+	if (!rc)
+		bt_poll(NULL, NULL);
+	return rc;
 }
 
 static int bt_add_ipmi_msg(struct ipmi_msg *ipmi_msg)
 {
 	struct bt_msg *bt_msg = container_of(ipmi_msg, struct bt_msg, ipmi_msg);
+	int rc;
 
-	lock(&bt.msgq_lock);
-	bt_add_msg(bt_msg);
-	list_add_tail(&bt.msgq, &bt_msg->link);
-	unlock(&bt.msgq_lock);
-
-	bt_poll(NULL, NULL);
-	return 0;
+	rc = bt_add_msg(bt_msg, false);
+	if (!rc)
+		bt_poll(NULL, NULL);
+	return rc;
 }
 
 void bt_irq(void)
@@ -472,8 +606,7 @@ static int bt_del_ipmi_msg(struct ipmi_msg *ipmi_msg)
 	struct bt_msg *bt_msg = container_of(ipmi_msg, struct bt_msg, ipmi_msg);
 
 	lock(&bt.msgq_lock);
-	list_del(&bt_msg->link);
-	bt.queue_len--;
+	bt_msg_unlink(bt_msg);
 	unlock(&bt.msgq_lock);
 	return 0;
 }
@@ -486,6 +619,46 @@ struct ipmi_backend bt_backend = {
 	.dequeue_msg = bt_del_ipmi_msg,
 };
 
+static void bt_get_caps_complete(struct ipmi_msg *msg)
+{
+	struct bt_caps *caps = &bt.caps;
+
+	if (msg->resp_size < 5) {
+		prerror("BT: Short Get BT Capabilities response\n");
+		goto out;
+	}
+
+	lock(&bt.msgq_lock);
+	caps->num_requests = MAX(1, MIN(msg->data[0], BT_MAX_OUTSTANDING));
+	caps->input_buf_size = msg->data[1] + 1;
+	caps->output_buf_size = msg->data[2] + 1;
+	caps->msg_timeout = msg->data[3];
+	caps->max_retries = msg->data[4];
+	if (secs_to_tb(caps->msg_timeout) > bt.msg_timeout)
+		bt.msg_timeout = secs_to_tb(caps->msg_timeout);
+	unlock(&bt.msgq_lock);
+
+	prlog(PR_INFO, "BT: %d outstanding request(s), buffers in %d out %d,"
+	      " timeout %ds\n", caps->num_requests, caps->input_buf_size,
+	      caps->output_buf_size, caps->msg_timeout);
+out:
+	ipmi_free_msg(msg);
+}
+
+/*
+ * Ask the BMC how many requests it can handle at once. Until we get
+ * an answer we only keep one request outstanding.
+ */
+static void bt_get_caps(void)
+{
+	struct ipmi_msg *msg;
+
+	msg = ipmi_mkmsg(IPMI_DEFAULT_INTERFACE, IPMI_GET_BT_CAPS,
+			 bt_get_caps_complete, NULL, NULL, 0, 5);
+	if (msg)
+		ipmi_queue_msg(msg);
+}
+
 void bt_init(void)
 {
 	struct dt_node *n;
@@ -520,10 +693,15 @@ void bt_init(void)
 	bt_set_state(BT_STATE_B_BUSY);
 	list_head_init(&bt.msgq);
 	bt.queue_len = 0;
+	bt.host_queue_len = 0;
+	bt.inflight = 0;
+	bt.caps.num_requests = 1;
+	bt.msg_timeout = BT_MSG_TIMEOUT;
 
 	printf("BT: Interface intialized, IO 0x%04x\n", bt.base_addr);
 
 	ipmi_register_backend(&bt_backend);
+	bt_get_caps();
 
 	/* We initially schedule the poller as a relatively fast timer, at
 	 * least until we have at least one interrupt occurring at which
@@ -202,10 +202,10 @@ static int fsp_con_port = -1;
 static bool fsp_con_full;
 
 /*
- * This is called by the code in console.c without the con_lock
- * held. However it can be called as the result of any printf
- * thus any other lock might be held including possibly the
- * FSP lock
+ * This is called by the code in console.c with the con_lock
+ * held. It can be called as the result of any printf thus any
+ * other lock might be held including possibly the FSP lock,
+ * that's fine as nothing waits on con_lock while holding those.
  */
 static size_t fsp_con_write(const char *buf, size_t len)
 {
@@ -50,8 +50,8 @@ static void *elog_write_to_fsp_buffer;
 #define ELOG_PANIC_WRITE_BUFFER_SIZE	0x0010000
 static void *elog_panic_write_buffer;
 
-#define ELOG_WRITE_TO_HOST_BUFFER_SIZE	0x0010000
-static void *elog_write_to_host_buffer;
+/* The PEL of the host log in flight, built into the host's buffer */
+static struct pel_stream elog_write_to_host_pel;
 
 static uint32_t elog_write_retries;
 
@@ -161,9 +161,8 @@ static void opal_commit_elog_in_host(void)
 			(elog_write_to_host_head_state == ELOG_STATE_NONE)) {
 		buf = list_top(&elog_write_to_host_pending,
 				struct errorlog, link);
-		buf->log_size = create_pel_log(buf,
-					       (char *)elog_write_to_host_buffer,
-					       ELOG_WRITE_TO_HOST_BUFFER_SIZE);
+		pel_stream_init(&elog_write_to_host_pel, buf);
+		buf->log_size = elog_write_to_host_pel.size;
 		elog_write_to_host_head_state = ELOG_STATE_FETCHED_DATA;
 		opal_update_pending_evt(OPAL_EVENT_ERROR_LOG_AVAIL,
 					OPAL_EVENT_ERROR_LOG_AVAIL);
@@ -193,8 +192,8 @@ bool opal_elog_read(uint64_t *buffer, uint64_t opal_elog_size,
 			return rc;
 		}
 
-		memcpy((void *)buffer, elog_write_to_host_buffer,
-							opal_elog_size);
+		pel_stream_read(&elog_write_to_host_pel, 0, buffer,
+				opal_elog_size);
 
 		list_del(&log_data->link);
 		list_add(&elog_write_to_host_processed, &log_data->link);
@@ -408,13 +407,6 @@ void fsp_elog_write_init(void)
 		return;
 	}
 
-	elog_write_to_host_buffer = memalign(TCE_PSIZE,
-					ELOG_WRITE_TO_HOST_BUFFER_SIZE);
-	if (!elog_write_to_host_buffer) {
-		prerror("FSP: could not allocate ELOG_WRITE_TO_HOST_BUFFER!\n");
-		return;
-	}
-
 	/* Map TCEs */
 	fsp_tce_map(PSI_DMA_ELOG_PANIC_WRITE_BUF, elog_panic_write_buffer,
 					PSI_DMA_ELOG_PANIC_WRITE_BUF_SZ);
@@ -422,9 +414,6 @@ void fsp_elog_write_init(void)
 	fsp_tce_map(PSI_DMA_ERRLOG_WRITE_BUF, elog_write_to_fsp_buffer,
 					PSI_DMA_ERRLOG_WRITE_BUF_SZ);
 
-	fsp_tce_map(PSI_DMA_ELOG_WR_TO_HOST_BUF, elog_write_to_host_buffer,
-					PSI_DMA_ELOG_WR_TO_HOST_BUF_SZ);
-
 	elog_init();
 
 	/* Add a poller */
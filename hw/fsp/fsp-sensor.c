@@ -27,6 +27,12 @@
  * expected as an argument for OPAL read call which has already been exported
  * to the device tree during fsp init. The sapphire code decodes this Id to
  * determine requested attribute and sensor.
+ *
+ * Each SPCN response carries the whole table for a modifier, so the tables
+ * are kept around (each one in its own part of the DMA buffer) and reads
+ * that come within FSP_SENSOR_CACHE_MS of the last fetch are answered
+ * synchronously from there. Reads of a stale table queue up behind a single
+ * fetch of it, and all complete when it does.
  */
 
 #include <skiboot.h>
@@ -36,6 +42,8 @@
 #include <spcn.h>
 #include <opal-api.h>
 #include <opal-msg.h>
+#include <timebase.h>
+#include <pool.h>
 #include<errorlog.h>
 
 #define INVALID_DATA	((uint32_t)-1)
@@ -94,15 +102,57 @@ enum spcn_attr {
 	SENSOR_MAX,
 };
 
+/* Last fetched entries of a modifier (and of its subsequent modifier) */
+struct sensor_table {
+	uint8_t		mod;		/* First modifier */
+	uint32_t	mod_index;
+	uint32_t	dma_offset;	/* Our part of the sensor buffer */
+	uint32_t	entry_count;
+	uint64_t	stamp;		/* When the fetch completed */
+	bool		valid;
+	bool		fetching;
+	uint32_t	fetch_index;	/* Modifier being fetched */
+	uint32_t	fetch_size;	/* Bytes received so far */
+	struct list_head waiters;	/* Reads waiting for the fetch */
+	struct list_head snapshots;	/* Snapshots waiting for it */
+};
+
 /* Parsed sensor attributes, passed through OPAL */
 struct opal_sensor_data {
+	struct list_node link;
 	uint64_t	async_token;	/* Asynchronous token */
 	uint32_t	*sensor_data;	/* Kernel pointer to copy data */
 	enum spcn_attr	spcn_attr;	/* Modifier attribute */
 	uint16_t	rid;		/* Sensor RID */
 	uint8_t		frc;		/* Sensor resource class */
-	uint32_t	mod_index;	/* Modifier index*/
-	uint32_t	offset;		/* Offset in sensor buffer */
+	struct sensor_table *table;
+};
+
+/* Sensors of a class, as returned by OPAL_SENSOR_SNAPSHOT */
+struct sensor_class {
+	enum spcn_attr	spcn_attr;
+	uint32_t	frcs;		/* Resource classes, one bit each */
+};
+
+static const struct sensor_class sensor_classes[] = {
+	[OPAL_SENSOR_CLASS_POWER]	= { SENSOR_POWER, 0 },
+	[OPAL_SENSOR_CLASS_TEMP]	= { SENSOR_DATA,
+					    1 << SENSOR_FRC_AMB_TEMP },
+	[OPAL_SENSOR_CLASS_FAN]		= { SENSOR_DATA,
+					    1 << SENSOR_FRC_COOLING_FAN },
+	[OPAL_SENSOR_CLASS_STATUS]	= { SENSOR_FAULTED,
+					    1 << SENSOR_FRC_POWER_SUPPLY |
+					    1 << SENSOR_FRC_COOLING_FAN },
+};
+
+struct sensor_snapshot {
+	struct list_node link;
+	uint64_t	async_token;
+	const struct sensor_class *class;
+	struct sensor_table *table;
+	struct opal_sensor_sample *samples;
+	__be32		*count;
+	uint32_t	max;
 };
 
 struct spcn_mod_attr {
@@ -177,15 +227,35 @@ static const char *frc_names[] = {
 		"io-backplane"
 };
 
+static struct sensor_table sensor_tables[] = {
+	{ .mod = SPCN_MOD_PRS_STATUS_FIRST },
+	{ .mod = SPCN_MOD_SENSOR_PARAM_FIRST },
+	{ .mod = SPCN_MOD_SENSOR_DATA_FIRST },
+	{ .mod = SPCN_MOD_SENSOR_POWER },
+};
+
+#define SENSOR_TABLE_SIZE	(PSI_DMA_SENSOR_BUF_SZ / ARRAY_SIZE(sensor_tables))
+
+#ifndef FSP_SENSOR_CACHE_MS
+#define FSP_SENSOR_CACHE_MS	1000
+#endif
+
+/* Reads and snapshots that can be waiting on fetches at once */
+#define SENSOR_MAX_READS	32
+#define SENSOR_MAX_SNAPSHOTS	8
+
 #define SENSOR_MAX_SIZE		0x00100000
 static void *sensor_buffer = NULL;
 static enum sensor_state sensor_state;
-static bool prev_msg_consumed = true;
-static struct lock sensor_lock;
+static struct lock sensor_lock = LOCK_UNLOCKED;
+static struct pool sensor_read_pool;
+static struct pool sensor_snapshot_pool;
+
+/* Cache statistics */
+static uint64_t sensor_hits, sensor_misses, sensor_fetches;
 
 /* Function prototypes */
-static int64_t fsp_sensor_send_read_request(struct opal_sensor_data *attr);
-static void queue_msg_for_delivery(int rc, struct opal_sensor_data *attr);
+static int64_t fsp_sensor_send_read_request(struct sensor_table *table);
 
 
 /*
@@ -229,23 +299,62 @@ static void queue_msg_for_delivery(int rc, struct opal_sensor_data *attr);
  * --------------------------------------------------------------------------
  */
 
-static void fsp_sensor_process_data(struct opal_sensor_data *attr)
+static uint32_t fsp_sensor_entry_value(uint16_t *sensor_mod_data,
+				       enum spcn_attr spcn_attr)
 {
-	uint8_t *sensor_buf_ptr = (uint8_t *)sensor_buffer;
+	uint32_t sensor_data = INVALID_DATA;
+
+	switch (spcn_attr) {
+	/* modifier 0x01, 0x02 */
+	case SENSOR_PRESENT:
+		prlog(PR_TRACE,"Not exported to device tree\n");
+		break;
+	case SENSOR_FAULTED:
+		sensor_data = sensor_mod_data[3] & 0x02;
+		break;
+	case SENSOR_AC_FAULTED:
+	case SENSOR_ON:
+	case SENSOR_ON_SUPPORTED:
+		prlog(PR_TRACE,"Not exported to device tree\n");
+		break;
+	/* modifier 0x10, 0x11 */
+	case SENSOR_THRS:
+		sensor_data = sensor_mod_data[6];
+		break;
+	case SENSOR_LOCATION:
+		prlog(PR_TRACE,"Not exported to device tree\n");
+		break;
+	/* modifier 0x12, 0x13 */
+	case SENSOR_DATA:
+		sensor_data = sensor_mod_data[2];
+		break;
+	default:
+		break;
+	}
+
+	return sensor_data;
+}
+
+/* Find the value of a sensor in the last fetch of its table */
+static uint32_t fsp_sensor_lookup(struct opal_sensor_data *attr)
+{
+	struct sensor_table *table = attr->table;
+	struct spcn_mod *mod = &spcn_mod_data[table->mod_index];
+	uint8_t *sensor_buf_ptr = (uint8_t *)sensor_buffer + table->dma_offset;
 	uint32_t sensor_data = INVALID_DATA;
 	uint16_t sensor_mod_data[8];
-	int count, i;
+	uint32_t count;
+	int i;
 	uint8_t valid, nr_power;
 	uint32_t power;
 
-	for (count = 0; count < spcn_mod_data[attr->mod_index].entry_count;
-			count++) {
+	for (count = 0; count < table->entry_count; count++) {
 		memcpy((void *)sensor_mod_data, sensor_buf_ptr,
-				spcn_mod_data[attr->mod_index].entry_size);
-		if (spcn_mod_data[attr->mod_index].mod == SPCN_MOD_PROC_JUNC_TEMP) {
+				mod->entry_size);
+		if (mod->mod == SPCN_MOD_PROC_JUNC_TEMP) {
 			/* TODO Support this modifier '0x14', if required */
 
-		} else if (spcn_mod_data[attr->mod_index].mod == SPCN_MOD_SENSOR_POWER) {
+		} else if (mod->mod == SPCN_MOD_SENSOR_POWER) {
 			valid = sensor_buf_ptr[0];
 			if (valid & 0x80) {
 				nr_power = valid & 0x0f;
@@ -261,45 +370,15 @@ static void fsp_sensor_process_data(struct opal_sensor_data *attr)
 			}
 		} else if (sensor_mod_data[0] == attr->frc &&
 				sensor_mod_data[1] == attr->rid) {
-			switch (attr->spcn_attr) {
-			/* modifier 0x01, 0x02 */
-			case SENSOR_PRESENT:
-				prlog(PR_TRACE,"Not exported to device tree\n");
-				break;
-			case SENSOR_FAULTED:
-				sensor_data = sensor_mod_data[3] & 0x02;
-				break;
-			case SENSOR_AC_FAULTED:
-			case SENSOR_ON:
-			case SENSOR_ON_SUPPORTED:
-				prlog(PR_TRACE,"Not exported to device tree\n");
-				break;
-			/* modifier 0x10, 0x11 */
-			case SENSOR_THRS:
-				sensor_data = sensor_mod_data[6];
-				break;
-			case SENSOR_LOCATION:
-				prlog(PR_TRACE,"Not exported to device tree\n");
-				break;
-			/* modifier 0x12, 0x13 */
-			case SENSOR_DATA:
-				sensor_data = sensor_mod_data[2];
-				break;
-			default:
-				break;
-			}
-
+			sensor_data = fsp_sensor_entry_value(sensor_mod_data,
+							     attr->spcn_attr);
 			break;
 		}
 
-		sensor_buf_ptr += spcn_mod_data[attr->mod_index].entry_size;
+		sensor_buf_ptr += mod->entry_size;
 	}
 
-	*(attr->sensor_data) = sensor_data;
-	if (sensor_data == INVALID_DATA)
-		queue_msg_for_delivery(OPAL_PARTIAL, attr);
-	else
-		queue_msg_for_delivery(OPAL_SUCCESS, attr);
+	return sensor_data;
 }
 
 static int fsp_sensor_process_read(struct fsp_msg *resp_msg)
@@ -339,105 +418,206 @@ static int fsp_sensor_process_read(struct fsp_msg *resp_msg)
 	return size;
 }
 
+static bool fsp_sensor_fresh(struct sensor_table *table)
+{
+	return table->valid && !table->fetching &&
+		tb_compare(mftb(), table->stamp +
+			   msecs_to_tb(FSP_SENSOR_CACHE_MS)) == TB_ABEFOREB;
+}
+
 static void queue_msg_for_delivery(int rc, struct opal_sensor_data *attr)
 {
 	prlog(PR_INSANE, "%s: rc:%d, data:%d\n",
 	      __func__, rc, *(attr->sensor_data));
 	opal_queue_msg(OPAL_MSG_ASYNC_COMP, NULL, NULL,
 			attr->async_token, rc);
-	spcn_mod_data[attr->mod_index].entry_count = 0;
-	free(attr);
-	prev_msg_consumed = true;
+	pool_free_object(&sensor_read_pool, attr);
+}
+
+/* The fetch of a table is over, answer everybody who waited for it */
+static void fsp_sensor_complete_reads(struct sensor_table *table, int rc)
+{
+	struct opal_sensor_data *attr;
+	uint32_t data;
+
+	while ((attr = list_pop(&table->waiters, struct opal_sensor_data,
+				link)) != NULL) {
+		if (rc == OPAL_SUCCESS) {
+			data = fsp_sensor_lookup(attr);
+			*(attr->sensor_data) = data;
+			queue_msg_for_delivery(data == INVALID_DATA ?
+					       OPAL_PARTIAL : OPAL_SUCCESS,
+					       attr);
+		} else {
+			*(attr->sensor_data) = INVALID_DATA;
+			queue_msg_for_delivery(rc, attr);
+		}
+	}
+}
+
+static void fsp_sensor_sample(struct sensor_snapshot *snap, uint32_t index,
+			      uint32_t id, uint32_t value)
+{
+	if (index >= snap->max)
+		return;
+	snap->samples[index].sensor_id = cpu_to_be32(id);
+	snap->samples[index].value = cpu_to_be32(value);
+}
+
+/* Copy out all the sensors of the class from the last fetch */
+static int64_t fsp_sensor_snapshot_fill(struct sensor_snapshot *snap)
+{
+	struct sensor_table *table = snap->table;
+	struct spcn_mod *mod = &spcn_mod_data[table->mod_index];
+	uint8_t *sensor_buf_ptr = (uint8_t *)sensor_buffer + table->dma_offset;
+	struct opal_sensor_data attr;
+	uint16_t sensor_mod_data[8];
+	uint32_t count, value, n = 0;
+	uint16_t frc;
+
+	if (snap->class->spcn_attr == SENSOR_POWER) {
+		/* The total of the power table, "power#1-data" */
+		memset(&attr, 0, sizeof(attr));
+		attr.spcn_attr = SENSOR_POWER;
+		attr.table = table;
+		value = fsp_sensor_lookup(&attr);
+		if (value != INVALID_DATA)
+			fsp_sensor_sample(snap, n++, SENSOR_POWER << 24, value);
+	} else {
+		for (count = 0; count < table->entry_count; count++) {
+			memcpy((void *)sensor_mod_data, sensor_buf_ptr,
+					mod->entry_size);
+			sensor_buf_ptr += mod->entry_size;
+
+			frc = sensor_mod_data[0];
+			if (frc >= 32 || !(snap->class->frcs & (1u << frc)))
+				continue;
+			value = fsp_sensor_entry_value(sensor_mod_data,
+						       snap->class->spcn_attr);
+			fsp_sensor_sample(snap, n++,
+					  snap->class->spcn_attr << 24 |
+					  (frc & 0xff) << 16 |
+					  sensor_mod_data[1], value);
+		}
+	}
+
+	*snap->count = cpu_to_be32(n);
+	return n > snap->max ? OPAL_PARTIAL : OPAL_SUCCESS;
+}
+
+static void fsp_sensor_complete_snapshots(struct sensor_table *table, int rc)
+{
+	struct sensor_snapshot *snap;
+	int64_t snap_rc;
+
+	while ((snap = list_pop(&table->snapshots, struct sensor_snapshot,
+				link)) != NULL) {
+		snap_rc = rc;
+		if (rc == OPAL_SUCCESS)
+			snap_rc = fsp_sensor_snapshot_fill(snap);
+		else
+			*snap->count = 0;
+		opal_queue_msg(OPAL_MSG_ASYNC_COMP, NULL, NULL,
+			       snap->async_token, snap_rc);
+		pool_free_object(&sensor_snapshot_pool, snap);
+	}
 }
 
 static void fsp_sensor_read_complete(struct fsp_msg *msg)
 {
-	struct opal_sensor_data *attr = msg->user_data;
+	struct sensor_table *table = msg->user_data;
+	struct spcn_mod *mod;
 	enum spcn_rsp_status status;
 	int rc, size;
 
 	prlog(PR_INSANE, "%s()\n", __func__);
 
+	lock(&sensor_lock);
 	status = (msg->resp->data.words[1] >> 24) & 0xff;
 	size = fsp_sensor_process_read(msg->resp);
 	fsp_freemsg(msg);
 
-	lock(&sensor_lock);
-	if (sensor_state == SENSOR_VALID_DATA) {
-		spcn_mod_data[attr->mod_index].entry_count += (size /
-				spcn_mod_data[attr->mod_index].entry_size);
-		attr->offset += size;
-		/* Fetch the subsequent entries of the same modifier type */
-		if (status == SPCN_RSP_STATUS_COND_SUCCESS) {
-			switch (spcn_mod_data[attr->mod_index].mod) {
-			case SPCN_MOD_PRS_STATUS_FIRST:
-			case SPCN_MOD_SENSOR_PARAM_FIRST:
-			case SPCN_MOD_SENSOR_DATA_FIRST:
-				attr->mod_index++;
-				spcn_mod_data[attr->mod_index].entry_count =
-						spcn_mod_data[attr->mod_index - 1].
-						entry_count;
-				spcn_mod_data[attr->mod_index - 1].entry_count = 0;
-				break;
-			default:
-				break;
-			}
+	if (sensor_state != SENSOR_VALID_DATA) {
+		rc = OPAL_INTERNAL_ERROR;
+		goto done;
+	}
 
-			rc = fsp_sensor_send_read_request(attr);
-			if (rc != OPAL_ASYNC_COMPLETION)
-				goto err;
-		} else { /* Notify 'powernv' of read completion */
-			fsp_sensor_process_data(attr);
+	mod = &spcn_mod_data[table->fetch_index];
+	table->entry_count += size / mod->entry_size;
+	table->fetch_size += size;
+
+	/* Fetch the subsequent entries of the same modifier type */
+	if (status == SPCN_RSP_STATUS_COND_SUCCESS &&
+	    table->fetch_size < SENSOR_TABLE_SIZE) {
+		switch (mod->mod) {
+		case SPCN_MOD_PRS_STATUS_FIRST:
+		case SPCN_MOD_SENSOR_PARAM_FIRST:
+		case SPCN_MOD_SENSOR_DATA_FIRST:
+			table->fetch_index++;
+			break;
+		default:
+			break;
 		}
-	} else {
-		rc = OPAL_INTERNAL_ERROR;
-		goto err;
+
+		rc = fsp_sensor_send_read_request(table);
+		if (rc == OPAL_ASYNC_COMPLETION) {
+			unlock(&sensor_lock);
+			return;
+		}
+		log_simple_error(&e_info(OPAL_RC_SENSOR_ASYNC_COMPLETE),
+			"SENSOR: %s: Failed to queue the "
+			"read request to fsp\n", __func__);
+		goto done;
 	}
+
+	table->valid = true;
+	table->stamp = mftb();
+	sensor_fetches++;
+	prlog(PR_TRACE, "SENSOR: Fetched %u entries of modifier 0x%02x"
+	      " (%llu hits, %llu misses, %llu fetches)\n",
+	      table->entry_count, table->mod, sensor_hits, sensor_misses,
+	      sensor_fetches);
+	rc = OPAL_SUCCESS;
+done:
+	table->fetching = false;
+	fsp_sensor_complete_reads(table, rc);
+	fsp_sensor_complete_snapshots(table, rc);
 	unlock(&sensor_lock);
-	return;
-err:
-	*(attr->sensor_data) = INVALID_DATA;
-	queue_msg_for_delivery(rc, attr);
-	unlock(&sensor_lock);
-	log_simple_error(&e_info(OPAL_RC_SENSOR_ASYNC_COMPLETE),
-		"SENSOR: %s: Failed to queue the "
-		"read request to fsp\n", __func__);
 }
 
-static int64_t fsp_sensor_send_read_request(struct opal_sensor_data *attr)
+static int64_t fsp_sensor_send_read_request(struct sensor_table *table)
 {
 	int rc;
 	struct fsp_msg *msg;
 	uint32_t *sensor_buf_ptr;
 	uint32_t align;
 	uint32_t cmd_header;
+	uint8_t mod = spcn_mod_data[table->fetch_index].mod;
 
-	prlog(PR_INSANE, "Get the data for modifier [%d]\n",
-	      spcn_mod_data[attr->mod_index].mod);
+	prlog(PR_INSANE, "Get the data for modifier [%d]\n", mod);
 
-	if (spcn_mod_data[attr->mod_index].mod == SPCN_MOD_PROC_JUNC_TEMP) {
+	if (mod == SPCN_MOD_PROC_JUNC_TEMP) {
 		/* TODO Support this modifier '0x14', if required */
-		align = attr->offset % sizeof(*sensor_buf_ptr);
+		align = table->fetch_size % sizeof(*sensor_buf_ptr);
 		if (align)
-			attr->offset += (sizeof(*sensor_buf_ptr) - align);
+			table->fetch_size += (sizeof(*sensor_buf_ptr) - align);
 
 		sensor_buf_ptr = (uint32_t *)((uint8_t *)sensor_buffer +
-				attr->offset);
+				table->dma_offset + table->fetch_size);
 
 		/* TODO Add 8 byte command data required for mod 0x14 */
 
-		attr->offset += 8;
+		table->fetch_size += 8;
 
-		cmd_header = spcn_mod_data[attr->mod_index].mod << 24 |
-				SPCN_CMD_PRS << 16 | 0x0008;
+		cmd_header = mod << 24 | SPCN_CMD_PRS << 16 | 0x0008;
 	} else {
-		cmd_header = spcn_mod_data[attr->mod_index].mod << 24 |
-				SPCN_CMD_PRS << 16;
+		cmd_header = mod << 24 | SPCN_CMD_PRS << 16;
 	}
 
 	msg = fsp_mkmsg(FSP_CMD_SPCN_PASSTHRU, 4,
 			SPCN_ADDR_MODE_CEC_NODE, cmd_header, 0,
-			PSI_DMA_SENSOR_BUF + attr->offset);
+			PSI_DMA_SENSOR_BUF + table->dma_offset +
+			table->fetch_size);
 
 	if (!msg) {
 		log_simple_error(&e_info(OPAL_RC_SENSOR_READ), "SENSOR: Failed "
@@ -445,7 +625,7 @@ static int64_t fsp_sensor_send_read_request(struct opal_sensor_data *attr)
 		return OPAL_INTERNAL_ERROR;
 	}
 
-	msg->user_data = attr;
+	msg->user_data = table;
 	rc = fsp_queue_msg(msg, fsp_sensor_read_complete);
 	if (rc) {
 		fsp_freemsg(msg);
@@ -458,31 +638,55 @@ static int64_t fsp_sensor_send_read_request(struct opal_sensor_data *attr)
 	return OPAL_ASYNC_COMPLETION;
 }
 
-static int64_t parse_sensor_id(uint32_t id, struct opal_sensor_data *attr)
+/* Start fetching a table from its first modifier */
+static int64_t fsp_sensor_fetch(struct sensor_table *table)
 {
-	uint32_t mod, index;
+	int64_t rc;
 
-	attr->spcn_attr = id >> 24;
-	if (attr->spcn_attr >= SENSOR_MAX)
-		return OPAL_PARAMETER;
+	table->valid = false;
+	table->entry_count = 0;
+	table->fetch_index = table->mod_index;
+	table->fetch_size = 0;
 
-	if (attr->spcn_attr <= SENSOR_ON_SUPPORTED)
+	rc = fsp_sensor_send_read_request(table);
+	if (rc == OPAL_ASYNC_COMPLETION)
+		table->fetching = true;
+	return rc;
+}
+
+/* The table an attribute comes from */
+static struct sensor_table *fsp_sensor_table(enum spcn_attr spcn_attr)
+{
+	uint32_t mod, index;
+
+	if (spcn_attr <= SENSOR_ON_SUPPORTED)
 		mod = SPCN_MOD_PRS_STATUS_FIRST;
-	else if (attr->spcn_attr <= SENSOR_LOCATION)
+	else if (spcn_attr <= SENSOR_LOCATION)
 		mod = SPCN_MOD_SENSOR_PARAM_FIRST;
-	else if (attr->spcn_attr <= SENSOR_DATA)
+	else if (spcn_attr <= SENSOR_DATA)
 		mod = SPCN_MOD_SENSOR_DATA_FIRST;
-	else if (attr->spcn_attr <= SENSOR_POWER)
+	else if (spcn_attr <= SENSOR_POWER)
 		mod = SPCN_MOD_SENSOR_POWER;
 	else
-		return OPAL_PARAMETER;
+		return NULL;
 
-	for (index = 0; spcn_mod_data[index].mod != SPCN_MOD_LAST; index++) {
-		if (spcn_mod_data[index].mod == mod)
-			break;
+	for (index = 0; index < ARRAY_SIZE(sensor_tables); index++) {
+		if (sensor_tables[index].mod == mod)
+			return &sensor_tables[index];
 	}
+	return NULL;
+}
+
+static int64_t parse_sensor_id(uint32_t id, struct opal_sensor_data *attr)
+{
+	attr->spcn_attr = id >> 24;
+	if (attr->spcn_attr >= SENSOR_MAX)
+		return OPAL_PARAMETER;
+
+	attr->table = fsp_sensor_table(attr->spcn_attr);
+	if (!attr->table)
+		return OPAL_PARAMETER;
 
-	attr->mod_index = index;
 	attr->frc = (id >> 16) & 0xff;
 	attr->rid = id & 0xffff;
 
@@ -493,7 +697,7 @@ static int64_t parse_sensor_id(uint32_t id, struct opal_sensor_data *attr)
 static int64_t fsp_opal_read_sensor(uint32_t sensor_hndl, int token,
 		uint32_t *sensor_data)
 {
-	struct opal_sensor_data *attr;
+	struct opal_sensor_data *attr, id;
 	int64_t rc;
 
 	prlog(PR_INSANE, "fsp_opal_read_sensor [%08x]\n", sensor_hndl);
@@ -508,52 +712,138 @@ static int64_t fsp_opal_read_sensor(uint32_t sensor_hndl, int token,
 		goto out;
 	}
 
+	/* Parse the sensor id and store them to the local structure */
+	memset(&id, 0, sizeof(id));
+	rc = parse_sensor_id(sensor_hndl, &id);
+	if (rc) {
+		log_simple_error(&e_info(OPAL_RC_SENSOR_READ),
+			"SENSOR: %s: Failed to parse the sensor "
+			"handle[0x%08x]\n", __func__, sensor_hndl);
+		goto out;
+	}
+
 	lock(&sensor_lock);
-	if (prev_msg_consumed) {
-		attr = zalloc(sizeof(*attr));
-		if (!attr) {
-			log_simple_error(&e_info(OPAL_RC_SENSOR_READ),
-				"SENSOR: Failed to allocate memory\n");
-			rc = OPAL_NO_MEM;
-			goto out_lock;
-		}
 
-		/* Parse the sensor id and store them to the local structure */
-		rc = parse_sensor_id(sensor_hndl, attr);
-		if (rc) {
-			log_simple_error(&e_info(OPAL_RC_SENSOR_READ),
-				"SENSOR: %s: Failed to parse the sensor "
-				"handle[0x%08x]\n", __func__, sensor_hndl);
-			goto out_free;
-		}
-		/* Kernel buffer pointer to copy the data later when ready */
-		attr->sensor_data = sensor_data;
-		attr->async_token = token;
+	/*
+	 * Recent enough, no need to bother the FSP. Callers of this one
+	 * always wait for the completion message though, so it is sent
+	 * straight away. Synchronous answers are for the callers of
+	 * OPAL_SENSOR_SNAPSHOT, which know to expect them.
+	 */
+	if (fsp_sensor_fresh(id.table)) {
+		sensor_hits++;
+		*sensor_data = fsp_sensor_lookup(&id);
+		rc = opal_queue_msg(OPAL_MSG_ASYNC_COMP, NULL, NULL, token,
+				    *sensor_data == INVALID_DATA ?
+				    OPAL_PARTIAL : OPAL_SUCCESS);
+		rc = rc ? OPAL_BUSY_EVENT : OPAL_ASYNC_COMPLETION;
+		goto out_lock;
+	}
+	sensor_misses++;
+
+	attr = pool_get(&sensor_read_pool, POOL_NORMAL);
+	if (!attr) {
+		rc = OPAL_BUSY_EVENT;
+		goto out_lock;
+	}
+	*attr = id;
 
-		rc = fsp_sensor_send_read_request(attr);
+	/* Kernel buffer pointer to copy the data later when ready */
+	attr->sensor_data = sensor_data;
+	attr->async_token = token;
+
+	/* Wait for the fetch in progress, or start one */
+	if (!attr->table->fetching) {
+		rc = fsp_sensor_fetch(attr->table);
 		if (rc != OPAL_ASYNC_COMPLETION) {
 			log_simple_error(&e_info(OPAL_RC_SENSOR_READ),
 				"SENSOR: %s: Failed to queue the read "
 					"request to fsp\n", __func__);
-			goto out_free;
+			pool_free_object(&sensor_read_pool, attr);
+			goto out_lock;
 		}
-
-		prev_msg_consumed = false;
-	} else {
-		rc = OPAL_BUSY_EVENT;
 	}
+	list_add_tail(&attr->table->waiters, &attr->link);
+	rc = OPAL_ASYNC_COMPLETION;
 
+out_lock:
 	unlock(&sensor_lock);
+out:
 	return rc;
+}
 
-out_free:
-	free(attr);
-out_lock:
-	unlock(&sensor_lock);
+static int64_t fsp_opal_sensor_snapshot(uint32_t class, uint64_t token,
+					struct opal_sensor_sample *samples,
+					__be32 *count)
+{
+	struct sensor_snapshot *snap, req;
+	int64_t rc;
+
+	if (sensor_state == SENSOR_PERMANENT_ERROR)
+		return OPAL_HARDWARE;
+
+	if (class >= ARRAY_SIZE(sensor_classes) || !count)
+		return OPAL_PARAMETER;
+
+	memset(&req, 0, sizeof(req));
+	req.class = &sensor_classes[class];
+	req.table = fsp_sensor_table(req.class->spcn_attr);
+	req.samples = samples;
+	req.count = count;
+	req.max = be32_to_cpu(*count);
+	req.async_token = token;
+	if (!req.table || (req.max && !samples))
+		return OPAL_PARAMETER;
+
+	lock(&sensor_lock);
+
+	if (fsp_sensor_fresh(req.table)) {
+		sensor_hits++;
+		rc = fsp_sensor_snapshot_fill(&req);
+		goto out;
+	}
+	sensor_misses++;
+
+	snap = pool_get(&sensor_snapshot_pool, POOL_NORMAL);
+	if (!snap) {
+		rc = OPAL_BUSY_EVENT;
+		goto out;
+	}
+	*snap = req;
+
+	if (!req.table->fetching) {
+		rc = fsp_sensor_fetch(req.table);
+		if (rc != OPAL_ASYNC_COMPLETION) {
+			pool_free_object(&sensor_snapshot_pool, snap);
+			goto out;
+		}
+	}
+	list_add_tail(&req.table->snapshots, &snap->link);
+	rc = OPAL_ASYNC_COMPLETION;
 out:
+	unlock(&sensor_lock);
 	return rc;
 }
 
+static void fsp_init_sensor_tables(void)
+{
+	struct sensor_table *table;
+	uint32_t i, index;
+
+	for (i = 0; i < ARRAY_SIZE(sensor_tables); i++) {
+		table = &sensor_tables[i];
+		for (index = 0; spcn_mod_data[index].mod != SPCN_MOD_LAST;
+				index++) {
+			if (spcn_mod_data[index].mod == table->mod)
+				break;
+		}
+		table->mod_index = index;
+		table->dma_offset = i * SENSOR_TABLE_SIZE;
+		list_head_init(&table->waiters);
+		list_head_init(&table->snapshots);
+	}
+}
+
 
 #define MAX_RIDS	64
 #define MAX_NAME	64
@@ -726,11 +1016,22 @@ void fsp_init_sensor(void)
 		return;
 	}
 
+	if (pool_init(&sensor_read_pool, sizeof(struct opal_sensor_data),
+		      SENSOR_MAX_READS, 0) ||
+	    pool_init(&sensor_snapshot_pool, sizeof(struct sensor_snapshot),
+		      SENSOR_MAX_SNAPSHOTS, 0)) {
+		log_simple_error(&e_info(OPAL_RC_SENSOR_INIT), "SENSOR: could "
+				 "not allocate read pool!\n");
+		return;
+	}
+	fsp_init_sensor_tables();
+
 	/* Map TCE */
 	fsp_tce_map(PSI_DMA_SENSOR_BUF, sensor_buffer, PSI_DMA_SENSOR_BUF_SZ);
 
 	/* Register OPAL interface */
 	opal_register(OPAL_SENSOR_READ, fsp_opal_read_sensor, 3);
+	opal_register(OPAL_SENSOR_SNAPSHOT, fsp_opal_sensor_snapshot, 4);
 
 	msg.resp = &resp;
 
@@ -39,6 +39,7 @@ static int64_t opal_ipmi_send(uint64_t interface,
 			      struct opal_ipmi_msg *opal_ipmi_msg, uint64_t msg_len)
 {
 	struct ipmi_msg *msg;
+	int64_t rc;
 
 	if (opal_ipmi_msg->version != OPAL_IPMI_MSG_FORMAT_VERSION_1) {
 		prerror("OPAL IPMI: Incorrect version\n");
@@ -63,7 +64,13 @@ static int64_t opal_ipmi_send(uint64_t interface,
 
 	msg->complete = opal_send_complete;
 	msg->error = opal_send_complete;
-	return ipmi_queue_msg(msg);
+	msg->host_req = true;
+
+	rc = ipmi_queue_msg(msg);
+	if (rc)
+		ipmi_free_msg(msg);
+
+	return rc;
 }
 
 static int64_t opal_ipmi_recv(uint64_t interface,
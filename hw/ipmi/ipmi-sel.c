@@ -24,6 +24,8 @@
 #include <errorlog.h>
 #include <pel.h>
 #include <opal-msg.h>
+#include <timer.h>
+#include <timebase.h>
 
 /* OEM SEL fields */
 #define SEL_OEM_ID_0		0x55
@@ -52,133 +54,363 @@ struct oem_sel {
 	uint8_t data[4];
 };
 
-/* As far as I can tell the size of PEL record is unbounded (due to
- * the possible presence of the user defined section). We chose this
- * size because it's what FSP uses, but we could probably reduce
- * it. */
-#define MAX_PEL_SIZE 0x10000
-
 #define ESEL_HDR_SIZE 7
 
-static void ipmi_elog_error(struct ipmi_msg *msg)
+/* Rate limit: at most ESEL_RATE_BURST logs are sent to the BMC in any
+ * ESEL_RATE_WINDOW_MS window. Further logs stay queued until the
+ * window expires. */
+#define ESEL_RATE_BURST		8
+#define ESEL_RATE_WINDOW_MS	10000
+
+/* A log whose reservation got cancelled this many times in a row is
+ * dropped rather than retried forever. */
+#define ESEL_MAX_RETRIES	5
+
+/* Logs waiting to be sent, the head being the one in flight */
+static LIST_HEAD(esel_pending);
+static struct lock esel_lock = LOCK_UNLOCKED;
+
+/* struct errorlog is packed, don't take the address of its member */
+static struct list_node *elog_link(struct errorlog *elog)
+{
+	return (void *)elog + offsetof(struct errorlog, link);
+}
+
+/*
+ * State of the eSEL engine, protected by esel_lock. A single IPMI
+ * message is allocated when a batch starts and is reused for every
+ * reservation and partial add command until the pending list is
+ * empty. The reservation is kept across logs and only renewed when
+ * the BMC tells us it has been cancelled.
+ */
+static struct {
+	struct ipmi_msg *msg;
+	struct errorlog *elog;
+	bool busy;
+	struct pel_stream pel;
+	size_t index;
+	uint16_t reservation_id;
+	uint16_t record_id;
+	unsigned int retries;
+
+	/* Rate limiting */
+	struct timer timer;
+	uint64_t window_start;
+	unsigned int window_count;
+
+	/* Statistics */
+	unsigned long sent;
+	unsigned long failed;
+	unsigned long coalesced;
+	unsigned long reservations;
+	unsigned long chunks;
+} esel;
+
+static void ipmi_elog_poll(struct ipmi_msg *msg);
+static void ipmi_elog_error(struct ipmi_msg *msg);
+
+static bool elog_is_duplicate(struct errorlog *a, struct errorlog *b)
+{
+	return a->reason_code == b->reason_code &&
+		a->component_id == b->component_id &&
+		a->event_severity == b->event_severity &&
+		a->user_section_size == b->user_section_size &&
+		!memcmp(a->user_data_dump, b->user_data_dump,
+			a->user_section_size);
+}
+
+/* Check the rate limit window. Returns false and arms the timer if
+ * we are not allowed to send another log yet. */
+static bool esel_rate_ok(void)
+{
+	uint64_t now = mftb();
+	uint64_t end = esel.window_start + msecs_to_tb(ESEL_RATE_WINDOW_MS);
+
+	if (!esel.window_count || tb_compare(now, end) != TB_ABEFOREB) {
+		esel.window_start = now;
+		esel.window_count = 0;
+	}
+
+	if (esel.window_count < ESEL_RATE_BURST)
+		return true;
+
+	schedule_timer_at(&esel.timer, end);
+	return false;
+}
+
+/* Fill in esel.msg with the next command to send for the current log.
+ * Must be called with esel_lock held. */
+static void esel_prepare_chunk(void)
+{
+	struct ipmi_msg *msg = esel.msg;
+	size_t req_size;
+
+	if (!esel.reservation_id) {
+		ipmi_init_msg(msg, IPMI_DEFAULT_INTERFACE, IPMI_RESERVE_SEL,
+			      ipmi_elog_poll, esel.elog, 0, 2);
+		msg->error = ipmi_elog_error;
+		esel.reservations++;
+		return;
+	}
+
+	if ((esel.pel.size - esel.index) < (IPMI_MAX_REQ_SIZE - ESEL_HDR_SIZE)) {
+		/* Last data to send */
+		msg->data[6] = 1;
+		req_size = esel.pel.size - esel.index + ESEL_HDR_SIZE;
+	} else {
+		msg->data[6] = 0;
+		req_size = IPMI_MAX_REQ_SIZE;
+	}
+
+	ipmi_init_msg(msg, IPMI_DEFAULT_INTERFACE, IPMI_PARTIAL_ADD_ESEL,
+		      ipmi_elog_poll, esel.elog, req_size, 2);
+	msg->error = ipmi_elog_error;
+
+	msg->data[0] = esel.reservation_id & 0xff;
+	msg->data[1] = (esel.reservation_id >> 8) & 0xff;
+	msg->data[2] = esel.record_id & 0xff;
+	msg->data[3] = (esel.record_id >> 8) & 0xff;
+	msg->data[4] = esel.index & 0xff;
+	msg->data[5] = (esel.index >> 8) & 0xff;
+
+	/* The PEL is built straight into the message, a chunk at a time */
+	esel.index += pel_stream_read(&esel.pel, esel.index,
+				      &msg->data[ESEL_HDR_SIZE],
+				      msg->req_size - ESEL_HDR_SIZE);
+	esel.chunks++;
+}
+
+/* Pick the next pending log and build its PEL. Returns the message to
+ * queue or NULL if the engine went idle. Must be called with esel_lock
+ * held. */
+static struct ipmi_msg *esel_next_log(void)
+{
+	struct ipmi_msg *msg;
+
+	esel.elog = list_top(&esel_pending, struct errorlog, link);
+	if (!esel.elog || !esel_rate_ok()) {
+		/* Nothing to do (or not allowed to yet), drop the
+		 * message, it will be reallocated for the next batch */
+		msg = esel.msg;
+		esel.msg = NULL;
+		esel.elog = NULL;
+		esel.busy = false;
+		if (msg)
+			ipmi_free_msg(msg);
+		return NULL;
+	}
+
+	if (!esel.msg) {
+		/* We pass a large request size in to mkmsg so that we
+		 * have a large enough allocation to reuse the message to
+		 * pass the PEL data via a series of partial add commands. */
+		esel.msg = ipmi_mkmsg(IPMI_DEFAULT_INTERFACE, IPMI_RESERVE_SEL,
+				      ipmi_elog_poll, NULL, NULL,
+				      IPMI_MAX_REQ_SIZE, 2);
+		if (!esel.msg) {
+			esel.elog = NULL;
+			esel.busy = false;
+			return NULL;
+		}
+	}
+
+	esel.window_count++;
+	pel_stream_init(&esel.pel, esel.elog);
+	esel.index = 0;
+	esel.record_id = 0;
+	esel.retries = 0;
+	esel_prepare_chunk();
+
+	return esel.msg;
+}
+
+/* Remove the log in flight from the pending list once the BMC has
+ * accepted (or definitely refused) it and move on to the next one.
+ * Must be called with esel_lock held. */
+static struct ipmi_msg *esel_log_done(struct errorlog **done)
 {
-	if (msg->cc == IPMI_LOST_ARBITRATION_ERR)
-		/* Retry due to SEL erase */
+	list_del(elog_link(esel.elog));
+	*done = esel.elog;
+
+	return esel_next_log();
+}
+
+/* Start sending if the engine is idle */
+static void esel_kick(void)
+{
+	struct ipmi_msg *msg = NULL;
+
+	lock(&esel_lock);
+	if (!esel.busy) {
+		esel.busy = true;
+		msg = esel_next_log();
+	}
+	unlock(&esel_lock);
+
+	/* Never queue with esel_lock held, the backend may complete the
+	 * message synchronously. Queueing at the tail lets other IPMI
+	 * traffic through between chunks, the reservation guards against
+	 * interleaved SEL updates. */
+	if (msg)
 		ipmi_queue_msg(msg);
-	else
-		opal_elog_complete(msg->user_data, false);
+}
 
-	ipmi_free_msg(msg);
+static void esel_timer_expiry(struct timer *t __unused, void *data __unused)
+{
+	esel_kick();
 }
 
-/* Goes through the required steps to add a complete eSEL:
+static void ipmi_elog_error(struct ipmi_msg *msg)
+{
+	struct errorlog *done = NULL;
+	struct ipmi_msg *next = msg;
+
+	lock(&esel_lock);
+	if ((msg->cc == IPMI_LOST_ARBITRATION_ERR ||
+	     msg->cc == IPMI_INVALID_RESERVATION_ERR) &&
+	    ++esel.retries > ESEL_MAX_RETRIES) {
+		prerror("IPMI: eSEL PLID 0x%x dropped, reservation lost %u"
+			" times\n", esel.elog->plid, esel.retries);
+		esel.reservation_id = 0;
+		esel.failed++;
+		next = esel_log_done(&done);
+		goto out;
+	}
+
+	switch (msg->cc) {
+	case IPMI_LOST_ARBITRATION_ERR:
+		/* Retry due to SEL erase. Restart the current log from
+		 * scratch as the BMC dropped the partial record. */
+		esel.reservation_id = 0;
+		esel.index = 0;
+		esel.record_id = 0;
+		esel_prepare_chunk();
+		break;
+	case IPMI_INVALID_RESERVATION_ERR:
+		/* Someone else touched the SEL, get a new reservation
+		 * and resend the current log */
+		prlog(PR_DEBUG, "IPMI: eSEL reservation cancelled\n");
+		esel.reservation_id = 0;
+		esel.index = 0;
+		esel.record_id = 0;
+		esel_prepare_chunk();
+		break;
+	default:
+		esel.failed++;
+		next = esel_log_done(&done);
+	}
+out:
+	unlock(&esel_lock);
+
+	if (done)
+		opal_elog_complete(done, false);
+	if (next)
+		ipmi_queue_msg(next);
+}
+
+/* Goes through the required steps to add complete eSELs:
  *
  *  1. Get a reservation
  *  2. Partially add data to the SEL
  *
  * Because a reservation is needed we need to ensure eSEL's are added
  * as a single transaction as concurrent/interleaved adds would cancel
- * the reservation. We guarantee this by always adding our messages to
- * the head of the transmission queue, blocking any other messages
- * being sent until we have completed sending this message.
- *
- * There is still a very small chance that we will accidentally
- * interleave a message if there is another one waiting at the head of
- * the ipmi queue and another cpu calls the ipmi poller before we
- * complete. However this should just cause a resevation cancelled
- * error which we have to deal with anyway (eg. because there may be a
- * SEL erase in progress) so it shouldn't cause any problems.
+ * the reservation. All eSELs go through the esel_pending list and are
+ * sent one after the other by this state machine so we never
+ * interleave our own adds. Other SEL users (or a SEL erase) may still
+ * cancel the reservation in which case we simply get a new one and
+ * restart the log in flight.
  */
 static void ipmi_elog_poll(struct ipmi_msg *msg)
 {
-	static char pel_buf[MAX_PEL_SIZE];
-	static size_t pel_size;
-	static int index = 0;
-	static unsigned int reservation_id = 0;
-	static unsigned int record_id = 0;
-	struct errorlog *elog_buf = (struct errorlog *) msg->user_data;
-	size_t req_size;
+	struct errorlog *done = NULL;
+	struct ipmi_msg *next = msg;
 
+	lock(&esel_lock);
 	if (msg->cmd == IPMI_CMD(IPMI_RESERVE_SEL)) {
-		reservation_id = msg->data[0];
-		reservation_id |= msg->data[1] << 8;
-		if (!reservation_id) {
+		esel.reservation_id = msg->data[0];
+		esel.reservation_id |= msg->data[1] << 8;
+		if (!esel.reservation_id) {
 			/* According to specification we should never
 			 * get here, but just in case we do we cancel
 			 * sending the message. */
 			prerror("Invalid reservation id");
-			opal_elog_complete(elog_buf, false);
-			ipmi_free_msg(msg);
-			return;
+			esel.failed++;
+			next = esel_log_done(&done);
+			goto out;
 		}
-
-		pel_size = create_pel_log(elog_buf, pel_buf, MAX_PEL_SIZE);
-		index = 0;
-		record_id = 0;
+		esel.index = 0;
+		esel.record_id = 0;
 	} else {
-		record_id = msg->data[0];
-		record_id |= msg->data[1] << 8;
+		esel.record_id = msg->data[0];
+		esel.record_id |= msg->data[1] << 8;
+
+		if (esel.index >= esel.pel.size) {
+			/* We're all done with this one, the reservation
+			 * is kept for the next log in the batch. */
+			esel.sent++;
+			next = esel_log_done(&done);
+			if (!next)
+				prlog(PR_DEBUG, "IPMI: eSEL batch done, sent %lu"
+				      " failed %lu coalesced %lu reservations %lu"
+				      " chunks %lu\n", esel.sent, esel.failed,
+				      esel.coalesced, esel.reservations,
+				      esel.chunks);
+			goto out;
+		}
 	}
 
 	/* Start or continue the IPMI_PARTIAL_ADD_SEL */
-	if (index >= pel_size) {
-		/* We're all done. Invalidate the resevation id to
-		 * ensure we get an error if we cut in on another eSEL
-		 * message. */
-		reservation_id = 0;
-		index = 0;
-		opal_elog_complete(elog_buf, true);
-		ipmi_free_msg(msg);
-		return;
-	}
-
-	if ((pel_size - index) < (IPMI_MAX_REQ_SIZE - ESEL_HDR_SIZE)) {
-		/* Last data to send */
-		msg->data[6] = 1;
-		req_size = pel_size - index + ESEL_HDR_SIZE;
-	} else {
-		msg->data[6] = 0;
-		req_size = IPMI_MAX_REQ_SIZE;
-	}
-
-	ipmi_init_msg(msg, IPMI_DEFAULT_INTERFACE, IPMI_PARTIAL_ADD_ESEL,
-		      ipmi_elog_poll, elog_buf, req_size, 2);
-
-	msg->data[0] = reservation_id & 0xff;
-	msg->data[1] = (reservation_id >> 8) & 0xff;
-	msg->data[2] = record_id & 0xff;
-	msg->data[3] = (record_id >> 8) & 0xff;
-	msg->data[4] = index & 0xff;
-	msg->data[5] = (index >> 8) & 0xff;
-
-	memcpy(&msg->data[ESEL_HDR_SIZE], &pel_buf[index], msg->req_size - ESEL_HDR_SIZE);
-	index += msg->req_size - ESEL_HDR_SIZE;
-
-	ipmi_queue_msg_head(msg);
-	return;
+	esel_prepare_chunk();
+out:
+	unlock(&esel_lock);
+
+	if (done)
+		opal_elog_complete(done, true);
+	if (next)
+		ipmi_queue_msg(next);
 }
 
 int ipmi_elog_commit(struct errorlog *elog_buf)
 {
-	struct ipmi_msg *msg;
+	struct errorlog *pending;
+	uint32_t dup_plid = 0;
+	bool duplicate = false;
+
+	lock(&esel_lock);
+
+	/* Coalesce with an identical log that hasn't reached the BMC
+	 * yet, there is no point filling the SEL with copies during an
+	 * error storm. */
+	list_for_each(&esel_pending, pending, link) {
+		if (elog_is_duplicate(pending, elog_buf)) {
+			duplicate = true;
+			dup_plid = pending->plid;
+			esel.coalesced++;
+			break;
+		}
+	}
+	if (!duplicate)
+		list_add_tail(&esel_pending, elog_link(elog_buf));
+	unlock(&esel_lock);
 
-	/* We pass a large request size in to mkmsg so that we have a
-	 * large enough allocation to reuse the message to pass the
-	 * PEL data via a series of partial add commands.  */
-	msg = ipmi_mkmsg(IPMI_DEFAULT_INTERFACE, IPMI_RESERVE_SEL, ipmi_elog_poll,
-			 elog_buf, NULL, IPMI_MAX_REQ_SIZE, 2);
-	if (!msg) {
-		opal_elog_complete(elog_buf, false);
-		return OPAL_RESOURCE;
+	if (duplicate) {
+		prlog(PR_DEBUG, "IPMI: eSEL PLID 0x%x coalesced with 0x%x\n",
+		      elog_buf->plid, dup_plid);
+		opal_elog_complete(elog_buf, true);
+		return 0;
 	}
-	msg->error = ipmi_elog_error;
 
-	msg->req_size = 0;
-	ipmi_queue_msg(msg);
+	esel_kick();
 
 	return 0;
 }
 
+void ipmi_sel_init(void)
+{
+	init_timer(&esel.timer, esel_timer_expiry, NULL);
+}
+
 static void sel_power(uint8_t power)
 {
 	switch (power) {
@@ -0,0 +1,372 @@
+/* Copyright 2013-2014 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#define __TEST__
+#include <timebase.h>
+
+static uint64_t stamp;
+#define mftb()	(stamp)
+
+#include "../ipmi-sel.c"
+
+/*
+ * Simulated BMC SEL. Each partial add command is checked against the
+ * current reservation and reassembled into a record, completed records
+ * are stored in sel[].
+ */
+#define SEL_MAX		32
+#define REC_MAX		2048
+
+struct sel_record {
+	size_t len;
+	uint8_t data[REC_MAX];
+};
+
+static struct sel_record sel[SEL_MAX];
+static unsigned int sel_count;
+static struct sel_record partial;
+static uint16_t bmc_reservation;
+static uint16_t bmc_record_id = 0x100;
+static unsigned int bmc_reserves;
+static int bmc_cancel_after = -1;
+static bool bmc_always_cancel;
+
+static struct ipmi_msg *bmc_queued;
+static unsigned int bmc_msgs;
+
+static struct ipmi_msg test_msg;
+static uint8_t test_msg_data[IPMI_MAX_REQ_SIZE];
+static bool test_msg_used;
+
+static struct timer *armed_timer;
+
+static unsigned int completed_ok, completed_fail;
+
+void lock(struct lock *l __unused)
+{
+}
+
+void unlock(struct lock *l __unused)
+{
+}
+
+void init_timer(struct timer *t, timer_func_t expiry, void *data)
+{
+	t->expiry = expiry;
+	t->user_data = data;
+	t->target = 0;
+}
+
+void schedule_timer_at(struct timer *t, uint64_t when)
+{
+	t->target = when;
+	armed_timer = t;
+}
+
+void prlog(int __unused log_level, const __unused char* fmt, ...)
+{
+}
+
+int _opal_queue_msg(enum OpalMessageType __unused msg_type,
+		    void __unused *data,
+		    void __unused (*consumed)(void *data), size_t __unused num_params,
+		    const u64 __unused *params)
+{
+	return 0;
+}
+
+void ipmi_init_msg(struct ipmi_msg *msg, int __unused interface,
+		   uint32_t code, void (*complete)(struct ipmi_msg *),
+		   void *user_data, size_t req_size, size_t resp_size)
+{
+	msg->cmd = IPMI_CMD(code);
+	msg->netfn = IPMI_NETFN(code) << 2;
+	msg->req_size = req_size;
+	msg->resp_size = resp_size;
+	msg->complete = complete;
+	msg->user_data = user_data;
+}
+
+struct ipmi_msg *ipmi_mkmsg(int interface, uint32_t code,
+			    void (*complete)(struct ipmi_msg *),
+			    void *user_data, void __unused *req_data,
+			    size_t req_size, size_t resp_size)
+{
+	/* The eSEL engine only ever has one message outstanding */
+	assert(!test_msg_used);
+	test_msg_used = true;
+	test_msg.data = test_msg_data;
+	ipmi_init_msg(&test_msg, interface, code, complete, user_data,
+		      req_size, resp_size);
+	return &test_msg;
+}
+
+void ipmi_free_msg(struct ipmi_msg *msg)
+{
+	assert(msg == &test_msg && test_msg_used);
+	test_msg_used = false;
+}
+
+int ipmi_queue_msg(struct ipmi_msg *msg)
+{
+	assert(!bmc_queued);
+	bmc_queued = msg;
+	return 0;
+}
+
+/* Fake PEL: a size and pattern derived from the PLID so records can be
+ * checked once reassembled by the BMC */
+static size_t fake_pel_size(struct errorlog *elog)
+{
+	return 40 + (elog->plid % 5) * 97;
+}
+
+void pel_stream_init(struct pel_stream *ps, struct errorlog *elog_data)
+{
+	ps->elog = elog_data;
+	ps->size = fake_pel_size(elog_data);
+}
+
+size_t pel_stream_read(struct pel_stream *ps, size_t offset, void *buf,
+		       size_t len)
+{
+	uint8_t *p = buf;
+	size_t i;
+
+	assert(offset < ps->size && len <= ps->size - offset);
+	for (i = 0; i < len; i++)
+		p[i] = (ps->elog->plid + offset + i) & 0xff;
+	return len;
+}
+
+void opal_elog_complete(struct errorlog *elog __unused, bool success)
+{
+	if (success)
+		completed_ok++;
+	else
+		completed_fail++;
+}
+
+static void bmc_respond(struct ipmi_msg *msg, uint8_t cc)
+{
+	msg->cc = cc;
+	if (cc != IPMI_CC_NO_ERROR)
+		msg->error(msg);
+	else
+		msg->complete(msg);
+}
+
+static void bmc_partial_add(struct ipmi_msg *msg)
+{
+	uint16_t resv = msg->data[0] | msg->data[1] << 8;
+	uint16_t rec = msg->data[2] | msg->data[3] << 8;
+	uint16_t offset = msg->data[4] | msg->data[5] << 8;
+	size_t len = msg->req_size - ESEL_HDR_SIZE;
+
+	if (bmc_always_cancel || bmc_cancel_after == 0) {
+		/* Another SEL user came along */
+		bmc_reservation++;
+		bmc_cancel_after = -1;
+	} else if (bmc_cancel_after > 0)
+		bmc_cancel_after--;
+
+	if (resv != bmc_reservation) {
+		partial.len = 0;
+		bmc_respond(msg, IPMI_INVALID_RESERVATION_ERR);
+		return;
+	}
+
+	if (offset == 0) {
+		assert(rec == 0);
+		partial.len = 0;
+		bmc_record_id++;
+	} else
+		assert(rec == bmc_record_id);
+
+	assert(offset == partial.len);
+	assert(partial.len + len <= REC_MAX);
+	memcpy(&partial.data[partial.len], &msg->data[ESEL_HDR_SIZE], len);
+	partial.len += len;
+
+	if (msg->data[6]) {
+		assert(sel_count < SEL_MAX);
+		sel[sel_count++] = partial;
+		partial.len = 0;
+	}
+
+	msg->data[0] = bmc_record_id & 0xff;
+	msg->data[1] = bmc_record_id >> 8;
+	bmc_respond(msg, IPMI_CC_NO_ERROR);
+}
+
+static void bmc_run(void)
+{
+	struct ipmi_msg *msg;
+
+	while (bmc_queued) {
+		msg = bmc_queued;
+		bmc_queued = NULL;
+		bmc_msgs++;
+
+		switch (msg->cmd) {
+		case IPMI_CMD(IPMI_RESERVE_SEL):
+			assert(msg->netfn >> 2 == IPMI_NETFN_STORAGE);
+			bmc_reserves++;
+			bmc_reservation++;
+			msg->data[0] = bmc_reservation & 0xff;
+			msg->data[1] = bmc_reservation >> 8;
+			bmc_respond(msg, IPMI_CC_NO_ERROR);
+			break;
+		case IPMI_CMD(IPMI_PARTIAL_ADD_ESEL):
+			assert(msg->netfn >> 2 == IPMI_NETFN_OEM);
+			bmc_partial_add(msg);
+			break;
+		default:
+			assert(0);
+		}
+	}
+}
+
+static void check_record(struct sel_record *rec, struct errorlog *elog)
+{
+	size_t i;
+
+	assert(rec->len == fake_pel_size(elog));
+	for (i = 0; i < rec->len; i++)
+		assert(rec->data[i] == ((elog->plid + i) & 0xff));
+}
+
+static struct errorlog logs[16];
+
+static void init_log(struct errorlog *elog, uint32_t plid, uint32_t reason)
+{
+	memset(elog, 0, sizeof(*elog));
+	elog->plid = plid;
+	elog->reason_code = reason;
+	elog->component_id = OPAL_PCI;
+	elog->user_section_size = 4;
+	memcpy(elog->user_data_dump, &reason, 4);
+}
+
+static void reset_sel(void)
+{
+	sel_count = 0;
+	bmc_reserves = 0;
+	bmc_msgs = 0;
+	completed_ok = completed_fail = 0;
+}
+
+int main(void)
+{
+	int i;
+
+	ipmi_sel_init();
+	assert(esel.timer.expiry);
+
+	/* Several logs go out back to back on a single reservation */
+	for (i = 0; i < 3; i++)
+		init_log(&logs[i], 0x1000 + i, 0x10 + i);
+	for (i = 0; i < 3; i++)
+		ipmi_elog_commit(&logs[i]);
+	bmc_run();
+	assert(sel_count == 3);
+	assert(bmc_reserves == 1);
+	assert(completed_ok == 3 && completed_fail == 0);
+	for (i = 0; i < 3; i++)
+		check_record(&sel[i], &logs[i]);
+	assert(!test_msg_used);
+
+	/* The reservation is reused by the next batch too */
+	reset_sel();
+	init_log(&logs[0], 0x2000, 0x20);
+	ipmi_elog_commit(&logs[0]);
+	bmc_run();
+	assert(sel_count == 1 && bmc_reserves == 0);
+	check_record(&sel[0], &logs[0]);
+
+	/* Identical logs pending at the same time are coalesced */
+	reset_sel();
+	init_log(&logs[0], 0x3000, 0x30);
+	init_log(&logs[1], 0x3001, 0x30);
+	init_log(&logs[2], 0x3002, 0x31);
+	init_log(&logs[3], 0x3003, 0x31);
+	for (i = 0; i < 4; i++)
+		ipmi_elog_commit(&logs[i]);
+	bmc_run();
+	assert(sel_count == 2);
+	assert(completed_ok == 4);
+	assert(esel.coalesced == 2);
+	check_record(&sel[0], &logs[0]);
+	check_record(&sel[1], &logs[2]);
+
+	/* A cancelled reservation restarts the log in flight */
+	stamp += msecs_to_tb(ESEL_RATE_WINDOW_MS);
+	reset_sel();
+	init_log(&logs[0], 0x4004, 0x40);
+	init_log(&logs[1], 0x4001, 0x41);
+	bmc_cancel_after = 3;
+	ipmi_elog_commit(&logs[0]);
+	ipmi_elog_commit(&logs[1]);
+	bmc_run();
+	assert(sel_count == 2);
+	assert(bmc_reserves == 1);
+	assert(completed_ok == 2 && completed_fail == 0);
+	check_record(&sel[0], &logs[0]);
+	check_record(&sel[1], &logs[1]);
+
+	/* A log that keeps losing its reservation is eventually dropped,
+	 * without holding up the next one */
+	stamp += msecs_to_tb(ESEL_RATE_WINDOW_MS);
+	reset_sel();
+	init_log(&logs[0], 0x4100, 0x42);
+	init_log(&logs[1], 0x4101, 0x43);
+	bmc_always_cancel = true;
+	ipmi_elog_commit(&logs[0]);
+	bmc_run();
+	assert(sel_count == 0 && completed_fail == 1);
+	assert(bmc_reserves == ESEL_MAX_RETRIES);
+	bmc_always_cancel = false;
+	ipmi_elog_commit(&logs[1]);
+	bmc_run();
+	assert(sel_count == 1 && completed_ok == 1);
+	check_record(&sel[0], &logs[1]);
+
+	/* Rate limiting holds back logs until the window expires */
+	stamp += msecs_to_tb(ESEL_RATE_WINDOW_MS);
+	reset_sel();
+	for (i = 0; i < ESEL_RATE_BURST + 2; i++) {
+		init_log(&logs[i], 0x5000 + i, 0x50 + i);
+		ipmi_elog_commit(&logs[i]);
+		bmc_run();
+	}
+	assert(sel_count == ESEL_RATE_BURST);
+	assert(armed_timer == &esel.timer);
+	assert(!test_msg_used);
+
+	stamp = armed_timer->target;
+	armed_timer->expiry(armed_timer, armed_timer->user_data);
+	bmc_run();
+	assert(sel_count == ESEL_RATE_BURST + 2);
+	assert(completed_ok == ESEL_RATE_BURST + 2);
+	for (i = 0; i < ESEL_RATE_BURST + 2; i++)
+		check_record(&sel[i], &logs[i]);
+	assert(!test_msg_used);
+
+	return 0;
+}
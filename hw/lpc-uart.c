@@ -129,37 +129,6 @@ static void uart_update_ier(void)
 	}
 }
 
-/*
- * Internal console driver (output only)
- */
-static size_t uart_con_write(const char *buf, size_t len)
-{
-	size_t written = 0;
-
-	lock(&uart_lock);
-	while(written < len) {
-		if (tx_room == 0) {
-			uart_wait_tx_room();
-			if (tx_room == 0)
-				goto bail;
-		} else {
-			uart_write(REG_THR, buf[written++]);
-			tx_room--;
-		}
-	}
- bail:
-	unlock(&uart_lock);
-	return written;
-}
-
-static struct con_ops uart_con_driver = {
-	.write = uart_con_write
-};
-
-/*
- * OPAL console driver
- */
-
 /*
  * We implement a simple buffer to buffer input data as some bugs in
  * Linux make it fail to read fast enough after we get an interrupt.
@@ -177,15 +146,17 @@ static uint32_t	in_count;
 
 /*
  * We implement a ring buffer for output data as well to speed things
- * up a bit. This allows us to have interrupt driven sends. This is only
- * for the output data coming from the OPAL API, not the internal one
- * which is already bufferred.
+ * up a bit. This allows us to have interrupt driven sends. It is
+ * shared by the internal console and the OPAL API so output from both
+ * stays ordered, and it is static as the internal console comes up
+ * before we can allocate memory.
  */
 #define OUT_BUF_SIZE	0x1000
-static uint8_t *out_buf;
+static uint8_t out_buf[OUT_BUF_SIZE];
 static uint32_t out_buf_prod;
 static uint32_t out_buf_cons;
 
+/* Must be called with UART lock held */
 static void uart_flush_out(void)
 {
 	bool tx_was_full = tx_full;
@@ -207,9 +178,14 @@ static void uart_flush_out(void)
 			tx_full = true;
 			break;
 		}
-		uart_write(REG_THR, out_buf[out_buf_cons++]);
-		out_buf_cons %= OUT_BUF_SIZE;
-		tx_room--;
+		tx_full = false;
+
+		/* Burst as much as the FIFO takes */
+		while (tx_room && out_buf_prod != out_buf_cons) {
+			uart_write(REG_THR, out_buf[out_buf_cons++]);
+			out_buf_cons %= OUT_BUF_SIZE;
+			tx_room--;
+		}
 	}
 	if (tx_full != tx_was_full)
 		uart_update_ier();
@@ -221,6 +197,53 @@ static uint32_t uart_tx_buf_space(void)
 		(out_buf_prod + OUT_BUF_SIZE - out_buf_cons) % OUT_BUF_SIZE;
 }
 
+/* Must be called with UART lock held */
+static size_t uart_tx_buf_add(const uint8_t *buf, size_t len)
+{
+	size_t chunk, written = 0;
+
+	len = MIN(len, uart_tx_buf_space());
+	while (written < len) {
+		chunk = MIN(len - written, OUT_BUF_SIZE - out_buf_prod);
+		memcpy(out_buf + out_buf_prod, buf + written, chunk);
+		out_buf_prod = (out_buf_prod + chunk) % OUT_BUF_SIZE;
+		written += chunk;
+	}
+	return written;
+}
+
+/*
+ * Internal console driver (output only)
+ *
+ * Once the UART interrupt is known to work this never waits for the
+ * UART: the data is queued in the TX ring and drained by the THRE
+ * interrupt (or the poller), and anything that doesn't fit stays in
+ * the in-memory console for the next flush. Until then we push the
+ * data out synchronously as we used to.
+ */
+static size_t uart_con_write(const char *buf, size_t len)
+{
+	size_t written = 0;
+
+	lock(&uart_lock);
+	do {
+		written += uart_tx_buf_add((const uint8_t *)buf + written,
+					   len - written);
+		uart_flush_out();
+	} while (!irq_ok && written < len);
+	unlock(&uart_lock);
+
+	return written;
+}
+
+static struct con_ops uart_con_driver = {
+	.write = uart_con_write
+};
+
+/*
+ * OPAL console driver
+ */
+
 static int64_t uart_opal_write(int64_t term_number, int64_t *length,
 			       const uint8_t *buffer)
 {
@@ -232,11 +255,7 @@ static int64_t uart_opal_write(int64_t term_number, int64_t *length,
 	lock(&uart_lock);
 
 	/* Copy data to out buffer */
-	while (uart_tx_buf_space() && len--) {
-		out_buf[out_buf_prod++] = *(buffer++);
-		out_buf_prod %= OUT_BUF_SIZE;
-		written++;
-	}
+	written = uart_tx_buf_add(buffer, len);
 
 	/* Flush out buffer again */
 	uart_flush_out();
@@ -345,21 +364,24 @@ static int64_t uart_opal_read(int64_t term_number, int64_t *length,
 
 static void __uart_do_poll(u8 trace_ctx)
 {
-	if (!in_buf)
-		return;
-
 	lock(&uart_lock);
-	uart_read_to_buffer();
+	if (in_buf)
+		uart_read_to_buffer();
 	uart_flush_out();
 	uart_trace(trace_ctx, 0, tx_full, in_count);
 	unlock(&uart_lock);
 
-	uart_adjust_opal_event();
+	if (in_buf)
+		uart_adjust_opal_event();
 }
 
 static void uart_console_poll(void *data __unused)
 {
 	__uart_do_poll(TRACE_UART_CTX_POLL);
+
+	/* Pick up what the TX ring couldn't take last time */
+	if (irq_ok)
+		flush_console();
 }
 
 void uart_irq(void)
@@ -421,7 +443,6 @@ void uart_setup_opal_console(void)
 
 	/* Allocate an input buffer */
 	in_buf = zalloc(IN_BUF_SIZE);
-	out_buf = zalloc(OUT_BUF_SIZE);
 	prlog(PR_DEBUG, "UART: Enabled as OS console\n");
 
 	/* Register OPAL APIs */
@@ -429,8 +450,6 @@ void uart_setup_opal_console(void)
 	opal_register(OPAL_CONSOLE_WRITE_BUFFER_SPACE,
 		      uart_opal_write_buffer_space, 2);
 	opal_register(OPAL_CONSOLE_WRITE, uart_opal_write, 3);
-
-	opal_add_poller(uart_console_poll, NULL);
 }
 
 static bool uart_init_hw(unsigned int speed, unsigned int clock)
@@ -511,6 +530,9 @@ void uart_init(bool enable_interrupt)
 	/* Install console backend for printf() */
 	set_console(&uart_con_driver);
 
+	/* Drains the TX ring when interrupts aren't there to do it */
+	opal_add_poller(uart_console_poll, NULL);
+
 	/* Setup the interrupts properties since HB couldn't do it */
 	irqchip = dt_prop_get_u32(n, "ibm,irq-chip-id");
 	irq = get_psi_interrupt(irqchip) + P8_IRQ_PSI_HOST_ERR;
@@ -25,6 +25,7 @@
 #include <xscom.h>
 #include <timebase.h>
 #include <timer.h>
+#include <pool.h>
 #include <opal-msg.h>
 #include <errorlog.h>
 /* XXX SRC's will be moved to errorlog.h and then remove fsp-elog.h */
@@ -55,8 +56,12 @@ DEFINE_LOG_ENTRY(OPAL_RC_I2C_RESET, OPAL_INPUT_OUTPUT_ERR_EVT, OPAL_I2C,
 #define USEC_PER_SEC		1000000
 #define USEC_PER_MSEC		1000
 #define I2C_RESET_DELAY_MS	5 /* 5 msecs */
+#define I2C_POLL_MAX_MS		10 /* Slowest poll while a transfer is stuck */
+#define I2C_MAX_EVENTS		8 /* Handled in one go */
+#define I2C_STATS_LOG_REQS	1024 /* Log the counters every that many reqs */
 #define I2C_FIFO_HI_LVL		4
 #define I2C_FIFO_LO_LVL		4
+#define I2C_POOL_REQS		32
 
 /*
  * I2C registers set.
@@ -182,7 +187,11 @@ DEFINE_LOG_ENTRY(OPAL_RC_I2C_RESET, OPAL_INPUT_OUTPUT_ERR_EVT, OPAL_I2C,
 
 struct p8_i2c_master {
 	struct lock		lock;		/* Lock to guard the members */
-	uint64_t		poll_interval;	/* Polling interval  */
+	uint64_t		poll_interval;	/* Shortest polling interval */
+	uint64_t		poll_cur;	/* Current polling interval */
+	uint64_t		poll_hint;	/* When the engine needs us next */
+	uint32_t		fifo_lo;	/* Programmed watermarks */
+	uint32_t		fifo_hi;
 	uint64_t		byte_timeout;	/* Timeout per byte */
 	uint64_t		xscom_base;	/* xscom base of i2cm */
 	uint32_t		fifo_size;	/* Maximum size of FIFO  */
@@ -190,6 +199,7 @@ struct p8_i2c_master {
 	uint32_t		engine_id;	/* Engine# on chip */
 	uint8_t			obuf[4];	/* Offset buffer */
 	uint32_t		bytes_sent;
+	uint32_t		cur_msg;	/* I2C_MULTI segment */
 	bool			irq_ok;		/* Interrupt working ? */
 	enum request_state {
 		state_idle,
@@ -198,7 +208,10 @@ struct p8_i2c_master {
 		state_error,
 		state_recovery,
 	}			state;
-	struct list_head	req_list;	/* Request queue head */
+	struct list_head	req_list;	/* Request in progress */
+	struct p8_i2c_master_port *ports;
+	uint32_t		nr_ports;
+	uint32_t		next_port;	/* Next port to serve */
 	struct timer		poller;
 	struct timer		timeout;
 	struct list_node	link;
@@ -209,14 +222,31 @@ struct p8_i2c_master_port {
 	struct p8_i2c_master	*master;
 	uint32_t		port_num;
 	uint32_t		bit_rate_div;	/* Divisor to set bus speed*/
+	uint64_t		byte_time;	/* Time to move a byte on the bus */
+	struct list_head	req_list;	/* Request queue head */
+
+	/* Counters */
+	uint64_t		reqs;
+	uint64_t		errors;
+	uint64_t		bytes;		/* Moved by successful requests */
+	uint64_t		busy_tb;	/* Spent on the bus */
+	uint64_t		wait_tb;	/* From queueing to completion */
+	uint64_t		max_wait_tb;
 };
 
 struct p8_i2c_request {
 	struct i2c_request	req;
 	uint32_t		port_num;
 	uint64_t		timeout;
+	uint64_t		queued;
+	uint64_t		started;
 };
 
+/* Requests come from this pool, and from the heap once it runs dry */
+static struct pool p8_i2c_req_pool;
+static struct lock p8_i2c_req_pool_lock = LOCK_UNLOCKED;
+static bool p8_i2c_req_pool_ok;
+
 static void p8_i2c_print_debug_info(struct p8_i2c_master_port *port,
 				    struct i2c_request *req)
 {
@@ -325,9 +355,11 @@ static int p8_i2c_prog_watermark(struct p8_i2c_master *master)
 		return rc;
 	}
 
-	/* Set the high/low watermark */
-	watermark = SETFIELD(I2C_WATERMARK_HIGH, watermark, I2C_FIFO_HI_LVL);
-	watermark = SETFIELD(I2C_WATERMARK_LOW, watermark, I2C_FIFO_LO_LVL);
+	/* Set the high/low watermark, the data requests fire at those levels */
+	master->fifo_hi = MIN(I2C_FIFO_HI_LVL, master->fifo_size);
+	master->fifo_lo = MIN(I2C_FIFO_LO_LVL, master->fifo_size);
+	watermark = SETFIELD(I2C_WATERMARK_HIGH, watermark, master->fifo_hi);
+	watermark = SETFIELD(I2C_WATERMARK_LOW, watermark, master->fifo_lo);
 	rc = xscom_write(master->chip_id, master->xscom_base +
 			 I2C_WATERMARK_REG, watermark);
 	if (rc)
@@ -370,12 +402,56 @@ static int p8_i2c_prog_mode(struct p8_i2c_master_port *port, bool enhanced_mode)
 	return rc;
 }
 
+static uint32_t p8_i2c_req_bytes(struct i2c_request *req)
+{
+	uint32_t i, bytes = 0;
+
+	if (req->op != I2C_MULTI)
+		return req->rw_len + req->offset_bytes;
+	for (i = 0; i < req->nr_msgs; i++)
+		bytes += req->msgs[i].len;
+	return bytes;
+}
+
+static void p8_i2c_account(struct i2c_request *req, int ret)
+{
+	struct p8_i2c_master_port *port =
+		container_of(req->bus, struct p8_i2c_master_port, bus);
+	struct p8_i2c_request *request =
+		container_of(req, struct p8_i2c_request, req);
+	uint64_t now = mftb(), wait, busy_ms;
+
+	wait = now - request->queued;
+	port->reqs++;
+	port->wait_tb += wait;
+	if (wait > port->max_wait_tb)
+		port->max_wait_tb = wait;
+	if (request->started)
+		port->busy_tb += now - request->started;
+	if (ret)
+		port->errors++;
+	else
+		port->bytes += p8_i2c_req_bytes(req);
+
+	if (port->reqs % I2C_STATS_LOG_REQS)
+		return;
+	busy_ms = tb_to_msecs(port->busy_tb);
+	prlog(PR_DEBUG, "I2C: Chip %08x Eng. %d Port %d: %llu reqs, %llu "
+	      "errors, %llu B/s, wait avg %lu us max %lu us\n",
+	      port->master->chip_id, port->master->engine_id, port->port_num,
+	      port->reqs, port->errors,
+	      busy_ms ? port->bytes * 1000 / busy_ms : 0,
+	      tb_to_usecs(port->wait_tb / port->reqs),
+	      tb_to_usecs(port->max_wait_tb));
+}
+
 static void p8_i2c_complete_request(struct p8_i2c_master *master,
 				    struct i2c_request *req, int ret)
 {
 	/* We only complete the current top level request */
 	assert(req == list_top(&master->req_list, struct i2c_request, link));
 
+	p8_i2c_account(req, ret);
 	cancel_timer_async(&master->timeout);
 	list_del(&req->link);
 	master->state = state_idle;
@@ -484,6 +560,7 @@ static void p8_i2c_status_error(struct p8_i2c_master_port *port,
 
 		/* Send an immediate stop */
 		master->state = state_error;
+		master->poll_hint = port->byte_time;
 		rc = xscom_write(master->chip_id, master->xscom_base +
 				 I2C_CMD_REG, I2C_CMD_WITH_STOP);
 		if (rc) {
@@ -539,12 +616,39 @@ static int p8_i2c_fifo_write(struct p8_i2c_master *master,
 	return rc;
 }
 
+static uint64_t p8_i2c_byte_time(struct i2c_request *req)
+{
+	struct p8_i2c_master_port *port =
+		container_of(req->bus, struct p8_i2c_master_port, bus);
+
+	return port->byte_time;
+}
+
+/* Buffer of the data phase, that of the current segment for I2C_MULTI */
+static uint8_t *p8_i2c_data_buf(struct p8_i2c_master *master,
+				struct i2c_request *req, uint32_t *len,
+				bool *read)
+{
+	struct i2c_msg *msg;
+
+	if (req->op != I2C_MULTI) {
+		*len = req->rw_len;
+		*read = req->op == I2C_READ || req->op == SMBUS_READ;
+		return req->rw_buf;
+	}
+	msg = &req->msgs[master->cur_msg];
+	*len = msg->len;
+	*read = msg->read;
+	return msg->buf;
+}
+
 static void p8_i2c_status_data_request(struct p8_i2c_master *master,
 				       struct i2c_request *req,
 				       uint64_t status)
 {
-	uint32_t fifo_count, fifo_free, count;
+	uint32_t fifo_count, fifo_free, count, len;
 	uint8_t *buf;
+	bool read;
 	int rc = 0;
 
 	fifo_count = GETFIELD(I2C_STAT_FIFO_ENTRY_COUNT, status);
@@ -569,22 +673,23 @@ static void p8_i2c_status_data_request(struct p8_i2c_master *master,
 			master->state = state_data;
 		break;
 	case state_data:
+		buf = p8_i2c_data_buf(master, req, &len, &read);
+
 		/* Sanity check */
-		if (master->bytes_sent >= req->rw_len) {
+		if (master->bytes_sent >= len) {
 			log_simple_error(&e_info(OPAL_RC_I2C_TRANSFER), "I2C: "
 					 "Data req with no data to send sent=%d "
-					 "req=%d\n", master->bytes_sent,
-					 req->rw_len);
+					 "req=%d\n", master->bytes_sent, len);
 			rc = OPAL_HARDWARE;
 			break;
 		}
 
 		/* Get next chunk */
-		buf = req->rw_buf + master->bytes_sent;
-		count = req->rw_len - master->bytes_sent;
+		buf += master->bytes_sent;
+		count = len - master->bytes_sent;
 
 		/* Check direction */
-		if (req->op == I2C_READ || req->op == SMBUS_READ) {
+		if (read) {
 			if (count > fifo_count)
 				count = fifo_count;
 			rc = p8_i2c_fifo_read(master, buf, count);
@@ -593,8 +698,20 @@ static void p8_i2c_status_data_request(struct p8_i2c_master *master,
 				count = fifo_free;
 			rc = p8_i2c_fifo_write(master, buf, count);
 		}
-		if (rc == 0)
-			master->bytes_sent += count;
+		if (rc)
+			break;
+		master->bytes_sent += count;
+
+		/*
+		 * Next data request once the FIFO drains to the low
+		 * watermark, or fills up to the high one
+		 */
+		if (read)
+			count = MIN(master->fifo_hi, len - master->bytes_sent);
+		else
+			count = fifo_count + count > master->fifo_lo ?
+				fifo_count + count - master->fifo_lo : 0;
+		master->poll_hint = count * p8_i2c_byte_time(req);
 		break;
 	default:
 		log_simple_error(&e_info(OPAL_RC_I2C_TRANSFER), "I2C: Invalid "
@@ -641,6 +758,7 @@ static void p8_i2c_complete_offset(struct p8_i2c_master *master,
 	cmd = SETFIELD(I2C_CMD_LEN_BYTES, cmd, req->rw_len);
 
 	DBG("Command: %016llx, state: %d\n", cmd, master->state);
+	master->poll_hint = p8_i2c_byte_time(req);
 
 	/* Send command */
 	rc = xscom_write(master->chip_id, master->xscom_base + I2C_CMD_REG,
@@ -659,9 +777,53 @@ static void p8_i2c_complete_offset(struct p8_i2c_master *master,
 	p8_i2c_complete_request(master, req, rc);
 }
 
+/* Only the last segment ends with a STOP, the others with a repeated START */
+static uint64_t p8_i2c_msg_cmd(struct i2c_request *req, uint32_t idx)
+{
+	struct i2c_msg *msg = &req->msgs[idx];
+	uint64_t cmd;
+
+	cmd = I2C_CMD_WITH_START | I2C_CMD_WITH_ADDR;
+	cmd = SETFIELD(I2C_CMD_DEV_ADDR, cmd, msg->dev_addr);
+	cmd = SETFIELD(I2C_CMD_LEN_BYTES, cmd, msg->len);
+	if (msg->read)
+		cmd |= I2C_CMD_READ_NOT_WRITE;
+	if (idx == req->nr_msgs - 1)
+		cmd |= I2C_CMD_WITH_STOP;
+
+	return cmd;
+}
+
+static void p8_i2c_next_msg(struct p8_i2c_master *master,
+			    struct i2c_request *req)
+{
+	uint64_t cmd;
+	int rc;
+
+	master->cur_msg++;
+	master->bytes_sent = 0;
+	cmd = p8_i2c_msg_cmd(req, master->cur_msg);
+
+	DBG("Command: %016llx, segment: %d\n", cmd, master->cur_msg);
+	master->poll_hint = p8_i2c_byte_time(req);
+
+	rc = xscom_write(master->chip_id, master->xscom_base + I2C_CMD_REG,
+			 cmd);
+	if (rc) {
+		log_simple_error(&e_info(OPAL_RC_I2C_TRANSFER), "I2C: Failed "
+				 "to write the CMD_REG\n");
+		p8_i2c_complete_request(master, req, rc);
+		return;
+	}
+
+	p8_i2c_enable_irqs(master);
+}
+
 static void p8_i2c_status_cmd_completion(struct p8_i2c_master *master,
 					 struct i2c_request *req)
 {
+	uint32_t len;
+	bool read;
 	int rc;
 
 	DBG("Command completion, state=%d bytes_sent=%d\n",
@@ -678,17 +840,27 @@ static void p8_i2c_status_cmd_completion(struct p8_i2c_master *master,
 	/* If we are not already in error state, check if we have
 	 * completed our data transfer properly
 	 */
-	if (master->state != state_error && master->bytes_sent != req->rw_len) {
+	p8_i2c_data_buf(master, req, &len, &read);
+	if (master->state != state_error && master->bytes_sent != len) {
 		log_simple_error(&e_info(OPAL_RC_I2C_TRANSFER), "I2C: Request "
 				 "complete with residual data req=%d done=%d\n",
-				 req->rw_len, master->bytes_sent);
+				 len, master->bytes_sent);
 		/* Should we error out here ? */
 	}
+
+	/* Segment done, carry on with the next one */
+	if (master->state == state_data && req->op == I2C_MULTI &&
+	    master->cur_msg + 1 < req->nr_msgs) {
+		p8_i2c_next_msg(master, req);
+		return;
+	}
+
 	rc = master->state == state_error ? req->result : OPAL_SUCCESS;
 	p8_i2c_complete_request(master, req, rc);
 }
 
-static void  p8_i2c_check_status(struct p8_i2c_master *master)
+/* Handle one event from the engine, if any, and tell if there was one */
+static bool p8_i2c_check_status(struct p8_i2c_master *master)
 {
 	struct p8_i2c_master_port *port;
 	struct i2c_request *req;
@@ -699,7 +871,7 @@ static void  p8_i2c_check_status(struct p8_i2c_master *master)
 	 * when we next try to enqueue a request
 	 */
 	if (master->state == state_idle)
-		return;
+		return false;
 
 	/* Read status register */
 	rc = xscom_read(master->chip_id, master->xscom_base + I2C_STAT_REG,
@@ -707,13 +879,13 @@ static void  p8_i2c_check_status(struct p8_i2c_master *master)
 	if (rc) {
 		log_simple_error(&e_info(OPAL_RC_I2C_TRANSFER), "I2C: Failed "
 				 "to read the STAT_REG\n");
-		return;
+		return false;
 	}
 
 	/* Nothing happened ? Go back */
 	if (!(status & (I2C_STAT_ANY_ERR | I2C_STAT_DATA_REQ |
 			I2C_STAT_CMD_COMP)))
-		return;
+		return false;
 
 	DBG("Non-0 status: %016llx\n", status);
 
@@ -723,7 +895,7 @@ static void  p8_i2c_check_status(struct p8_i2c_master *master)
 	if (rc) {
 		log_simple_error(&e_info(OPAL_RC_I2C_TRANSFER), "I2C: Failed "
 				 "to disable the interrupts\n");
-		return;
+		return false;
 	}
 
 	/* No request ? That's not normal ! Bail out without re-enabling
@@ -734,7 +906,7 @@ static void  p8_i2c_check_status(struct p8_i2c_master *master)
 		log_simple_error(&e_info(OPAL_RC_I2C_TRANSFER),
 				 "I2C: Interrupt with no request"
 				 ", status=0x%016llx\n", status);
-		return;
+		return false;
 	}
 
 	/* Get port for current request */
@@ -749,6 +921,47 @@ static void  p8_i2c_check_status(struct p8_i2c_master *master)
 		p8_i2c_status_data_request(master, req, status);
 	else if (status & I2C_STAT_CMD_COMP)
 		p8_i2c_status_cmd_completion(master, req);
+
+	return true;
+}
+
+/*
+ * The engine may need us again by the time an event is handled, the
+ * FIFO can drain while it's being filled over XSCOM for example, so
+ * keep going while there are events rather than waiting for the next
+ * interrupt or poll.
+ */
+static bool p8_i2c_run(struct p8_i2c_master *master)
+{
+	int events = 0;
+
+	while (events < I2C_MAX_EVENTS && p8_i2c_check_status(master))
+		events++;
+
+	return events != 0;
+}
+
+/*
+ * Without interrupts, poll when the engine is next expected to need us,
+ * going by how much is left in the FIFO, and back off while nothing
+ * happens. With interrupts, the OPAL pollers are only a safety net.
+ */
+static uint64_t p8_i2c_schedule_poll(struct p8_i2c_master *master,
+				     bool progress)
+{
+	uint64_t next;
+
+	if (master->irq_ok)
+		return schedule_timer(&master->poller, TIMER_POLL);
+
+	next = progress ? master->poll_hint : master->poll_cur * 2;
+	if (next < master->poll_interval)
+		next = master->poll_interval;
+	if (next > msecs_to_tb(I2C_POLL_MAX_MS))
+		next = msecs_to_tb(I2C_POLL_MAX_MS);
+	master->poll_cur = next;
+
+	return schedule_timer(&master->poller, next);
 }
 
 static int p8_i2c_check_initial_status(struct p8_i2c_master_port *port)
@@ -881,6 +1094,7 @@ static int p8_i2c_start_request(struct p8_i2c_master *master,
 
 	/* Initialize bytes_sent */
 	master->bytes_sent = 0;
+	master->cur_msg = 0;
 
 	/* Set up the command register */
 	cmd = I2C_CMD_WITH_START | I2C_CMD_WITH_ADDR;
@@ -904,6 +1118,10 @@ static int p8_i2c_start_request(struct p8_i2c_master *master,
 				req->rw_len + req->offset_bytes);
 		master->state = state_offset;
 		break;
+	case I2C_MULTI:
+		cmd = p8_i2c_msg_cmd(req, 0);
+		master->state = state_data;
+		break;
 	default:
 		return OPAL_PARAMETER;
 	}
@@ -922,12 +1140,16 @@ static int p8_i2c_start_request(struct p8_i2c_master *master,
 	p8_i2c_enable_irqs(master);
 
 	/* Run a poll timer for boot cases or non-working interrupts
-	 * cases
+	 * cases, the address goes out first
 	 */
-	now = schedule_timer(&master->poller, master->poll_interval);
+	master->poll_hint = port->byte_time;
+	now = p8_i2c_schedule_poll(master, true);
+	request->started = now;
 
 	/* Calculate and start timeout */
-	tbytes = req->rw_len + req->offset_bytes + 2;
+	tbytes = p8_i2c_req_bytes(req) + 2;
+	if (req->op == I2C_MULTI)
+		tbytes += 2 * (req->nr_msgs - 1);
 	request->timeout = now + tbytes * master->byte_timeout;
 
 	/* Start the timeout */
@@ -936,13 +1158,37 @@ static int p8_i2c_start_request(struct p8_i2c_master *master,
 	return OPAL_SUCCESS;
 }
 
+/*
+ * Ports have their own queue and the master serves them in turn, so
+ * that a port with a long list of requests doesn't starve the others.
+ */
+static struct i2c_request *p8_i2c_next_request(struct p8_i2c_master *master)
+{
+	struct p8_i2c_master_port *port;
+	struct i2c_request *req;
+	uint32_t i;
+
+	for (i = 0; i < master->nr_ports; i++) {
+		port = &master->ports[(master->next_port + i) %
+				      master->nr_ports];
+		req = list_pop(&port->req_list, struct i2c_request, link);
+		if (!req)
+			continue;
+		master->next_port = (port - master->ports + 1) %
+			master->nr_ports;
+		list_add_tail(&master->req_list, &req->link);
+		return req;
+	}
+	return NULL;
+}
+
 static void p8_i2c_check_work(struct p8_i2c_master *master)
 {
 	struct i2c_request *req;
 	int rc;
 
-	while (master->state == state_idle && !list_empty(&master->req_list)) {
-		req = list_top(&master->req_list, struct i2c_request, link);
+	while (master->state == state_idle && list_empty(&master->req_list) &&
+	       (req = p8_i2c_next_request(master)) != NULL) {
 		rc = p8_i2c_start_request(master, req);
 		if (rc)
 			p8_i2c_complete_request(master, req, rc);
@@ -955,6 +1201,9 @@ static int p8_i2c_queue_request(struct i2c_request *req)
 	struct p8_i2c_master_port *port =
 		container_of(bus, struct p8_i2c_master_port, bus);
 	struct p8_i2c_master *master = port->master;
+	struct p8_i2c_request *request =
+		container_of(req, struct p8_i2c_request, req);
+	uint32_t i;
 	int rc = 0;
 
 	/* Parameter check */
@@ -967,8 +1216,26 @@ static int p8_i2c_queue_request(struct i2c_request *req)
 		prlog(PR_ERR, "I2C: Invalid offset size %d\n", req->offset_bytes);
 		return OPAL_PARAMETER;
 	}
+
+	if (req->op == I2C_MULTI) {
+		if (!req->nr_msgs || req->nr_msgs > I2C_MAX_MSGS) {
+			prlog(PR_ERR, "I2C: Invalid segment count %d\n",
+			      req->nr_msgs);
+			return OPAL_PARAMETER;
+		}
+		for (i = 0; i < req->nr_msgs; i++) {
+			if (req->msgs[i].len > I2C_MAX_TFR_LEN) {
+				prlog(PR_ERR, "I2C: Too large segment %d "
+				      "bytes\n", req->msgs[i].len);
+				return OPAL_PARAMETER;
+			}
+		}
+	}
+
 	lock(&master->lock);
-	list_add_tail(&master->req_list, &req->link);
+	request->queued = mftb();
+	request->started = 0;
+	list_add_tail(&port->req_list, &req->link);
 	p8_i2c_check_work(master);
 	unlock(&master->lock);
 
@@ -979,9 +1246,14 @@ static struct i2c_request *p8_i2c_alloc_request(struct i2c_bus *bus)
 {
 	struct p8_i2c_master_port *port =
 		container_of(bus, struct p8_i2c_master_port, bus);
-	struct p8_i2c_request *request;
-
-	request = zalloc(sizeof(*request));
+	struct p8_i2c_request *request = NULL;
+
+	lock(&p8_i2c_req_pool_lock);
+	if (p8_i2c_req_pool_ok)
+		request = pool_get(&p8_i2c_req_pool, POOL_NORMAL);
+	unlock(&p8_i2c_req_pool_lock);
+	if (!request)
+		request = zalloc(sizeof(*request));
 	if (!request) {
 		prlog(PR_ERR, "I2C: Failed to allocate i2c request\n");
 		return NULL;
@@ -993,11 +1265,27 @@ static struct i2c_request *p8_i2c_alloc_request(struct i2c_bus *bus)
 	return &request->req;
 }
 
+static bool p8_i2c_pool_request(struct p8_i2c_request *request)
+{
+	void *p = request;
+
+	return p8_i2c_req_pool_ok && p >= p8_i2c_req_pool.buf &&
+		p < p8_i2c_req_pool.buf +
+		I2C_POOL_REQS * p8_i2c_req_pool.obj_size;
+}
+
 static void p8_i2c_free_request(struct i2c_request *req)
 {
 	struct p8_i2c_request *request =
 		container_of(req, struct p8_i2c_request, req);
-	free(request);
+
+	if (!p8_i2c_pool_request(request)) {
+		free(request);
+		return;
+	}
+	lock(&p8_i2c_req_pool_lock);
+	pool_free_object(&p8_i2c_req_pool, request);
+	unlock(&p8_i2c_req_pool_lock);
 }
 
 static inline uint32_t p8_i2c_get_bit_rate_divisor(uint32_t lb_freq,
@@ -1015,6 +1303,12 @@ static inline uint64_t p8_i2c_get_poll_interval(uint32_t bus_speed)
 	return usecs_to_tb(usec);
 }
 
+/* 8 data bits and the ACK */
+static inline uint64_t p8_i2c_get_byte_time(uint32_t bus_speed)
+{
+	return usecs_to_tb((9 * USEC_PER_SEC) / bus_speed);
+}
+
 static void p8_i2c_timeout(struct timer *t __unused, void *data)
 {
 	struct p8_i2c_master_port *port;
@@ -1064,6 +1358,7 @@ static void p8_i2c_timeout(struct timer *t __unused, void *data)
 static void p8_i2c_poll(struct timer *t __unused, void *data)
 {
 	struct p8_i2c_master *master = data;
+	bool progress;
 
 	/*
 	 * This is called when the interrupt isn't functional or
@@ -1076,9 +1371,9 @@ static void p8_i2c_poll(struct timer *t __unused, void *data)
 		return;
 
 	lock(&master->lock);
-	p8_i2c_check_status(master);
+	progress = p8_i2c_run(master);
 	if (master->state != state_idle)
-		schedule_timer(&master->poller, master->poll_interval);
+		p8_i2c_schedule_poll(master, progress);
 	p8_i2c_check_work(master);
 	unlock(&master->lock);
 }
@@ -1098,7 +1393,7 @@ void p8_i2c_interrupt(uint32_t chip_id)
 		lock(&master->lock);
 
 		/* Run the state machine */
-		p8_i2c_check_status(master);
+		p8_i2c_run(master);
 
 		/* Check for new work */
 		p8_i2c_check_work(master);
@@ -1118,6 +1413,12 @@ void p8_i2c_init(void)
 	static bool irq_printed;
 	int rc;
 
+	if (pool_init(&p8_i2c_req_pool, sizeof(struct p8_i2c_request),
+		      I2C_POOL_REQS, 0))
+		prlog(PR_ERR, "I2C: Failed to allocate the request pool\n");
+	else
+		p8_i2c_req_pool_ok = true;
+
 	dt_for_each_compatible(dt_root, i2cm, "ibm,power8-i2cm") {
 		master = zalloc(sizeof(*master));
 		if (!master) {
@@ -1186,6 +1487,8 @@ void p8_i2c_init(void)
 
 		/* Add master to chip's list */
 		list_add_tail(&chip->i2cms, &master->link);
+		master->ports = port;
+		master->nr_ports = count;
 		max_bus_speed = 0;
 
 		dt_for_each_child(i2cm, i2cm_port) {
@@ -1193,11 +1496,13 @@ void p8_i2c_init(void)
 
 			port->port_num = dt_prop_get_u32(i2cm_port, "reg");
 			port->master = master;
+			list_head_init(&port->req_list);
 			speed = dt_prop_get_u32(i2cm_port, "bus-frequency");
 			if (speed > max_bus_speed)
 				max_bus_speed = speed;
 			port->bit_rate_div =
 				p8_i2c_get_bit_rate_divisor(lb_freq, speed);
+			port->byte_time = p8_i2c_get_byte_time(speed);
 			port->bus.dt_node = i2cm_port;
 			port->bus.queue_req = p8_i2c_queue_request;
 			port->bus.alloc_req = p8_i2c_alloc_request;
@@ -1210,16 +1515,14 @@ void p8_i2c_init(void)
 			port++;
 		}
 
-		/* If we have no interrupt, calculate a poll interval, otherwise
-		 * just use a TIMER_POLL timer which will tick on OPAL pollers
-		 * only (which allows us to operate during boot before
-		 * interrupts are functional etc...
+		/* If we have no interrupt, polls are no closer than this,
+		 * otherwise p8_i2c_schedule_poll() just uses a TIMER_POLL
+		 * timer which will tick on OPAL pollers only (which allows
+		 * us to operate during boot before interrupts are functional
+		 * etc...
 		 */
-		if (master->irq_ok)
-			master->poll_interval = TIMER_POLL;
-		else
-			master->poll_interval =
-				p8_i2c_get_poll_interval(max_bus_speed);
+		master->poll_interval = p8_i2c_get_poll_interval(max_bus_speed);
+		master->poll_cur = master->poll_interval;
 		master->byte_timeout = master->irq_ok ?
 			msecs_to_tb(I2C_TIMEOUT_IRQ_MS) :
 			msecs_to_tb(I2C_TIMEOUT_POLL_MS);
@@ -108,6 +108,9 @@ static bool phb3_fenced(struct phb3 *p)
 	/* We still probably has crazy xscom */
 	xscom_read(p->chip_id, p->pe_xscom + 0x0, &nfir);
 	if (nfir & PPC_BIT(16)) {
+		/* Whatever we shadowed of config space is gone */
+		if (!(p->flags & PHB3_AIB_FENCED))
+			pci_cfg_shadow_flush(&p->phb);
 		p->flags |= PHB3_AIB_FENCED;
 		p->state = PHB3_STATE_FENCED;
 		return true;
@@ -578,7 +581,7 @@ static int64_t phb3_ioda_reset(struct phb *phb, bool purge)
 {
 	struct phb3 *p = phb_to_phb3(phb);
 	uint64_t server, prio;
-	uint64_t *pdata64, data64;
+	uint64_t *pdata64, data64, peev[4];
 	uint32_t i;
 
 	if (purge) {
@@ -643,27 +646,26 @@ static int64_t phb3_ioda_reset(struct phb *phb, bool purge)
 			out_be64(p->regs + PHB_IODA_DATA0, 0x0ul);
 	}
 
-	/* Clear PEST & PEEV */
+	/* Clear PEST & PEEV, the PEEV tells us which PEs were frozen */
+	phb3_ioda_sel(p, IODA2_TBL_PEEV, 0, true);
+	for (i = 0; i < ARRAY_SIZE(peev); i++)
+		peev[i] = in_be64(p->regs + PHB_IODA_DATA0);
 	for (i = 0; i < PHB3_MAX_PE_NUM; i++) {
-		uint64_t pesta, pestb;
+		if (peev[i / 64] & PPC_BIT(i % 64))
+			PHBDBG(p, "Frozen PE#%d\n", i);
+	}
 
-		phb3_ioda_sel(p, IODA2_TBL_PESTA, i, false);
-		pesta = in_be64(p->regs + PHB_IODA_DATA0);
+	phb3_ioda_sel(p, IODA2_TBL_PESTA, 0, true);
+	for (i = 0; i < PHB3_MAX_PE_NUM; i++)
 		out_be64(p->regs + PHB_IODA_DATA0, 0);
-		phb3_ioda_sel(p, IODA2_TBL_PESTB, i, false);
-		pestb = in_be64(p->regs + PHB_IODA_DATA0);
+	phb3_ioda_sel(p, IODA2_TBL_PESTB, 0, true);
+	for (i = 0; i < PHB3_MAX_PE_NUM; i++)
 		out_be64(p->regs + PHB_IODA_DATA0, 0);
 
-		if ((pesta & IODA2_PESTA_MMIO_FROZEN) ||
-		    (pestb & IODA2_PESTB_DMA_STOPPED))
-			PHBDBG(p, "Frozen PE#%d (%s - %s)\n",
-			       i, (pesta & IODA2_PESTA_MMIO_FROZEN) ? "DMA" : "",
-			       (pestb & IODA2_PESTB_DMA_STOPPED) ? "MMIO" : "");
-	}
-
 	phb3_ioda_sel(p, IODA2_TBL_PEEV, 0, true);
-	for (i = 0; i < 4; i++)
+	for (i = 0; i < ARRAY_SIZE(peev); i++)
 		out_be64(p->regs + PHB_IODA_DATA0, 0);
+	p->diag_valid = false;
 
 	return OPAL_SUCCESS;
 }
@@ -879,15 +881,15 @@ static int64_t phb3_map_pe_mmio_window(struct phb *phb,
 	return OPAL_SUCCESS;
 }
 
-static int64_t phb3_map_pe_dma_window(struct phb *phb,
-				      uint16_t pe_num,
-				      uint16_t window_id,
-				      uint16_t tce_levels,
-				      uint64_t tce_table_addr,
-				      uint64_t tce_table_size,
-				      uint64_t tce_page_size)
+/* Build the TVE of a TCE table, a zero table size disables it */
+static int64_t phb3_tve_encode(uint16_t pe_num,
+			       uint16_t window_id,
+			       uint16_t tce_levels,
+			       uint64_t tce_table_addr,
+			       uint64_t tce_table_size,
+			       uint64_t tce_page_size,
+			       uint64_t *tve)
 {
-	struct phb3 *p = phb_to_phb3(phb);
 	uint64_t tts_encoded;
 	uint64_t data64 = 0;
 
@@ -904,9 +906,7 @@ static int64_t phb3_map_pe_dma_window(struct phb *phb,
 	 * we ignore other arguments
 	 */
 	if (tce_table_size == 0) {
-		phb3_ioda_sel(p, IODA2_TBL_TVT, window_id, false);
-		out_be64(p->regs + PHB_IODA_DATA0, 0);
-		p->tve_cache[window_id] = 0;
+		*tve = 0;
 		return OPAL_SUCCESS;
 	}
 
@@ -942,7 +942,27 @@ static int64_t phb3_map_pe_dma_window(struct phb *phb,
 	}
 
 	/* Encode number of levels */
-	data64 = SETFIELD(IODA2_TVT_NUM_LEVELS, data64, tce_levels - 1);
+	*tve = SETFIELD(IODA2_TVT_NUM_LEVELS, data64, tce_levels - 1);
+
+	return OPAL_SUCCESS;
+}
+
+static int64_t phb3_map_pe_dma_window(struct phb *phb,
+				      uint16_t pe_num,
+				      uint16_t window_id,
+				      uint16_t tce_levels,
+				      uint64_t tce_table_addr,
+				      uint64_t tce_table_size,
+				      uint64_t tce_page_size)
+{
+	struct phb3 *p = phb_to_phb3(phb);
+	uint64_t data64;
+	int64_t rc;
+
+	rc = phb3_tve_encode(pe_num, window_id, tce_levels, tce_table_addr,
+			     tce_table_size, tce_page_size, &data64);
+	if (rc != OPAL_SUCCESS)
+		return rc;
 
 	phb3_ioda_sel(p, IODA2_TBL_TVT, window_id, false);
 	out_be64(p->regs + PHB_IODA_DATA0, data64);
@@ -1014,14 +1034,198 @@ static int64_t phb3_map_pe_dma_window_real(struct phb *phb,
 	return OPAL_SUCCESS;
 }
 
-static void phb3_pci_msi_check_q(struct phb3 *p, uint32_t ive_num)
+/* A TCE table as described by its TVE */
+struct phb3_tce_table {
+	__be64		*root;
+	uint32_t	levels;
+	uint32_t	level_shift;	/* log2 of TCEs per level */
+	uint32_t	page_shift;
+	uint64_t	entries;	/* TCEs covering the window */
+};
+
+/* Pages given by the OS for missing indirect levels */
+struct phb3_tce_pool {
+	__be64		*pages;
+	uint32_t	count;
+	uint32_t	next;
+};
+
+static int64_t phb3_tce_table(struct phb3 *p, uint16_t pe_num,
+			      uint16_t window_id, struct phb3_tce_table *t)
+{
+	uint64_t tve, psize, bits;
+
+	if (pe_num >= PHB3_MAX_PE_NUM || (window_id >> 1) != pe_num)
+		return OPAL_PARAMETER;
+
+	/* Disabled and real mode windows have no page size */
+	tve = p->tve_cache[window_id];
+	psize = GETFIELD(IODA2_TVT_IO_PSIZE, tve);
+	if (!psize)
+		return OPAL_PARAMETER;
+
+	t->root = (__be64 *)(GETFIELD(IODA2_TVT_TABLE_ADDR, tve) << 12);
+	t->levels = GETFIELD(IODA2_TVT_NUM_LEVELS, tve) + 1;
+	t->level_shift = GETFIELD(IODA2_TVT_TCE_TABLE_SIZE, tve) + 8;
+	t->page_shift = psize + 11;
+
+	/* The window is at most 2^59 bytes, bit 59 selects the TVE */
+	bits = t->levels * t->level_shift;
+	if (bits > 59 - t->page_shift)
+		bits = 59 - t->page_shift;
+	t->entries = 1ull << bits;
+
+	return OPAL_SUCCESS;
+}
+
+/*
+ * Walk down to the last level table holding a TCE, filling missing
+ * indirect levels from the pool when there is one. Returns NULL with
+ * *rc still OPAL_SUCCESS if the TCE doesn't exist and there is no
+ * pool.
+ */
+static __be64 *phb3_tce_leaf(struct phb3_tce_table *t, uint64_t index,
+			     struct phb3_tce_pool *pool, int64_t *rc)
+{
+	uint64_t mask = (1ull << t->level_shift) - 1;
+	uint64_t size = 8ull << t->level_shift;
+	__be64 *tbl = t->root, *ent;
+	uint64_t e, page = 0;
+	uint32_t lvl;
+
+	for (lvl = t->levels - 1; lvl > 0; lvl--) {
+		ent = &tbl[(index >> (lvl * t->level_shift)) & mask];
+		e = be64_to_cpu(*ent);
+		if (!(e & (IODA2_TCE_READ | IODA2_TCE_WRITE))) {
+			if (!pool)
+				return NULL;
+			while (pool->next < pool->count && !page)
+				page = be64_to_cpu(pool->pages[pool->next++]);
+			if (!page) {
+				*rc = OPAL_RESOURCE;
+				return NULL;
+			}
+			if (page & (size - 1)) {
+				*rc = OPAL_PARAMETER;
+				return NULL;
+			}
+			pool->pages[pool->next - 1] = 0;
+
+			memset((void *)page, 0, size);
+			e = page | IODA2_TCE_READ | IODA2_TCE_WRITE;
+			*ent = cpu_to_be64(e);
+			page = 0;
+		}
+		tbl = (__be64 *)(e & IODA2_TCE_RPN_MASK);
+	}
+
+	return &tbl[index & mask];
+}
+
+static int64_t phb3_tce_op(struct phb3 *p, struct opal_pci_tce_op *op,
+			   struct phb3_tce_pool *pool, uint64_t *kill_pes)
+{
+	uint16_t pe = be16_to_cpu(op->pe_number);
+	uint64_t index = be64_to_cpu(op->index);
+	uint64_t addr = be64_to_cpu(op->addr);
+	uint64_t count = be32_to_cpu(op->count);
+	uint64_t mask, perm = 0, n, i;
+	struct phb3_tce_table t;
+	__be64 *leaf;
+	int64_t rc;
+
+	rc = phb3_tce_table(p, pe, be16_to_cpu(op->window_id), &t);
+	if (rc != OPAL_SUCCESS)
+		return rc;
+	if (!count || index >= t.entries || count > t.entries - index)
+		return OPAL_PARAMETER;
+
+	switch (op->op) {
+	case OPAL_PCI_TCE_OP_PUT:
+		if (!op->perm ||
+		    (op->perm & ~(OPAL_PCI_TCE_READ | OPAL_PCI_TCE_WRITE)))
+			return OPAL_PARAMETER;
+		if (addr & ((1ull << t.page_shift) - 1))
+			return OPAL_PARAMETER;
+		if (op->perm & OPAL_PCI_TCE_READ)
+			perm |= IODA2_TCE_READ;
+		if (op->perm & OPAL_PCI_TCE_WRITE)
+			perm |= IODA2_TCE_WRITE;
+		break;
+	case OPAL_PCI_TCE_OP_CLEAR:
+		/* Nothing to clear below a missing level */
+		pool = NULL;
+		break;
+	default:
+		return OPAL_PARAMETER;
+	}
+
+	/* Fill the TCEs one last level table at a time */
+	kill_pes[pe / 64] |= PPC_BIT(pe % 64);
+	mask = (1ull << t.level_shift) - 1;
+	while (count) {
+		n = mask + 1 - (index & mask);
+		if (n > count)
+			n = count;
+
+		leaf = phb3_tce_leaf(&t, index, pool, &rc);
+		if (rc != OPAL_SUCCESS)
+			return rc;
+		for (i = 0; leaf && i < n; i++) {
+			leaf[i] = perm ? cpu_to_be64(addr | perm) : 0;
+			addr += 1ull << t.page_shift;
+		}
+		index += n;
+		count -= n;
+	}
+
+	return OPAL_SUCCESS;
+}
+
+/*
+ * Update the TCE tables for a whole batch, then kill the TCE cache
+ * once: for the PE if only one was touched, everything otherwise.
+ */
+static int64_t phb3_tce_batch(struct phb *phb, struct opal_pci_tce_op *ops,
+			      uint32_t count, __be64 *pool, uint32_t pool_count)
+{
+	struct phb3 *p = phb_to_phb3(phb);
+	struct phb3_tce_pool tce_pool = {
+		.pages	= pool,
+		.count	= pool_count,
+	};
+	uint64_t kill_pes[PHB3_MAX_PE_NUM / 64] = { 0 };
+	uint32_t i, pes = 0, pe = 0;
+	int64_t rc, ret = OPAL_SUCCESS;
+
+	for (i = 0; i < count; i++) {
+		rc = phb3_tce_op(p, &ops[i], &tce_pool, kill_pes);
+		ops[i].rc = cpu_to_be32(rc);
+		if (rc && ret == OPAL_SUCCESS)
+			ret = rc;
+	}
+
+	for (i = 0; i < PHB3_MAX_PE_NUM; i++) {
+		if (kill_pes[i / 64] & PPC_BIT(i % 64)) {
+			pe = i;
+			pes++;
+		}
+	}
+	if (pes == 1)
+		out_be64(p->regs + PHB_TCE_KILL, PHB_TCE_KILL_PE |
+			 SETFIELD(PHB_TCE_KILL_PENUM, 0ul, pe));
+	else if (pes)
+		out_be64(p->regs + PHB_TCE_KILL, PHB_TCE_KILL_ALL);
+
+	return ret;
+}
+
+static bool phb3_pci_msi_q_set(struct phb3 *p, uint32_t ive_num)
 {
-	uint64_t ive, ivc, ffi;
 	uint8_t *q_byte;
 
 	/* Each IVE has 16-bytes or 128-bytes */
-	ive = p->tbl_ivt + (ive_num * IVT_TABLE_STRIDE * 8);
-	q_byte = (uint8_t *)(ive + 5);
+	q_byte = (uint8_t *)(p->tbl_ivt + (ive_num * IVT_TABLE_STRIDE * 8) + 5);
 
 	/*
 	 * Handle Q bit. If the Q bit doesn't show up,
@@ -1036,9 +1240,19 @@ static void phb3_pci_msi_check_q(struct phb3 *p, uint32_t ive_num)
 
 		/* Q still not set, bail out */
 		if (!(*q_byte & 0x1))
-			return;
+			return false;
 	}
 
+	return true;
+}
+
+static void phb3_pci_msi_resend(struct phb3 *p, uint32_t ive_num)
+{
+	uint64_t ivc, ffi;
+	uint8_t *q_byte;
+
+	q_byte = (uint8_t *)(p->tbl_ivt + (ive_num * IVT_TABLE_STRIDE * 8) + 5);
+
 	/* Lock FFI and send interrupt */
 	while (in_be64(p->regs + PHB_FFI_LOCK))
 		/* XXX Handle fences ! */
@@ -1059,18 +1273,38 @@ static void phb3_pci_msi_check_q(struct phb3 *p, uint32_t ive_num)
 	out_be64(p->regs + PHB_FFI_REQUEST, ffi);
 }
 
+static void phb3_pci_msi_check_q(struct phb3 *p, uint32_t ive_num)
+{
+	if (phb3_pci_msi_q_set(p, ive_num))
+		phb3_pci_msi_resend(p, ive_num);
+}
+
+/*
+ * Called without the PHB lock: the OS only EOIs an interrupt once,
+ * from the CPU it was presented to, so the P and generation bits of
+ * the IVE are ours and the IVC update is a single store. Only the
+ * resend of an interrupt whose Q bit got set needs the lock, as the
+ * FFI is shared by the whole PHB.
+ */
 static int64_t phb3_pci_msi_eoi(struct phb *phb,
 				uint32_t hwirq)
 {
 	struct phb3 *p = phb_to_phb3(phb);
 	uint32_t ive_num = PHB3_IRQ_NUM(hwirq);
-	uint64_t ive, ivc;
+	struct phb3_msi_stats *st = NULL;
+	uint64_t ive, ivc, start = 0, tb;
 	uint8_t *p_byte, gp, gen;
+	bool refire;
 
 	/* OS might not configure IVT yet */
 	if (!p->tbl_ivt)
 		return OPAL_HARDWARE;
 
+	if (p->msi_stats_on) {
+		st = &p->msi_stats[ive_num];
+		start = mftb();
+	}
+
 	/* Each IVE has 16-bytes or 128-bytes */
 	ive = p->tbl_ivt + (ive_num * IVT_TABLE_STRIDE * 8);
 	p_byte = (uint8_t *)(ive + 4);
@@ -1090,7 +1324,72 @@ static int64_t phb3_pci_msi_eoi(struct phb *phb,
 	out_be64(p->regs + PHB_IVC_UPDATE, ivc);
 
 	/* Handle Q bit */
-	phb3_pci_msi_check_q(p, ive_num);
+	refire = phb3_pci_msi_q_set(p, ive_num);
+	if (refire) {
+		lock(&p->lock);
+		phb3_pci_msi_resend(p, ive_num);
+		unlock(&p->lock);
+	}
+
+	if (st) {
+		tb = mftb() - start;
+		st->count++;
+		st->q_refires += refire;
+		st->tb_total += tb;
+		if (tb > st->tb_max)
+			st->tb_max = tb;
+	}
+
+	return OPAL_SUCCESS;
+}
+
+static int64_t phb3_msi_stats(struct phb *phb, uint64_t flags, uint32_t first,
+			      uint32_t count,
+			      struct opal_pci_msi_stats *stats)
+{
+	struct phb3 *p = phb_to_phb3(phb);
+	struct phb3_msi_stats *st;
+	uint32_t i;
+
+	if (flags & ~(uint64_t)(OPAL_PCI_MSI_STATS_ENABLE |
+				OPAL_PCI_MSI_STATS_DISABLE |
+				OPAL_PCI_MSI_STATS_RESET))
+		return OPAL_PARAMETER;
+	if ((flags & OPAL_PCI_MSI_STATS_ENABLE) &&
+	    (flags & OPAL_PCI_MSI_STATS_DISABLE))
+		return OPAL_PARAMETER;
+	if (first >= IVT_TABLE_ENTRIES || count > IVT_TABLE_ENTRIES - first)
+		return OPAL_PARAMETER;
+
+	if (!p->msi_stats) {
+		if (!(flags & OPAL_PCI_MSI_STATS_ENABLE)) {
+			/* Never enabled, nothing counted */
+			if (stats)
+				memset(stats, 0, count * sizeof(*stats));
+			return OPAL_SUCCESS;
+		}
+		p->msi_stats = zalloc(IVT_TABLE_ENTRIES * sizeof(*st));
+		if (!p->msi_stats)
+			return OPAL_NO_MEM;
+	}
+
+	/* Counters of live interrupts may move while we copy them */
+	for (i = 0; stats && i < count; i++) {
+		st = &p->msi_stats[first + i];
+		stats[i].count = cpu_to_be64(st->count);
+		stats[i].q_refires = cpu_to_be64(st->q_refires);
+		stats[i].eoi_tb_total = cpu_to_be64(st->tb_total);
+		stats[i].eoi_tb_max = cpu_to_be64(st->tb_max);
+	}
+	if (flags & OPAL_PCI_MSI_STATS_RESET)
+		memset(p->msi_stats, 0, IVT_TABLE_ENTRIES * sizeof(*st));
+
+	/* Counters visible before lock-free EOIs start using them */
+	lwsync();
+	if (flags & OPAL_PCI_MSI_STATS_ENABLE)
+		p->msi_stats_on = true;
+	if (flags & OPAL_PCI_MSI_STATS_DISABLE)
+		p->msi_stats_on = false;
 
 	return OPAL_SUCCESS;
 }
@@ -1320,6 +1619,9 @@ static void phb3_err_ER_clear(struct phb3 *p)
 	uint64_t val64;
 	uint64_t fir = in_be64(p->regs + PHB_LEM_FIR_ACCUM);
 
+	/* Whatever diag data we kept is about to be stale */
+	p->diag_valid = false;
+
 	/* Rec 1: Grab the PCI config lock */
 	/* Removed... unnecessary. We have our own lock here */
 
@@ -1831,6 +2133,162 @@ static int64_t phb3_set_peltv(struct phb *phb,
 	return OPAL_SUCCESS;
 }
 
+/*
+ * Write back the dirty entries of a cached IODA table. Consecutive
+ * entries go out in auto-increment runs, and a single clean entry
+ * in the middle is rewritten rather than selecting the next one.
+ */
+static void phb3_ioda_flush(struct phb3 *p, uint32_t table,
+			    const uint64_t *cache, const uint64_t *dirty,
+			    uint32_t entries)
+{
+	uint32_t i, next = entries;
+
+	for (i = 0; i < entries; i++) {
+		if (!(dirty[i / 64] & (1ul << (i % 64))))
+			continue;
+		if (next + 1 == i)
+			out_be64(p->regs + PHB_IODA_DATA0, cache[next++]);
+		if (next != i)
+			phb3_ioda_sel(p, table, i, true);
+		out_be64(p->regs + PHB_IODA_DATA0, cache[i]);
+		next = i + 1;
+	}
+}
+
+static int64_t phb3_pe_op(struct phb3 *p, struct opal_pci_pe_op *op,
+			  uint32_t *rtt_first, uint32_t *rtt_last,
+			  uint64_t *m32d_dirty, uint64_t *tve_dirty)
+{
+	uint16_t pe = be16_to_cpu(op->pe_number);
+	uint32_t first, count, idx, i;
+	uint16_t window_id;
+	uint8_t *peltv;
+	uint64_t tve;
+	int64_t rc;
+
+	if (pe >= PHB3_MAX_PE_NUM)
+		return OPAL_PARAMETER;
+
+	switch (op->op) {
+	case OPAL_PCI_PE_OP_SET_RID:
+		first = be16_to_cpu(op->u.range.first);
+		count = be16_to_cpu(op->u.range.count);
+		if (!p->tbl_rtt)
+			return OPAL_HARDWARE;
+		if (op->action != OPAL_MAP_PE && op->action != OPAL_UNMAP_PE)
+			return OPAL_PARAMETER;
+		if (!count || first + count > RTT_TABLE_ENTRIES)
+			return OPAL_PARAMETER;
+
+		for (i = first; i < first + count; i++)
+			p->rte_cache[i] = op->action ? pe : 0xffff;
+		if (*rtt_first > first)
+			*rtt_first = first;
+		if (*rtt_last < first + count - 1)
+			*rtt_last = first + count - 1;
+		break;
+	case OPAL_PCI_PE_OP_SET_PELTV:
+		if (!p->tbl_peltv)
+			return OPAL_HARDWARE;
+		if (op->action > OPAL_ADD_PE_TO_DOMAIN)
+			return OPAL_PARAMETER;
+
+		idx = pe * (PHB3_MAX_PE_NUM / 8);
+		peltv = (uint8_t *)p->tbl_peltv + idx;
+		for (i = 0; i < PHB3_MAX_PE_NUM / 8; i++) {
+			if (op->action)
+				p->peltv_cache[idx + i] |= op->u.peltv[i];
+			else
+				p->peltv_cache[idx + i] &= ~op->u.peltv[i];
+			peltv[i] = p->peltv_cache[idx + i];
+		}
+		break;
+	case OPAL_PCI_PE_OP_MAP_M32:
+		first = be16_to_cpu(op->u.range.first);
+		count = be16_to_cpu(op->u.range.count);
+		if (!count || first + count > ARRAY_SIZE(p->m32d_cache))
+			return OPAL_PARAMETER;
+
+		for (i = first; i < first + count; i++) {
+			p->m32d_cache[i] = SETFIELD(IODA2_M32DT_PE, 0ull, pe);
+			m32d_dirty[i / 64] |= 1ul << (i % 64);
+		}
+		break;
+	case OPAL_PCI_PE_OP_MAP_M64:
+		/* The M64 BARs only hit the hardware when enabled */
+		return phb3_map_pe_mmio_window(&p->phb, pe,
+					       OPAL_M64_WINDOW_TYPE,
+					       be16_to_cpu(op->u.window_num),
+					       0);
+	case OPAL_PCI_PE_OP_MAP_TVE:
+		window_id = be16_to_cpu(op->u.tve.window_id);
+		rc = phb3_tve_encode(pe, window_id,
+				     be16_to_cpu(op->u.tve.tce_levels),
+				     be64_to_cpu(op->u.tve.tce_table_addr),
+				     be64_to_cpu(op->u.tve.tce_table_size),
+				     be64_to_cpu(op->u.tve.tce_page_size),
+				     &tve);
+		if (rc != OPAL_SUCCESS)
+			return rc;
+
+		p->tve_cache[window_id] = tve;
+		tve_dirty[window_id / 64] |= 1ul << (window_id % 64);
+		break;
+	default:
+		return OPAL_PARAMETER;
+	}
+
+	return OPAL_SUCCESS;
+}
+
+/*
+ * Apply a batch of PE assignments to the IODA caches first, then
+ * push them out: one copy of the touched RTT range followed by a
+ * single RTC invalidation, and auto-increment runs for the M32DT
+ * and TVT entries that changed.
+ */
+static int64_t phb3_set_pe_batch(struct phb *phb,
+				 struct opal_pci_pe_op *ops,
+				 uint32_t count)
+{
+	struct phb3 *p = phb_to_phb3(phb);
+	uint64_t m32d_dirty[ARRAY_SIZE(p->m32d_cache) / 64] = { 0 };
+	uint64_t tve_dirty[ARRAY_SIZE(p->tve_cache) / 64] = { 0 };
+	uint32_t rtt_first = RTT_TABLE_ENTRIES, rtt_last = 0;
+	int64_t rc, ret = OPAL_SUCCESS;
+	uint16_t *rte;
+	uint32_t i;
+
+	for (i = 0; i < count; i++) {
+		rc = phb3_pe_op(p, &ops[i], &rtt_first, &rtt_last,
+				m32d_dirty, tve_dirty);
+		ops[i].rc = cpu_to_be32(rc);
+		if (rc && ret == OPAL_SUCCESS)
+			ret = rc;
+	}
+
+	if (rtt_first <= rtt_last) {
+		rte = (uint16_t *)p->tbl_rtt;
+		memcpy(rte + rtt_first, p->rte_cache + rtt_first,
+		       (rtt_last - rtt_first + 1) * sizeof(*rte));
+		if (rtt_first == rtt_last)
+			out_be64(p->regs + PHB_RTC_INVALIDATE,
+				 SETFIELD(PHB_RTC_INVALIDATE_RID, 0ul,
+					  rtt_first));
+		else
+			out_be64(p->regs + PHB_RTC_INVALIDATE,
+				 PHB_RTC_INVALIDATE_ALL);
+	}
+
+	phb3_ioda_flush(p, IODA2_TBL_M32DT, p->m32d_cache, m32d_dirty,
+			ARRAY_SIZE(p->m32d_cache));
+	phb3_ioda_flush(p, IODA2_TBL_TVT, p->tve_cache, tve_dirty,
+			ARRAY_SIZE(p->tve_cache));
+
+	return ret;
+}
+
 static int64_t phb3_link_state(struct phb *phb)
 {
 	struct phb3 *p = phb_to_phb3(phb);
@@ -1942,13 +2400,27 @@ static void phb3_setup_for_link_up(struct phb3 *p)
 	}
 }
 
+/* Limit the target speed of the link and retrain it */
+static void phb3_set_link_gen(struct phb3 *p, unsigned int gen)
+{
+	uint16_t val;
+
+	p->link_gen = gen;
+	phb3_pcicfg_read16(&p->phb, 0, p->ecap + PCICAP_EXP_LCTL2, &val);
+	val = SETFIELD(PCICAP_EXP_LCTL2_TLSPD, val, gen);
+	phb3_pcicfg_write16(&p->phb, 0, p->ecap + PCICAP_EXP_LCTL2, val);
+	phb3_pcicfg_read16(&p->phb, 0, p->ecap + PCICAP_EXP_LCTL, &val);
+	phb3_pcicfg_write16(&p->phb, 0, p->ecap + PCICAP_EXP_LCTL,
+			    val | PCICAP_EXP_LCTL_LINK_RETRAIN);
+}
+
 static int64_t phb3_sm_link_poll(struct phb3 *p)
 {
 	uint64_t reg;
 
 	/* This is the state machine to wait for the link to come
-	 * up. Currently we just wait until we timeout, eventually
-	 * we want to add retries and fallback to Gen1.
+	 * up. If we have an electrical link but it doesn't train,
+	 * we retry one generation lower at a time down to Gen1.
 	 */
 	switch(p->state) {
 	case PHB3_STATE_WAIT_LINK_ELECTRICAL:
@@ -1991,9 +2463,16 @@ static int64_t phb3_sm_link_poll(struct phb3 *p)
 		if (p->retries-- == 0) {
 			PHBDBG(p, "Timeout waiting for link up\n");
 			PHBDBG(p, "DLP train control: 0x%016llx\n", reg);
-			/* No link, we still mark the PHB as functional */
-			p->state = PHB3_STATE_FUNCTIONAL;
-			return OPAL_SUCCESS;
+			if (p->link_gen <= 1) {
+				/* No link, we still mark the PHB as functional */
+				p->state = PHB3_STATE_FUNCTIONAL;
+				return OPAL_SUCCESS;
+			}
+
+			PHBINF(p, "Link training failed, fallback to Gen%d\n",
+			       p->link_gen - 1);
+			phb3_set_link_gen(p, p->link_gen - 1);
+			p->retries = PHB3_LINK_WAIT_RETRIES;
 		}
 		return phb3_set_sm_timeout(p, msecs_to_tb(100));
 	default:
@@ -2005,6 +2484,16 @@ static int64_t phb3_sm_link_poll(struct phb3 *p)
 
 static int64_t phb3_start_link_poll(struct phb3 *p)
 {
+	/*
+	 * Whatever made us fall back to a lower speed may be gone after
+	 * a reset (adapter replaced, reseated), start from the top again
+	 */
+	if (p->link_gen != p->max_link_speed) {
+		PHBDBG(p, "Restoring Gen%d target link speed\n",
+		       p->max_link_speed);
+		phb3_set_link_gen(p, p->max_link_speed);
+	}
+
 	/*
 	 * Wait for link up to 10s. However, we give up after
 	 * only a second if the electrical connection isn't
@@ -2230,6 +2719,7 @@ static int64_t phb3_sm_complete_reset(struct phb3 *p)
 	case PHB3_STATE_CRESET_REINIT:
 		p->flags &= ~PHB3_AIB_FENCED;
 		p->flags &= ~PHB3_CAPP_RECOVERY;
+		pci_cfg_shadow_flush(&p->phb);
 		phb3_init_hw(p);
 
 		p->state = PHB3_STATE_CRESET_FRESET;
@@ -2245,6 +2735,7 @@ static int64_t phb3_sm_complete_reset(struct phb3 *p)
 	/* Mark the PHB as dead and expect it to be removed */
 error:
 	p->state = PHB3_STATE_BROKEN;
+	pci_cfg_shadow_flush(&p->phb);
 	return OPAL_PARAMETER;
 }
 
@@ -2403,6 +2894,7 @@ static int64_t phb3_eeh_freeze_clear(struct phb *phb, uint64_t pe_number,
 	}
 	if (err != 0)
 		phb3_err_ER_clear(p);
+	p->diag_valid = false;
 
 	/*
 	 * We have PEEV in system memory. It would give more performance
@@ -2468,6 +2960,7 @@ static int64_t phb3_eeh_freeze_set(struct phb *phb, uint64_t pe_number,
 		data |= IODA2_PESTB_DMA_STOPPED;
 		out_be64(p->regs + PHB_IODA_DATA0, data);
 	}
+	p->diag_valid = false;
 
 	return OPAL_SUCCESS;
 }
@@ -2592,6 +3085,77 @@ static int64_t phb3_eeh_next_error(struct phb *phb,
 	return OPAL_SUCCESS;
 }
 
+/*
+ * Report every frozen PE at once. The PHB level summary is the same
+ * as phb3_eeh_next_error(), the frozen PEs come from the PEEV and
+ * their PESTs are read in one auto-increment run per table, from the
+ * first to the last frozen PE.
+ */
+static int64_t phb3_eeh_get_frozen_pes(struct phb *phb,
+				       struct opal_pci_frozen_pes *frozen)
+{
+	struct phb3 *p = phb_to_phb3(phb);
+	uint64_t first_pe, peev[4], pesta, pestb, *pest;
+	uint16_t pci_error_type, severity;
+	uint32_t i, n, lo = PHB3_MAX_PE_NUM, hi = 0;
+	struct opal_pci_frozen_pe *fpe;
+	int64_t rc;
+
+	memset(frozen, 0, sizeof(*frozen));
+	frozen->num_pes = cpu_to_be16(PHB3_MAX_PE_NUM);
+
+	rc = phb3_eeh_next_error(phb, &first_pe, &pci_error_type, &severity);
+	frozen->pci_error_type = cpu_to_be16(pci_error_type);
+	frozen->severity = cpu_to_be16(severity);
+	if (rc != OPAL_SUCCESS || pci_error_type != OPAL_EEH_PE_ERROR)
+		return rc;
+
+	phb3_ioda_sel(p, IODA2_TBL_PEEV, 0, true);
+	for (i = 0; i < ARRAY_SIZE(peev); i++) {
+		peev[i] = in_be64(p->regs + PHB_IODA_DATA0);
+		frozen->frozen[i] = cpu_to_be64(peev[i]);
+	}
+	for (i = 0; i < PHB3_MAX_PE_NUM; i++) {
+		if (!(peev[i / 64] & PPC_BIT(i % 64)))
+			continue;
+		if (lo > i)
+			lo = i;
+		hi = i;
+	}
+	if (lo > hi)
+		return OPAL_SUCCESS;
+
+	/* Error bits from the IODA, the rest from the in-memory PEST */
+	pest = (uint64_t *)p->tbl_pest;
+	phb3_ioda_sel(p, IODA2_TBL_PESTA, lo, true);
+	for (i = lo, n = 0; i <= hi; i++) {
+		pesta = in_be64(p->regs + PHB_IODA_DATA0);
+		if (!(peev[i / 64] & PPC_BIT(i % 64)))
+			continue;
+
+		fpe = &frozen->pes[n++];
+		fpe->pe_number = cpu_to_be16(i);
+		fpe->pesta = cpu_to_be64(pesta | pest[2 * i]);
+		if (pesta & IODA2_PESTA_MMIO_FROZEN)
+			fpe->freeze_state |= OPAL_EEH_STOPPED_MMIO_FREEZE;
+	}
+
+	phb3_ioda_sel(p, IODA2_TBL_PESTB, lo, true);
+	for (i = lo, n = 0; i <= hi; i++) {
+		pestb = in_be64(p->regs + PHB_IODA_DATA0);
+		if (!(peev[i / 64] & PPC_BIT(i % 64)))
+			continue;
+
+		fpe = &frozen->pes[n++];
+		fpe->pestb = cpu_to_be64(pestb | pest[2 * i + 1]);
+		if (pestb & IODA2_PESTB_DMA_STOPPED)
+			fpe->freeze_state |= OPAL_EEH_STOPPED_DMA_FREEZE;
+	}
+	frozen->num_frozen = cpu_to_be16(n);
+
+	return OPAL_SUCCESS;
+}
+
 static int64_t phb3_err_inject_finalize(struct phb3 *p, uint64_t addr,
 					uint64_t mask, uint64_t ctrl,
 					bool is_write)
@@ -2933,6 +3497,58 @@ static int64_t phb3_err_inject(struct phb *phb, uint32_t pe_no,
 	return handler(p, pe_no, addr, mask, is_write);
 }
 
+/*
+ * Reading the whole diag data takes a few hundred ASB accesses. The
+ * FIRs are sticky and a PE stays in the PEEV while frozen, so on top
+ * of those we look at the error status and log registers and the UTL
+ * status: as long as none of them has moved since the last read,
+ * nothing new was logged and the copy we have is still good. Anything
+ * clearing errors or freezes drops the copy.
+ */
+static const uint32_t phb3_diag_key_regs[PHB3_DIAG_KEY_REGS] = {
+	PHB_LEM_FIR_ACCUM,
+	PHB_ERR_STATUS,		PHB_ERR1_STATUS,
+	PHB_ERR_LOG_0,		PHB_ERR_LOG_1,
+	PHB_OUT_ERR_STATUS,	PHB_OUT_ERR1_STATUS,
+	PHB_OUT_ERR_LOG_0,	PHB_OUT_ERR_LOG_1,
+	PHB_INA_ERR_STATUS,	PHB_INA_ERR1_STATUS,
+	PHB_INA_ERR_LOG_0,	PHB_INA_ERR_LOG_1,
+	PHB_INB_ERR_STATUS,	PHB_INB_ERR1_STATUS,
+	PHB_INB_ERR_LOG_0,	PHB_INB_ERR_LOG_1,
+	UTL_SYS_BUS_AGENT_STATUS,
+	UTL_PCIE_PORT_STATUS,
+	UTL_RC_STATUS,
+};
+
+static bool phb3_diag_cached(struct phb3 *p)
+{
+	uint64_t nfir, regs[PHB3_DIAG_KEY_REGS], peev[4];
+	bool same;
+	uint32_t i;
+
+	if (p->flags & PHB3_AIB_FENCED) {
+		p->diag_valid = false;
+		return false;
+	}
+
+	xscom_read(p->chip_id, p->pe_xscom + 0x0, &nfir);
+	for (i = 0; i < ARRAY_SIZE(regs); i++)
+		regs[i] = phb3_read_reg_asb(p, phb3_diag_key_regs[i]);
+	phb3_ioda_sel(p, IODA2_TBL_PEEV, 0, true);
+	for (i = 0; i < ARRAY_SIZE(peev); i++)
+		peev[i] = in_be64(p->regs + PHB_IODA_DATA0);
+
+	same = p->diag_valid && nfir == p->diag_nfir &&
+	       !memcmp(regs, p->diag_regs, sizeof(regs)) &&
+	       !memcmp(peev, p->diag_peev, sizeof(peev));
+
+	p->diag_nfir = nfir;
+	memcpy(p->diag_regs, regs, sizeof(regs));
+	memcpy(p->diag_peev, peev, sizeof(peev));
+
+	return same;
+}
+
 static int64_t phb3_get_diag_data(struct phb *phb,
 				  void *diag_buffer,
 				  uint64_t diag_buffer_len)
@@ -2950,7 +3566,11 @@ static int64_t phb3_get_diag_data(struct phb *phb,
 	 * whether to use ASB or AIB
 	 */
 	phb3_fenced(p);
-	phb3_read_phb_status(p, data);
+	if (!phb3_diag_cached(p)) {
+		phb3_read_phb_status(p, &p->diag);
+		p->diag_valid = !(p->flags & PHB3_AIB_FENCED);
+	}
+	memcpy(data, &p->diag, sizeof(*data));
 
 	/*
 	 * We're running to here probably because of errors
@@ -2962,6 +3582,7 @@ static int64_t phb3_get_diag_data(struct phb *phb,
 	    p->err.err_src == PHB3_ERR_SRC_PHB) {
 		phb3_err_ER_clear(p);
 		phb3_set_err_pending(p, false);
+		p->diag_valid = false;
 	}
 
 	return OPAL_SUCCESS;
@@ -3308,12 +3929,15 @@ static const struct phb_ops phb3_ops = {
 	.map_pe_mmio_window	= phb3_map_pe_mmio_window,
 	.map_pe_dma_window	= phb3_map_pe_dma_window,
 	.map_pe_dma_window_real = phb3_map_pe_dma_window_real,
-	.pci_msi_eoi		= phb3_pci_msi_eoi,
+	.tce_batch		= phb3_tce_batch,
+	.pci_msi_eoi_nolock	= phb3_pci_msi_eoi,
+	.msi_stats		= phb3_msi_stats,
 	.set_xive_pe		= phb3_set_ive_pe,
 	.get_msi_32		= phb3_get_msi_32,
 	.get_msi_64		= phb3_get_msi_64,
 	.set_pe			= phb3_set_pe,
 	.set_peltv		= phb3_set_peltv,
+	.set_pe_batch		= phb3_set_pe_batch,
 	.link_state		= phb3_link_state,
 	.power_state		= phb3_power_state,
 	.slot_power_off		= phb3_slot_power_off,
@@ -3326,6 +3950,7 @@ static const struct phb_ops phb3_ops = {
 	.eeh_freeze_clear	= phb3_eeh_freeze_clear,
 	.eeh_freeze_set		= phb3_eeh_freeze_set,
 	.next_error		= phb3_eeh_next_error,
+	.get_frozen_pes		= phb3_eeh_get_frozen_pes,
 	.err_inject		= phb3_err_inject,
 	.get_diag_data		= NULL,
 	.get_diag_data2		= phb3_get_diag_data,
@@ -4114,6 +4739,7 @@ static void phb3_create(struct dt_node *np)
 	if (dt_has_node_property(np, "ibm,capp-ucode", NULL))
 		p->capp_ucode_base = dt_prop_get_u32(np, "ibm,capp-ucode");
 	p->max_link_speed = dt_prop_get_u32_def(np, "ibm,max-link-speed", 3);
+	p->link_gen = p->max_link_speed;
 	p->state = PHB3_STATE_UNINITIALIZED;
 
 	if (!phb3_calculate_windows(p))
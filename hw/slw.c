@@ -59,12 +59,14 @@ DEFINE_LOG_ENTRY(OPAL_RC_SLW_REG, OPAL_PLATFORM_ERR_EVT, OPAL_SLW,
 		 OPAL_PLATFORM_FIRMWARE, OPAL_INFO,
 		 OPAL_NA, NULL);
 
-static void slw_do_rvwinkle(void *data)
+/* How long CPUs get to change state, and cores to reach winkle */
+#define SLW_CALLIN_TIMEOUT_MS	1000
+#define SLW_WINKLE_TIMEOUT_MS	1000
+
+static void slw_do_rvwinkle(void *data __unused)
 {
 	struct cpu_thread *cpu = this_cpu();
-	struct cpu_thread *master = data;
 	uint64_t lpcr = mfspr(SPR_LPCR);
-	struct proc_chip *chip;
 
 	/* Setup our ICP to receive IPIs */
 	icp_prep_for_rvwinkle();
@@ -93,50 +95,114 @@ static void slw_do_rvwinkle(void *data)
 
 	/* Restore LPCR */
 	mtspr(SPR_LPCR, lpcr);
+}
 
-	/* If we are passed a master pointer we are the designated
-	 * waker, let's proceed. If not, return, we are finished.
-	 */
-	if (!master)
-		return;
+static bool slw_not_down(struct cpu_thread *cpu, void *data)
+{
+	return cpu != data && cpu->state == cpu_state_active;
+}
+
+/* The CPUs in rvwinkle on @core, or on every other core */
+struct slw_wake {
+	struct cpu_thread	*core;
+	bool			on_core;
+};
+
+static bool slw_wake_pending(struct cpu_thread *cpu, void *data)
+{
+	struct slw_wake *w = data;
+
+	if (cpu->state != cpu_state_rvwinkle || cpu == w->core)
+		return false;
+	return cpu_is_sibling(cpu, w->core) == w->on_core;
+}
+
+/* Kick them all, then wait for them all to be back */
+static unsigned int slw_wake_cpus(struct cpu_thread *core, bool on_core)
+{
+	struct slw_wake w = { .core = core, .on_core = on_core };
+	struct cpu_thread *cpu;
+
+	for_each_cpu(cpu) {
+		if (slw_wake_pending(cpu, &w))
+			icp_kick_cpu(cpu);
+	}
+	return cpu_barrier("waking up", slw_wake_pending, &w,
+			   SLW_CALLIN_TIMEOUT_MS);
+}
+
+static bool slw_core_in_winkle(struct cpu_thread *c, uint64_t *hist)
+{
+	int rc;
+
+	rc = xscom_read(c->chip_id,
+			XSCOM_ADDR_P8_EX_SLAVE(pir_to_core_id(c->pir),
+					       EX_PM_IDLE_STATE_HISTORY_PHYP),
+			hist);
+	/* Can't tell, don't hold everybody up for it */
+	if (rc)
+		return true;
+	return GETFIELD(EX_PM_IDLE_ST_HIST_PM_STATE, *hist) !=
+		EX_PM_IDLE_ST_HIST_PM_STATE_RUN;
+}
+
+/*
+ * Poll the idle state history of the cores picked like slw_wake_cpus()
+ * does until they have all left the run state, which is when the SLW
+ * engine has them in winkle.
+ */
+static unsigned int slw_wait_winkle(struct cpu_thread *core, bool on_core)
+{
+	unsigned long end = mftb() + msecs_to_tb(SLW_WINKLE_TIMEOUT_MS);
+	struct proc_chip *chip;
+	struct cpu_thread *c;
+	unsigned int left;
+	uint64_t hist;
+	bool timeout;
+
+	for (;;) {
+		timeout = tb_compare(mftb(), end) == TB_AAFTERB;
+		left = 0;
+		for_each_chip(chip) {
+			for_each_available_core_in_chip(c, chip->id) {
+				if (cpu_is_sibling(c, core) != on_core)
+					continue;
+				if (slw_core_in_winkle(c, &hist))
+					continue;
+				left++;
+				if (timeout)
+					prerror("SLW: core %x:%x not in winkle"
+						" after %d ms, history: "
+						"0x%016llx\n", chip->id,
+						pir_to_core_id(c->pir),
+						SLW_WINKLE_TIMEOUT_MS, hist);
+			}
+		}
+		if (!left || timeout)
+			return left;
+		time_wait_us(100);
+	}
+}
+
+/* Runs on the waker, once the master is down it brings its core back */
+static void slw_wake_master(void *data)
+{
+	struct cpu_thread *master = data;
 
 	prlog(PR_DEBUG, "SLW: CPU PIR 0x%04x waiting for master...\n",
-	      cpu->pir);
+	      this_cpu()->pir);
 
 	/* Allriiiight... now wait for master to go down */
 	while(master->state != cpu_state_rvwinkle)
 		sync();
 
-	/* XXX Wait one second ! (should check xscom state ? ) */
-	time_wait_ms(1000);
-
-	for_each_chip(chip) {
-		struct cpu_thread *c;
-		uint64_t tmp;
-		for_each_available_core_in_chip(c, chip->id) {
-			xscom_read(chip->id,
-				 XSCOM_ADDR_P8_EX_SLAVE(pir_to_core_id(c->pir),
-							EX_PM_IDLE_STATE_HISTORY_PHYP),
-				   &tmp);	
-			prlog(PR_TRACE, "SLW: core %x:%x"
-			      " history: 0x%016llx (mid2)\n",
-			      chip->id, pir_to_core_id(c->pir),
-			      tmp);
-		}
-	}
+	/* And for its whole core to be in winkle */
+	slw_wait_winkle(master, true);
 
 	prlog(PR_DEBUG, "SLW: Waking master (PIR 0x%04x)...\n", master->pir);
 
 	/* Now poke all the secondary threads on the master's core */
-	for_each_cpu(cpu) {
-		if (!cpu_is_sibling(cpu, master) || (cpu == master))
-			continue;
-		icp_kick_cpu(cpu);
-
-		/* Wait for it to claim to be back (XXX ADD TIMEOUT) */
-		while(cpu->state != cpu_state_active)
-			sync();
-	}
+	slw_wake_cpus(master, true);
 
 	/* Now poke the master and be gone */
 	icp_kick_cpu(master);
@@ -739,8 +805,7 @@ static inline void slw_patch_scans(struct proc_chip *chip __unused,
 int64_t slw_reinit(uint64_t flags)
 {
 	struct proc_chip *chip;
-	struct cpu_thread *cpu;
-	bool has_waker = false;
+	struct cpu_thread *cpu, *waker = NULL;
 	bool target_le = slw_current_le;
 
 #ifndef __HAVE_LIBPORE__
@@ -760,6 +825,25 @@ int64_t slw_reinit(uint64_t flags)
 	      this_cpu()->pir,
 	      target_le ? "little" : "big");
 
+	/* Pick up a waker for myself: it must not be a sibling of
+	 * the current CPU and must be a thread 0 (so it gets to
+	 * sync its timebase before doing time_wait_ms()
+	 */
+	for_each_available_cpu(cpu) {
+		if (!cpu_is_sibling(cpu, this_cpu()) && cpu_is_thread0(cpu)) {
+			waker = cpu;
+			break;
+		}
+	}
+
+	/* If we didn't find one, that means we had no other core in
+	 * the system, we can't do it
+	 */
+	if (!waker) {
+		prlog(PR_TRACE, "SLW: No candidate waker, giving up !\n");
+		return OPAL_HARDWARE;
+	}
+
 	/* Prepare chips/cores for rvwinkle */
 	for_each_chip(chip) {
 		if (!chip->slw_base) {
@@ -776,66 +860,33 @@ int64_t slw_reinit(uint64_t flags)
 
 	slw_patch_reset();
 
-	/* rvwinkle everybody and pick one to wake me once I rvwinkle myself */
+	/* rvwinkle everybody at once, then wait for them to be down */
 	for_each_available_cpu(cpu) {
-		struct cpu_thread *master = NULL;
-
-		if (cpu == this_cpu())
-			continue;
-
-		/* Pick up a waker for myself: it must not be a sibling of
-		 * the current CPU and must be a thread 0 (so it gets to
-		 * sync its timebase before doing time_wait_ms()
-		 */
-		if (!has_waker && !cpu_is_sibling(cpu, this_cpu()) &&
-		    cpu_is_thread0(cpu)) {
-			has_waker = true;
-			master = this_cpu();
-		}
-		__cpu_queue_job(cpu, slw_do_rvwinkle, master, true);
-
-		/* Wait for it to claim to be down */
-		while(cpu->state != cpu_state_rvwinkle)
-			sync();		
+		if (cpu != this_cpu())
+			__cpu_queue_job(cpu, slw_do_rvwinkle, NULL, true);
 	}
-
-	/* XXX Wait one second ! (should check xscom state ? ) */
-	prlog(PR_TRACE, "SLW: Waiting one second...\n");
-	time_wait_ms(1000);
-	prlog(PR_TRACE, "SLW: Done.\n");
-
-	for_each_chip(chip) {
-		struct cpu_thread *c;
-		uint64_t tmp;
-		for_each_available_core_in_chip(c, chip->id) {
-			xscom_read(chip->id,
-				 XSCOM_ADDR_P8_EX_SLAVE(pir_to_core_id(c->pir),
-							EX_PM_IDLE_STATE_HISTORY_PHYP),
-				   &tmp);
-			prlog(PR_DEBUG, "SLW: core %x:%x"
-			      " history: 0x%016llx (mid)\n",
-			      chip->id, pir_to_core_id(c->pir), tmp);
-		}
+	if (cpu_barrier("entering rvwinkle", slw_not_down, this_cpu(),
+			SLW_CALLIN_TIMEOUT_MS)) {
+		/* Bring back those that made it */
+		slw_wake_cpus(this_cpu(), false);
+		slw_wake_cpus(this_cpu(), true);
+		slw_unpatch_reset();
+		return OPAL_HARDWARE;
 	}
 
+	/* Wait for the other cores to actually get into winkle */
+	slw_wait_winkle(this_cpu(), false);
 
 	/* Wake everybody except on my core */
-	for_each_cpu(cpu) {
-		if (cpu->state != cpu_state_rvwinkle ||
-		    cpu_is_sibling(cpu, this_cpu()))
-			continue;
-		icp_kick_cpu(cpu);
-
-		/* Wait for it to claim to be back (XXX ADD TIMEOUT) */
-		while(cpu->state != cpu_state_active)
-			sync();
-	}
-
-	/* Did we find a waker ? If we didn't, that means we had no
-	 * other core in the system, we can't do it
-	 */
-	if (!has_waker) {
-		prlog(PR_TRACE, "SLW: No candidate waker, giving up !\n");
+	slw_wake_cpus(this_cpu(), false);
+
+	/* Hand over to the waker, it brings my core back once I'm down */
+	if (waker->state != cpu_state_active ||
+	    !__cpu_queue_job(waker, slw_wake_master, this_cpu(), true)) {
+		prerror("SLW: Waker PIR 0x%04x isn't back, giving up !\n",
+			waker->pir);
+		slw_wake_cpus(this_cpu(), true);
+		slw_unpatch_reset();
 		return OPAL_HARDWARE;
 	}
 
@@ -0,0 +1,390 @@
+/* Copyright 2013-2014 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#define __TEST__
+#include <timebase.h>
+
+static uint64_t stamp = 1;
+#define mftb()	(stamp)
+
+#define zalloc(bytes) calloc((bytes), 1)
+
+#include "../bt.c"
+#include "../../core/ipmi.c"
+
+/*
+ * Simulated BT interface. The host side registers behave like the
+ * hardware, the BMC side accepts requests into a small table and
+ * answers them in a configurable order.
+ */
+#define SIM_IO_BASE	0xe4
+#define SIM_MAX_REQ	16
+
+struct sim_req {
+	uint8_t data[IPMI_MAX_REQ_SIZE + BT_MIN_REQ_LEN + 1];
+	int len;
+};
+
+static struct {
+	uint8_t ctrl;
+	uint8_t intmask;
+	uint8_t h2b[IPMI_MAX_REQ_SIZE + BT_MIN_REQ_LEN + 1];
+	int h2b_len;
+	uint8_t b2h[IPMI_MAX_RESP_SIZE + BT_MIN_RESP_LEN + 1];
+	int b2h_rd;
+
+	struct sim_req reqs[SIM_MAX_REQ];
+	int nreqs;
+	int max_outstanding;
+	int resets;
+
+	bool accept;		/* Pick up requests from H2B */
+	bool respond;		/* Send responses */
+	bool lifo;		/* Answer the newest request first */
+	uint8_t caps_num_requests;
+
+	uint8_t order[64];	/* Tags in the order requests were accepted */
+	int norder;
+} sim;
+
+static void sim_reset(void)
+{
+	memset(&sim, 0, sizeof(sim));
+	sim.accept = true;
+	sim.respond = true;
+	sim.caps_num_requests = 4;
+}
+
+int64_t lpc_write(enum OpalLPCAddressType addr_type, uint32_t addr,
+		  uint32_t data, uint32_t sz)
+{
+	assert(addr_type == OPAL_LPC_IO && sz == 1);
+
+	switch (addr - SIM_IO_BASE) {
+	case BT_CTRL:
+		if (data & BT_CTRL_CLR_WR_PTR)
+			sim.h2b_len = 0;
+		if (data & BT_CTRL_CLR_RD_PTR)
+			sim.b2h_rd = 0;
+		if (data & BT_CTRL_H2B_ATN)
+			sim.ctrl |= BT_CTRL_H2B_ATN;
+		if (data & BT_CTRL_B2H_ATN)
+			sim.ctrl &= ~BT_CTRL_B2H_ATN;
+		if (data & BT_CTRL_SMS_ATN)
+			sim.ctrl &= ~BT_CTRL_SMS_ATN;
+		if (data & BT_CTRL_H_BUSY)
+			sim.ctrl ^= BT_CTRL_H_BUSY;
+		break;
+	case BT_HOST2BMC:
+		assert(sim.h2b_len < sizeof(sim.h2b));
+		sim.h2b[sim.h2b_len++] = data;
+		break;
+	case BT_INTMASK:
+		if (data & BT_INTMASK_BMC_HWRST)
+			sim.resets++;
+		if (data & BT_INTMASK_B2H_IRQ)
+			sim.intmask &= ~BT_INTMASK_B2H_IRQ;
+		sim.intmask = (sim.intmask & ~BT_INTMASK_B2H_IRQEN) |
+			(data & BT_INTMASK_B2H_IRQEN);
+		break;
+	default:
+		assert(0);
+	}
+	return OPAL_SUCCESS;
+}
+
+int64_t lpc_read(enum OpalLPCAddressType addr_type, uint32_t addr,
+		 uint32_t *data, uint32_t sz)
+{
+	assert(addr_type == OPAL_LPC_IO && sz == 1);
+
+	switch (addr - SIM_IO_BASE) {
+	case BT_CTRL:
+		*data = sim.ctrl;
+		break;
+	case BT_HOST2BMC:
+		assert(sim.b2h_rd < sizeof(sim.b2h));
+		*data = sim.b2h[sim.b2h_rd++];
+		break;
+	case BT_INTMASK:
+		*data = sim.intmask;
+		break;
+	default:
+		assert(0);
+	}
+	return OPAL_SUCCESS;
+}
+
+/* One step of the BMC: pick up a request and/or post a response */
+static void sim_bmc_step(void)
+{
+	struct sim_req *req;
+	int i, idx;
+
+	if ((sim.ctrl & BT_CTRL_H2B_ATN) && sim.accept) {
+		assert(sim.nreqs < SIM_MAX_REQ);
+		req = &sim.reqs[sim.nreqs++];
+		req->len = sim.h2b_len;
+		memcpy(req->data, sim.h2b, sim.h2b_len);
+		assert(req->data[0] == req->len - 1);
+		if (req->len > 4)
+			sim.order[sim.norder++] = req->data[4];
+		if (sim.nreqs > sim.max_outstanding)
+			sim.max_outstanding = sim.nreqs;
+		sim.ctrl &= ~BT_CTRL_H2B_ATN;
+	}
+
+	if (!sim.respond || !sim.nreqs ||
+	    (sim.ctrl & (BT_CTRL_B2H_ATN | BT_CTRL_H_BUSY)))
+		return;
+
+	idx = sim.lifo ? sim.nreqs - 1 : 0;
+	req = &sim.reqs[idx];
+
+	/* Length, netfn, seq, cmd, cc then data */
+	sim.b2h[1] = req->data[1] + (1 << 2);
+	sim.b2h[2] = req->data[2];
+	sim.b2h[3] = req->data[3];
+	sim.b2h[4] = IPMI_CC_NO_ERROR;
+	if (req->data[1] >> 2 == IPMI_NETFN_APP &&
+	    req->data[3] == IPMI_CMD(IPMI_GET_BT_CAPS)) {
+		sim.b2h[5] = sim.caps_num_requests;
+		sim.b2h[6] = 0x3f;
+		sim.b2h[7] = 0x3f;
+		sim.b2h[8] = 5;
+		sim.b2h[9] = 1;
+		sim.b2h[0] = BT_MIN_RESP_LEN + 5;
+	} else {
+		/* Echo the tag (first data byte) back */
+		sim.b2h[5] = req->len > 4 ? req->data[4] : 0;
+		sim.b2h[0] = BT_MIN_RESP_LEN + 1;
+	}
+
+	for (i = idx; i < sim.nreqs - 1; i++)
+		sim.reqs[i] = sim.reqs[i + 1];
+	sim.nreqs--;
+
+	sim.ctrl |= BT_CTRL_B2H_ATN;
+}
+
+static void sim_run(int steps)
+{
+	while (steps--) {
+		sim_bmc_step();
+		bt_poll(NULL, NULL);
+	}
+}
+
+/* Device tree stubs, just enough for bt_init() */
+struct dt_node *dt_root;
+static struct dt_property fake_reg;
+static struct dt_node fake_node;
+
+struct dt_node *dt_find_compatible_node(struct dt_node __unused *root,
+					struct dt_node __unused *prev,
+					const char __unused *compat)
+{
+	return &fake_node;
+}
+
+const struct dt_property *dt_find_property(const struct dt_node __unused *node,
+					   const char __unused *name)
+{
+	return &fake_reg;
+}
+
+u32 dt_property_get_cell(const struct dt_property __unused *prop, u32 index)
+{
+	return index ? SIM_IO_BASE : OPAL_LPC_IO;
+}
+
+/* Other stubs */
+void lock(struct lock __unused *l)
+{
+}
+
+void unlock(struct lock __unused *l)
+{
+}
+
+bool try_lock(struct lock __unused *l)
+{
+	return true;
+}
+
+void init_timer(struct timer *t, timer_func_t expiry, void *data)
+{
+	t->expiry = expiry;
+	t->user_data = data;
+}
+
+uint64_t schedule_timer(struct timer *t, uint64_t how_long)
+{
+	t->target = how_long;
+	return stamp;
+}
+
+void prlog(int __unused log_level, const __unused char* fmt, ...)
+{
+}
+
+uint64_t opal_dynamic_event_alloc(void)
+{
+	return 1;
+}
+
+void time_wait_ms(unsigned long __unused ms)
+{
+	sim_run(1);
+}
+
+void ipmi_parse_sel(struct ipmi_msg __unused *msg)
+{
+}
+
+void ipmi_wdt_stop(void)
+{
+}
+
+/* Test messages carry a tag in their first data byte that the BMC
+ * echoes back */
+static int done_count, err_count;
+static uint8_t done_order[64];
+
+static void test_complete(struct ipmi_msg *msg)
+{
+	assert(msg->resp_size == 1);
+	assert(msg->data[0] == (uintptr_t)msg->user_data);
+	done_order[done_count++] = msg->data[0];
+	ipmi_free_msg(msg);
+}
+
+static void test_error(struct ipmi_msg *msg)
+{
+	assert(msg->cc == IPMI_TIMEOUT_ERR);
+	err_count++;
+	ipmi_free_msg(msg);
+}
+
+static int queue_test_msg(uint8_t tag, bool host)
+{
+	struct ipmi_msg *msg;
+	int rc;
+
+	msg = ipmi_mkmsg(IPMI_DEFAULT_INTERFACE, IPMI_GET_SEL_INFO,
+			 test_complete, (void *)(uintptr_t)tag, &tag, 1, 1);
+	assert(msg);
+	msg->error = test_error;
+	msg->host_req = host;
+	rc = ipmi_queue_msg(msg);
+	if (rc)
+		ipmi_free_msg(msg);
+	return rc;
+}
+
+static void reset_counts(void)
+{
+	done_count = err_count = 0;
+	sim.norder = 0;
+	sim.max_outstanding = 0;
+}
+
+int main(void)
+{
+	int i;
+
+	sim_reset();
+	bt_init();
+	assert(bt.caps.num_requests == 1);
+
+	/* The capabilities come back and open up the pipeline */
+	sim_run(4);
+	assert(bt.caps.num_requests == 4);
+	assert(bt.msg_timeout == secs_to_tb(5));
+	assert(bt.queue_len == 0 && bt.inflight == 0);
+
+	/* Several requests outstanding, answered out of order */
+	reset_counts();
+	sim.respond = false;
+	for (i = 0; i < 8; i++)
+		assert(queue_test_msg(i, false) == 0);
+	sim_run(20);
+	assert(sim.max_outstanding == 4);
+	assert(bt.inflight == 4);
+	sim.respond = true;
+	sim.lifo = true;
+	sim_run(40);
+	assert(done_count == 8 && err_count == 0);
+	assert(done_order[0] == 3);
+	assert(bt.queue_len == 0 && bt.inflight == 0);
+	assert(bt.stats.max_inflight == 4);
+	sim.lifo = false;
+
+	/* Host requests overtake queued firmware requests */
+	reset_counts();
+	sim.accept = false;
+	for (i = 0; i < 4; i++)
+		assert(queue_test_msg(0x10 + i, false) == 0);
+	assert(queue_test_msg(0x20, true) == 0);
+	assert(queue_test_msg(0x21, true) == 0);
+	sim.accept = true;
+	sim_run(40);
+	assert(done_count == 6);
+	/* The first firmware request was already in the H2B buffer */
+	assert(sim.order[0] == 0x10);
+	assert(sim.order[1] == 0x20);
+	assert(sim.order[2] == 0x21);
+	assert(sim.order[3] == 0x11);
+
+	/* Backpressure on the host, firmware messages are never dropped */
+	reset_counts();
+	sim.accept = false;
+	for (i = 0; i < BT_MAX_QUEUE_LEN; i++)
+		assert(queue_test_msg(0x30 + i, true) == 0);
+	assert(queue_test_msg(0x3f, true) == OPAL_BUSY);
+	for (i = 0; i < 2 * BT_MAX_QUEUE_LEN; i++)
+		assert(queue_test_msg(0x40 + i, false) == 0);
+	assert(bt.stats.rejected == 1);
+	sim.accept = true;
+	sim_run(100);
+	assert(done_count == 3 * BT_MAX_QUEUE_LEN && err_count == 0);
+	assert(queue_test_msg(0x3f, true) == 0);
+	sim_run(10);
+	assert(done_count == 3 * BT_MAX_QUEUE_LEN + 1);
+
+	/* Requests the BMC never answers time out individually */
+	reset_counts();
+	sim.respond = false;
+	assert(queue_test_msg(0x50, false) == 0);
+	assert(queue_test_msg(0x51, false) == 0);
+	sim_run(10);
+	assert(bt.inflight == 2);
+	stamp += bt.msg_timeout + 1;
+	sim_run(1);
+	assert(err_count == 2 && bt.queue_len == 0 && bt.inflight == 0);
+	assert(sim.resets == 1);
+
+	/* A late response to an expired request is discarded */
+	sim.respond = true;
+	sim_run(10);
+	assert(bt.stats.unmatched == 2);
+	assert(done_count == 0);
+
+	return 0;
+}
@@ -0,0 +1,389 @@
+/* Copyright 2013-2014 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+/* processor.h has its own sync() */
+#define sync	__skiboot_sync
+
+#define zalloc(bytes) calloc((bytes), 1)
+
+#include "../lpc-uart.c"
+
+/*
+ * Simulated 16550 on LPC IO space. The transmitter shifts one byte
+ * out of the 16 entry FIFO for every SIM_TICKS_PER_BYTE register
+ * accesses, which stands in for the line rate.
+ */
+#define SIM_IO_BASE		0x3f8
+#define SIM_FIFO_SIZE		16
+#define SIM_TICKS_PER_BYTE	4
+#define SIM_OUT_MAX		(256 * 1024)
+
+static struct {
+	uint8_t fifo[SIM_FIFO_SIZE];
+	int fifo_len;
+	unsigned long ticks;
+
+	uint8_t ier;
+	uint8_t lcr;
+
+	uint8_t out[SIM_OUT_MAX];
+	size_t out_len;
+
+	unsigned long lsr_reads;
+	unsigned long thr_writes;
+	unsigned long overruns;
+} sim;
+
+static void sim_tick(void)
+{
+	if (++sim.ticks % SIM_TICKS_PER_BYTE || !sim.fifo_len)
+		return;
+
+	assert(sim.out_len < SIM_OUT_MAX);
+	sim.out[sim.out_len++] = sim.fifo[0];
+	memmove(sim.fifo, sim.fifo + 1, --sim.fifo_len);
+}
+
+/* Let the line run until the FIFO is empty */
+static void sim_drain(void)
+{
+	while (sim.fifo_len)
+		sim_tick();
+}
+
+int64_t lpc_write(enum OpalLPCAddressType addr_type, uint32_t addr,
+		  uint32_t data, uint32_t sz)
+{
+	assert(addr_type == OPAL_LPC_IO && sz == 1);
+	sim_tick();
+
+	switch (addr - SIM_IO_BASE) {
+	case REG_THR:
+		if (sim.lcr & LCR_DLAB)
+			break;
+		sim.thr_writes++;
+		if (sim.fifo_len == SIM_FIFO_SIZE) {
+			sim.overruns++;
+			break;
+		}
+		sim.fifo[sim.fifo_len++] = data;
+		break;
+	case REG_IER:
+		if (!(sim.lcr & LCR_DLAB))
+			sim.ier = data;
+		break;
+	case REG_LCR:
+		sim.lcr = data;
+		break;
+	}
+	return OPAL_SUCCESS;
+}
+
+int64_t lpc_read(enum OpalLPCAddressType addr_type, uint32_t addr,
+		 uint32_t *data, uint32_t sz)
+{
+	assert(addr_type == OPAL_LPC_IO && sz == 1);
+	sim_tick();
+
+	switch (addr - SIM_IO_BASE) {
+	case REG_LSR:
+		sim.lsr_reads++;
+		*data = sim.fifo_len ? 0 : LSR_THRE | LSR_TEMT;
+		break;
+	case REG_LCR:
+		*data = sim.lcr;
+		break;
+	case REG_IER:
+		*data = sim.ier;
+		break;
+	default:
+		*data = 0;
+	}
+	return OPAL_SUCCESS;
+}
+
+void cpu_relax(void)
+{
+	sim_tick();
+}
+
+/* Other stubs */
+void lock(struct lock __unused *l)
+{
+}
+
+void unlock(struct lock __unused *l)
+{
+}
+
+void prlog(int __unused log_level, const __unused char* fmt, ...)
+{
+}
+
+void trace_add(union trace __unused *trace, u8 __unused type,
+	       u16 __unused len)
+{
+}
+
+void opal_update_pending_evt(uint64_t __unused evt_mask,
+			     uint64_t __unused evt_values)
+{
+}
+
+/* Device tree and OPAL stubs for uart_init() */
+static struct dt_node fake_node;
+static struct dt_property fake_reg;
+struct dt_node *dt_root, *dt_chosen, *opal_node;
+
+static struct con_ops *console;
+static void (*poller)(void *data);
+
+struct dt_node *dt_find_compatible_node(struct dt_node __unused *root,
+					struct dt_node __unused *prev,
+					const char __unused *compat)
+{
+	return &fake_node;
+}
+
+const struct dt_property *dt_find_property(const struct dt_node __unused *node,
+					   const char __unused *name)
+{
+	return &fake_reg;
+}
+
+u32 dt_property_get_cell(const struct dt_property __unused *prop, u32 index)
+{
+	return index ? SIM_IO_BASE : OPAL_LPC_IO;
+}
+
+u32 dt_prop_get_u32(const struct dt_node __unused *node, const char *prop)
+{
+	if (!strcmp(prop, "current-speed"))
+		return 115200;
+	if (!strcmp(prop, "clock-frequency"))
+		return 1843200;
+	return 0;
+}
+
+struct dt_property *__dt_add_property_cells(struct dt_node __unused *node,
+					    const char __unused *name,
+					    int __unused count, ...)
+{
+	return NULL;
+}
+
+struct dt_property *__dt_add_property_strings(struct dt_node __unused *node,
+					      const char __unused *name,
+					      int __unused count, ...)
+{
+	return NULL;
+}
+
+struct dt_property *dt_add_property_string(struct dt_node __unused *node,
+					   const char __unused *name,
+					   const char __unused *value)
+{
+	return NULL;
+}
+
+struct dt_node *dt_new(struct dt_node __unused *parent,
+		       const char __unused *name)
+{
+	return &fake_node;
+}
+
+struct dt_node *dt_new_addr(struct dt_node __unused *parent,
+			    const char __unused *name,
+			    uint64_t __unused unit_addr)
+{
+	return &fake_node;
+}
+
+char *dt_get_path(const struct dt_node __unused *node)
+{
+	return NULL;
+}
+
+void log_simple_error(struct opal_err_info __unused *e_info,
+		      const char __unused *fmt, ...)
+{
+}
+
+bool lpc_present(void)
+{
+	return true;
+}
+
+void lpc_used_by_console(void)
+{
+}
+
+void set_console(struct con_ops *driver)
+{
+	console = driver;
+}
+
+uint32_t get_psi_interrupt(uint32_t __unused chip_id)
+{
+	return 0;
+}
+
+uint32_t get_ics_phandle(void)
+{
+	return 0;
+}
+
+void __opal_register(uint64_t __unused token, void __unused *func,
+		     unsigned __unused num_args)
+{
+}
+
+void opal_add_poller(void (*fn)(void *data), void __unused *data)
+{
+	poller = fn;
+}
+
+static int flushes;
+
+bool flush_console(void)
+{
+	flushes++;
+	return false;
+}
+
+/* Test data with a period that doesn't divide the ring or FIFO size */
+static uint8_t test_buf[3 * OUT_BUF_SIZE];
+
+static void check_out(size_t len)
+{
+	size_t i;
+
+	assert(sim.out_len == len);
+	for (i = 0; i < len; i++)
+		assert(sim.out[i] == test_buf[i]);
+	assert(sim.overruns == 0);
+}
+
+static void sim_reset(void)
+{
+	sim_drain();
+	sim.out_len = 0;
+	sim.lsr_reads = 0;
+	sim.thr_writes = 0;
+	sim.ticks = 0;
+}
+
+static double rate(size_t bytes, struct timespec *start)
+{
+	struct timespec end;
+	double secs;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = (end.tv_sec - start->tv_sec) +
+		(end.tv_nsec - start->tv_nsec) / 1e9;
+	return secs > 0 ? bytes / secs : 0;
+}
+
+int main(void)
+{
+	struct timespec start;
+	size_t i, written, total;
+	int polls;
+
+	for (i = 0; i < sizeof(test_buf); i++)
+		test_buf[i] = (i * 7 + i / 251) & 0xff;
+
+	uart_init(true);
+	assert(console && console->write == uart_con_write);
+	assert(poller == uart_console_poll);
+	assert(has_irq);
+
+	/*
+	 * Before the interrupt is known to work the write is synchronous,
+	 * everything goes out before we return and the FIFO never
+	 * overflows
+	 */
+	sim_reset();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	written = console->write((const char *)test_buf, sizeof(test_buf));
+	assert(written == sizeof(test_buf));
+	sim_drain();
+	check_out(sizeof(test_buf));
+	assert(out_buf_prod == out_buf_cons);
+	assert(sim.thr_writes == sizeof(test_buf));
+	printf("blocking:     %zu bytes, %lu LSR reads, %.0f bytes/s\n",
+	       written, sim.lsr_reads, rate(written, &start));
+
+	/*
+	 * Once the interrupt fired we never wait for the UART. A write
+	 * takes what fits in the ring, fills the FIFO and asks for the
+	 * THRE interrupt to do the rest.
+	 */
+	uart_irq();
+	assert(irq_ok);
+	sim_reset();
+
+	written = uart_con_write((const char *)test_buf, sizeof(test_buf));
+	assert(written == OUT_BUF_SIZE - 1);
+	assert(sim.thr_writes == SIM_FIFO_SIZE);
+	assert(sim.lsr_reads <= 2);
+	assert(tx_full && (cached_ier & IER_THRE));
+
+	/* What the FIFO took is free again, then the ring is full */
+	written += uart_con_write((const char *)test_buf + written,
+				  sizeof(test_buf) - written);
+	assert(written == OUT_BUF_SIZE - 1 + SIM_FIFO_SIZE);
+	assert(uart_con_write((const char *)test_buf + written, 1) == 0);
+	assert(sim.thr_writes == SIM_FIFO_SIZE);
+
+	/* Interrupts drain the ring one FIFO load at a time */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	total = written;
+	polls = 0;
+	while (total < sizeof(test_buf) || out_buf_prod != out_buf_cons) {
+		sim_drain();
+		uart_irq();
+		polls++;
+		total += uart_con_write((const char *)test_buf + total,
+					sizeof(test_buf) - total);
+	}
+	sim_drain();
+	check_out(sizeof(test_buf));
+	assert(sim.thr_writes == sizeof(test_buf));
+	assert(!tx_full && !(cached_ier & IER_THRE));
+	printf("non-blocking: %zu bytes, %lu LSR reads, %d irqs, %.0f bytes/s\n",
+	       total, sim.lsr_reads, polls, rate(total, &start));
+
+	/* The poller drains the ring and refills it from the console */
+	sim_reset();
+	flushes = 0;
+	written = uart_con_write((const char *)test_buf, 100);
+	assert(written == 100);
+	for (polls = 0; out_buf_prod != out_buf_cons; polls++) {
+		sim_drain();
+		poller(NULL);
+	}
+	assert(flushes == polls);
+	sim_drain();
+	check_out(100);
+
+	return 0;
+}
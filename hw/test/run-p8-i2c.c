@@ -0,0 +1,615 @@
+/* Copyright 2013-2014 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#define __TEST__
+#include <skiboot.h>
+#include <timebase.h>
+
+static uint64_t stamp = 1;
+#define mftb()	(stamp)
+
+/* Keep the heap allocations on libc */
+#define __MEM_REGION_MALLOC_H
+#define zalloc(bytes) calloc((bytes), 1)
+
+/* The device-tree is all in heap */
+#define is_rodata(p)	false
+
+#include "../p8-i2c.c"
+#include "../../core/pool.c"
+#include "../../core/device.c"
+
+/*
+ * Simulated I2C engine. Commands move bytes between the FIFO and an
+ * EEPROM with a one byte address pointer behind each port, a little
+ * more every time the status register is read. Bus conditions are
+ * logged so the tests can check for repeated starts.
+ */
+#define SIM_XSCOM_BASE	0xa0000
+#define SIM_FIFO_SIZE	8
+#define SIM_PORTS	2
+#define SIM_DEV_ADDR	0x50
+
+static struct {
+	uint64_t mode;
+	uint64_t watermark;
+	bool active;		/* Command in progress */
+	bool read;
+	bool stop;
+	bool nack;
+	bool held;		/* Bus not released by a STOP */
+	bool cmd_comp;
+	bool stall;		/* Nothing moves on the bus */
+	uint32_t rate;		/* Bytes moved per step, 0 for all */
+	uint32_t len;
+	uint32_t done;
+	uint8_t fifo[SIM_FIFO_SIZE];
+	uint32_t fifo_count;
+	int resets;
+	char log[256];
+
+	struct {
+		uint8_t mem[256];
+		uint8_t ptr;
+		bool first;	/* Next byte written is the address */
+	} eeprom[SIM_PORTS];
+} sim;
+
+static void sim_log(const char *fmt, ...) __attribute__((format (printf, 1, 2)));
+
+static void sim_log(const char *fmt, ...)
+{
+	size_t len = strlen(sim.log);
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(sim.log + len, sizeof(sim.log) - len, fmt, ap);
+	va_end(ap);
+}
+
+static void sim_reset(void)
+{
+	unsigned int i, p;
+
+	memset(&sim, 0, sizeof(sim));
+	sim.cmd_comp = true;
+	for (p = 0; p < SIM_PORTS; p++)
+		for (i = 0; i < 256; i++)
+			sim.eeprom[p].mem[i] = i ^ (p ? 0xff : 0);
+}
+
+static void sim_cmd(uint64_t cmd)
+{
+	uint32_t addr = GETFIELD(I2C_CMD_DEV_ADDR, cmd);
+	bool read = cmd & I2C_CMD_READ_NOT_WRITE;
+
+	assert(!sim.active);
+
+	/* Immediate STOP */
+	if (!(cmd & I2C_CMD_WITH_START)) {
+		assert(cmd == I2C_CMD_WITH_STOP);
+		sim_log("P ");
+		sim.held = false;
+		sim.cmd_comp = true;
+		return;
+	}
+
+	sim_log("%s %c%02x ", sim.held ? "Sr" : "S", read ? 'R' : 'W', addr);
+	sim.held = true;
+	sim.cmd_comp = false;
+	if (addr != SIM_DEV_ADDR) {
+		sim.nack = true;
+		return;
+	}
+	sim.active = true;
+	sim.read = read;
+	sim.stop = cmd & I2C_CMD_WITH_STOP;
+	sim.len = GETFIELD(I2C_CMD_LEN_BYTES, cmd);
+	sim.done = 0;
+	sim.fifo_count = 0;
+	sim.eeprom[GETFIELD(I2C_MODE_PORT_NUM, sim.mode)].first = !read;
+}
+
+/* Move the current command along, as if some time had passed */
+static void sim_step(void)
+{
+	uint32_t port = GETFIELD(I2C_MODE_PORT_NUM, sim.mode);
+	uint32_t i, moved = 0;
+
+	if (!sim.active)
+		return;
+	assert(port < SIM_PORTS);
+
+	if (sim.read) {
+		while (sim.fifo_count < SIM_FIFO_SIZE && sim.done < sim.len &&
+		       (!sim.rate || moved++ < sim.rate)) {
+			sim.fifo[sim.fifo_count++] =
+				sim.eeprom[port].mem[sim.eeprom[port].ptr++];
+			sim.done++;
+		}
+	} else {
+		for (i = 0; i < sim.fifo_count; i++, sim.done++) {
+			if (sim.rate && i == sim.rate)
+				break;
+			if (sim.eeprom[port].first)
+				sim.eeprom[port].ptr = sim.fifo[i];
+			else
+				sim.eeprom[port].mem[sim.eeprom[port].ptr++] =
+					sim.fifo[i];
+			sim.eeprom[port].first = false;
+		}
+		memmove(sim.fifo, sim.fifo + i, sim.fifo_count - i);
+		sim.fifo_count -= i;
+	}
+
+	if (sim.done < sim.len || sim.fifo_count)
+		return;
+	sim.active = false;
+	sim.cmd_comp = true;
+	if (sim.stop) {
+		sim_log("P ");
+		sim.held = false;
+	}
+}
+
+static uint64_t sim_stat(void)
+{
+	uint64_t stat = 0;
+
+	if (sim.stall)
+		return 0;
+	sim_step();
+	if (sim.nack)
+		stat |= I2C_STAT_NACK_RCVD_ERR;
+	if (sim.active && sim.read && sim.fifo_count &&
+	    (sim.fifo_count >= GETFIELD(I2C_WATERMARK_HIGH, sim.watermark) ||
+	     sim.done == sim.len))
+		stat |= I2C_STAT_DATA_REQ;
+	if (sim.active && !sim.read && sim.done + sim.fifo_count < sim.len &&
+	    sim.fifo_count <= GETFIELD(I2C_WATERMARK_LOW, sim.watermark))
+		stat |= I2C_STAT_DATA_REQ;
+	if (sim.cmd_comp)
+		stat |= I2C_STAT_CMD_COMP;
+	return SETFIELD(I2C_STAT_FIFO_ENTRY_COUNT, stat, sim.fifo_count);
+}
+
+int xscom_write(uint32_t partid, uint64_t pcb_addr, uint64_t val)
+{
+	assert(partid == 0);
+
+	switch (pcb_addr - SIM_XSCOM_BASE) {
+	case I2C_FIFO_REG:
+		assert(sim.active && !sim.read);
+		assert(sim.fifo_count < SIM_FIFO_SIZE);
+		assert(sim.done + sim.fifo_count < sim.len);
+		sim.fifo[sim.fifo_count++] = GETFIELD(I2C_FIFO, val);
+		break;
+	case I2C_CMD_REG:
+		sim_cmd(val);
+		break;
+	case I2C_MODE_REG:
+		sim.mode = val;
+		break;
+	case I2C_WATERMARK_REG:
+		sim.watermark = val;
+		break;
+	case I2C_INTR_MASK_REG:
+	case I2C_INTR_COND_REG:
+	case I2C_INTR_REG:
+	case I2C_RESET_ERRORS:
+		break;
+	case I2C_RESET_I2C_REG:
+		sim.active = sim.nack = false;
+		sim.fifo_count = 0;
+		sim.cmd_comp = true;
+		sim.resets++;
+		break;
+	default:
+		assert(0);
+	}
+	return 0;
+}
+
+int xscom_read(uint32_t partid, uint64_t pcb_addr, uint64_t *val)
+{
+	uint32_t i;
+
+	assert(partid == 0);
+
+	switch (pcb_addr - SIM_XSCOM_BASE) {
+	case I2C_FIFO_REG:
+		assert(sim.fifo_count && sim.read);
+		*val = SETFIELD(I2C_FIFO, 0ull, sim.fifo[0]);
+		for (i = 1; i < sim.fifo_count; i++)
+			sim.fifo[i - 1] = sim.fifo[i];
+		sim.fifo_count--;
+		break;
+	case I2C_CMD_REG:
+	case I2C_INTR_MASK_REG:
+		*val = 0;
+		break;
+	case I2C_MODE_REG:
+		*val = sim.mode;
+		break;
+	case I2C_WATERMARK_REG:
+		*val = sim.watermark;
+		break;
+	case I2C_STAT_REG:
+		*val = sim_stat();
+		break;
+	case I2C_EXTD_STAT_REG:
+		*val = SETFIELD(I2C_EXTD_STAT_FIFO_SIZE, 0ull, SIM_FIFO_SIZE);
+		break;
+	default:
+		assert(0);
+	}
+	return 0;
+}
+
+/* Stubs */
+static struct proc_chip sim_chip;
+
+struct proc_chip *get_chip(uint32_t chip_id)
+{
+	return chip_id == 0 ? &sim_chip : NULL;
+}
+
+struct proc_chip *next_chip(struct proc_chip *chip)
+{
+	return chip ? NULL : &sim_chip;
+}
+
+void lock(struct lock __unused *l)
+{
+}
+
+void unlock(struct lock __unused *l)
+{
+}
+
+void init_timer(struct timer *t, timer_func_t expiry, void *data)
+{
+	t->expiry = expiry;
+	t->user_data = data;
+}
+
+static uint64_t last_poll;
+
+uint64_t schedule_timer(struct timer __unused *t, uint64_t how_long)
+{
+	last_poll = how_long;
+	return stamp;
+}
+
+void schedule_timer_at(struct timer __unused *t, uint64_t when __unused)
+{
+}
+
+void cancel_timer_async(struct timer __unused *t)
+{
+}
+
+void time_wait_ms(unsigned long ms)
+{
+	stamp += msecs_to_tb(ms);
+}
+
+void log_simple_error(struct opal_err_info __unused *e_info,
+		      const char __unused *fmt, ...)
+{
+}
+
+static struct i2c_bus *buses[SIM_PORTS];
+static unsigned int nr_buses;
+
+void i2c_add_bus(struct i2c_bus *bus)
+{
+	assert(nr_buses < SIM_PORTS);
+	buses[nr_buses++] = bus;
+}
+
+/* Tests */
+static int done_rc[16];
+static int done_order[16];
+static int done_count;
+
+static void test_complete(int rc, struct i2c_request *req)
+{
+	int tag = (unsigned long)req->user_data;
+
+	assert(done_count < 16);
+	done_order[done_count++] = tag;
+	done_rc[tag] = rc;
+	i2c_free_req(req);
+}
+
+static struct i2c_request *test_req(unsigned int port, int op, int tag)
+{
+	struct i2c_request *req = i2c_alloc_req(buses[port]);
+
+	assert(req);
+	req->op = op;
+	req->dev_addr = SIM_DEV_ADDR;
+	req->completion = test_complete;
+	req->user_data = (void *)(unsigned long)tag;
+	return req;
+}
+
+static void test_msg(struct i2c_request *req, bool read, uint32_t addr,
+		     void *buf, uint32_t len)
+{
+	struct i2c_msg *msg = &req->msgs[req->nr_msgs++];
+
+	msg->read = read;
+	msg->dev_addr = addr;
+	msg->buf = buf;
+	msg->len = len;
+}
+
+static struct p8_i2c_master *sim_master(void)
+{
+	return list_top(&sim_chip.i2cms, struct p8_i2c_master, link);
+}
+
+static void run_until(int count)
+{
+	int i;
+
+	for (i = 0; i < 1000 && done_count < count; i++) {
+		stamp++;
+		p8_i2c_interrupt(0);
+	}
+	assert(done_count == count);
+	assert(sim_master()->state == state_idle);
+}
+
+static void reset_counts(void)
+{
+	done_count = 0;
+	memset(done_rc, 0xff, sizeof(done_rc));
+	sim.log[0] = 0;
+}
+
+static void setup(void)
+{
+	struct dt_node *i2cm, *port;
+	unsigned int i;
+
+	dt_root = dt_new_root("");
+	dt_add_property_cells(dt_root, "#address-cells", 1);
+	dt_add_property_cells(dt_root, "#size-cells", 1);
+	i2cm = dt_new_addr(dt_root, "i2cm", SIM_XSCOM_BASE);
+	dt_add_property_cells(i2cm, "reg", SIM_XSCOM_BASE, 0x20);
+	dt_add_property_string(i2cm, "compatible", "ibm,power8-i2cm");
+	dt_add_property_cells(i2cm, "ibm,chip-id", 0);
+	dt_add_property_cells(i2cm, "chip-engine#", 1);
+	dt_add_property_cells(i2cm, "clock-frequency", 50000000);
+	for (i = 0; i < SIM_PORTS; i++) {
+		port = dt_new_addr(i2cm, "i2c-bus", i);
+		dt_add_property_cells(port, "reg", i);
+		dt_add_property_cells(port, "bus-frequency", 400000);
+		dt_add_property_string(port, "ibm,port-name", "sim");
+	}
+
+	sim_chip.type = PROC_CHIP_P8_MURANO;
+	sim_chip.ec_level = 0x21;
+	list_head_init(&sim_chip.i2cms);
+	sim_reset();
+	p8_i2c_init();
+	assert(nr_buses == SIM_PORTS);
+	assert(sim_master()->fifo_size == SIM_FIFO_SIZE);
+}
+
+/* Write more than a FIFO with an offset, read it back */
+static void test_smbus(void)
+{
+	uint8_t wbuf[40], rbuf[40];
+	struct i2c_request *req;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(wbuf); i++)
+		wbuf[i] = 0xa0 + i;
+
+	reset_counts();
+	req = test_req(0, SMBUS_WRITE, 0);
+	req->offset = 0x30;
+	req->offset_bytes = 1;
+	req->rw_buf = wbuf;
+	req->rw_len = sizeof(wbuf);
+	assert(i2c_queue_req(req) == 0);
+	run_until(1);
+	assert(done_rc[0] == OPAL_SUCCESS);
+	assert(!memcmp(&sim.eeprom[0].mem[0x30], wbuf, sizeof(wbuf)));
+	assert(!strcmp(sim.log, "S W50 P "));
+
+	reset_counts();
+	req = test_req(0, SMBUS_READ, 1);
+	req->offset = 0x30;
+	req->offset_bytes = 1;
+	req->rw_buf = rbuf;
+	req->rw_len = sizeof(rbuf);
+	assert(i2c_queue_req(req) == 0);
+	run_until(1);
+	assert(done_rc[1] == OPAL_SUCCESS);
+	assert(!memcmp(rbuf, wbuf, sizeof(wbuf)));
+	assert(!strcmp(sim.log, "S W50 Sr R50 P "));
+}
+
+/* Offset write then two reads, all in one transaction */
+static void test_multi(void)
+{
+	uint8_t off = 0x10, rbuf[20];
+	struct i2c_request *req;
+	unsigned int i;
+
+	reset_counts();
+	req = test_req(1, I2C_MULTI, 0);
+	test_msg(req, false, SIM_DEV_ADDR, &off, 1);
+	test_msg(req, true, SIM_DEV_ADDR, rbuf, 4);
+	test_msg(req, true, SIM_DEV_ADDR, rbuf + 4, 16);
+	assert(i2c_queue_req(req) == 0);
+	run_until(1);
+	assert(done_rc[0] == OPAL_SUCCESS);
+	for (i = 0; i < sizeof(rbuf); i++)
+		assert(rbuf[i] == ((0x10 + i) ^ 0xff));
+	assert(!strcmp(sim.log, "S W50 Sr R50 Sr R50 P "));
+
+	/* Too many segments, or none at all */
+	req = test_req(1, I2C_MULTI, 1);
+	assert(i2c_queue_req(req) == OPAL_PARAMETER);
+	req->nr_msgs = I2C_MAX_MSGS + 1;
+	assert(i2c_queue_req(req) == OPAL_PARAMETER);
+	i2c_free_req(req);
+}
+
+/* A missing device in the middle gets a NACK, then a STOP */
+static void test_nack(void)
+{
+	uint8_t off = 0, rbuf[4];
+	struct i2c_request *req;
+	int resets = sim.resets;
+
+	reset_counts();
+	req = test_req(0, I2C_MULTI, 0);
+	test_msg(req, false, SIM_DEV_ADDR, &off, 1);
+	test_msg(req, true, SIM_DEV_ADDR + 1, rbuf, sizeof(rbuf));
+	assert(i2c_queue_req(req) == 0);
+	run_until(1);
+	assert(done_rc[0] == OPAL_I2C_NACK_RCVD);
+	assert(!strcmp(sim.log, "S W50 Sr R51 P "));
+	assert(sim.resets == resets + 1);
+
+	/* The engine is usable again */
+	reset_counts();
+	req = test_req(0, I2C_READ, 1);
+	req->rw_buf = rbuf;
+	req->rw_len = sizeof(rbuf);
+	assert(i2c_queue_req(req) == 0);
+	run_until(1);
+	assert(done_rc[1] == OPAL_SUCCESS);
+	assert(!strcmp(sim.log, "S R50 P "));
+}
+
+/* A port with a backlog doesn't hold up the other one */
+static void test_fairness(void)
+{
+	static const int ports[] = { 0, 0, 0, 0, 1, 1 };
+	static const int expect[] = { 0, 4, 1, 5, 2, 3 };
+	struct i2c_request *req;
+	uint8_t rbuf[6][4];
+	unsigned int i;
+
+	reset_counts();
+	for (i = 0; i < ARRAY_SIZE(ports); i++) {
+		req = test_req(ports[i], I2C_READ, i);
+		req->rw_buf = rbuf[i];
+		req->rw_len = sizeof(rbuf[i]);
+		assert(i2c_queue_req(req) == 0);
+	}
+	run_until(ARRAY_SIZE(ports));
+	for (i = 0; i < ARRAY_SIZE(ports); i++) {
+		assert(done_order[i] == expect[i]);
+		assert(done_rc[i] == OPAL_SUCCESS);
+	}
+}
+
+/* Pool exhaustion falls back to the heap */
+static void test_pool(void)
+{
+	struct i2c_request *reqs[I2C_POOL_REQS + 2];
+	unsigned int i;
+
+	assert(p8_i2c_req_pool.free_count == I2C_POOL_REQS);
+	for (i = 0; i < ARRAY_SIZE(reqs); i++) {
+		reqs[i] = i2c_alloc_req(buses[i & 1]);
+		assert(reqs[i] && reqs[i]->bus == buses[i & 1]);
+		assert(p8_i2c_pool_request(container_of(reqs[i],
+			struct p8_i2c_request, req)) == (i < I2C_POOL_REQS));
+	}
+	assert(p8_i2c_req_pool.free_count == 0);
+	for (i = 0; i < ARRAY_SIZE(reqs); i++)
+		i2c_free_req(reqs[i]);
+	assert(p8_i2c_req_pool.free_count == I2C_POOL_REQS);
+}
+
+/* Without interrupts, the poller follows the FIFO and backs off */
+static void test_poll(void)
+{
+	struct p8_i2c_master *master = sim_master();
+	struct p8_i2c_master_port *port = &master->ports[1];
+	uint64_t reqs = port->reqs, bytes = port->bytes;
+	struct i2c_request *req;
+	uint8_t wbuf[40];
+	int i;
+
+	memset(wbuf, 0x5a, sizeof(wbuf));
+	master->irq_ok = false;
+
+	reset_counts();
+	req = test_req(1, SMBUS_WRITE, 0);
+	req->offset = 0x80;
+	req->offset_bytes = 1;
+	req->rw_buf = wbuf;
+	req->rw_len = sizeof(wbuf);
+	assert(i2c_queue_req(req) == 0);
+	assert(last_poll == port->byte_time);
+
+	/* Nothing happens, each poll waits twice as long up to a cap */
+	sim.rate = 2;
+	sim.stall = true;
+	for (i = 0; i < 12; i++) {
+		p8_i2c_poll(&master->poller, master);
+		assert(last_poll == MIN(port->byte_time << (i + 1),
+					msecs_to_tb(I2C_POLL_MAX_MS)));
+	}
+	sim.stall = false;
+
+	/* Then it's back to waiting for the FIFO to drain */
+	p8_i2c_poll(&master->poller, master);
+	assert(last_poll == (master->fifo_size - master->fifo_lo) *
+	       port->byte_time);
+	for (i = 0; i < 100 && !done_count; i++) {
+		stamp += last_poll;
+		p8_i2c_poll(&master->poller, master);
+	}
+	assert(done_count == 1 && done_rc[0] == OPAL_SUCCESS);
+	assert(!memcmp(&sim.eeprom[1].mem[0x80], wbuf, sizeof(wbuf)));
+	sim.rate = 0;
+
+	assert(port->reqs == reqs + 1);
+	assert(port->bytes == bytes + sizeof(wbuf) + 1);
+	assert(port->busy_tb && port->max_wait_tb);
+	assert(master->ports[0].errors == 1 && !port->errors);
+	master->irq_ok = true;
+}
+
+int main(void)
+{
+	setup();
+	test_smbus();
+	test_multi();
+	test_nack();
+	test_fairness();
+	test_pool();
+	test_poll();
+	dt_free(dt_root);
+
+	return 0;
+}
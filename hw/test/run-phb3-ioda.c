@@ -0,0 +1,889 @@
+/* Copyright 2013-2014 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <config.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+
+#define __TEST__
+#include <skiboot.h>
+#include <processor.h>
+#include <timebase.h>
+
+static uint64_t stamp;
+#define mftb()		(stamp)
+#define lwsync()
+#define sync()
+#define eieio()
+#define ilog2(val)	(63 - __builtin_clzl(val))
+#define is_pow2(val)	(((val) & ((val) - 1)) == 0)
+#define zalloc(bytes)	calloc((bytes), 1)
+#define local_alloc(chip_id, size, align)	malloc(size)
+
+/* The PHB registers are backed by the IODA2 model below */
+#define __IO_H
+
+static uint64_t sim_in64(volatile void *addr);
+static void sim_out64(volatile void *addr, uint64_t val);
+
+static inline uint8_t in_8(const volatile void *addr)
+{
+	return *(const volatile uint8_t *)addr;
+}
+
+static inline void out_8(volatile void *addr, uint8_t val)
+{
+	*(volatile uint8_t *)addr = val;
+}
+
+#define in_le8	in_8
+#define out_le8	out_8
+
+static inline uint16_t in_le16(const volatile void *addr)
+{
+	return *(const volatile uint16_t *)addr;
+}
+
+static inline void out_le16(volatile void *addr, uint16_t val)
+{
+	*(volatile uint16_t *)addr = val;
+}
+
+static inline uint32_t in_le32(const volatile void *addr)
+{
+	return *(const volatile uint32_t *)addr;
+}
+
+static inline void out_le32(volatile void *addr, uint32_t val)
+{
+	*(volatile uint32_t *)addr = val;
+}
+
+static inline uint32_t in_be32(const volatile void *addr)
+{
+	return *(const volatile uint32_t *)addr;
+}
+
+static inline void out_be32(volatile void *addr, uint32_t val)
+{
+	*(volatile uint32_t *)addr = val;
+}
+
+static inline uint64_t in_be64(volatile void *addr)
+{
+	return sim_in64(addr);
+}
+
+static inline void out_be64(volatile void *addr, uint64_t val)
+{
+	sim_out64(addr, val);
+}
+
+#include "../phb3.c"
+
+/*
+ * Software IODA2: the PHB_IODA_ADDR/PHB_IODA_DATA0 pair with table
+ * select and auto-increment, the tables behind it, and counters for
+ * the MMIOs issued by the code under test.
+ */
+#define SIM_REGS_SIZE	0x1000
+#define SIM_TBL_MAX	512
+
+static const uint32_t sim_tbl_size[] = {
+	[IODA2_TBL_LXIVT]	= 8,
+	[IODA2_TBL_RBA]		= 32,
+	[IODA2_TBL_MRT]		= 8,
+	[IODA2_TBL_PESTA]	= PHB3_MAX_PE_NUM,
+	[IODA2_TBL_PESTB]	= PHB3_MAX_PE_NUM,
+	[IODA2_TBL_TVT]		= 512,
+	[IODA2_TBL_M64BT]	= 16,
+	[IODA2_TBL_M32DT]	= 256,
+	[IODA2_TBL_PEEV]	= 4,
+};
+
+static struct {
+	uint64_t regs[SIM_REGS_SIZE / 8];
+	uint64_t tbl[ARRAY_SIZE(sim_tbl_size)][SIM_TBL_MAX];
+	uint32_t tsel;
+	uint32_t tadr;
+	bool autoinc;
+
+	uint64_t asb_addr;
+
+	unsigned long reads;		/* All 64-bit loads */
+	unsigned long writes;		/* All 64-bit stores */
+	unsigned long sels;		/* PHB_IODA_ADDR stores */
+	unsigned long xscoms;
+	unsigned long rtc_all;
+	unsigned long rtc_rid;
+	unsigned long tce_kills;
+	uint64_t last_kill;
+	unsigned long ivc_updates;
+	unsigned long ffi_requests;
+	unsigned long locks;
+} sim;
+
+static uint64_t *sim_ioda_entry(void)
+{
+	uint64_t *e;
+
+	assert(sim.tsel < ARRAY_SIZE(sim_tbl_size));
+	assert(sim.tadr < sim_tbl_size[sim.tsel]);
+	e = &sim.tbl[sim.tsel][sim.tadr];
+	if (sim.autoinc)
+		sim.tadr++;
+	return e;
+}
+
+static uint64_t sim_in64(volatile void *addr)
+{
+	uint64_t off = (uint8_t *)addr - (uint8_t *)sim.regs;
+
+	assert(off < SIM_REGS_SIZE && !(off & 7));
+	sim.reads++;
+	if (off == PHB_IODA_DATA0)
+		return *sim_ioda_entry();
+	/* Loads to the PHB take a while */
+	stamp += 10;
+	return sim.regs[off / 8];
+}
+
+static void sim_out64(volatile void *addr, uint64_t val)
+{
+	uint64_t off = (uint8_t *)addr - (uint8_t *)sim.regs;
+
+	assert(off < SIM_REGS_SIZE && !(off & 7));
+	sim.writes++;
+	switch (off) {
+	case PHB_IODA_ADDR:
+		sim.sels++;
+		sim.tsel = GETFIELD(PHB_IODA_AD_TSEL, val);
+		sim.tadr = GETFIELD(PHB_IODA_AD_TADR, val);
+		sim.autoinc = !!(val & PHB_IODA_AD_AUTOINC);
+		break;
+	case PHB_IODA_DATA0:
+		*sim_ioda_entry() = val;
+		break;
+	case PHB_RTC_INVALIDATE:
+		if (val & PHB_RTC_INVALIDATE_ALL)
+			sim.rtc_all++;
+		else
+			sim.rtc_rid++;
+		break;
+	case PHB_TCE_KILL:
+		sim.tce_kills++;
+		sim.last_kill = val;
+		break;
+	case PHB_IVC_UPDATE:
+		sim.ivc_updates++;
+		break;
+	case PHB_FFI_REQUEST:
+		sim.ffi_requests++;
+		break;
+	default:
+		sim.regs[off / 8] = val;
+	}
+}
+
+static void sim_reset_counts(void)
+{
+	sim.reads = sim.writes = sim.sels = sim.rtc_all = sim.rtc_rid = 0;
+	sim.xscoms = sim.tce_kills = 0;
+	sim.ivc_updates = sim.ffi_requests = sim.locks = 0;
+}
+
+/*
+ * XSCOM: the PHB registers are reachable through the ASB address and
+ * data pair, everything else reads as 0.
+ */
+#define SIM_PE_XSCOM	0x2000
+#define SIM_SPCI_XSCOM	0x3000
+
+int xscom_read(uint32_t partid __unused, uint64_t pcb_addr, uint64_t *val)
+{
+	sim.xscoms++;
+	if (pcb_addr == SIM_SPCI_XSCOM + 0x2)
+		*val = sim_in64((uint8_t *)sim.regs + sim.asb_addr);
+	else
+		*val = 0;
+	return 0;
+}
+
+int xscom_write(uint32_t partid __unused, uint64_t pcb_addr, uint64_t val)
+{
+	sim.xscoms++;
+	if (pcb_addr == SIM_SPCI_XSCOM)
+		sim.asb_addr = val;
+	else if (pcb_addr == SIM_SPCI_XSCOM + 0x2)
+		sim_out64((uint8_t *)sim.regs + sim.asb_addr, val);
+	return 0;
+}
+
+/* Stubs */
+struct dt_node *dt_root;
+
+void lock(struct lock *l __unused)
+{
+	sim.locks++;
+}
+
+void unlock(struct lock *l __unused)
+{
+}
+
+/*
+ * SR-IOV style layout: a PF on bus 1 owning the whole bus, and VFs
+ * on bus 2 with one RID, two M32 segments and one TVE each. The PF
+ * PELTV covers all of the VFs and every VF freezes itself.
+ */
+#define PF_PE		0xff
+#define NUM_VFS		96
+#define VF_RID(i)	(0x200 + (i))
+#define VF_PE(i)	(i)
+#define VF_M32(i)	(2 * (i))
+#define TCE_TABLE(i)	(0x10000000ull + (i) * 0x10000ull)
+#define TCE_SIZE	0x10000ull
+
+static struct phb3 *new_phb3(void)
+{
+	struct phb3 *p = zalloc(sizeof(*p));
+
+	assert(p);
+	memset(&sim, 0, sizeof(sim));
+	p->phb.ops = &phb3_ops;
+	p->regs = sim.regs;
+	p->pe_xscom = SIM_PE_XSCOM;
+	p->spci_xscom = SIM_SPCI_XSCOM;
+	p->tbl_rtt = (uint64_t)malloc(RTT_TABLE_SIZE);
+	p->tbl_peltv = (uint64_t)malloc(PELTV_TABLE_SIZE);
+	p->tbl_pest = (uint64_t)zalloc(PHB3_MAX_PE_NUM * 16);
+	assert(p->tbl_rtt && p->tbl_peltv && p->tbl_pest);
+	phb3_init_ioda_cache(p);
+	assert(phb3_ioda_reset(&p->phb, false) == OPAL_SUCCESS);
+	sim_reset_counts();
+
+	return p;
+}
+
+static void free_phb3(struct phb3 *p)
+{
+	free((void *)p->tbl_rtt);
+	free((void *)p->tbl_peltv);
+	free((void *)p->tbl_pest);
+	free(p);
+}
+
+static void setup_one_by_one(struct phb3 *p)
+{
+	struct phb *phb = &p->phb;
+	uint32_t i;
+
+	assert(phb3_set_pe(phb, PF_PE, 0x100, OpalPciBusAll,
+			   OPAL_IGNORE_RID_DEVICE_NUMBER,
+			   OPAL_IGNORE_RID_FUNCTION_NUMBER,
+			   OPAL_MAP_PE) == OPAL_SUCCESS);
+	assert(phb3_map_pe_mmio_window(phb, PF_PE, OPAL_M64_WINDOW_TYPE,
+				       1, 0) == OPAL_SUCCESS);
+
+	for (i = 0; i < NUM_VFS; i++) {
+		assert(phb3_set_pe(phb, VF_PE(i), VF_RID(i), OpalPciBusAll,
+				   OPAL_COMPARE_RID_DEVICE_NUMBER,
+				   OPAL_COMPARE_RID_FUNCTION_NUMBER,
+				   OPAL_MAP_PE) == OPAL_SUCCESS);
+		assert(phb3_set_peltv(phb, PF_PE, VF_PE(i),
+				      OPAL_ADD_PE_TO_DOMAIN) == OPAL_SUCCESS);
+		assert(phb3_set_peltv(phb, VF_PE(i), VF_PE(i),
+				      OPAL_ADD_PE_TO_DOMAIN) == OPAL_SUCCESS);
+		assert(phb3_map_pe_mmio_window(phb, VF_PE(i),
+					       OPAL_M32_WINDOW_TYPE, 0,
+					       VF_M32(i)) == OPAL_SUCCESS);
+		assert(phb3_map_pe_mmio_window(phb, VF_PE(i),
+					       OPAL_M32_WINDOW_TYPE, 0,
+					       VF_M32(i) + 1) == OPAL_SUCCESS);
+		assert(phb3_map_pe_dma_window(phb, VF_PE(i), VF_PE(i) * 2, 1,
+					      TCE_TABLE(i), TCE_SIZE,
+					      0x1000) == OPAL_SUCCESS);
+	}
+}
+
+static void set_peltv_bit(struct opal_pci_pe_op *op, uint32_t pe)
+{
+	op->u.peltv[pe / 8] |= 0x80 >> (pe % 8);
+}
+
+static uint32_t build_batch(struct opal_pci_pe_op *ops)
+{
+	uint32_t i, n = 0;
+
+	memset(ops, 0, sizeof(*ops) * OPAL_PCI_PE_BATCH_MAX);
+
+	ops[n].op = OPAL_PCI_PE_OP_SET_RID;
+	ops[n].action = OPAL_MAP_PE;
+	ops[n].pe_number = cpu_to_be16(PF_PE);
+	ops[n].u.range.first = cpu_to_be16(0x100);
+	ops[n++].u.range.count = cpu_to_be16(0x100);
+
+	ops[n].op = OPAL_PCI_PE_OP_MAP_M64;
+	ops[n].pe_number = cpu_to_be16(PF_PE);
+	ops[n++].u.window_num = cpu_to_be16(1);
+
+	ops[n].op = OPAL_PCI_PE_OP_SET_PELTV;
+	ops[n].action = OPAL_ADD_PE_TO_DOMAIN;
+	ops[n].pe_number = cpu_to_be16(PF_PE);
+	for (i = 0; i < NUM_VFS; i++)
+		set_peltv_bit(&ops[n], VF_PE(i));
+	n++;
+
+	for (i = 0; i < NUM_VFS; i++) {
+		ops[n].op = OPAL_PCI_PE_OP_SET_RID;
+		ops[n].action = OPAL_MAP_PE;
+		ops[n].pe_number = cpu_to_be16(VF_PE(i));
+		ops[n].u.range.first = cpu_to_be16(VF_RID(i));
+		ops[n++].u.range.count = cpu_to_be16(1);
+
+		ops[n].op = OPAL_PCI_PE_OP_SET_PELTV;
+		ops[n].action = OPAL_ADD_PE_TO_DOMAIN;
+		ops[n].pe_number = cpu_to_be16(VF_PE(i));
+		set_peltv_bit(&ops[n++], VF_PE(i));
+
+		ops[n].op = OPAL_PCI_PE_OP_MAP_M32;
+		ops[n].pe_number = cpu_to_be16(VF_PE(i));
+		ops[n].u.range.first = cpu_to_be16(VF_M32(i));
+		ops[n++].u.range.count = cpu_to_be16(2);
+
+		ops[n].op = OPAL_PCI_PE_OP_MAP_TVE;
+		ops[n].pe_number = cpu_to_be16(VF_PE(i));
+		ops[n].u.tve.window_id = cpu_to_be16(VF_PE(i) * 2);
+		ops[n].u.tve.tce_levels = cpu_to_be16(1);
+		ops[n].u.tve.tce_table_addr = cpu_to_be64(TCE_TABLE(i));
+		ops[n].u.tve.tce_table_size = cpu_to_be64(TCE_SIZE);
+		ops[n++].u.tve.tce_page_size = cpu_to_be64(0x1000);
+	}
+	assert(n <= OPAL_PCI_PE_BATCH_MAX);
+
+	return n;
+}
+
+static struct opal_pci_pe_op ops[OPAL_PCI_PE_BATCH_MAX];
+
+static void test_batch_matches_single_ops(void)
+{
+	struct phb3 *a, *b;
+	uint64_t (*tbl)[SIM_TBL_MAX];
+	unsigned long single_writes, single_rtc;
+	uint32_t i, n;
+
+	tbl = malloc(sizeof(sim.tbl));
+	assert(tbl);
+
+	a = new_phb3();
+	setup_one_by_one(a);
+	memcpy(tbl, sim.tbl, sizeof(sim.tbl));
+	single_writes = sim.writes;
+	single_rtc = sim.rtc_all + sim.rtc_rid;
+
+	b = new_phb3();
+	n = build_batch(ops);
+	assert(phb3_set_pe_batch(&b->phb, ops, n) == OPAL_SUCCESS);
+	for (i = 0; i < n; i++)
+		assert(ops[i].rc == 0);
+
+	/* Same caches, in-memory tables and IODA tables */
+	assert(!memcmp(a->rte_cache, b->rte_cache, RTT_TABLE_SIZE));
+	assert(!memcmp((void *)a->tbl_rtt, (void *)b->tbl_rtt,
+		       RTT_TABLE_SIZE));
+	assert(!memcmp(a->peltv_cache, b->peltv_cache, PELTV_TABLE_SIZE));
+	assert(!memcmp((void *)a->tbl_peltv, (void *)b->tbl_peltv,
+		       PELTV_TABLE_SIZE));
+	assert(!memcmp(a->m32d_cache, b->m32d_cache, sizeof(a->m32d_cache)));
+	assert(!memcmp(a->m64b_cache, b->m64b_cache, sizeof(a->m64b_cache)));
+	assert(!memcmp(a->tve_cache, b->tve_cache, sizeof(a->tve_cache)));
+	assert(!memcmp(tbl, sim.tbl, sizeof(sim.tbl)));
+	assert(((uint16_t *)b->tbl_rtt)[VF_RID(3)] == VF_PE(3));
+	assert(sim.tbl[IODA2_TBL_TVT][VF_PE(5) * 2] == b->tve_cache[10]);
+
+	/* One RTC invalidation, one run each for M32DT and the TVT */
+	assert(sim.rtc_all == 1 && sim.rtc_rid == 0);
+	assert(sim.sels == 2);
+	printf("%u descriptors: %lu MMIO writes, %lu RTC invalidates "
+	       "one by one, %lu and %lu batched\n", n,
+	       single_writes, single_rtc, sim.writes,
+	       sim.rtc_all + sim.rtc_rid);
+	assert(sim.writes * 2 < single_writes);
+	assert(single_rtc == 0x100 + NUM_VFS);
+
+	free_phb3(a);
+	free_phb3(b);
+	free(tbl);
+}
+
+static void test_batch_errors(void)
+{
+	struct phb3 *p = new_phb3();
+
+	memset(ops, 0, sizeof(ops));
+
+	ops[0].op = OPAL_PCI_PE_OP_SET_RID;
+	ops[0].action = OPAL_MAP_PE;
+	ops[0].pe_number = cpu_to_be16(3);
+	ops[0].u.range.first = cpu_to_be16(0x300);
+	ops[0].u.range.count = cpu_to_be16(1);
+
+	/* Bad PE, RID range past the end, unknown op, bad TVE */
+	ops[1] = ops[0];
+	ops[1].pe_number = cpu_to_be16(PHB3_MAX_PE_NUM);
+	ops[2] = ops[0];
+	ops[2].u.range.first = cpu_to_be16(0xffff);
+	ops[2].u.range.count = cpu_to_be16(2);
+	ops[3].op = 0xff;
+	ops[4].op = OPAL_PCI_PE_OP_MAP_TVE;
+	ops[4].pe_number = cpu_to_be16(3);
+	ops[4].u.tve.window_id = cpu_to_be16(8);
+
+	/* TVEs 0 and 2: the clean entry in between is rewritten */
+	ops[5].op = OPAL_PCI_PE_OP_MAP_TVE;
+	ops[5].pe_number = cpu_to_be16(1);
+	ops[5].u.tve.window_id = cpu_to_be16(2);
+	ops[5].u.tve.tce_levels = cpu_to_be16(1);
+	ops[5].u.tve.tce_table_addr = cpu_to_be64(TCE_TABLE(1));
+	ops[5].u.tve.tce_table_size = cpu_to_be64(TCE_SIZE);
+	ops[5].u.tve.tce_page_size = cpu_to_be64(0x10000);
+	ops[6] = ops[5];
+	ops[6].pe_number = 0;
+	ops[6].u.tve.window_id = 0;
+	ops[6].u.tve.tce_table_addr = cpu_to_be64(TCE_TABLE(0));
+
+	assert(phb3_set_pe_batch(&p->phb, ops, 7) == OPAL_PARAMETER);
+	assert(ops[0].rc == 0 && ops[5].rc == 0 && ops[6].rc == 0);
+	assert(be32_to_cpu(ops[1].rc) == (uint32_t)OPAL_PARAMETER);
+	assert(be32_to_cpu(ops[2].rc) == (uint32_t)OPAL_PARAMETER);
+	assert(be32_to_cpu(ops[3].rc) == (uint32_t)OPAL_PARAMETER);
+	assert(be32_to_cpu(ops[4].rc) == (uint32_t)OPAL_PARAMETER);
+
+	/* The good entries went through, a single RID is invalidated alone */
+	assert(((uint16_t *)p->tbl_rtt)[0x300] == 3);
+	assert(((uint16_t *)p->tbl_rtt)[0xffff] == 0);
+	assert(sim.rtc_all == 0 && sim.rtc_rid == 1);
+	assert(sim.tbl[IODA2_TBL_TVT][0] && !sim.tbl[IODA2_TBL_TVT][1]);
+	assert(sim.tbl[IODA2_TBL_TVT][2] == p->tve_cache[2]);
+	assert(sim.sels == 1 && sim.writes == 1 + 1 + 3);
+
+	free_phb3(p);
+}
+
+/* Freeze a PE the way the hardware does, PESTs and PEEV */
+static void sim_freeze(uint32_t pe, bool mmio, bool dma)
+{
+	if (mmio)
+		sim.tbl[IODA2_TBL_PESTA][pe] |= IODA2_PESTA_MMIO_FROZEN;
+	if (dma)
+		sim.tbl[IODA2_TBL_PESTB][pe] |= IODA2_PESTB_DMA_STOPPED;
+	sim.tbl[IODA2_TBL_PEEV][pe / 64] |= PPC_BIT(pe % 64);
+}
+
+static void test_frozen_pes(void)
+{
+	struct phb3 *p = new_phb3();
+	struct opal_pci_frozen_pes *frozen = malloc(sizeof(*frozen));
+	uint64_t *pest = (uint64_t *)p->tbl_pest;
+	struct opal_pci_frozen_pe *fpe;
+	uint32_t i, n = 0;
+
+	assert(frozen);
+
+	/* Nothing frozen */
+	assert(phb3_eeh_get_frozen_pes(&p->phb, frozen) == OPAL_SUCCESS);
+	assert(be16_to_cpu(frozen->pci_error_type) == OPAL_EEH_NO_ERROR);
+	assert(be16_to_cpu(frozen->num_pes) == PHB3_MAX_PE_NUM);
+	assert(!frozen->num_frozen && !frozen->frozen[0]);
+
+	/* A switch went down and took every third PE with it */
+	for (i = 5; i < 200; i += 3)
+		sim_freeze(i, true, i % 2);
+	pest[2 * 8] = 0x1234;
+	pest[2 * 8 + 1] = 0x5678;
+
+	sim_reset_counts();
+	assert(phb3_eeh_get_frozen_pes(&p->phb, frozen) == OPAL_SUCCESS);
+	assert(be16_to_cpu(frozen->pci_error_type) == OPAL_EEH_PE_ERROR);
+	assert(be16_to_cpu(frozen->severity) == OPAL_EEH_SEV_PE_ER);
+	for (i = 0; i < ARRAY_SIZE(frozen->frozen); i++)
+		assert(be64_to_cpu(frozen->frozen[i]) ==
+		       sim.tbl[IODA2_TBL_PEEV][i]);
+	for (i = 5; i < 200; i += 3) {
+		fpe = &frozen->pes[n++];
+		assert(be16_to_cpu(fpe->pe_number) == i);
+		assert(fpe->freeze_state == (i % 2 ?
+					     OPAL_EEH_STOPPED_MMIO_DMA_FREEZE :
+					     OPAL_EEH_STOPPED_MMIO_FREEZE));
+	}
+	assert(be16_to_cpu(frozen->num_frozen) == n);
+	assert(be64_to_cpu(frozen->pes[1].pesta) ==
+	       (IODA2_PESTA_MMIO_FROZEN | 0x1234));
+	assert(be64_to_cpu(frozen->pes[1].pestb) == 0x5678);
+
+	/* A few PEEV reads, one PESTA and one PESTB run, no per-PE select */
+	printf("%u frozen PEs in one call: %lu MMIO loads, %lu IODA selects\n",
+	       n, sim.reads, sim.sels);
+	assert(sim.sels == 5);
+	assert(sim.reads <= 3 * 4 + 1 + 2 * (197 - 5 + 1));
+
+	free(frozen);
+	free_phb3(p);
+}
+
+static void test_diag_cache(void)
+{
+	struct phb3 *p = new_phb3();
+	struct OpalIoPhb3ErrorData *a = malloc(sizeof(*a));
+	struct OpalIoPhb3ErrorData *b = malloc(sizeof(*b));
+	unsigned long full;
+
+	assert(a && b);
+	p->ecap = 0x40;
+	p->aercap = 0x100;
+	sim_freeze(7, true, true);
+
+	assert(phb3_get_diag_data(&p->phb, a, sizeof(*a)) == OPAL_SUCCESS);
+	full = sim.reads + sim.writes + sim.xscoms;
+	assert(a->pestA[7] & IODA2_PESTA_MMIO_FROZEN);
+
+	/* Nothing changed: served from the copy */
+	sim_reset_counts();
+	assert(phb3_get_diag_data(&p->phb, b, sizeof(*b)) == OPAL_SUCCESS);
+	assert(!memcmp(a, b, sizeof(*a)));
+	printf("diag data: %lu accesses, %lu when cached\n", full,
+	       sim.reads + sim.writes + sim.xscoms);
+	assert((sim.reads + sim.writes + sim.xscoms) * 20 < full);
+
+	/* Another PE freezes: read again */
+	sim_freeze(9, false, true);
+	sim_reset_counts();
+	assert(phb3_get_diag_data(&p->phb, b, sizeof(*b)) == OPAL_SUCCESS);
+	assert(sim.reads + sim.writes + sim.xscoms >= full);
+	assert(b->pestB[9] & IODA2_PESTB_DMA_STOPPED);
+
+	/* Clearing the freeze drops the copy */
+	assert(phb3_eeh_freeze_clear(&p->phb, 9,
+			OPAL_EEH_ACTION_CLEAR_FREEZE_ALL) == OPAL_SUCCESS);
+	assert(!p->diag_valid);
+
+	free(a);
+	free(b);
+	free_phb3(p);
+}
+
+/*
+ * DMA translation the way the PHB does it, straight from the TVT of
+ * the model: returns the real address or -1 for a fault.
+ */
+static uint64_t sim_translate(uint32_t window_id, uint64_t dma_addr,
+			      bool write)
+{
+	uint64_t tve = sim.tbl[IODA2_TBL_TVT][window_id];
+	uint64_t psize = GETFIELD(IODA2_TVT_IO_PSIZE, tve);
+	uint32_t levels = GETFIELD(IODA2_TVT_NUM_LEVELS, tve) + 1;
+	uint32_t shift = GETFIELD(IODA2_TVT_TCE_TABLE_SIZE, tve) + 8;
+	uint32_t page_shift = psize + 11;
+	uint64_t *tbl, tce, index;
+	int lvl;
+
+	if (!psize)
+		return -1ull;
+	tbl = (uint64_t *)(GETFIELD(IODA2_TVT_TABLE_ADDR, tve) << 12);
+	index = (dma_addr & ((1ull << 59) - 1)) >> page_shift;
+	for (lvl = levels - 1; lvl >= 0; lvl--) {
+		tce = be64_to_cpu(tbl[(index >> (lvl * shift)) &
+				      ((1ull << shift) - 1)]);
+		if (!(tce & (write ? IODA2_TCE_WRITE : IODA2_TCE_READ)))
+			return -1ull;
+		tbl = (uint64_t *)(tce & IODA2_TCE_RPN_MASK);
+	}
+
+	return (uint64_t)tbl | (dma_addr & ((1ull << page_shift) - 1));
+}
+
+#define TCE_LEVEL_SIZE	0x10000ull	/* 8K TCEs per level */
+#define TCE_POOL	64
+
+static __be64 tce_pool[TCE_POOL];
+static void *tce_pages[TCE_POOL];
+
+static void *tce_root(struct phb3 *p, uint16_t pe, uint16_t levels,
+		      uint64_t page_size)
+{
+	void *root = aligned_alloc(TCE_LEVEL_SIZE, TCE_LEVEL_SIZE);
+
+	assert(root);
+	memset(root, 0, TCE_LEVEL_SIZE);
+	assert(phb3_map_pe_dma_window(&p->phb, pe, pe * 2, levels,
+				      (uint64_t)root, TCE_LEVEL_SIZE,
+				      page_size) == OPAL_SUCCESS);
+	return root;
+}
+
+static void fill_tce_pool(void)
+{
+	uint32_t i;
+
+	for (i = 0; i < TCE_POOL; i++) {
+		if (!tce_pages[i]) {
+			tce_pages[i] = aligned_alloc(TCE_LEVEL_SIZE,
+						     TCE_LEVEL_SIZE);
+			assert(tce_pages[i]);
+		}
+		tce_pool[i] = cpu_to_be64((uint64_t)tce_pages[i]);
+	}
+}
+
+static void set_tce_op(struct opal_pci_tce_op *op, uint8_t type,
+		       uint16_t pe, uint64_t index, uint32_t count,
+		       uint64_t addr)
+{
+	memset(op, 0, sizeof(*op));
+	op->op = type;
+	op->perm = type == OPAL_PCI_TCE_OP_PUT ?
+		OPAL_PCI_TCE_READ | OPAL_PCI_TCE_WRITE : 0;
+	op->pe_number = cpu_to_be16(pe);
+	op->window_id = cpu_to_be16(pe * 2);
+	op->index = cpu_to_be64(index);
+	op->count = cpu_to_be32(count);
+	op->addr = cpu_to_be64(addr);
+}
+
+static struct opal_pci_tce_op tce_ops[OPAL_PCI_TCE_BATCH_MAX];
+
+static void test_tce_batch(void)
+{
+	struct phb3 *p = new_phb3();
+	uint64_t ra = 0x4000000000ull;
+	void *root1, *root3;
+	uint32_t i;
+
+	/* Single level, 64K pages: no pool needed */
+	root1 = tce_root(p, 1, 1, 0x10000);
+	set_tce_op(&tce_ops[0], OPAL_PCI_TCE_OP_PUT, 1, 10, 4, ra);
+	tce_ops[0].perm = OPAL_PCI_TCE_READ;
+	assert(phb3_tce_batch(&p->phb, tce_ops, 1, NULL, 0) == OPAL_SUCCESS);
+	assert(sim_translate(2, 10 * 0x10000 + 0x123, false) == ra + 0x123);
+	assert(sim_translate(2, 13 * 0x10000, false) == ra + 3 * 0x10000);
+	assert(sim_translate(2, 10 * 0x10000, true) == -1ull);
+	assert(sim_translate(2, 14 * 0x10000, false) == -1ull);
+	assert(sim.tce_kills == 1);
+	assert(sim.last_kill == (PHB_TCE_KILL_PE |
+				 SETFIELD(PHB_TCE_KILL_PENUM, 0ul, 1)));
+
+	/* Three levels, 4K pages, a range crossing last level tables */
+	root3 = tce_root(p, 3, 3, 0x1000);
+	fill_tce_pool();
+	set_tce_op(&tce_ops[0], OPAL_PCI_TCE_OP_PUT, 3, 0x2000 - 2, 5, ra);
+	set_tce_op(&tce_ops[1], OPAL_PCI_TCE_OP_PUT, 3, 0x4000000, 1,
+		   ra + 0x100000);
+	set_tce_op(&tce_ops[2], OPAL_PCI_TCE_OP_CLEAR, 1, 11, 1, 0);
+	sim_reset_counts();
+	assert(phb3_tce_batch(&p->phb, tce_ops, 3, tce_pool, TCE_POOL) ==
+	       OPAL_SUCCESS);
+	for (i = 0; i < 5; i++)
+		assert(sim_translate(6, (0x2000ull - 2 + i) << 12, true) ==
+		       ra + i * 0x1000);
+	assert(sim_translate(6, 0x4000000ull << 12, true) == ra + 0x100000);
+	assert(sim_translate(6, (0x2000ull + 3) << 12, false) == -1ull);
+	assert(sim_translate(2, 11 * 0x10000, false) == -1ull);
+	assert(sim_translate(2, 12 * 0x10000, false) == ra + 2 * 0x10000);
+
+	/* 3 + 2 indirect levels came from the pool and were consumed */
+	for (i = 0; i < 5; i++)
+		assert(!tce_pool[i]);
+	assert(tce_pool[5]);
+	assert(sim.tce_kills == 1 && sim.last_kill == PHB_TCE_KILL_ALL);
+
+	/* Errors: bad window, misaligned page, past the end, empty pool */
+	set_tce_op(&tce_ops[0], OPAL_PCI_TCE_OP_PUT, 3, 0, 1, ra + 0x800);
+	set_tce_op(&tce_ops[1], OPAL_PCI_TCE_OP_PUT, 4, 0, 1, ra);
+	set_tce_op(&tce_ops[2], OPAL_PCI_TCE_OP_PUT, 1, 0x1fff, 2, ra);
+	set_tce_op(&tce_ops[3], OPAL_PCI_TCE_OP_PUT, 3, 0x8000000, 1, ra);
+	set_tce_op(&tce_ops[4], OPAL_PCI_TCE_OP_CLEAR, 3, 0x9000000, 16, 0);
+	sim_reset_counts();
+	assert(phb3_tce_batch(&p->phb, tce_ops, 5, NULL, 0) ==
+	       OPAL_PARAMETER);
+	assert(be32_to_cpu(tce_ops[0].rc) == (uint32_t)OPAL_PARAMETER);
+	assert(be32_to_cpu(tce_ops[1].rc) == (uint32_t)OPAL_PARAMETER);
+	assert(be32_to_cpu(tce_ops[2].rc) == (uint32_t)OPAL_PARAMETER);
+	assert(be32_to_cpu(tce_ops[3].rc) == (uint32_t)OPAL_RESOURCE);
+	assert(tce_ops[4].rc == 0);
+
+	free(root1);
+	free(root3);
+	free_phb3(p);
+}
+
+static double elapsed(struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) +
+		(end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * Map and unmap 128K TCEs with two level tables, in batches of 64
+ * descriptors of 32 TCEs, the way a driver maps scatter lists.
+ */
+#define BENCH_TCES	0x20000
+#define BENCH_RUN	32
+
+static void bench_tce(uint64_t page_size)
+{
+	struct phb3 *p = new_phb3();
+	uint32_t per_batch = OPAL_PCI_TCE_BATCH_MAX / 8;
+	uint64_t ra = 0x100000000000ull, index, n = 0;
+	struct timespec start;
+	double map, unmap;
+	void *root;
+	uint32_t i;
+
+	root = tce_root(p, 5, 2, page_size);
+	fill_tce_pool();
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (index = 0; index < BENCH_TCES; index += per_batch * BENCH_RUN) {
+		for (i = 0; i < per_batch; i++)
+			set_tce_op(&tce_ops[i], OPAL_PCI_TCE_OP_PUT, 5,
+				   index + i * BENCH_RUN, BENCH_RUN,
+				   ra + (index + i * BENCH_RUN) * page_size);
+		assert(phb3_tce_batch(&p->phb, tce_ops, per_batch, tce_pool,
+				      TCE_POOL) == OPAL_SUCCESS);
+		n++;
+	}
+	map = elapsed(&start);
+	assert(sim.tce_kills == n);
+
+	for (index = 0; index < BENCH_TCES; index += 997)
+		assert(sim_translate(10, index * page_size + 8, true) ==
+		       ra + index * page_size + 8);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (index = 0; index < BENCH_TCES; index += per_batch * BENCH_RUN) {
+		for (i = 0; i < per_batch; i++)
+			set_tce_op(&tce_ops[i], OPAL_PCI_TCE_OP_CLEAR, 5,
+				   index + i * BENCH_RUN, BENCH_RUN, 0);
+		assert(phb3_tce_batch(&p->phb, tce_ops, per_batch, NULL, 0) ==
+		       OPAL_SUCCESS);
+	}
+	unmap = elapsed(&start);
+	assert(sim_translate(10, 0, false) == -1ull);
+	assert(sim.tce_kills == 2 * n);
+
+	printf("%6lluK pages: map %.1f M TCE/s, unmap %.1f M TCE/s, "
+	       "%llu TCE kills instead of %llu\n",
+	       (unsigned long long)page_size >> 10,
+	       BENCH_TCES / map / 1e6, BENCH_TCES / unmap / 1e6,
+	       (unsigned long long)(2 * n),
+	       (unsigned long long)(2 * n * per_batch));
+
+	free(root);
+	free_phb3(p);
+}
+
+static uint8_t *sim_ive(struct phb3 *p, uint32_t ive_num)
+{
+	return (uint8_t *)(p->tbl_ivt + ive_num * IVT_TABLE_STRIDE * 8);
+}
+
+static void test_msi_eoi(void)
+{
+	struct phb3 *p = new_phb3();
+	struct opal_pci_msi_stats st[4];
+	uint32_t i;
+
+	p->tbl_ivt = (uint64_t)zalloc(IVT_TABLE_SIZE);
+	assert(p->tbl_ivt);
+
+	/* Not counting until enabled */
+	assert(phb3_pci_msi_eoi(&p->phb, 0x10) == OPAL_SUCCESS);
+	assert(phb3_msi_stats(&p->phb, 0, 0x10, 1, st) == OPAL_SUCCESS);
+	assert(!st[0].count);
+	assert(phb3_msi_stats(&p->phb, OPAL_PCI_MSI_STATS_ENABLE |
+			      OPAL_PCI_MSI_STATS_DISABLE, 0, 0, NULL) ==
+	       OPAL_PARAMETER);
+	assert(phb3_msi_stats(&p->phb, 0, 0x7ff, 2, st) == OPAL_PARAMETER);
+	assert(phb3_msi_stats(&p->phb, OPAL_PCI_MSI_STATS_ENABLE, 0, 0,
+			      NULL) == OPAL_SUCCESS);
+
+	/* Q clear: one store and one flushing load, no lock */
+	sim_reset_counts();
+	for (i = 0; i < 1000; i++) {
+		sim_ive(p, 0x10)[4] |= 1;	/* P set by the interrupt */
+		assert(phb3_pci_msi_eoi(&p->phb, 0x10) == OPAL_SUCCESS);
+		assert(!(sim_ive(p, 0x10)[4] & 1));
+	}
+	assert(sim.locks == 0 && sim.ffi_requests == 0);
+	assert(sim.writes == 1000 && sim.reads == 1000);
+	printf("MSI EOI: %lu MMIOs and %lu locks per EOI\n",
+	       (sim.reads + sim.writes) / 1000, sim.locks / 1000);
+
+	/* Q set: the interrupt is resent under the lock */
+	sim_ive(p, 0x11)[5] = 1;
+	assert(phb3_pci_msi_eoi(&p->phb, 0x11) == OPAL_SUCCESS);
+	assert(sim.locks == 1 && sim.ffi_requests == 1);
+	assert(!sim_ive(p, 0x11)[5]);
+
+	assert(phb3_msi_stats(&p->phb, OPAL_PCI_MSI_STATS_RESET, 0x10, 3,
+			      st) == OPAL_SUCCESS);
+	assert(be64_to_cpu(st[0].count) == 1000);
+	assert(!st[0].q_refires);
+	assert(be64_to_cpu(st[0].eoi_tb_total) == 1000 * 10);
+	assert(be64_to_cpu(st[0].eoi_tb_max) == 10);
+	assert(be64_to_cpu(st[1].count) == 1);
+	assert(be64_to_cpu(st[1].q_refires) == 1);
+	assert(!st[2].count);
+
+	/* Reset after reading, disable stops counting */
+	assert(phb3_msi_stats(&p->phb, OPAL_PCI_MSI_STATS_DISABLE, 0x10, 1,
+			      st) == OPAL_SUCCESS);
+	assert(!st[0].count);
+	assert(phb3_pci_msi_eoi(&p->phb, 0x10) == OPAL_SUCCESS);
+	assert(phb3_msi_stats(&p->phb, 0, 0x10, 1, st) == OPAL_SUCCESS);
+	assert(!st[0].count);
+
+	free(p->msi_stats);
+	free((void *)p->tbl_ivt);
+	free_phb3(p);
+}
+
+int main(void)
+{
+	uint32_t i;
+
+	test_batch_matches_single_ops();
+	test_batch_errors();
+	test_frozen_pes();
+	test_diag_cache();
+	test_tce_batch();
+	test_msi_eoi();
+	bench_tce(0x1000);
+	bench_tce(0x10000);
+	bench_tce(0x1000000);
+
+	for (i = 0; i < TCE_POOL; i++)
+		free(tce_pages[i]);
+
+	return 0;
+}
@@ -78,6 +78,12 @@
 /* Enable this to make fast reboot clear memory */
 //#define FAST_REBOOT_CLEARS_MEMORY	1
 
+/* Enable this to clear memory while PCI comes back after a fast reboot,
+ * adapters that are still doing DMA at that point could leave data
+ * behind in memory that has already been cleared
+ */
+//#define FAST_REBOOT_SCRUBS_IN_BACKGROUND	1
+
 /* Enable this to disable setting of the output pending event when
  * sending things on the console. The FSP is very slow to consume
  * and older kernels wait after each character during early boot so
@@ -86,6 +92,12 @@
  */
 #define DISABLE_CON_PENDING_EVT	1
 
+/* How long, in milliseconds, sensor tables fetched from the FSP are used
+ * to answer OPAL_SENSOR_READ before being fetched again (0 fetches them
+ * on every read). Defaults to a second
+ */
+//#define FSP_SENSOR_CACHE_MS	1000
+
 /* Configure this to provide some additional kernel command line
  * arguments to the bootloader
  */
@@ -103,6 +103,11 @@ extern void cpu_callin(struct cpu_thread *cpu);
 /* For cpus which fail to call in. */
 extern void cpu_remove_node(const struct cpu_thread *t);
 
+/* Wait for all CPUs @pending picks to be done, with a timeout */
+typedef bool (*cpu_barrier_fn)(struct cpu_thread *cpu, void *data);
+extern unsigned int cpu_barrier(const char *what, cpu_barrier_fn pending,
+				void *data, unsigned long timeout_ms);
+
 /* Find CPUs using different methods */
 extern struct cpu_thread *find_cpu_by_chip_id(u32 chip_id);
 extern struct cpu_thread *find_cpu_by_node(struct dt_node *cpu);
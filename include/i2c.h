@@ -41,6 +41,16 @@ struct i2c_bus {
  * OPAL_I2C_STOP_ERR		Did not able to send the STOP condtion on bus
  */
 
+/* One segment of an I2C_MULTI request */
+struct i2c_msg {
+	bool			read;
+	uint32_t		dev_addr;	/* Slave device address */
+	uint32_t		len;
+	void			*buf;
+};
+
+#define I2C_MAX_MSGS		8
+
 struct i2c_request {
 	struct list_node	link;
 	struct i2c_bus		*bus;
@@ -49,6 +59,7 @@ struct i2c_request {
 		I2C_WRITE,	/* RAW write to the device without offset */
 		SMBUS_READ,	/* SMBUS protocol read from the device */
 		SMBUS_WRITE,	/* SMBUS protocol write to the device */
+		I2C_MULTI,	/* Segments joined by repeated starts */
 	} op;
 	int			result;		/* OPAL i2c error code */
 	uint32_t		dev_addr;	/* Slave device address */
@@ -56,6 +67,8 @@ struct i2c_request {
 	uint32_t		offset;		/* Internal device offset */
 	uint32_t		rw_len;		/* Length of the data request */
 	void			*rw_buf;	/* Data request buffer */
+	uint32_t		nr_msgs;	/* I2C_MULTI segments */
+	struct i2c_msg		msgs[I2C_MAX_MSGS];
 	void			(*completion)(	/* Completion callback */
 					      int rc, struct i2c_request *req);
 	void			*user_data;	/* Client data */
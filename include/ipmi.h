@@ -109,6 +109,7 @@
 #define IPMI_GET_MESSAGE_FLAGS		IPMI_CODE(IPMI_NETFN_APP, 0x31)
 #define IPMI_GET_MESSAGE		IPMI_CODE(IPMI_NETFN_APP, 0x33)
 #define IPMI_READ_EVENT			IPMI_CODE(IPMI_NETFN_APP, 0x35)
+#define IPMI_GET_BT_CAPS		IPMI_CODE(IPMI_NETFN_APP, 0x36)
 
 #define IPMI_PARTIAL_ADD_ESEL		IPMI_CODE(IPMI_NETFN_OEM, 0xf0)
 
@@ -122,6 +123,7 @@
 #define IPMI_ERR_MSG_TRUNCATED		0xc6
 #define IPMI_REQ_LEN_INVALID_ERR	0xc7
 #define IPMI_REQ_LEN_EXCEEDED_ERR	0xc8
+#define IPMI_INVALID_RESERVATION_ERR	0xc5
 #define IPMI_NOT_IN_MY_STATE_ERR	0xd5	/* IPMI 2.0 */
 #define IPMI_LOST_ARBITRATION_ERR	0x81
 #define IPMI_BUS_ERR			0x82
@@ -150,6 +152,10 @@ struct ipmi_msg {
 	void (*error)(struct ipmi_msg *);
 	void *user_data;
 
+	/* Set for requests issued by the OS through OPAL_IPMI_SEND,
+	 * backends service these ahead of firmware generated ones */
+	bool host_req;
+
 	uint8_t req_size;
 	uint8_t resp_size;
 	uint8_t *data;
@@ -189,7 +195,8 @@ void ipmi_init_msg(struct ipmi_msg *msg, int interface,
 /* called by backend code to indicate a SMS_ATN event */
 void ipmi_sms_attention(void);
 
-/* Add an ipmi message to the queue */
+/* Add an ipmi message to the queue. Returns OPAL_BUSY if the backend
+ * can't take more host requests, the caller still owns the message. */
 int ipmi_queue_msg(struct ipmi_msg *msg);
 
 /* Add an ipmi message to the start of the queue */
@@ -225,6 +232,9 @@ void ipmi_fru_init(uint8_t fru_dev_id);
 struct errorlog;
 int ipmi_elog_commit(struct errorlog *elog_buf);
 
+/* Set up the eSEL engine, before any log gets committed */
+void ipmi_sel_init(void);
+
 /* Callback to parse an OEM SEL message */
 void ipmi_parse_sel(struct ipmi_msg *msg);
 
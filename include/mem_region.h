@@ -67,5 +67,10 @@ void mem_region_add_dt_reserved(void);
 void mem_reserve(const char *name, uint64_t start, uint64_t len);
 
 struct mem_region *find_mem_region(const char *name);
+struct mem_region *mem_region_next(struct mem_region *region);
+
+/* Clear the memory handed over to the OS, see core/mem-scrub.c */
+void mem_scrub_start(void);
+void mem_scrub_wait(void);
 
 #endif /* __MEMORY_REGION */
@@ -161,7 +161,17 @@
 #define OPAL_IPMI_SEND				107
 #define OPAL_IPMI_RECV				108
 #define OPAL_I2C_REQUEST			109
-#define OPAL_LAST				109
+#define OPAL_PCI_CONFIG_BATCH			110
+#define OPAL_PCI_SET_PE_BATCH			111
+#define OPAL_PCI_GET_FROZEN_PES			112
+#define OPAL_PCI_TCE_BATCH			113
+#define OPAL_PCI_MSI_STATS			114
+#define OPAL_PCI_SLOT_RESCAN			115
+#define OPAL_PCI_CFG_SHADOW			116
+#define OPAL_SENSOR_SNAPSHOT			117
+#define OPAL_I2C_TRANSFER			118
+#define OPAL_ELOG_STATS				119
+#define OPAL_LAST				119
 
 /* Device tree flags */
 
@@ -843,6 +853,170 @@ struct opal_i2c_request {
 	__be64 buffer_ra;		/* Buffer real address */
 };
 
+/* OPAL_I2C_TRANSFER segment */
+struct opal_i2c_msg {
+	uint8_t	flags;
+#define OPAL_I2C_MSG_READ	0x01
+	uint8_t	reserved;
+	__be16	addr;			/* 7 bit address */
+	__be32	size;			/* Data size */
+	__be64	buffer_ra;		/* Buffer real address */
+};
+
+/* OPAL_PCI_CONFIG_BATCH descriptor */
+struct opal_pci_cfg_op {
+	__be16	bdfn;
+	__be16	offset;
+	uint8_t	size;			/* 1, 2 or 4 bytes */
+	uint8_t	op;
+#define OPAL_PCI_CFG_OP_READ	0
+#define OPAL_PCI_CFG_OP_WRITE	1
+	__be16	reserved;
+	__be32	value;			/* Written, or read back */
+	__be32	rc;			/* OPAL return code */
+};
+
+/* Maximum number of descriptors per OPAL_PCI_CONFIG_BATCH call */
+#define OPAL_PCI_CFG_BATCH_MAX	128
+
+/* OPAL_PCI_SET_PE_BATCH descriptor */
+struct opal_pci_pe_op {
+	uint8_t	op;
+#define OPAL_PCI_PE_OP_SET_RID		0	/* RID range to PE */
+#define OPAL_PCI_PE_OP_SET_PELTV	1	/* Child PEs of a PE */
+#define OPAL_PCI_PE_OP_MAP_M32		2	/* M32 segment range to PE */
+#define OPAL_PCI_PE_OP_MAP_M64		3	/* Single PE M64 BAR */
+#define OPAL_PCI_PE_OP_MAP_TVE		4	/* TCE table of a PE */
+	uint8_t	action;			/* enum OpalPeAction / OpalPeltvAction */
+	__be16	pe_number;
+	__be32	rc;			/* OPAL return code */
+	union {
+		struct {
+			__be16	first;
+			__be16	count;
+		} range;		/* SET_RID, MAP_M32 */
+		uint8_t	peltv[32];	/* SET_PELTV, PE#0 is the MSB */
+		__be16	window_num;	/* MAP_M64 */
+		struct {
+			__be16	window_id;
+			__be16	tce_levels;
+			__be32	reserved;
+			__be64	tce_table_addr;
+			__be64	tce_table_size;
+			__be64	tce_page_size;
+		} tve;			/* MAP_TVE */
+	} u;
+};
+
+/* Maximum number of descriptors per OPAL_PCI_SET_PE_BATCH call */
+#define OPAL_PCI_PE_BATCH_MAX	512
+
+/* OPAL_PCI_GET_FROZEN_PES result */
+#define OPAL_PCI_MAX_FROZEN_PES	256
+
+struct opal_pci_frozen_pe {
+	__be16	pe_number;
+	uint8_t	freeze_state;		/* enum OpalFreezeState */
+	uint8_t	reserved[5];
+	__be64	pesta;
+	__be64	pestb;
+};
+
+struct opal_pci_frozen_pes {
+	__be16	pci_error_type;		/* enum OpalPciStatusToken */
+	__be16	severity;		/* enum OpalPciErrorSeverity */
+	__be16	num_pes;		/* PEs covered by the bitmap */
+	__be16	num_frozen;		/* Valid entries in pes[] */
+	__be64	frozen[OPAL_PCI_MAX_FROZEN_PES / 64];	/* PE#0 is the MSB */
+	struct opal_pci_frozen_pe pes[OPAL_PCI_MAX_FROZEN_PES];
+};
+
+/* OPAL_PCI_TCE_BATCH descriptor */
+struct opal_pci_tce_op {
+	uint8_t	op;
+#define OPAL_PCI_TCE_OP_PUT	0	/* Map count pages from addr */
+#define OPAL_PCI_TCE_OP_CLEAR	1	/* Unmap count pages */
+	uint8_t	perm;			/* PUT only */
+#define OPAL_PCI_TCE_READ	0x1
+#define OPAL_PCI_TCE_WRITE	0x2
+	__be16	pe_number;
+	__be16	window_id;		/* As OPAL_PCI_MAP_PE_DMA_WINDOW */
+	__be16	reserved;
+	__be32	count;			/* Number of TCEs */
+	__be32	rc;			/* OPAL return code */
+	__be64	index;			/* First TCE of the window */
+	__be64	addr;			/* PUT: real address of the first page */
+};
+
+/* Maximum number of descriptors per OPAL_PCI_TCE_BATCH call */
+#define OPAL_PCI_TCE_BATCH_MAX	512
+
+/* OPAL_PCI_MSI_STATS flags and per MSI counters */
+enum {
+	OPAL_PCI_MSI_STATS_ENABLE	= 0x1,
+	OPAL_PCI_MSI_STATS_DISABLE	= 0x2,
+	OPAL_PCI_MSI_STATS_RESET	= 0x4,	/* After reading */
+};
+
+struct opal_pci_msi_stats {
+	__be64	count;			/* EOIs, one per interrupt */
+	__be64	q_refires;		/* Interrupts resent for a set Q */
+	__be64	eoi_tb_total;		/* Timebase ticks spent in EOI */
+	__be64	eoi_tb_max;
+};
+
+/* OPAL_PCI_SLOT_RESCAN result, num_* can exceed what fits the lists */
+#define OPAL_PCI_RESCAN_MAX_FNS	256
+
+struct opal_pci_slot_rescan {
+	__be16	num_added;
+	__be16	num_removed;
+	__be32	reserved;
+	__be16	added[OPAL_PCI_RESCAN_MAX_FNS];		/* bdfn */
+	__be16	removed[OPAL_PCI_RESCAN_MAX_FNS];	/* bdfn */
+};
+
+/* OPAL_PCI_CFG_SHADOW flags and counters */
+enum {
+	OPAL_PCI_CFG_SHADOW_ENABLE	= 0x1,
+	OPAL_PCI_CFG_SHADOW_DISABLE	= 0x2,
+	OPAL_PCI_CFG_SHADOW_FLUSH	= 0x4,
+	OPAL_PCI_CFG_SHADOW_RESET_STATS	= 0x8,	/* After reading */
+};
+
+struct opal_pci_cfg_shadow_stats {
+	__be64	hits;			/* Reads served from the shadow */
+	__be64	misses;			/* Config cycles, fills included */
+	__be64	fills;			/* Functions shadowed */
+	__be64	flushes;
+};
+
+/* Sensor classes for OPAL_SENSOR_SNAPSHOT */
+enum OpalSensorClass {
+	OPAL_SENSOR_CLASS_POWER		= 0,
+	OPAL_SENSOR_CLASS_TEMP		= 1,
+	OPAL_SENSOR_CLASS_FAN		= 2,
+	OPAL_SENSOR_CLASS_STATUS	= 3,
+};
+
+struct opal_sensor_sample {
+	__be32	sensor_id;		/* As in the device-tree */
+	__be32	value;
+};
+
+/* OPAL_ELOG_STATS flags and counters */
+enum {
+	OPAL_ELOG_STATS_RESET		= 0x1,	/* After reading */
+};
+
+struct opal_elog_stats {
+	__be64	committed;		/* Logs passed to the platform */
+	__be64	duplicates;		/* Repeats only counted */
+	__be64	summaries;		/* Logs reporting repeats */
+	__be64	rate_limited;		/* Dropped by the rate limiter */
+	__be64	no_buffer;		/* Lost for lack of a record */
+};
+
 #endif /* __ASSEMBLY__ */
 
 #endif /* __OPAL_H */
@@ -521,4 +521,13 @@
 #define PCIECAP_AER_TLP_PFX_LOG2	0x40
 #define PCIECAP_AER_TLP_PFX_LOG3	0x44
 
+/* ARI Ext. Capability */
+#define PCIECAP_ID_ARI			0x000e
+#define PCIECAP_ARI_CAP			0x04
+#define   PCIECAP_ARI_CAP_MFVC		0x0001
+#define   PCIECAP_ARI_CAP_ACS		0x0002
+#define   PCIECAP_ARI_CAP_NFN_MASK	0xff00
+#define   PCIECAP_ARI_CAP_NFN_LSH	8
+#define PCIECAP_ARI_CTL			0x06
+
 #endif /* __PCI_CFG_H */
@@ -126,7 +126,18 @@ struct pci_device {
 	uint32_t		cap[64];
 	uint32_t		mps;		/* Max payload size capability */
 
+	/*
+	 * Captured by the scan so that MPS setup, the device-tree and the
+	 * boot summary don't go back to config space
+	 */
+	uint32_t		vdid;
+	uint32_t		rev_class;	/* Revision ID and class code */
+	uint8_t			intpin;
+	bool			devctl_valid;
+	uint16_t		devctl;		/* PCIe device control */
+
 	struct pci_slot_info    *slot_info;
+	struct dt_node		*dn;
 	struct pci_device	*parent;
 	struct list_head	children;
 	struct list_node	link;
@@ -265,6 +276,8 @@ struct phb_ops {
 				  uint64_t diag_buffer_len);
 	int64_t (*next_error)(struct phb *phb, uint64_t *first_frozen_pe,
 			      uint16_t *pci_error_type, uint16_t *severity);
+	int64_t (*get_frozen_pes)(struct phb *phb,
+				  struct opal_pci_frozen_pes *frozen);
 
 	/*
 	 * Other IODA methods
@@ -292,6 +305,14 @@ struct phb_ops {
 	int64_t (*set_peltv)(struct phb *phb, uint32_t parent_pe,
 			     uint32_t child_pe, uint8_t state);
 
+	/*
+	 * Apply a list of OPAL_PCI_SET_PE_BATCH descriptors, setting
+	 * the rc of each of them. Optional, the generic code falls
+	 * back to the single entry ops above.
+	 */
+	int64_t (*set_pe_batch)(struct phb *phb, struct opal_pci_pe_op *ops,
+				uint32_t count);
+
 	int64_t (*map_pe_dma_window)(struct phb *phb, uint16_t pe_number,
 				     uint16_t window_id, uint16_t tce_levels,
 				     uint64_t tce_table_addr,
@@ -303,6 +324,15 @@ struct phb_ops {
 					  uint64_t pci_start_addr,
 					  uint64_t pci_mem_size);
 
+	/*
+	 * Apply a list of OPAL_PCI_TCE_BATCH descriptors to the TCE
+	 * tables of DMA windows set up with map_pe_dma_window, taking
+	 * missing indirect levels from the pool, then invalidate the
+	 * TCE cache once.
+	 */
+	int64_t (*tce_batch)(struct phb *phb, struct opal_pci_tce_op *ops,
+			     uint32_t count, __be64 *pool, uint32_t pool_count);
+
 	int64_t (*set_mve)(struct phb *phb, uint32_t mve_number,
 			   uint32_t pe_number);
 
@@ -338,6 +368,13 @@ struct phb_ops {
 	 */
 	int64_t (*pci_msi_eoi)(struct phb *phb, uint32_t hwirq);
 
+	/* Same as pci_msi_eoi but called without the PHB lock held */
+	int64_t (*pci_msi_eoi_nolock)(struct phb *phb, uint32_t hwirq);
+
+	/* Per MSI interrupt and EOI counters, see OPAL_PCI_MSI_STATS */
+	int64_t (*msi_stats)(struct phb *phb, uint64_t flags, uint32_t first,
+			     uint32_t count, struct opal_pci_msi_stats *stats);
+
 	/*
 	 * Slot control
 	 */
@@ -416,6 +453,24 @@ struct phb_ops {
 	int64_t (*set_capp_recovery)(struct phb *phb);
 };
 
+/*
+ * Shadow of the config registers of a function that don't change until
+ * it gets reset or replaced, see pci_cfg_shadow_read()
+ */
+#define PCI_CFG_SHADOW_HASH	64
+#define PCI_CFG_SHADOW_CAPS	32
+
+struct pci_cfg_shadow {
+	struct pci_cfg_shadow	*next;
+	uint16_t		bdfn;
+	bool			has_caps;	/* PCI_CFG_STAT_CAP */
+	uint8_t			ncaps;
+	uint64_t		ro;		/* Valid bytes of hdr */
+	uint8_t			hdr[0x40];
+	uint16_t		cap_pos[PCI_CFG_SHADOW_CAPS];
+	uint32_t		cap_hdr[PCI_CFG_SHADOW_CAPS];
+};
+
 enum phb_type {
 	phb_type_pci,
 	phb_type_pcix_v1,
@@ -435,6 +490,17 @@ struct phb {
 	struct pci_lsi_state	lstate;
 	uint32_t		mps;
 
+	/* Config space shadow, protected by the PHB lock */
+	bool			cfg_shadow_off;
+	struct pci_cfg_shadow	*cfg_shadow[PCI_CFG_SHADOW_HASH];
+	uint64_t		cfg_shadow_hits;
+	uint64_t		cfg_shadow_misses;
+	uint64_t		cfg_shadow_fills;
+	uint64_t		cfg_shadow_flushes;
+
+	/* Slot rescan in progress, protected by the PHB lock */
+	struct pci_slot_rescan	*rescan;
+
 	/* PCI-X only slot info, for PCI-E this is in the RC bridge */
 	struct pci_slot_info    *slot_info;
 
@@ -494,6 +560,13 @@ extern struct pci_device *pci_walk_dev(struct phb *phb,
 				       void *userdata);
 extern struct pci_device *pci_find_dev(struct phb *phb, uint16_t bdfn);
 extern void pci_restore_bridge_buses(struct phb *phb);
+extern int64_t pci_cfg_shadow_read(struct phb *phb, uint32_t bdfn,
+				   uint32_t offset, uint32_t size,
+				   uint32_t *data);
+extern void pci_cfg_shadow_write(struct phb *phb, uint32_t bdfn,
+				 uint32_t offset, uint32_t size,
+				 uint32_t data);
+extern void pci_cfg_shadow_flush(struct phb *phb);
 
 /* Manage PHBs */
 extern int64_t pci_register_phb(struct phb *phb);
@@ -509,6 +582,11 @@ extern void pci_std_swizzle_irq_map(struct dt_node *dt_node,
 
 /* Initialize all PCI slots */
 extern void pci_init_slots(void);
+extern void pci_reset_slots(void);
+extern void pci_probe_slots(void);
 extern void pci_reset(void);
+extern int64_t pci_rescan_slot(struct phb *phb, uint16_t bdfn,
+			       struct opal_pci_slot_rescan *res);
+extern void pci_rescan_abort(struct phb *phb);
 
 #endif /* __PCI_H */
@@ -173,7 +173,22 @@ struct opal_user_section {
 		      + SRC_SECTION_SIZE + EXTENDED_HEADER_SECTION_SIZE \
 		      + MTMS_SECTION_SIZE)
 
+/*
+ * A PEL being produced piece by piece, straight into the buffer it
+ * is sent from. The size is known up front, and every read of the
+ * same stream returns the same bytes.
+ */
+struct pel_stream {
+	struct errorlog	*elog;
+	size_t		size;
+	uint32_t	date;
+	uint64_t	time;
+};
+
 size_t pel_size(struct errorlog *elog_data);
+void pel_stream_init(struct pel_stream *ps, struct errorlog *elog_data);
+size_t pel_stream_read(struct pel_stream *ps, size_t offset, void *buf,
+		       size_t len);
 int create_pel_log(struct errorlog *elog_data, char *pel_buffer,
 		   size_t pel_buffer_size) __warn_unused_result;
 
@@ -92,6 +92,9 @@
 #define   PHB_RTC_INVALIDATE_RID_LSH	PPC_BITLSHIFT(31)
 #define PHB_TCE_KILL			0x210
 #define   PHB_TCE_KILL_ALL		PPC_BIT(0)
+#define   PHB_TCE_KILL_PE		PPC_BIT(1)
+#define   PHB_TCE_KILL_PENUM_MASK	PPC_BITMASK(56,63)
+#define   PHB_TCE_KILL_PENUM_LSH	PPC_BITLSHIFT(63)
 #define PHB_TCE_SPEC_CTL		0x218
 #define PHB_IODA_ADDR			0x220
 #define   PHB_IODA_AD_AUTOINC		PPC_BIT(0)
@@ -374,6 +377,11 @@
 #define IODA2_TVT_IO_PSIZE_MASK		PPC_BITMASK(59,63)
 #define IODA2_TVT_IO_PSIZE_LSH		PPC_BITLSHIFT(63)
 
+/* TCE, also used for the indirect levels */
+#define IODA2_TCE_RPN_MASK		PPC_BITMASK(0,51)
+#define IODA2_TCE_WRITE			PPC_BIT(62)
+#define IODA2_TCE_READ			PPC_BIT(63)
+
 /* PESTA */
 #define IODA2_PESTA_MMIO_FROZEN		PPC_BIT(0)
 
@@ -149,6 +149,9 @@ struct rtt_entry {
  */
 #define PHB3_MAX_PE_NUM		256
 
+/* Error registers checked before reusing the last diag data */
+#define PHB3_DIAG_KEY_REGS	20
+
 /*
  * State structure for a PHB
  */
@@ -249,6 +252,13 @@ struct phb3_err {
 	uint32_t err_bit;
 };
 
+struct phb3_msi_stats {
+	uint64_t count;
+	uint64_t q_refires;
+	uint64_t tb_total;
+	uint64_t tb_max;
+};
+
 /* Link timeouts, increments of 100ms */
 #define PHB3_LINK_WAIT_RETRIES		20
 #define PHB3_LINK_ELECTRICAL_RETRIES	10
@@ -301,6 +311,8 @@ struct phb3 {
 	uint64_t		capp_ucode_base;
 	bool			capp_ucode_loaded;
 	unsigned int		max_link_speed;
+	unsigned int		link_gen;   /* Lowered on training failures,
+					       back to max on each reset */
 
 	uint16_t		rte_cache[RTT_TABLE_SIZE/2];
 	uint8_t			peltv_cache[PELTV_TABLE_SIZE];
@@ -313,6 +325,17 @@ struct phb3 {
 	bool			err_pending;
 	struct phb3_err		err;
 
+	/* Last diag data, reused while the error state is unchanged */
+	bool			diag_valid;
+	uint64_t		diag_nfir;
+	uint64_t		diag_regs[PHB3_DIAG_KEY_REGS];
+	uint64_t		diag_peev[4];
+	struct OpalIoPhb3ErrorData diag;
+
+	/* MSI counters, allocated on first use and never freed */
+	bool			msi_stats_on;
+	struct phb3_msi_stats	*msi_stats;
+
 	struct phb		phb;
 };
 
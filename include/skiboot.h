@@ -182,6 +182,8 @@ extern unsigned long get_symbol(unsigned long addr,
 extern void fast_reset(void);
 extern void __secondary_cpu_entry(void);
 extern void load_and_boot_kernel(bool is_reboot);
+extern void start_kernel_preload(bool after_mem_scrub);
+extern void wait_kernel_preload(void);
 extern void cleanup_tlb(void);
 extern void init_shared_sprs(void);
 extern void init_replicated_sprs(void);
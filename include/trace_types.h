@@ -25,6 +25,7 @@
 #define TRACE_FSP_MSG	4	/* FSP message sent/received */
 #define TRACE_FSP_EVENT	5	/* FSP driver event */
 #define TRACE_UART	6	/* UART driver traces */
+#define TRACE_PRLOG	7	/* Binary prlog() records */
 
 /* One per cpu, plus one for NMIs */
 struct tracebuf {
@@ -120,6 +121,22 @@ struct trace_uart {
 	__be16 in_count;
 };
 
+/*
+ * Unformatted prlog(): fmt is the offset of the format string in the
+ * skiboot image, args are the integer arguments it consumes, as
+ * 64-bit values.
+ */
+#define TRACE_PRLOG_MAX_ARGS	8
+
+struct trace_prlog {
+	struct trace_hdr hdr;
+	__be32 fmt;
+	u8 level;
+	u8 nargs;
+	u8 unused[2];
+	__be64 args[TRACE_PRLOG_MAX_ARGS];
+};
+
 union trace {
 	struct trace_hdr hdr;
 	/* Trace types go here... */
@@ -129,6 +146,7 @@ union trace {
 	struct trace_fsp_msg fsp_msg;
 	struct trace_fsp_event fsp_evt;
 	struct trace_uart uart;
+	struct trace_prlog prlog;
 };
 
 #endif /* __TRACE_TYPES_H */
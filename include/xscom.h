@@ -153,6 +153,7 @@
 /* Fields in history regs */
 #define EX_PM_IDLE_ST_HIST_PM_STATE_MASK	PPC_BITMASK(0, 2)
 #define EX_PM_IDLE_ST_HIST_PM_STATE_LSH		PPC_BITLSHIFT(2)
+#define EX_PM_IDLE_ST_HIST_PM_STATE_RUN		0
 
 
 /*
@@ -100,6 +100,7 @@ void astbmc_init(void)
 	ipmi_rtc_init();
 	ipmi_opal_init();
 	ipmi_fru_init(0x01);
+	ipmi_sel_init();
 	elog_init();
 
 	/* As soon as IPMI is up, inform BMC we are in "S0" */
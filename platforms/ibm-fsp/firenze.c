@@ -310,8 +310,8 @@ static void firenze_add_pcidev_to_fsp_inventory(struct phb *phb,
 	entry->hw_proc_id = chip->pcid;
 	entry->slot_idx = pd->parent->slot_info->slot_index;
 	entry->reserved = 0;
-	pci_cfg_read16(phb, pd->bdfn, PCI_CFG_VENDOR_ID, &entry->vendor_id);
-	pci_cfg_read16(phb, pd->bdfn, PCI_CFG_DEVICE_ID, &entry->device_id);
+	entry->vendor_id = pd->vdid & 0xffff;
+	entry->device_id = pd->vdid >> 16;
 	if (pd->is_bridge) {
 		int64_t ssvc = pci_find_cap(phb, pd->bdfn,
 					    PCI_CFG_CAP_ID_SUBSYS_VID);